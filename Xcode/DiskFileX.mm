@@ -14,7 +14,10 @@
 
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "par2cmdline.h"
 #include "OSXStuff.h"
@@ -69,6 +72,9 @@ static inline void TraceIO(const char *aText, ...) {}
 #define MaxOffset 0x7fffffffffffffffULL
 #define MaxLength 0xffffffffUL
 
+// Output files are created with F_NOCACHE in direct write mode
+static bool sDirectWrite = false;
+
 /* Given a file name as it may appear in the par2 file, convert it to Unicode.
    Of course the problem is we don't know how it was encoded: code page 1250, UTF-8, 
    or whatever. Par2 not using Unicode is a BIG mistake. This function first sees if
@@ -152,6 +158,9 @@ DiskFile::DiskFile(void) : filename ()
 	filesize = 0;
 	offset = 0;		// Actually not used?
 	mFile = nil;
+	mWritable = false;
+	mMap = 0;
+	mMapLength = 0;
 	exists = false;
 	mFullFileBuffer = nil;
 }
@@ -159,7 +168,11 @@ DiskFile::DiskFile(void) : filename ()
 //-----------------------------------------------------------------------------
 DiskFile::~DiskFile(void)
 {
+	if (mMap != 0)
+		munmap(mMap, (size_t) mMapLength);
 	[((NSMutableData *)mFullFileBuffer) release];
+	if (mFile != nil)
+		DiskFilePool::Forget(this);
 	[((NSFileHandle *)mFile) release];
 }
 
@@ -180,6 +193,7 @@ bool DiskFile::Create(string _filename, u64 _filesize)
 	{
 		mFile = [[NSFileHandle fileHandleForWritingAtPath : lUnicodeFilename] retain];
 	}
+	DiskFilePool::StatusChanged(_filename);
 	
 	if (((NSFileHandle *)mFile) == nil)
 	{
@@ -193,8 +207,23 @@ bool DiskFile::Create(string _filename, u64 _filesize)
 		return false;
 	}
 	
+	int lFile = [(NSFileHandle *)mFile fileDescriptor];
+	if (sDirectWrite && fcntl(lFile, F_NOCACHE, 1) == -1)
+	{
+		NSLog (@"fcntl F_NOCACHE failed on file \"%s\"", _filename.c_str());
+	}
+
 	if (_filesize > 0)
 	{
+		// Reserve the space in one go, contiguous if possible, instead of letting the file grow
+		// as the data is written. It is only an optimisation; the 1 byte write below sets the size.
+		fstore_t lStore = {F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)_filesize, 0};
+		if (fcntl(lFile, F_PREALLOCATE, &lStore) == -1)
+		{
+			lStore.fst_flags = F_ALLOCATEALL;
+			fcntl(lFile, F_PREALLOCATE, &lStore);
+		}
+
 		BOOL lSeekResult;
 		NS_DURING
 			[((NSFileHandle *)mFile) seekToFileOffset : (unsigned long long)_filesize - 1];
@@ -208,6 +237,7 @@ bool DiskFile::Create(string _filename, u64 _filesize)
 			[((NSFileHandle *)mFile) release];
 			mFile = 0;
 			[[NSFileManager defaultManager] removeItemAtPath:lUnicodeFilename error:nil];
+			DiskFilePool::StatusChanged(_filename);
 			
 			// For some ridiculous reason the compiler choked on 
 			//		cerr << "Could not create: " << _filename
@@ -231,6 +261,7 @@ bool DiskFile::Create(string _filename, u64 _filesize)
 			[((NSFileHandle *)mFile) release];
 			mFile = 0;
 			[[NSFileManager defaultManager] removeItemAtPath:lUnicodeFilename error:nil];
+			DiskFilePool::StatusChanged(_filename);
 			
 			// For some ridiculous reason the compiler choked on 
 			//		cerr << "Could not create: " << _filename
@@ -244,6 +275,7 @@ bool DiskFile::Create(string _filename, u64 _filesize)
 	offset = filesize;
 	
 	exists = true;
+	mWritable = true;
 
 	return true;
 }
@@ -314,6 +346,69 @@ bool DiskFile::Write(u64 _offset, const void *buffer, size_t length)
 	return rv;
 }
 
+//-----------------------------------------------------------------------------
+// Write several buffers to consecutive parts of the file. This goes around the file handle,
+// whose position is not changed.
+bool DiskFile::WriteV(u64 _offset, const struct iovec *buffers, u32 count)
+{
+	TraceIO("WriteV file \"%s\" offset %llu buffers %u\n", filename.c_str(),
+			(unsigned long long) _offset, count);
+
+	assert(((NSFileHandle *)mFile) != nil);
+
+	// pwritev may write less than asked; the entries that are done are skipped
+	vector<struct iovec> lBuffers(buffers, buffers + count);
+	u64 lLength = 0;
+	for (u32 i = 0; i < count; i++)
+		lLength += lBuffers[i].iov_len;
+
+	if (_offset > MaxOffset)
+	{
+		cerr << "Could not write " << lLength << " bytes to " << filename << " at offset " << _offset << endl;
+		return false;
+	}
+
+	int lFile = FileDescriptor();
+	u32 lFirst = 0;
+	u64 lOffset = _offset;
+	while (lFirst < count)
+	{
+		if (lBuffers[lFirst].iov_len == 0)
+		{
+			lFirst++;
+			continue;
+		}
+
+		int lCount = (int)min((u32)IOV_MAX, count - lFirst);
+		ssize_t lWritten = pwritev(lFile, &lBuffers[lFirst], lCount, (off_t)lOffset);
+		if (lWritten < 0 && errno == EINTR)
+			continue;
+		if (lWritten <= 0)
+		{
+			cerr << "Could not write " << lLength << " bytes to " << filename << " at offset " << _offset << endl;
+			return false;
+		}
+
+		lOffset += lWritten;
+		while (lWritten > 0)
+		{
+			size_t lUsed = min((size_t)lWritten, lBuffers[lFirst].iov_len);
+			lBuffers[lFirst].iov_base = (u8 *)lBuffers[lFirst].iov_base + lUsed;
+			lBuffers[lFirst].iov_len -= lUsed;
+			lWritten -= lUsed;
+			if (lBuffers[lFirst].iov_len == 0)
+				lFirst++;
+		}
+	}
+
+	if (filesize < lOffset)
+	{
+		filesize = lOffset;
+	}
+
+	return true;
+}
+
 //-----------------------------------------------------------------------------
 // Open the file
 bool DiskFile::Open(bool tryToCacheData)
@@ -354,6 +449,7 @@ bool DiskFile::Open(string _filename, u64 _filesize, bool tryToCacheData)
 	
 	filename = _filename;
 	filesize = _filesize;
+	mWritable = false;
 	
 	if (_filesize > MaxOffset)
 	{
@@ -415,6 +511,8 @@ bool DiskFile::Open(string _filename, u64 _filesize, bool tryToCacheData)
 		offset = 0;
 		exists = true;
 		rv = true;
+
+		FindHoles([(NSFileHandle *)mFile fileDescriptor]);
 	}
 	
 	return rv;
@@ -431,6 +529,7 @@ bool DiskFile::Open(string _filename, u64 _filesize, bool tryToCacheData)
 	
 	filename = _filename;
 	filesize = _filesize;
+	mWritable = false;
 	
 	if (_filesize > MaxOffset)
 	{
@@ -466,12 +565,114 @@ bool DiskFile::Open(string _filename, u64 _filesize, bool tryToCacheData)
 		offset = 0;
 		exists = true;
 		rv = true;
+
+		FindHoles([(NSFileHandle *)mFile fileDescriptor]);
 	}
 	
 	return rv;
 }
 #endif
 
+//-----------------------------------------------------------------------------
+// Open the file for reading and writing
+bool DiskFile::OpenForUpdate(void)
+{
+	TraceIO("Open file \"%s\" for update\n", filename.c_str());
+
+	assert(mFile == nil && mFullFileBuffer == nil);	// File must not be open
+
+	NSString *lUnicodeFilename = FileSystemFilename2Unicode (filename.c_str ());
+	mFile = [[NSFileHandle fileHandleForUpdatingAtPath : lUnicodeFilename] retain];
+	if (mFile == nil)
+	{
+		cerr << "Could not open " << filename << " for writing" << endl;
+		return false;
+	}
+
+	filesize = GetFileSize(filename);
+	offset = 0;
+	exists = true;
+	mWritable = true;
+	mHoles.clear();
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+bool DiskFile::OpenForUpdate(string _filename)
+{
+	filename = _filename;
+
+	return OpenForUpdate();
+}
+
+//-----------------------------------------------------------------------------
+// Change the length of the file
+bool DiskFile::SetLength(u64 aLength)
+{
+	TraceIO("Set length of file \"%s\" to %llu\n", filename.c_str(), (unsigned long long) aLength);
+
+	assert(((NSFileHandle *)mFile) != nil);
+
+	// The mapping covers the old length
+	if (mMap != 0)
+	{
+		munmap(mMap, (size_t) mMapLength);
+		mMap = 0;
+		mMapLength = 0;
+	}
+
+	bool lResult = aLength <= MaxOffset;
+	if (lResult)
+	{
+		NS_DURING
+			[((NSFileHandle *)mFile) truncateFileAtOffset : (unsigned long long) aLength];
+		NS_HANDLER
+			lResult = false;
+		NS_ENDHANDLER
+	}
+
+	if (!lResult)
+	{
+		cerr << "Could not set end of file: " << filename.c_str () << endl;
+		return false;
+	}
+
+	// truncateFileAtOffset also moves the file pointer
+	filesize = aLength;
+	offset = aLength;
+	DiskFilePool::StatusChanged(filename);
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Write everything to the disk. On OSX, fsync only passes the data to the drive, which
+// may keep it in its own cache; F_FULLFSYNC also flushes that.
+bool DiskFile::Sync(void)
+{
+	TraceIO("Sync file \"%s\"\n", filename.c_str());
+
+	int lFile = FileDescriptor();
+	assert(lFile >= 0);
+
+	if (fcntl(lFile, F_FULLFSYNC) != 0 && fsync(lFile) != 0)
+	{
+		cerr << "Could not write " << filename.c_str () << " to disk" << endl;
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// OSX can clone whole files (clonefile), but not ranges within them, and has no
+// copy in the kernel either. The caller copies the data itself.
+bool DiskFile::CopyRange(u64 aOffset, const DiskFile &aSource, u64 aSourceOffset, u64 aLength)
+{
+	return aLength == 0;
+}
+
 //-----------------------------------------------------------------------------
 // Read some data from the file, without our own read ahead buffer
 bool DiskFile::ReadWithoutFFBuffer(u64 _offset, void *buffer, size_t length)
@@ -562,8 +763,15 @@ bool DiskFile::Read(u64 _offset, void *buffer, size_t length)
 {
 	bool rv = false;
 	
+	const void *lMapped = MappedData(_offset, length);
+
 	// We will use the full file buffer if one has been allocated at Open.
-	if (mFullFileBuffer)
+	if (lMapped != 0)
+	{
+		memcpy(buffer, lMapped, length);
+		rv = true;
+	}
+	else if (mFullFileBuffer)
 	{
 		rv = this->ReadUsingFFBuffer(_offset, buffer, length);
 	}
@@ -574,12 +782,218 @@ bool DiskFile::Read(u64 _offset, void *buffer, size_t length)
 	return rv;
 }
 
+//-----------------------------------------------------------------------------
+// Map the file contents. This uses the file descriptor of the NSFileHandle; with F_NOCACHE
+// set on it, the data still ends up in the unified buffer cache when the pages are touched.
+bool DiskFile::Map(void)
+{
+	assert(mFile != nil);
+
+	if (mMap != 0)
+		return true;
+	if (filesize == 0)
+		return false;
+
+	void *lMap = mmap(0, (size_t) filesize, PROT_READ, MAP_SHARED, FileDescriptor(), 0);
+	if (lMap == MAP_FAILED)
+	{
+		TraceIO("mmap failed on file \"%s\"\n", filename.c_str());
+		return false;
+	}
+	madvise(lMap, (size_t) filesize, MADV_SEQUENTIAL);
+	mMap = lMap;
+	mMapLength = filesize;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+const void *DiskFile::MappedData(u64 aOffset, size_t aLength) const
+{
+	if (mMap == 0 || aOffset + aLength > mMapLength)
+		return 0;
+	return &((const u8 *) mMap)[aOffset];
+}
+
+//-----------------------------------------------------------------------------
+void DiskFile::Prefetch(u64 aOffset, size_t aLength) const
+{
+	if (mMap == 0 || aOffset >= mMapLength)
+		return;
+	u64 lStart = AlignedBufferPool::RoundDown(aOffset);	// madvise wants a page aligned address
+	u64 lEnd = min(aOffset + aLength, mMapLength);
+	madvise(&((u8 *) mMap)[lStart], (size_t)(lEnd - lStart), MADV_WILLNEED);
+}
+
+//-----------------------------------------------------------------------------
+// Find out which pages of the range are in memory, by mapping them temporarily
+u64 DiskFile::ResidentLength(u64 aOffset, u64 aLength) const
+{
+	assert(mFile != nil);
+
+	if (aOffset >= filesize || aLength == 0)
+		return 0;
+	aLength = min(aLength, filesize - aOffset);
+
+	u64 lStart = AlignedBufferPool::RoundDown(aOffset);
+	size_t lLength = (size_t) (aOffset + aLength - lStart);
+
+	void *lMap = mmap(0, lLength, PROT_READ, MAP_SHARED, FileDescriptor(), (off_t) lStart);
+	if (lMap == MAP_FAILED)
+		return 0;
+
+	size_t lPageSize = AlignedBufferPool::Alignment();
+	vector<char> lResident((lLength + lPageSize - 1) / lPageSize);
+	u64 rv = 0;
+	if (mincore(lMap, lLength, &lResident[0]) == 0)
+	{
+		for (size_t i = 0; i < lResident.size(); i++)
+		{
+			if (lResident[i] & MINCORE_INCORE)
+				rv += lPageSize;
+		}
+	}
+
+	munmap(lMap, lLength);
+
+	return min(rv, aLength);
+}
+
+//-----------------------------------------------------------------------------
+// Walk the holes of the file once. A file without holes takes a single lseek, which
+// ends up at the implicit hole at the end of the file. ENXIO from SEEK_DATA means that
+// there is no data after the hole; it runs to the end of the file. The lseeks move the
+// position of the file handle, so it is put back.
+void DiskFile::FindHoles(int aFile)
+{
+	mHoles.clear();
+#ifdef SEEK_HOLE
+	if (aFile < 0)
+		return;
+
+	u64 lOffset = 0;
+	while (lOffset < filesize)
+	{
+		off_t lHole = lseek(aFile, (off_t)lOffset, SEEK_HOLE);
+		if (lHole < 0 || (u64)lHole >= filesize)
+			break;
+
+		off_t lData = lseek(aFile, lHole, SEEK_DATA);
+		if (lData < 0 && errno != ENXIO)
+			break;
+		u64 lEnd = lData < 0 ? filesize : min((u64)lData, filesize);
+		if (lEnd <= (u64)lHole)
+			break;
+
+		mHoles.push_back((u64)lHole);
+		mHoles.push_back(lEnd);
+		lOffset = lEnd;
+	}
+	lseek(aFile, (off_t)offset, SEEK_SET);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+bool DiskFile::NextHole(u64 aOffset, u64 &aStart, u64 &aEnd) const
+{
+	// Binary search for the first hole that ends beyond aOffset
+	size_t lLow = 0;
+	size_t lHigh = mHoles.size() / 2;
+	while (lLow < lHigh)
+	{
+		size_t lMiddle = (lLow + lHigh) / 2;
+		if (mHoles[2*lMiddle+1] <= aOffset)
+			lLow = lMiddle + 1;
+		else
+			lHigh = lMiddle;
+	}
+	if (lLow == mHoles.size() / 2)
+		return false;
+
+	aStart = mHoles[2*lLow];
+	aEnd = mHoles[2*lLow+1];
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+bool DiskFile::IsHole(u64 aOffset, u64 aLength) const
+{
+	if (aOffset >= filesize || aLength == 0)
+		return false;
+	aLength = min(aLength, filesize - aOffset);
+
+	u64 lStart, lEnd;
+	if (!NextHole(aOffset, lStart, lEnd))
+		return false;
+
+	return lStart <= aOffset && aOffset + aLength <= lEnd;
+}
+
+//-----------------------------------------------------------------------------
+bool DiskFile::Device(u64 &aDevice) const
+{
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		return false;
+
+	aDevice = (u64) st.st_dev;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+int DiskFile::FileDescriptor(void) const
+{
+	// Note that the FF buffer is not a file; the caller must use Read in that case
+	if (mFile == nil)
+		return -1;
+	return [((NSFileHandle *)mFile) fileDescriptor];
+}
+
+//-----------------------------------------------------------------------------
+bool DiskFile::CanTransferDirectly(u64 aOffset, const void *aBuffer, size_t aLength) const
+{
+	// F_NOCACHE has no alignment requirements
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Input files are always opened with F_NOCACHE (see Open), which is the OSX equivalent
+// of direct I/O. So the setting is only remembered.
+static bool sDirectIO = false;
+
+void DiskFile::SetDirectIO(bool aDirectIO)
+{
+	sDirectIO = aDirectIO;
+}
+
+bool DiskFile::DirectIO(void)
+{
+	return sDirectIO;
+}
+
+void DiskFile::SetDirectWrite(bool aDirectWrite)
+{
+	sDirectWrite = aDirectWrite;
+}
+
+bool DiskFile::DirectWrite(void)
+{
+	return sDirectWrite;
+}
+
 //-----------------------------------------------------------------------------
 // Close the file
 void DiskFile::Close(void)
 {
 	TraceIO("Close file \"%s\"\n", filename.c_str());
 
+	if (mMap != 0)
+	{
+		munmap(mMap, (size_t) mMapLength);
+		mMap = 0;
+		mMapLength = 0;
+	}
+
 	if (mFullFileBuffer)	// Note: in this version, mFullFileBuffer is not used
 	{
 #ifdef FILE_CACHE_EXPERIMENT
@@ -589,8 +1003,11 @@ void DiskFile::Close(void)
 		[((NSMutableData *)mFullFileBuffer) release];	// Might be nil
 		mFullFileBuffer = nil;
 	}
+	if (mFile != nil)
+		DiskFilePool::Forget(this);
 	[((NSFileHandle *)mFile) release];	// Might be nil
 	mFile = nil;
+	mHoles.clear();
 }
 
 //-----------------------------------------------------------------------------
@@ -627,6 +1044,8 @@ bool DiskFile::Rename(string _filename)
 	if ([[NSFileManager defaultManager] moveItemAtPath : lOldUnicodeFilename 
 												toPath : lNewUnicodeFilename error : nil])
 	{
+		DiskFilePool::StatusChanged(filename);
+		DiskFilePool::StatusChanged(_filename);
 		filename = _filename;
 		rv = true;
 	}
@@ -651,6 +1070,7 @@ bool DiskFile::Delete(void)
 	if ([lUnicodeFilename length] > 0 && 
 		[[NSFileManager defaultManager] removeItemAtPath:lUnicodeFilename error:nil])
 	{
+		DiskFilePool::StatusChanged(filename);
 		rv = true;
 	}
 	else
@@ -822,9 +1242,26 @@ string DiskFile::TranslateFilename(string filename)
 
 //-----------------------------------------------------------------------------
 bool DiskFile::FileExists(string filename)
+{
+	u64 lFileSize;
+	return DiskFilePool::Status(filename, lFileSize);
+}
+
+//-----------------------------------------------------------------------------
+u64 DiskFile::GetFileSize(string filename)
+{
+	u64 lFileSize;
+	return DiskFilePool::Status(filename, lFileSize) ? lFileSize : 0;
+}
+
+//-----------------------------------------------------------------------------
+// The status of the file according to the OS. FileExists and GetFileSize use the cache of
+// the DiskFilePool, which calls this.
+bool DiskFile::StatFile(string filename, u64 &filesize)
 {
 	bool rv = false;
-	
+	filesize = 0;
+
 	NSString *lUnicodeFilename = FileSystemFilename2Unicode (filename.c_str ());
 
 	if (lUnicodeFilename)
@@ -835,17 +1272,15 @@ bool DiskFile::FileExists(string filename)
 		// make sure it isn't a symbolic link.
 		NSString *lDest = [[NSFileManager defaultManager] destinationOfSymbolicLinkAtPath:lUnicodeFilename
 																					error:nil];
-		if (lDest)
-		{
-			rv = false;		// It is a symbolic link
-		}
-		else
+		if (!lDest)
 		{
 			NSDictionary *lFileAttr = [[NSFileManager defaultManager] attributesOfItemAtPath:lUnicodeFilename
 																					   error:nil];
-			if (lFileAttr)
+			if (lFileAttr && [[lFileAttr objectForKey : NSFileType] isEqualToString : NSFileTypeRegular])
 			{
-				rv = [[lFileAttr objectForKey : NSFileType] isEqualToString : NSFileTypeRegular];
+				// It is a regular file
+				rv = true;
+				filesize = [[lFileAttr objectForKey : NSFileSize] longLongValue];
 			}
 		}
 	}
@@ -853,32 +1288,32 @@ bool DiskFile::FileExists(string filename)
 	return rv;
 }
 
-
 //-----------------------------------------------------------------------------
-u64 DiskFile::GetFileSize(string filename)
+// The same, and also what tells whether the contents might have changed: the modification
+// and status change times (in nanoseconds) and the file number. NSFileManager has neither
+// the status change time nor the nanoseconds, so they come from lstat.
+bool DiskFile::StatFile(string filename, u64 &filesize, u64 &mtime, u64 &ctime, u64 &inode)
 {
-	u64 rv = 0;
+	bool rv = false;
+	filesize = mtime = ctime = inode = 0;
 
 	NSString *lUnicodeFilename = FileSystemFilename2Unicode (filename.c_str ());
 
-	// destinationOfSymbolicLinkAtPath traverses symbolic links if filename is one. To avoid that,
-	// first test if it IS a link.
-	NSString *lDest = [[NSFileManager defaultManager] destinationOfSymbolicLinkAtPath:lUnicodeFilename
-																				error:nil];
-	if (!lDest)
+	if (lUnicodeFilename)
 	{
-		// It is not a symbolic link
-		NSDictionary *lFileAttr = [[NSFileManager defaultManager] attributesOfItemAtPath:lUnicodeFilename 
-																				   error:nil];
-		if (lFileAttr)
+		NSString *lDest = [[NSFileManager defaultManager] destinationOfSymbolicLinkAtPath:lUnicodeFilename
+																					error:nil];
+		struct stat st;
+		if (!lDest && lstat([lUnicodeFilename fileSystemRepresentation], &st) == 0 && S_ISREG(st.st_mode))
 		{
-			if ([[lFileAttr objectForKey : NSFileType] isEqualToString : NSFileTypeRegular])
-			{
-				// It is a regular file
-				rv = [[lFileAttr objectForKey : NSFileSize] longLongValue];
-			}
+			rv = true;
+			filesize = st.st_size;
+			mtime = (u64)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+			ctime = (u64)st.st_ctimespec.tv_sec * 1000000000 + st.st_ctimespec.tv_nsec;
+			inode = st.st_ino;
 		}
-	}	
+	}
+
 	return rv;
 }
 
@@ -12,6 +12,7 @@
 /*
  * Note: after some experiments, the class is currently not used. See comments in the commented-out
  * Open method in DiskFileX.mm. The singleton object is created, but the methods are never called.
+ * Keeping verified data around for the repair is now done per data block by BlockCache (blockcache.h).
  *
  * The FileCache is a singleton object, responsible for storing the contents of entire input files
  * that are used in the par2 process. This main benefit of the cache is to keep file data round 
@@ -0,0 +1,121 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "par2cmdline.h"
+
+// How many unused buffers, and how much memory in them, are kept for reuse. Buffers that
+// are given back when the pool is full, are freed.
+#define MaxIdleBuffers 8
+#define MaxIdleBytes   (64 * 1048576)
+
+static dispatch_semaphore_t sPoolSema = dispatch_semaphore_create(1);
+static map<void*, size_t> sBuffersInUse;      // Buffer -> its size
+static multimap<size_t, void*> sIdleBuffers;  // Size -> buffer
+static size_t sIdleBytes = 0;                 // The total size of sIdleBuffers
+
+size_t AlignedBufferPool::Alignment(void)
+{
+  static size_t sPageSize = (size_t)sysconf(_SC_PAGESIZE);
+  return sPageSize;
+}
+
+size_t AlignedBufferPool::RoundUp(size_t aSize)
+{
+  size_t lAlignment = Alignment();
+  return (aSize + lAlignment - 1) & ~(lAlignment - 1);
+}
+
+u64 AlignedBufferPool::RoundDown(u64 aOffset)
+{
+  return aOffset & ~(u64)(Alignment() - 1);
+}
+
+bool AlignedBufferPool::IsAligned(u64 aOffset, const void *aBuffer, size_t aLength)
+{
+  u64 lMask = Alignment() - 1;
+  return ((aOffset | (u64)(uintptr_t)aBuffer | (u64)aLength) & lMask) == 0;
+}
+
+void *AlignedBufferPool::Get(size_t aSize)
+{
+  size_t lSize = RoundUp(aSize > 0 ? aSize : 1);
+  void *lBuffer = 0;
+
+  dispatch_semaphore_wait(sPoolSema, DISPATCH_TIME_FOREVER);
+
+  // Reuse an idle buffer that is large enough, but not wastefully large
+  multimap<size_t, void*>::iterator lIdle = sIdleBuffers.lower_bound(lSize);
+  if (lIdle != sIdleBuffers.end() && lIdle->first / 2 <= lSize)
+  {
+    lSize = lIdle->first;
+    lBuffer = lIdle->second;
+    sIdleBytes -= lSize;
+    sIdleBuffers.erase(lIdle);
+  }
+
+  if (lBuffer == 0 && posix_memalign(&lBuffer, Alignment(), lSize) != 0)
+  {
+    lBuffer = 0;
+  }
+
+  if (lBuffer != 0)
+  {
+    sBuffersInUse[lBuffer] = lSize;
+  }
+
+  dispatch_semaphore_signal(sPoolSema);
+
+  return lBuffer;
+}
+
+void AlignedBufferPool::Release(void *aBuffer)
+{
+  if (aBuffer == 0)
+    return;
+
+  dispatch_semaphore_wait(sPoolSema, DISPATCH_TIME_FOREVER);
+
+  map<void*, size_t>::iterator lUsed = sBuffersInUse.find(aBuffer);
+  assert(lUsed != sBuffersInUse.end());
+
+  if (sIdleBuffers.size() < MaxIdleBuffers && sIdleBytes + lUsed->second <= MaxIdleBytes)
+  {
+    sIdleBuffers.insert(pair<size_t, void*>(lUsed->second, aBuffer));
+    sIdleBytes += lUsed->second;
+  }
+  else
+  {
+    free(aBuffer);
+  }
+  sBuffersInUse.erase(lUsed);
+
+  dispatch_semaphore_signal(sPoolSema);
+}
+
+void AlignedBufferPool::Purge(void)
+{
+  dispatch_semaphore_wait(sPoolSema, DISPATCH_TIME_FOREVER);
+
+  for (multimap<size_t, void*>::iterator lIdle = sIdleBuffers.begin(); lIdle != sIdleBuffers.end(); ++lIdle)
+  {
+    free(lIdle->second);
+  }
+  sIdleBuffers.clear();
+  sIdleBytes = 0;
+
+  dispatch_semaphore_signal(sPoolSema);
+}
@@ -0,0 +1,51 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef __ALIGNEDBUFFERPOOL_H__
+#define __ALIGNEDBUFFERPOOL_H__
+
+// The AlignedBufferPool hands out page aligned memory buffers. Such buffers can be used
+// for direct (uncached) I/O, which requires the memory, the file offset and the length to
+// be aligned. Buffers that are given back are kept for reuse, so that for instance the
+// buffers of the FileCheckSummer are not allocated again for every file that is scanned.
+// All functions are thread safe.
+
+class AlignedBufferPool
+{
+public:
+  // Get a buffer of at least aSize bytes, aligned to Alignment(). Returns 0 if there
+  // is not enough memory.
+  static void *Get(size_t aSize);
+
+  // Give back a buffer obtained with Get. A null pointer is ignored.
+  static void Release(void *aBuffer);
+
+  // Free all buffers that are not in use
+  static void Purge(void);
+
+  // The alignment of the buffers (the page size)
+  static size_t Alignment(void);
+
+  // Round a size or offset up or down to a multiple of Alignment()
+  static size_t RoundUp(size_t aSize);
+  static u64 RoundDown(u64 aOffset);
+
+  // Tells whether an offset, a buffer and a length are all aligned
+  static bool IsAligned(u64 aOffset, const void *aBuffer, size_t aLength);
+};
+
+#endif // __ALIGNEDBUFFERPOOL_H__
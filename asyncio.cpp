@@ -0,0 +1,678 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "par2cmdline.h"
+
+#include <errno.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// How much memory AsyncBlockReader may use for reading ahead
+#define ReadAheadBytes   (64 * 1048576)
+
+AsyncIO::AsyncIO(u32 queuedepth)
+: mQueueDepth(queuedepth)
+, mOutstanding(0)
+, mUseRing(false)
+, mRing(0)
+{
+  assert(queuedepth > 0);
+
+  mRequests = new Request[mQueueDepth];
+  mFreeSlots.reserve(mQueueDepth);
+  for (u32 slot = mQueueDepth; slot > 0; slot--)
+  {
+    mFreeSlots.push_back(slot - 1);
+  }
+  mQueued.reserve(mQueueDepth);
+  mReady.reserve(mQueueDepth);
+
+  mReadySema = dispatch_semaphore_create(1);
+  mDoneSema = dispatch_semaphore_create(0);
+
+#ifdef HAVE_LIBURING
+  struct io_uring *lRing = new struct io_uring;
+  if (io_uring_queue_init(mQueueDepth, lRing, 0) == 0)
+  {
+    mRing = lRing;
+    mUseRing = true;
+  }
+  else
+  {
+    // Probably an old kernel, or io_uring is not permitted (containers); use the thread pool.
+    delete lRing;
+  }
+#endif
+}
+
+AsyncIO::~AsyncIO(void)
+{
+  // Never leave the OS writing into buffers that are about to be freed
+  if (mOutstanding > 0)
+    WaitAll();
+
+#ifdef HAVE_LIBURING
+  if (mUseRing)
+  {
+    io_uring_queue_exit((struct io_uring *)mRing);
+    delete (struct io_uring *)mRing;
+  }
+#endif
+
+  dispatch_release(mDoneSema);
+  dispatch_release(mReadySema);
+  delete [] mRequests;
+}
+
+bool AsyncIO::QueueRead(DiskFile *diskfile, u64 offset, void *buffer, size_t length, u32 tag)
+{
+  return Queue(diskfile, offset, (u8 *)buffer, length, tag, false);
+}
+
+bool AsyncIO::QueueWrite(DiskFile *diskfile, u64 offset, const void *buffer, size_t length, u32 tag)
+{
+  return Queue(diskfile, offset, (u8 *)const_cast<void *>(buffer), length, tag, true);
+}
+
+bool AsyncIO::Queue(DiskFile *diskfile, u64 offset, u8 *buffer, size_t length, u32 tag, bool write)
+{
+  assert(diskfile != 0);
+
+  dispatch_semaphore_wait(mReadySema, DISPATCH_TIME_FOREVER);
+  if (mFreeSlots.empty())
+  {
+    dispatch_semaphore_signal(mReadySema);
+    return false;
+  }
+  u32 lSlot = mFreeSlots.back();
+  mFreeSlots.pop_back();
+  dispatch_semaphore_signal(mReadySema);
+
+  Request &lRequest = mRequests[lSlot];
+  lRequest.diskfile = diskfile;
+  lRequest.fd = diskfile->FileDescriptor();
+  lRequest.buffer = buffer;
+  lRequest.length = length;
+  lRequest.done = 0;
+  lRequest.needed = length;
+  lRequest.bounce = 0;
+  lRequest.target = 0;
+  lRequest.skip = 0;
+  lRequest.offset = offset;
+  lRequest.tag = tag;
+  lRequest.write = write;
+
+  mOutstanding++;
+
+  if (length == 0)
+  {
+    // Nothing to transfer
+    Complete(lSlot, true);
+  }
+  else if (!diskfile->CanTransferDirectly(offset, buffer, length))
+  {
+    if (write)
+    {
+      // Unaligned write in direct I/O mode; let the DiskFile handle it
+      Complete(lSlot, diskfile->Write(offset, buffer, length));
+      return true;
+    }
+
+    // Unaligned read in direct I/O mode. Read the aligned range around it into a bounce
+    // buffer; Complete copies the wanted part out.
+    u64 lStart = AlignedBufferPool::RoundDown(offset);
+    size_t lSkip = (size_t)(offset - lStart);
+    size_t lLength = AlignedBufferPool::RoundUp(lSkip + length);
+    u8 *lBounce = (u8 *)AlignedBufferPool::Get(lLength);
+    if (lBounce == 0)
+    {
+      Complete(lSlot, false);
+      return true;
+    }
+
+    lRequest.buffer = lBounce;
+    lRequest.length = lLength;
+    lRequest.needed = lSkip + length;
+    lRequest.bounce = lBounce;
+    lRequest.target = buffer;
+    lRequest.skip = lSkip;
+    lRequest.offset = lStart;
+
+    assert(lRequest.fd >= 0);
+    mQueued.push_back(lSlot);
+  }
+  else
+  {
+    assert(lRequest.fd >= 0);
+    mQueued.push_back(lSlot);
+  }
+
+  return true;
+}
+
+bool AsyncIO::Submit(void)
+{
+  if (mQueued.empty())
+    return true;
+
+#ifdef HAVE_LIBURING
+  if (mUseRing)
+  {
+    for (vector<u32>::const_iterator slot = mQueued.begin(); slot != mQueued.end(); ++slot)
+    {
+      if (!PrepareRingRequest(*slot))
+        return false;
+    }
+    mQueued.clear();
+
+    // One system call for the whole batch
+    int lResult;
+    do
+    {
+      lResult = io_uring_submit((struct io_uring *)mRing);
+    } while (lResult == -EINTR);
+
+    return lResult >= 0;
+  }
+#endif
+
+  // Thread pool: each request is executed by a GCD worker. Blocking in pread/pwrite is
+  // exactly what we want these threads to do, and the queue depth bounds their number.
+  for (vector<u32>::const_iterator slot = mQueued.begin(); slot != mQueued.end(); ++slot)
+  {
+    u32 lSlot = *slot;
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+      this->Execute(lSlot);
+    });
+  }
+  mQueued.clear();
+
+  return true;
+}
+
+// Perform one request synchronously; used by the thread pool.
+void AsyncIO::Execute(u32 aSlot)
+{
+  Request &lRequest = mRequests[aSlot];
+
+  while (lRequest.done < lRequest.length)
+  {
+    ssize_t lResult;
+    if (lRequest.write)
+    {
+      lResult = pwrite(lRequest.fd, lRequest.buffer + lRequest.done,
+                       lRequest.length - lRequest.done, (off_t)(lRequest.offset + lRequest.done));
+    }
+    else
+    {
+      lResult = pread(lRequest.fd, lRequest.buffer + lRequest.done,
+                      lRequest.length - lRequest.done, (off_t)(lRequest.offset + lRequest.done));
+    }
+
+    if (lResult < 0 && errno == EINTR)
+      continue;
+    if (lResult == 0 && lRequest.done >= lRequest.needed)
+      break;
+    if (lResult <= 0)
+    {
+      Complete(aSlot, false);
+      return;
+    }
+
+    lRequest.done += lResult;
+  }
+
+  Complete(aSlot, true);
+}
+
+// Record the completion of a request and make its slot available again
+void AsyncIO::Complete(u32 aSlot, bool aSuccess)
+{
+  Request &lRequest = mRequests[aSlot];
+
+  // The transfer as the caller asked for it
+  u64 lOffset = lRequest.offset + lRequest.skip;
+  size_t lLength = lRequest.needed - lRequest.skip;
+
+  if (lRequest.bounce != 0)
+  {
+    if (aSuccess)
+      memcpy(lRequest.target, lRequest.bounce + lRequest.skip, lLength);
+
+    AlignedBufferPool::Release(lRequest.bounce);
+    lRequest.bounce = 0;
+  }
+
+  if (!aSuccess)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    if (lRequest.write)
+    {
+      cerr << "Could not write " << (u64)lLength << " bytes to " << lRequest.diskfile->FileName()
+           << " at offset " << lOffset << endl;
+    }
+    else
+    {
+      cerr << "Could not read " << (u64)lLength << " bytes from " << lRequest.diskfile->FileName()
+           << " at offset " << lOffset << endl;
+    }
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  Completion lCompletion;
+  lCompletion.tag = lRequest.tag;
+  lCompletion.success = aSuccess;
+
+  dispatch_semaphore_wait(mReadySema, DISPATCH_TIME_FOREVER);
+  mReady.push_back(lCompletion);
+  mFreeSlots.push_back(aSlot);
+  dispatch_semaphore_signal(mReadySema);
+
+  dispatch_semaphore_signal(mDoneSema);
+}
+
+u32 AsyncIO::Reap(u32 aMinimum, Completion *aCompletions, u32 aMaximum)
+{
+  assert(aMinimum <= mOutstanding && aMinimum <= aMaximum);
+
+  // Anything still queued must be on its way before we can wait for it
+  Submit();
+
+  u32 lCount = 0;
+  while (lCount < aMaximum && lCount < mOutstanding)
+  {
+    // Take whatever has completed already
+    if (dispatch_semaphore_wait(mDoneSema, DISPATCH_TIME_NOW) == 0)
+    {
+      lCount++;
+      continue;
+    }
+    if (lCount >= aMinimum)
+      break;
+
+#ifdef HAVE_LIBURING
+    if (mUseRing)
+    {
+      // Collect a batch of completions from the ring; this signals mDoneSema
+      ProcessRingCompletions(true);
+      continue;
+    }
+#endif
+    dispatch_semaphore_wait(mDoneSema, DISPATCH_TIME_FOREVER);
+    lCount++;
+  }
+
+  // Every signal of mDoneSema corresponds to one entry in mReady
+  dispatch_semaphore_wait(mReadySema, DISPATCH_TIME_FOREVER);
+  assert(mReady.size() >= lCount);
+  for (u32 i = 0; i < lCount; i++)
+  {
+    aCompletions[i] = mReady.back();
+    mReady.pop_back();
+  }
+  dispatch_semaphore_signal(mReadySema);
+
+  mOutstanding -= lCount;
+
+  return lCount;
+}
+
+bool AsyncIO::WaitAll(void)
+{
+  bool rv = true;
+  Completion lCompletions[16];
+
+  while (mOutstanding > 0)
+  {
+    u32 lCount = Reap(1, lCompletions, 16);
+    for (u32 i = 0; i < lCount; i++)
+    {
+      if (!lCompletions[i].success)
+        rv = false;
+    }
+  }
+
+  return rv;
+}
+
+#ifdef HAVE_LIBURING
+bool AsyncIO::PrepareRingRequest(u32 aSlot)
+{
+  struct io_uring *lRing = (struct io_uring *)mRing;
+  Request &lRequest = mRequests[aSlot];
+
+  struct io_uring_sqe *lSqe = io_uring_get_sqe(lRing);
+  if (lSqe == 0)
+  {
+    // Cannot happen: the ring has as many entries as there are request slots
+    return false;
+  }
+
+  if (lRequest.write)
+  {
+    io_uring_prep_write(lSqe, lRequest.fd, lRequest.buffer + lRequest.done,
+                        (unsigned)(lRequest.length - lRequest.done), lRequest.offset + lRequest.done);
+  }
+  else
+  {
+    io_uring_prep_read(lSqe, lRequest.fd, lRequest.buffer + lRequest.done,
+                       (unsigned)(lRequest.length - lRequest.done), lRequest.offset + lRequest.done);
+  }
+  io_uring_sqe_set_data(lSqe, (void *)(uintptr_t)aSlot);
+
+  return true;
+}
+
+void AsyncIO::ProcessRingCompletions(bool aWait)
+{
+  struct io_uring *lRing = (struct io_uring *)mRing;
+  struct io_uring_cqe *lCqe;
+
+  if (aWait)
+  {
+    int lResult = io_uring_wait_cqe(lRing, &lCqe);
+    if (lResult < 0 && lResult != -EINTR)
+    {
+      // The ring is broken; fail everything that is in flight
+      for (u32 slot = 0; slot < mQueueDepth; slot++)
+      {
+        if (find(mFreeSlots.begin(), mFreeSlots.end(), slot) == mFreeSlots.end())
+          Complete(slot, false);
+      }
+      return;
+    }
+  }
+
+  // Reap in batches; the completion queue is only advanced once per batch
+  struct io_uring_cqe *lCqes[AsyncIOMaxQueueDepth];
+  bool lResubmit = false;
+  unsigned lCount;
+  while ((lCount = io_uring_peek_batch_cqe(lRing, lCqes, AsyncIOMaxQueueDepth)) > 0)
+  {
+    for (unsigned i = 0; i < lCount; i++)
+    {
+      u32 lSlot = (u32)(uintptr_t)io_uring_cqe_get_data(lCqes[i]);
+      int lResult = lCqes[i]->res;
+      Request &lRequest = mRequests[lSlot];
+
+      if (lResult == -EINTR || lResult == -EAGAIN)
+      {
+        lResubmit = PrepareRingRequest(lSlot) || lResubmit;
+      }
+      else if (lResult == 0 && lRequest.done >= lRequest.needed)
+      {
+        // A bounced read that runs past the end of file
+        Complete(lSlot, true);
+      }
+      else if (lResult <= 0)
+      {
+        Complete(lSlot, false);
+      }
+      else
+      {
+        lRequest.done += lResult;
+        if (lRequest.done < lRequest.length)
+        {
+          // Short transfer; queue the remainder
+          lResubmit = PrepareRingRequest(lSlot) || lResubmit;
+        }
+        else
+        {
+          Complete(lSlot, true);
+        }
+      }
+    }
+    io_uring_cq_advance(lRing, lCount);
+  }
+
+  if (lResubmit)
+    io_uring_submit(lRing);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+AsyncBlockReader::AsyncBlockReader(void)
+: mIO(0)
+, mBlocks(0)
+, mBlockOffset(0)
+, mBlockLength(0)
+, mBuffer(0)
+, mSlotSize(0)
+, mSlotCount(0)
+, mNextToQueue(0)
+, mNextToReturn(0)
+, mCache(0)
+, mMapped(false)
+, mFailed(false)
+{
+}
+
+AsyncBlockReader::~AsyncBlockReader(void)
+{
+  Finish();
+  delete mIO;
+}
+
+u32 AsyncBlockReader::SlotCount(size_t chunksize)
+{
+  // At least double buffering; beyond that, as many as the read ahead budget allows
+  size_t lSlots = ReadAheadBytes / max(chunksize, (size_t)1);
+  return (u32)max((size_t)2, min(lSlots, (size_t)AsyncIOMaxQueueDepth));
+}
+
+u32 AsyncBlockReader::SlotCount(size_t chunksize, size_t memory)
+{
+  size_t lSlots = memory / AlignedBufferPool::RoundUp(max(chunksize, (size_t)1));
+  return (u32)max((size_t)2, min(lSlots, (size_t)SlotCount(chunksize)));
+}
+
+size_t AsyncBlockReader::MinimumBufferSize(size_t chunksize)
+{
+  return 2 * AlignedBufferPool::RoundUp(chunksize);
+}
+
+size_t AsyncBlockReader::LargestChunkSize(size_t memorylimit, u32 chunkcount)
+{
+  chunkcount = max(chunkcount, (u32)1);
+
+  // Rounding the input slots up to the alignment may take a few rounds to settle
+  size_t lChunkSize = ~3 & (memorylimit / (chunkcount + 2));
+  while (lChunkSize > 0 && (u64)lChunkSize * chunkcount + MinimumBufferSize(lChunkSize) > memorylimit)
+  {
+    size_t lInput = MinimumBufferSize(lChunkSize);
+    size_t lSmaller = memorylimit > lInput ? ~3 & ((memorylimit - lInput) / chunkcount) : lChunkSize / 2;
+    lChunkSize = ~3 & min(lSmaller, lChunkSize - 4);
+  }
+
+  return lChunkSize;
+}
+
+bool AsyncBlockReader::Start(const vector<DataBlock*> &aBlocks, u64 blockoffset, size_t blocklength,
+                             void *aBuffer, size_t aSlotSize, u32 aSlotCount, BlockCache *aCache,
+                             bool aMapped)
+{
+  assert(blocklength <= aSlotSize && aSlotCount > 0);
+  assert(mOpenFiles.empty());
+
+  mBlocks = &aBlocks;
+  mBlockOffset = blockoffset;
+  mBlockLength = blocklength;
+  mBuffer = (u8 *)aBuffer;
+  mSlotSize = aSlotSize;
+  mSlotCount = aSlotCount;
+  mNextToQueue = 0;
+  mNextToReturn = 0;
+  mCache = aCache;
+  mMapped = aMapped;
+  mFailed = false;
+
+  mSlotReady.assign(mSlotCount, false);
+  mSlotCached.assign(mSlotCount, false);
+  mSlotData.assign(mSlotCount, (const void*)0);
+  mCompletions.resize(mSlotCount);
+
+  if (mIO == 0 || mIO->QueueDepth() != mSlotCount)
+  {
+    delete mIO;
+    mIO = new AsyncIO(mSlotCount);
+  }
+
+  return QueueMore();
+}
+
+// Queue reads until all slots are in use
+bool AsyncBlockReader::QueueMore(void)
+{
+  while (mNextToQueue < mBlocks->size() && mNextToQueue < mNextToReturn + mSlotCount)
+  {
+    DataBlock *lBlock = (*mBlocks)[mNextToQueue];
+    DiskFile *lFile = lBlock->GetDiskFile();
+    u32 lSlot = (u32)(mNextToQueue % mSlotCount);
+
+    // No I/O at all if the data is in the cache
+    if (mCache != 0 && lBlock->ReadCachedData(*mCache, mBlockOffset, mBlockLength, mBuffer + lSlot * mSlotSize))
+    {
+      mSlotReady[lSlot] = true;
+      mSlotCached[lSlot] = true;
+      mSlotData[lSlot] = mBuffer + lSlot * mSlotSize;
+      mNextToQueue++;
+      continue;
+    }
+
+    map<DiskFile*, u32>::iterator f = mOpenFiles.find(lFile);
+    if (f == mOpenFiles.end())
+    {
+      if (!DiskFilePool::Acquire(lFile))
+      {
+        mFailed = true;
+        return false;
+      }
+      f = mOpenFiles.insert(pair<DiskFile*, u32>(lFile, 0)).first;
+    }
+    f->second++;
+
+    mSlotCached[lSlot] = false;
+
+    // Use the data in place if the file can be mapped
+    if (mMapped && lFile->Map())
+    {
+      const void *lData = lBlock->MappedData(mBlockOffset, mBlockLength);
+      if (lData != 0)
+      {
+        // By the time the block is needed, the pages should be in memory
+        lBlock->PrefetchData(mBlockOffset, mBlockLength);
+
+        mSlotReady[lSlot] = true;
+        mSlotData[lSlot] = lData;
+        mNextToQueue++;
+        continue;
+      }
+    }
+
+    mSlotData[lSlot] = mBuffer + lSlot * mSlotSize;
+
+    // A hole in a sparse file reads as zeroes; there is no need to ask the OS. The holes
+    // were found when the file was opened, so this takes no system call either.
+    if (lBlock->IsHole(mBlockOffset, mBlockLength))
+    {
+      memset(mBuffer + lSlot * mSlotSize, 0, mBlockLength);
+      mSlotReady[lSlot] = true;
+      mNextToQueue++;
+      continue;
+    }
+
+    mSlotReady[lSlot] = false;
+    if (!lBlock->QueueReadData(*mIO, mBlockOffset, mBlockLength, mBuffer + lSlot * mSlotSize, (u32)mNextToQueue))
+    {
+      mFailed = true;
+      return false;
+    }
+
+    mNextToQueue++;
+  }
+
+  return mIO->Submit();
+}
+
+// The block has been consumed: give its file back to the pool if no queued block
+// needs it anymore
+void AsyncBlockReader::Release(size_t aBlockIndex)
+{
+  if (mSlotCached[aBlockIndex % mSlotCount])
+    return;
+
+  DiskFile *lFile = (*mBlocks)[aBlockIndex]->GetDiskFile();
+
+  map<DiskFile*, u32>::iterator f = mOpenFiles.find(lFile);
+  assert(f != mOpenFiles.end());
+  if (--f->second == 0)
+  {
+    DiskFilePool::Release(lFile);
+    mOpenFiles.erase(f);
+  }
+}
+
+const void *AsyncBlockReader::Next(void)
+{
+  if (mFailed || mNextToReturn >= mBlocks->size())
+    return 0;
+
+  // The previous block has been processed; its slot can be reused
+  if (mNextToReturn > 0)
+  {
+    Release(mNextToReturn - 1);
+    if (!QueueMore())
+      return 0;
+  }
+
+  u32 lSlot = (u32)(mNextToReturn % mSlotCount);
+  while (!mSlotReady[lSlot])
+  {
+    // Take a whole batch of completions at once
+    u32 lCount = mIO->Reap(1, &mCompletions[0], mSlotCount);
+    for (u32 i = 0; i < lCount; i++)
+    {
+      if (!mCompletions[i].success)
+        mFailed = true;
+      mSlotReady[mCompletions[i].tag % mSlotCount] = true;
+    }
+    if (mFailed)
+      return 0;
+  }
+
+  mNextToReturn++;
+
+  return mSlotData[lSlot];
+}
+
+bool AsyncBlockReader::Finish(void)
+{
+  bool rv = !mFailed;
+
+  if (mIO != 0 && !mIO->WaitAll())
+    rv = false;
+
+  for (map<DiskFile*, u32>::iterator f = mOpenFiles.begin(); f != mOpenFiles.end(); ++f)
+  {
+    DiskFilePool::Release(f->first);
+  }
+  mOpenFiles.clear();
+
+  return rv;
+}
@@ -0,0 +1,173 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef __ASYNCIO_H__
+#define __ASYNCIO_H__
+
+// AsyncIO allows many reads and writes on DiskFiles to be outstanding at the same time.
+// Requests are queued with QueueRead/QueueWrite, handed to the OS in one go with Submit,
+// and collected in batches with Reap. Each request carries a tag chosen by the caller,
+// which is returned with its completion.
+// On Linux, when built with HAVE_LIBURING, the requests are passed to the kernel with
+// io_uring. Elsewhere (or when the kernel refuses to set up a ring) each request is executed
+// with pread/pwrite on a Grand Central Dispatch queue.
+// A DiskFile must be open while requests for it are outstanding, and the buffers must
+// remain valid until the request has been reaped. Reads that the DiskFile cannot do
+// directly on its descriptor (unaligned ones in direct I/O mode) are done asynchronously
+// as well, through an aligned bounce buffer. Such writes (files opened for writing do not
+// use direct I/O) are done synchronously.
+
+// The largest queue depth that is useful for the I/O we do
+#define AsyncIOMaxQueueDepth 32
+
+class AsyncIO
+{
+public:
+  // A finished request, as returned by Reap
+  struct Completion
+  {
+    u32  tag;
+    bool success;
+  };
+
+  AsyncIO(u32 queuedepth);
+  ~AsyncIO(void);
+
+  // Queue a request. Fails if QueueDepth requests are already outstanding.
+  // A request with length 0 completes immediately.
+  bool QueueRead(DiskFile *diskfile, u64 offset, void *buffer, size_t length, u32 tag);
+  bool QueueWrite(DiskFile *diskfile, u64 offset, const void *buffer, size_t length, u32 tag);
+
+  // Pass all queued requests to the OS
+  bool Submit(void);
+
+  // Wait until at least aMinimum requests have completed, and return up to aMaximum
+  // completions. Returns the number of completions stored in aCompletions.
+  u32 Reap(u32 aMinimum, Completion *aCompletions, u32 aMaximum);
+
+  // Submit and wait for everything that is outstanding; false if any request failed.
+  bool WaitAll(void);
+
+  // The number of requests that have been queued but not reaped yet
+  u32 Outstanding(void) const {return mOutstanding;}
+  u32 QueueDepth(void) const {return mQueueDepth;}
+
+protected:
+  struct Request
+  {
+    DiskFile *diskfile;
+    int       fd;
+    u8       *buffer;
+    size_t    length;
+    size_t    done;       // How much has been transferred so far
+    size_t    needed;     // How much must be transferred; a bounced read may run past the end of file
+    u8       *bounce;     // The aligned buffer of a bounced read, or 0
+    u8       *target;     // Where the data of a bounced read goes
+    size_t    skip;       // Where that data starts in the bounce buffer
+    u64       offset;
+    u32       tag;
+    bool      write;
+  };
+
+  bool Queue(DiskFile *diskfile, u64 offset, u8 *buffer, size_t length, u32 tag, bool write);
+  void Complete(u32 aSlot, bool aSuccess);
+  void Execute(u32 aSlot);          // Thread pool: perform one request synchronously
+#ifdef HAVE_LIBURING
+  bool PrepareRingRequest(u32 aSlot);
+  void ProcessRingCompletions(bool aWait);
+#endif
+
+protected:
+  u32                   mQueueDepth;
+  u32                   mOutstanding;
+  Request              *mRequests;       // mQueueDepth request slots
+  vector<u32>           mFreeSlots;
+  vector<u32>           mQueued;         // Slots that have been queued but not submitted
+  vector<Completion>    mReady;          // Completions that have not been reaped
+  dispatch_semaphore_t  mReadySema;      // Protects mReady and mFreeSlots
+  dispatch_semaphore_t  mDoneSema;       // Signalled once for every completion
+  bool                  mUseRing;
+  void                 *mRing;           // Actually struct io_uring
+};
+
+// AsyncBlockReader reads the same part of each of a list of DataBlocks, in order, while
+// keeping many of the reads in flight. The caller provides the memory, as a number of
+// slots that are used round robin. Files are taken from the DiskFilePool when the first
+// read for them is queued, and given back when the last block that needs them has been
+// consumed; the pool keeps them open for the next pass. Blocks that are in the optional BlockCache are
+// copied from there, and their files are not touched at all.
+// In mapped mode the files are mapped into memory and Next returns pointers into the
+// mappings, so that the data is not copied at all. Only blocks that need zero padding
+// (the last block of a file) are still read into a slot.
+// Blocks that are in a hole of a sparse file are not read; their slot is cleared.
+
+class AsyncBlockReader
+{
+public:
+  AsyncBlockReader(void);
+  ~AsyncBlockReader(void);
+
+  // Prepare reading [blockoffset, blockoffset + blocklength) of each of the blocks.
+  bool Start(const vector<DataBlock*> &aBlocks, u64 blockoffset, size_t blocklength,
+             void *aBuffer, size_t aSlotSize, u32 aSlotCount, BlockCache *aCache = 0,
+             bool aMapped = false);
+
+  // Wait for the data of the next block and return a pointer to it. The data remains
+  // valid until the next call of Next or Finish. Returns 0 on failure.
+  const void *Next(void);
+
+  // Wait for anything that is still outstanding and give the files back to the pool.
+  bool Finish(void);
+
+  // How many slots (reads in flight) are useful for a given chunk size
+  static u32 SlotCount(size_t chunksize);
+
+  // As many of those as fit in the given memory, but at least two
+  static u32 SlotCount(size_t chunksize, size_t memory);
+
+  // How much memory the slots for a given chunk size take at least (double buffering)
+  static size_t MinimumBufferSize(size_t chunksize);
+
+  // The largest chunk size (a multiple of 4) for which chunkcount output chunks and the
+  // smallest input buffer together fit in memorylimit. Returns 0 if there is none.
+  static size_t LargestChunkSize(size_t memorylimit, u32 chunkcount);
+
+protected:
+  bool QueueMore(void);
+  void Release(size_t aBlockIndex);
+
+protected:
+  AsyncIO                    *mIO;
+  const vector<DataBlock*>   *mBlocks;
+  u64                         mBlockOffset;
+  size_t                      mBlockLength;
+  u8                         *mBuffer;
+  size_t                      mSlotSize;
+  u32                         mSlotCount;
+  size_t                      mNextToQueue;
+  size_t                      mNextToReturn;
+  vector<bool>                mSlotReady;
+  vector<bool>                mSlotCached;    // The data came from mCache, not from a file
+  vector<const void*>         mSlotData;      // Where the data of each slot is
+  BlockCache                 *mCache;
+  bool                        mMapped;
+  vector<AsyncIO::Completion> mCompletions;
+  map<DiskFile*, u32>         mOpenFiles;     // Queued blocks that have not been consumed yet
+  bool                        mFailed;
+};
+
+#endif // __ASYNCIO_H__
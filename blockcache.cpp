@@ -0,0 +1,141 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "par2cmdline.h"
+
+BlockCache::BlockCache(void)
+: mBudget(0)
+, mUsed(0)
+, mHits(0)
+, mMisses(0)
+{
+  mSema = dispatch_semaphore_create(1);
+}
+
+BlockCache::~BlockCache(void)
+{
+  Clear();
+  dispatch_release(mSema);
+}
+
+void BlockCache::SetBudget(size_t aBudget)
+{
+  dispatch_semaphore_wait(mSema, DISPATCH_TIME_FOREVER);
+
+  mBudget = aBudget;
+  while (mUsed > mBudget)
+  {
+    Drop(--mEntries.end());
+  }
+
+  dispatch_semaphore_signal(mSema);
+}
+
+bool BlockCache::Insert(const DiskFile *aDiskFile, u64 aOffset, const void *aData, size_t aLength)
+{
+  // Quick check without locking; the budget only changes between the phases
+  if (aLength == 0 || aLength > mBudget)
+    return false;
+
+  // Copy the data before taking the lock; the copying is the expensive part
+  u8 *lData = (u8 *)malloc(aLength);
+  if (lData == 0)
+    return false;
+  memcpy(lData, aData, aLength);
+
+  dispatch_semaphore_wait(mSema, DISPATCH_TIME_FOREVER);
+
+  // Replace an older copy of the same block
+  map<Key, EntryIterator>::iterator lExisting = mIndex.find(Key(aDiskFile, aOffset));
+  if (lExisting != mIndex.end())
+  {
+    Drop(lExisting->second);
+  }
+
+  // Make room by dropping the least recently used blocks
+  while (mUsed + aLength > mBudget && !mEntries.empty())
+  {
+    Drop(--mEntries.end());
+  }
+
+  bool rv = mUsed + aLength <= mBudget;
+  if (rv)
+  {
+    Entry lEntry;
+    lEntry.diskfile = aDiskFile;
+    lEntry.offset = aOffset;
+    lEntry.data = lData;
+    lEntry.length = aLength;
+
+    mEntries.push_front(lEntry);
+    mIndex[Key(aDiskFile, aOffset)] = mEntries.begin();
+    mUsed += aLength;
+  }
+
+  dispatch_semaphore_signal(mSema);
+
+  if (!rv)
+    free(lData);
+
+  return rv;
+}
+
+bool BlockCache::Read(const DiskFile *aDiskFile, u64 aOffset, u64 aPosition, void *aBuffer, size_t aLength)
+{
+  if (mBudget == 0)
+    return false;
+
+  dispatch_semaphore_wait(mSema, DISPATCH_TIME_FOREVER);
+
+  map<Key, EntryIterator>::iterator lFound = mIndex.find(Key(aDiskFile, aOffset));
+  bool rv = lFound != mIndex.end() && aPosition + aLength <= lFound->second->length;
+  if (rv)
+  {
+    // Move the block to the front of the LRU list. The iterator stays valid.
+    mEntries.splice(mEntries.begin(), mEntries, lFound->second);
+    memcpy(aBuffer, &lFound->second->data[aPosition], aLength);
+    mHits++;
+  }
+  else
+  {
+    mMisses++;
+  }
+
+  dispatch_semaphore_signal(mSema);
+
+  return rv;
+}
+
+void BlockCache::Clear(void)
+{
+  dispatch_semaphore_wait(mSema, DISPATCH_TIME_FOREVER);
+
+  while (!mEntries.empty())
+  {
+    Drop(mEntries.begin());
+  }
+
+  dispatch_semaphore_signal(mSema);
+}
+
+void BlockCache::Drop(EntryIterator aEntry)
+{
+  mIndex.erase(Key(aEntry->diskfile, aEntry->offset));
+  mUsed -= aEntry->length;
+  free(aEntry->data);
+  mEntries.erase(aEntry);
+}
@@ -0,0 +1,77 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef __BLOCKCACHE_H__
+#define __BLOCKCACHE_H__
+
+// The BlockCache keeps the contents of data blocks in memory, so that data that was read
+// during verification does not have to be read from disk again during repair. Blocks are
+// identified by their DiskFile and their offset in that file, just like a DataBlock.
+// The total size of the cached data never exceeds the budget; when room is needed, the
+// least recently used blocks are dropped.
+// All functions are thread safe.
+
+class BlockCache
+{
+public:
+  BlockCache(void);
+  ~BlockCache(void);
+
+  // Set the number of bytes the cache may use. A budget of 0 disables the cache.
+  // Blocks are dropped if the new budget is smaller than what is in use.
+  void SetBudget(size_t aBudget);
+  size_t Budget(void) const {return mBudget;}
+
+  // Store a copy of the data of a block. Returns false if the block is not cached
+  // (the cache is disabled, or the block is larger than the budget).
+  bool Insert(const DiskFile *aDiskFile, u64 aOffset, const void *aData, size_t aLength);
+
+  // Copy part of a cached block to aBuffer. Returns false if the block is not in the
+  // cache, or if the requested part is not within the cached data.
+  bool Read(const DiskFile *aDiskFile, u64 aOffset, u64 aPosition, void *aBuffer, size_t aLength);
+
+  // Drop everything
+  void Clear(void);
+
+  // Statistics
+  u64 Hits(void) const {return mHits;}
+  u64 Misses(void) const {return mMisses;}
+
+protected:
+  struct Entry
+  {
+    const DiskFile *diskfile;
+    u64             offset;
+    u8             *data;
+    size_t          length;
+  };
+  typedef pair<const DiskFile*, u64> Key;
+  typedef list<Entry>::iterator      EntryIterator;
+
+  void Drop(EntryIterator aEntry);        // Caller holds mSema
+
+protected:
+  size_t                    mBudget;
+  size_t                    mUsed;
+  list<Entry>               mEntries;     // Most recently used first
+  map<Key, EntryIterator>   mIndex;
+  u64                       mHits;
+  u64                       mMisses;
+  dispatch_semaphore_t      mSema;        // Protects everything above
+};
+
+#endif // __BLOCKCACHE_H__
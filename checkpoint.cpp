@@ -0,0 +1,142 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#include "par2cmdline.h"
+
+// The layout of a checkpoint file:
+//   magic, identity, block offset, state length, state, MD5 of all that precedes
+static const u8 sCheckpointMagic[8] = {'P', 'A', 'R', '2', 'C', 'K', 'P', '\0'};
+
+Checkpoint::Checkpoint(void)
+{
+}
+
+Checkpoint::~Checkpoint(void)
+{
+}
+
+void Checkpoint::SetFile(string aFileName, const MD5Hash &aIdentity)
+{
+  mFileName = aFileName;
+  mIdentity = aIdentity;
+}
+
+bool Checkpoint::Load(u64 &aBlockOffset, vector<u8> &aState)
+{
+  if (!IsSet() || !DiskFile::FileExists(mFileName))
+    return false;
+
+  DiskFile lFile;
+  if (!lFile.Open(mFileName, false))
+    return false;
+
+  u64 lHeaderSize = sizeof(sCheckpointMagic) + sizeof(MD5Hash) + 2 * sizeof(leu64);
+  u64 lFileSize = lFile.FileSize();
+  if (lFileSize < lHeaderSize + sizeof(MD5Hash) || lFileSize - lHeaderSize - sizeof(MD5Hash) > 0x7fffffff)
+    return false;
+
+  vector<u8> lData((size_t)lFileSize);
+  if (!lFile.Read(0, &lData[0], lData.size()))
+    return false;
+  lFile.Close();
+
+  // Check the whole file before believing any of it
+  size_t lDataSize = lData.size() - sizeof(MD5Hash);
+  MD5Context lContext;
+  lContext.Update(&lData[0], lDataSize);
+  MD5Hash lHash;
+  lContext.Final(lHash);
+  if (memcmp(&lHash, &lData[lDataSize], sizeof(MD5Hash)) != 0)
+    return false;
+
+  size_t lPosition = 0;
+  if (memcmp(&lData[lPosition], sCheckpointMagic, sizeof(sCheckpointMagic)) != 0)
+    return false;
+  lPosition += sizeof(sCheckpointMagic);
+
+  if (memcmp(&lData[lPosition], &mIdentity, sizeof(MD5Hash)) != 0)
+    return false;
+  lPosition += sizeof(MD5Hash);
+
+  leu64 lBlockOffset;
+  leu64 lStateLength;
+  memcpy(&lBlockOffset, &lData[lPosition], sizeof(leu64));
+  lPosition += sizeof(leu64);
+  memcpy(&lStateLength, &lData[lPosition], sizeof(leu64));
+  lPosition += sizeof(leu64);
+
+  if (lStateLength != lDataSize - lPosition)
+    return false;
+
+  aBlockOffset = lBlockOffset;
+  aState.assign(lData.begin() + lPosition, lData.begin() + lDataSize);
+
+  return true;
+}
+
+bool Checkpoint::Save(u64 aBlockOffset, const vector<u8> &aState)
+{
+  if (!IsSet())
+    return false;
+
+  vector<u8> lData;
+  leu64 lBlockOffset = aBlockOffset;
+  leu64 lStateLength = (u64)aState.size();
+  lData.insert(lData.end(), sCheckpointMagic, sCheckpointMagic + sizeof(sCheckpointMagic));
+  lData.insert(lData.end(), (const u8*)&mIdentity, (const u8*)&mIdentity + sizeof(MD5Hash));
+  lData.insert(lData.end(), (const u8*)&lBlockOffset, (const u8*)&lBlockOffset + sizeof(leu64));
+  lData.insert(lData.end(), (const u8*)&lStateLength, (const u8*)&lStateLength + sizeof(leu64));
+  lData.insert(lData.end(), aState.begin(), aState.end());
+
+  MD5Context lContext;
+  lContext.Update(&lData[0], lData.size());
+  MD5Hash lHash;
+  lContext.Final(lHash);
+  lData.insert(lData.end(), (const u8*)&lHash, (const u8*)&lHash + sizeof(MD5Hash));
+
+  // Write a new file and put it in place of the old one
+  string lNewName = mFileName + ".new";
+  DiskFile lFile;
+  if (!lFile.Create(lNewName, 0))
+    return false;
+  bool rv = lFile.Write(0, &lData[0], lData.size()) && lFile.Sync();
+  lFile.Close();
+
+  if (rv && ::rename(lNewName.c_str(), mFileName.c_str()) != 0)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "Could not write checkpoint " << mFileName << endl;
+    dispatch_semaphore_signal(coutSema);
+    rv = false;
+  }
+  if (!rv)
+    ::unlink(lNewName.c_str());
+  DiskFilePool::StatusChanged(lNewName);
+  DiskFilePool::StatusChanged(mFileName);
+
+  return rv;
+}
+
+void Checkpoint::Remove(void)
+{
+  if (IsSet() && DiskFile::FileExists(mFileName))
+  {
+    ::unlink(mFileName.c_str());
+    DiskFilePool::StatusChanged(mFileName);
+  }
+}
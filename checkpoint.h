@@ -0,0 +1,57 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+// Creating or repairing a large set takes a number of passes, each of which computes
+// a part (a range of offsets) of all output blocks. A Checkpoint records how far the
+// passes got, so that an interrupted run can be continued by running the same command
+// again. Besides the offset, it keeps some state that the caller needs to continue,
+// such as the MD5 contexts of the blocks.
+// A checkpoint only applies to the same work: the identity is a hash of everything
+// that determines the output, and a checkpoint with another identity is ignored.
+// Save replaces the checkpoint file in one rename, so it is either the old one or the
+// new one, never a mix. The caller syncs the output files before saving.
+
+class Checkpoint
+{
+public:
+  Checkpoint(void);
+  ~Checkpoint(void);
+
+  // Which file the checkpoint is kept in, and the identity of the work
+  void SetFile(string aFileName, const MD5Hash &aIdentity);
+
+  // Read the checkpoint. Returns false if there is none for this work (or it is damaged).
+  bool Load(u64 &aBlockOffset, vector<u8> &aState);
+
+  // Record that all passes up to aBlockOffset have been completed
+  bool Save(u64 aBlockOffset, const vector<u8> &aState);
+
+  // The work is done
+  void Remove(void);
+
+  bool IsSet(void) const {return !mFileName.empty();}
+
+protected:
+  string    mFileName;
+  MD5Hash   mIdentity;
+};
+
+#endif // __CHECKPOINT_H__
@@ -64,6 +64,20 @@ CommandLine::CommandLine(void)
 , totalsourcesize(0)
 , largestsourcesize(0)
 , memorylimit(0)
+, cachelimit(0)
+, directio(false)
+, directwrite(false)
+, mappedinput(false)
+, syndromes(false)
+, paranoid(false)
+, resume(false)
+, openfilelimit(0)
+, sessiondir()
+, previousdir()
+, shardnumber(0)
+, shardcount(0)
+, streamfile()
+, autotune(false)
 {
 }
 
@@ -76,9 +90,11 @@ void CommandLine::usage(void)
     "  par2 c(reate) [options] <par2 file> [files] : Create PAR2 files\n"
     "  par2 v(erify) [options] <par2 file> [files] : Verify files using PAR2 file\n"
     "  par2 r(epair) [options] <par2 file> [files] : Repair files using PAR2 files\n"
+    "  par2 u(pdate) [options] <par2 file> [files] : Update PAR2 files for changed files\n"
+    "  par2 m(erge) [options] <par2 file> <shards> : Make PAR2 files from shard files\n"
     "\n"
-    "You may also leave out the \"c\", \"v\", and \"r\" commands by using \"parcreate\",\n"
-    "\"par2verify\", or \"par2repair\" instead.\n"
+    "You may also leave out the \"c\", \"v\", \"r\", \"u\" and \"m\" commands by using\n"
+    "\"parcreate\", \"par2verify\", \"par2repair\", \"par2update\" or \"par2merge\" instead.\n"
     "\n"
     "Options:\n"
     "\n"
@@ -93,6 +109,21 @@ void CommandLine::usage(void)
     "  -m<n>  : Memory (in MB) to use\n"
     "  -v [-v]: Be more verbose\n"
     "  -q [-q]: Be more quiet (-q -q gives silence)\n"
+    "  --direct-io : Read files without using the file system cache\n"
+    "  --direct-write : Do not keep large writes in the file system cache\n"
+    "  --mmap : Map input files into memory instead of reading them\n"
+    "  --syndromes : Prepare the repair while verifying (uses the -m memory)\n"
+    "  --paranoid : Read repaired files back to verify them\n"
+    "  --resume : Continue an interrupted create or repair where it stopped\n"
+    "  --cache-memory=<n> : Memory (in MB) to keep verified data in for the repair\n"
+    "  --open-files=<n> : Keep at most <n> files open at the same time\n"
+    "  --session=<dir> : Keep the verification results in <dir> for the next run\n"
+    "  --previous=<dir> : When updating, the old versions of the changed files are in <dir>\n"
+    "  --shard=<i>/<n> : Create only the i-th of n parts of the recovery blocks, to merge later\n"
+    "  --stream=<file> : Create from the standard input, which is also written to <file>\n"
+    "                    (needs -s and -c, and the recovery blocks must fit in -m)\n"
+    "  --auto-tune : Choose the block size that creates fastest within -m (not with -b or -s),\n"
+    "                keeping at least 2000 source blocks if the files allow that\n"
     "  --     : Treat all remaining CommandLine as filenames\n"
     "\n"
     "If you wish to create par2 files for a single source file, you may leave\n"
@@ -131,6 +162,14 @@ bool CommandLine::Parse(int argc, char *argv[])
   {
     operation = opRepair;
   }
+  else if (0 == stricmp("par2update", name.c_str()))
+  {
+    operation = opUpdate;
+  }
+  else if (0 == stricmp("par2merge", name.c_str()))
+  {
+    operation = opMerge;
+  }
 
   // Have we determined what operation we want?
   if (operation == opNone)
@@ -155,6 +194,14 @@ bool CommandLine::Parse(int argc, char *argv[])
       if (argv[0][1] == 0 || 0 == stricmp(argv[0], "repair"))
         operation = opRepair;
       break;
+    case 'u':
+      if (argv[0][1] == 0 || 0 == stricmp(argv[0], "update"))
+        operation = opUpdate;
+      break;
+    case 'm':
+      if (argv[0][1] == 0 || 0 == stricmp(argv[0], "merge"))
+        operation = opMerge;
+      break;
     }
     if (operation == opNone)
     {
@@ -352,9 +399,9 @@ bool CommandLine::Parse(int argc, char *argv[])
 
         case 'u':  // Specify uniformly sized recovery files
           {
-            if (operation != opCreate)
+            if (operation != opCreate && operation != opMerge)
             {
-              cerr << "Cannot specify uniform files unless creating." << endl;
+              cerr << "Cannot specify uniform files unless creating or merging." << endl;
               return false;
             }
             if (argv[0][2])
@@ -374,9 +421,9 @@ bool CommandLine::Parse(int argc, char *argv[])
 
         case 'l':  // Limit the size of the recovery files
           {
-            if (operation != opCreate)
+            if (operation != opCreate && operation != opMerge)
             {
-              cerr << "Cannot specify limit files unless creating." << endl;
+              cerr << "Cannot specify limit files unless creating or merging." << endl;
               return false;
             }
             if (argv[0][2])
@@ -401,9 +448,9 @@ bool CommandLine::Parse(int argc, char *argv[])
 
         case 'n':  // Specify the number of recovery files
           {
-            if (operation != opCreate)
+            if (operation != opCreate && operation != opMerge)
             {
-              cerr << "Cannot specify recovery file count unless creating." << endl;
+              cerr << "Cannot specify recovery file count unless creating or merging." << endl;
               return false;
             }
             if (recoveryfilecount > 0)
@@ -513,10 +560,159 @@ bool CommandLine::Parse(int argc, char *argv[])
 
         case '-':
           {
-            argc--;
-            argv++;
-            options = false;
-            continue;
+            if (argv[0][2] == 0)
+            {
+              argc--;
+              argv++;
+              options = false;
+              continue;
+            }
+
+            // Long options
+            if (0 == stricmp(&argv[0][2], "direct-io"))
+            {
+              directio = true;
+            }
+            else if (0 == stricmp(&argv[0][2], "direct-write"))
+            {
+              directwrite = true;
+            }
+            else if (0 == stricmp(&argv[0][2], "mmap"))
+            {
+              mappedinput = true;
+            }
+            else if (0 == stricmp(&argv[0][2], "syndromes"))
+            {
+              syndromes = true;
+            }
+            else if (0 == stricmp(&argv[0][2], "paranoid"))
+            {
+              paranoid = true;
+            }
+            else if (0 == stricmp(&argv[0][2], "resume"))
+            {
+              resume = true;
+            }
+            else if (0 == strncasecmp(&argv[0][2], "cache-memory=", 13))
+            {
+              if (cachelimit > 0)
+              {
+                cerr << "Cannot specify cache memory limit twice." << endl;
+                return false;
+              }
+
+              char *p = &argv[0][15];
+              while (*p && isdigit(*p))
+              {
+                cachelimit = cachelimit * 10 + (*p - '0');
+                p++;
+              }
+              if (cachelimit == 0 || *p)
+              {
+                cerr << "Invalid cache memory limit option: " << argv[0] << endl;
+                return false;
+              }
+            }
+            else if (0 == strncasecmp(&argv[0][2], "open-files=", 11))
+            {
+              char *p = &argv[0][13];
+              openfilelimit = 0;
+              while (*p && isdigit(*p))
+              {
+                openfilelimit = openfilelimit * 10 + (*p - '0');
+                p++;
+              }
+              if (openfilelimit == 0 || *p)
+              {
+                cerr << "Invalid open files limit option: " << argv[0] << endl;
+                return false;
+              }
+            }
+            else if (0 == strncasecmp(&argv[0][2], "session=", 8))
+            {
+              sessiondir = &argv[0][10];
+              if (sessiondir.empty())
+              {
+                cerr << "Invalid session option: " << argv[0] << endl;
+                return false;
+              }
+
+              // The session file is written there at the end; find out now if that can work
+              struct stat st;
+              if (stat(sessiondir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+              {
+                cerr << "The session directory does not exist or is not a directory: " << sessiondir << endl;
+                return false;
+              }
+            }
+            else if (0 == strncasecmp(&argv[0][2], "shard=", 6))
+            {
+              if (operation != opCreate)
+              {
+                cerr << "Cannot specify a shard unless creating." << endl;
+                return false;
+              }
+              char *p = &argv[0][8];
+              shardnumber = 0;
+              while (*p && isdigit(*p))
+              {
+                shardnumber = shardnumber * 10 + (*p - '0');
+                p++;
+              }
+              shardcount = 0;
+              if (*p == '/')
+              {
+                p++;
+                while (*p && isdigit(*p))
+                {
+                  shardcount = shardcount * 10 + (*p - '0');
+                  p++;
+                }
+              }
+              if (shardnumber == 0 || shardnumber > shardcount || *p)
+              {
+                cerr << "Invalid shard option: " << argv[0] << endl;
+                return false;
+              }
+            }
+            else if (0 == strncasecmp(&argv[0][2], "stream=", 7))
+            {
+              if (operation != opCreate)
+              {
+                cerr << "Cannot specify a stream unless creating." << endl;
+                return false;
+              }
+              streamfile = &argv[0][9];
+              if (streamfile.empty())
+              {
+                cerr << "Invalid stream option: " << argv[0] << endl;
+                return false;
+              }
+              streamfile = DiskFile::GetCanonicalPathname(streamfile);
+            }
+            else if (0 == stricmp(&argv[0][2], "auto-tune"))
+            {
+              if (operation != opCreate)
+              {
+                cerr << "Cannot auto-tune unless creating." << endl;
+                return false;
+              }
+              autotune = true;
+            }
+            else if (0 == strncasecmp(&argv[0][2], "previous=", 9))
+            {
+              previousdir = &argv[0][11];
+              if (previousdir.empty())
+              {
+                cerr << "Invalid previous option: " << argv[0] << endl;
+                return false;
+              }
+            }
+            else
+            {
+              cerr << "Invalid option specified: " << argv[0] << endl;
+              return false;
+            }
           }
           break;
         default:
@@ -558,7 +754,7 @@ bool CommandLine::Parse(int argc, char *argv[])
           {
             // If we are verifying or repairing, the PAR2 file must
             // already exist
-            if (operation != opCreate)
+            if (operation != opCreate && operation != opMerge)
             {
               // Find the last '.' in the filename
               string::size_type where = filename.find_last_of('.');
@@ -686,6 +882,42 @@ bool CommandLine::Parse(int argc, char *argv[])
     noiselevel = nlNormal;
   }
 
+  // Updating needs the old versions of the data files, and only works for PAR2
+  if (operation == opUpdate)
+  {
+    if (version != verPar2)
+    {
+      cerr << "Only PAR2 files can be updated." << endl;
+      return false;
+    }
+    if (previousdir.empty())
+    {
+      cerr << "You must specify where the old versions of the files are (--previous) when updating." << endl;
+      return false;
+    }
+  }
+
+  // When merging, the other files are the shards
+  if (operation == opMerge)
+  {
+    if (recoveryfilescheme == scUnknown)
+    {
+      recoveryfilescheme = scVariable;
+    }
+
+    if (extrafiles.size() == 0)
+    {
+      cerr << "You must specify the shard files when merging." << endl;
+      return false;
+    }
+
+    // Strip the ".par2" from the end of the filename of the main PAR2 file.
+    if (parfilename.length() > 5 && 0 == stricmp(parfilename.substr(parfilename.length()-5, 5).c_str(), ".par2"))
+    {
+      parfilename = parfilename.substr(0, parfilename.length()-5);
+    }
+  }
+
   // If we a creating, check the other parameters
   if (operation == opCreate)
   {
@@ -695,15 +927,45 @@ bool CommandLine::Parse(int argc, char *argv[])
       recoveryfilescheme = scVariable;
     }
 
+    // The size of the stream is not known in advance, so neither is the block count
+    if (!streamfile.empty())
+    {
+      if (blocksize == 0 || !recoveryblockcountset)
+      {
+        cerr << "You must specify the block size (-s) and the recovery block count (-c) when creating from a stream." << endl;
+        return false;
+      }
+      if (extrafiles.size() > 0)
+      {
+        cerr << "You cannot specify source files when creating from a stream." << endl;
+        return false;
+      }
+    }
+
+    // The planner chooses the block size itself
+    if (autotune)
+    {
+      if (blockcount > 0 || blocksize > 0)
+      {
+        cerr << "You cannot specify the block count (-b) or the block size (-s) with --auto-tune." << endl;
+        return false;
+      }
+      if (!streamfile.empty())
+      {
+        cerr << "You cannot use --auto-tune when creating from a stream." << endl;
+        return false;
+      }
+    }
+
     // If neither block count not block size is specified
-    if (blockcount == 0 && blocksize == 0)
+    if (blockcount == 0 && blocksize == 0 && !autotune)
     {
       // Use a block count of 2000
       blockcount = 2000;
     }
 
     // If we are creating, the source files must be given.
-    if (extrafiles.size() == 0)
+    if (extrafiles.size() == 0 && streamfile.empty())
     {
       // Does the par filename include the ".par2" on the end?
       if (parfilename.length() > 5 && 0 == stricmp(parfilename.substr(parfilename.length()-5, 5).c_str(), ".par2"))
@@ -760,6 +1022,7 @@ bool CommandLine::Parse(int argc, char *argv[])
     memorylimit = 16;
   }
   memorylimit *= 1048576;
+  cachelimit *= 1048576;
 
   return true;
 }
@@ -41,7 +41,9 @@ public:
     opNone = 0,
     opCreate,        // Create new PAR2 recovery volumes
     opVerify,        // Verify but don't repair damaged data files
-    opRepair         // Verify and if possible repair damaged data files
+    opRepair,        // Verify and if possible repair damaged data files
+    opUpdate,        // Bring PAR2 recovery volumes up to date with changed data files
+    opMerge          // Assemble PAR2 recovery volumes from the files of a sharded create
   } Operation;
 
   typedef enum
@@ -100,9 +102,23 @@ public:
   u32                    GetRecoveryBlockCount(void) const {return recoveryblockcount;}
   CommandLine::Scheme    GetRecoveryFileScheme(void) const {return recoveryfilescheme;}
   size_t                 GetMemoryLimit(void) const        {return memorylimit;}
+  size_t                 GetCacheLimit(void) const         {return cachelimit;}
   u64                    GetLargestSourceSize(void) const  {return largestsourcesize;}
   u64                    GetTotalSourceSize(void) const    {return totalsourcesize;}
   CommandLine::NoiseLevel GetNoiseLevel(void) const        {return noiselevel;}
+  bool                   GetDirectIO(void) const           {return directio;}
+  bool                   GetDirectWrite(void) const        {return directwrite;}
+  bool                   GetMappedInput(void) const        {return mappedinput;}
+  bool                   GetSyndromes(void) const          {return syndromes;}
+  bool                   GetParanoid(void) const           {return paranoid;}
+  bool                   GetResume(void) const             {return resume;}
+  u32                    GetOpenFileLimit(void) const      {return openfilelimit;}
+  string                 GetSessionDir(void) const         {return sessiondir;}
+  string                 GetPreviousDir(void) const        {return previousdir;}
+  u32                    GetShardNumber(void) const        {return shardnumber;}
+  u32                    GetShardCount(void) const         {return shardcount;}
+  string                 GetStreamFile(void) const         {return streamfile;}
+  bool                   GetAutoTune(void) const           {return autotune;}
 
   string                              GetParFilename(void) const {return parfilename;}
   const list<CommandLine::ExtraFile>& GetExtraFiles(void) const  {return extrafiles;}
@@ -150,6 +166,43 @@ protected:
   size_t memorylimit;          // How much memory is permitted to be used
                                // for the output buffer when creating
                                // or repairing.
+
+  size_t cachelimit;           // How much memory may be used to keep data
+                               // found during verification for the repair.
+
+  bool directio;               // Read files without using the file system cache.
+
+  bool directwrite;            // Do not keep large writes in the file system cache.
+
+  bool mappedinput;            // Process the data of input files in place, by
+                               // mapping the files into memory.
+
+  bool syndromes;              // Compute the syndromes of the recovery blocks
+                               // during verification.
+
+  bool paranoid;               // Verify repaired files by reading them back,
+                               // instead of checking the blocks as they are written.
+
+  bool resume;                 // Keep a checkpoint after each pass, and continue from
+                               // it if the previous run was interrupted.
+
+  u32 openfilelimit;           // How many files may be kept open at the same time
+                               // (0: derived from the limit of the process).
+
+  string sessiondir;           // Where the results of a verification are kept, so
+                               // that a later run only has to look at what changed.
+
+  string previousdir;          // Where the versions of the data files are that the
+                               // recovery volumes were made from, when updating.
+
+  u32 shardnumber;             // Which part of the recovery blocks this create computes
+  u32 shardcount;              // (1 .. shardcount), or 0 to compute all of them.
+
+  string streamfile;           // When creating from the standard input, the file
+                               // that the data is written to (and protected as).
+
+  bool autotune;               // Let the creator choose the block size from the
+                               // measured speed of this machine.
 };
 
 typedef list<CommandLine::ExtraFile>::const_iterator ExtraFileIterator;
@@ -27,8 +27,20 @@
 
 bool CreatorPacket::Create(const MD5Hash &setid)
 {
-  string creator = "Created by " PACKAGE " version " VERSION ".";
+  return Create(setid, "Created by " PACKAGE " version " VERSION ".");
+}
+
+bool CreatorPacket::Create(const MD5Hash &setid, u32 shardnumber, u32 shardcount, u32 firstblock, u32 blockcount)
+{
+  char shard[100];
+  snprintf(shard, sizeof(shard), " Shard %u of %u of recovery blocks %u to %u.",
+           shardnumber, shardcount, firstblock, firstblock + blockcount - 1);
+
+  return Create(setid, string("Created by " PACKAGE " version " VERSION ".") + shard);
+}
 
+bool CreatorPacket::Create(const MD5Hash &setid, const string &creator)
+{
   // Allocate a packet just large enough for creator name
   CREATORPACKET *packet = (CREATORPACKET *)AllocatePacket(sizeof(*packet) + (~3 & (3+(u32)creator.size())));
 
@@ -75,3 +87,29 @@ bool CreatorPacket::Load(DiskFile *diskfile, u64 offset, PACKET_HEADER &header)
                         packet->client, 
                         (size_t)packet->header.length - sizeof(PACKET_HEADER));
 }
+
+// Find the shard details that Create wrote at the end of the description
+
+bool CreatorPacket::GetShard(u32 &shardnumber, u32 &shardcount, u32 &firstblock, u32 &blockcount) const
+{
+  if (packetlength <= sizeof(CREATORPACKET))
+    return false;
+
+  // The description is padded with NULLs
+  const CREATORPACKET *packet = (const CREATORPACKET *)packetdata;
+  string creator((const char *)packet->client, packetlength - sizeof(CREATORPACKET));
+  size_t start = creator.find(" Shard ");
+  if (start == string::npos)
+    return false;
+
+  u32 lastblock;
+  if (4 != sscanf(creator.c_str() + start, " Shard %u of %u of recovery blocks %u to %u.",
+                  &shardnumber, &shardcount, &firstblock, &lastblock))
+    return false;
+  if (shardnumber == 0 || shardnumber > shardcount || lastblock < firstblock)
+    return false;
+
+  blockcount = lastblock - firstblock + 1;
+
+  return true;
+}
@@ -36,9 +36,19 @@ public:
 
   // Create a creator packet for a specified set id hash value
   bool Create(const MD5Hash &set_id_hash);
+  // The same for a shard of a sharded create (--shard). The description also says which
+  // shard it is, and which recovery blocks the shards compute together.
+  bool Create(const MD5Hash &set_id_hash, u32 shardnumber, u32 shardcount, u32 firstblock, u32 blockcount);
 
   // Load a creator packet from a specified file
   bool Load(DiskFile *diskfile, u64 offset, PACKET_HEADER &header);
+
+  // Which shard the packet is of, as Create put it in the description. False if it
+  // is not of a shard.
+  bool GetShard(u32 &shardnumber, u32 &shardcount, u32 &firstblock, u32 &blockcount) const;
+
+protected:
+  bool Create(const MD5Hash &set_id_hash, const string &creator);
 };
 
 #endif // __CREATORPACKET_H__
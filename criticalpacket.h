@@ -35,6 +35,9 @@ public:
   // Write a copy of the packet to the specified file at the specified offset
   bool    WritePacket(DiskFile &diskfile, u64 fileoffset) const;
 
+  // Copy the packet to a buffer of at least PacketLength bytes. Returns the length.
+  size_t  CopyPacket(void *buffer) const;
+
   // Obtain the lenght of the packet.
   size_t  PacketLength(void) const;
 
@@ -67,6 +70,15 @@ inline size_t CriticalPacket::PacketLength(void) const
   return packetlength;
 }
 
+inline size_t CriticalPacket::CopyPacket(void *buffer) const
+{
+  assert(packetdata != 0 && packetlength != 0);
+
+  memcpy(buffer, packetdata, packetlength);
+
+  return packetlength;
+}
+
 inline void* CriticalPacket::AllocatePacket(size_t length, size_t extra)
 {
   // Hey! We can't allocate the packet twice
@@ -117,9 +129,16 @@ public:
   // Write the packet to disk.
   bool   WritePacket(void) const;
 
+  // Copy the packet to a buffer, to write it together with others.
+  size_t CopyPacket(void *buffer) const {return packet->CopyPacket(buffer);}
+
   // Obtain the length of the packet.
   u64    PacketLength(void) const;
 
+  // Where the copy goes
+  DiskFile* GetDiskFile(void) const {return diskfile;}
+  u64       Offset(void) const {return offset;}
+
 protected:
   DiskFile             *diskfile;
   u64                   offset;
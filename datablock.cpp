@@ -69,6 +69,69 @@ bool DataBlock::ReadData(u64    position, // Position within the block
   return true;
 }
 
+// Read some data at a specified position within a datablock from the block
+// cache. Returns false (and leaves the buffer alone) if the data is not cached.
+// As with ReadData, the part of the buffer beyond the end of the block is zeroed.
+
+bool DataBlock::ReadCachedData(BlockCache &cache,    // Cache to read from
+                               u64         position, // Position within the block
+                               size_t      size,     // Size of the memory buffer
+                               void       *buffer)   // Pointer to memory buffer
+{
+  assert(diskfile != 0);
+
+  size_t want = 0;
+  if (length > position)
+  {
+    want = (size_t)min((u64)size, length - position);
+  }
+
+  if (want > 0 && !cache.Read(diskfile, offset, position, buffer, want))
+    return false;
+
+  if (want < size)
+  {
+    memset(&((u8*)buffer)[want], 0, size-want);
+  }
+
+  return true;
+}
+
+// Return a pointer to the data at a specified position within the data block,
+// if the disk file has been mapped into memory.
+
+const void* DataBlock::MappedData(u64    position, // Position within the block
+                                  size_t size)     // Amount of data needed
+  const
+{
+  assert(diskfile != 0);
+
+  if (position + size > length)
+    return 0;
+
+  return diskfile->MappedData(offset + position, size);
+}
+
+void DataBlock::PrefetchData(u64 position, size_t size) const
+{
+  assert(diskfile != 0);
+
+  if (length > position)
+  {
+    diskfile->Prefetch(offset + position, (size_t)min((u64)size, length - position));
+  }
+}
+
+bool DataBlock::IsHole(u64 position, size_t size) const
+{
+  assert(diskfile != 0);
+
+  if (length <= position)
+    return false;
+
+  return diskfile->IsHole(offset + position, min((u64)size, length - position));
+}
+
 // Write some data at a specified position within a datablock
 // from memory to disk
 
@@ -98,3 +161,60 @@ bool DataBlock::WriteData(u64         position, // Position within the block
 
   return true;
 }
+
+// Copy the whole block from a source block, inside the OS
+
+bool DataBlock::CopyDataFrom(const DataBlock &source)
+{
+  assert(diskfile != 0 && source.diskfile != 0);
+
+  return diskfile->CopyRange(offset, *source.diskfile, source.offset, length);
+}
+
+// Queue an asynchronous read of some data at a specified position within
+// the data block. As with ReadData, the part of the buffer beyond the end of
+// the data block is zeroed.
+
+bool DataBlock::QueueReadData(AsyncIO &aio,      // I/O engine to queue the read on
+                              u64      position, // Position within the block
+                              size_t   size,     // Size of the memory buffer
+                              void    *buffer,   // Pointer to memory buffer
+                              u32      tag)      // Tag for the completion
+{
+  assert(diskfile != 0);
+
+  size_t want = 0;
+  if (length > position)
+  {
+    want = (size_t)min((u64)size, length - position);
+  }
+
+  if (want < size)
+  {
+    memset(&((u8*)buffer)[want], 0, size-want);
+  }
+
+  // A read of 0 bytes is still queued, so that the caller gets its completion
+  return aio.QueueRead(diskfile, offset + position, buffer, want, tag);
+}
+
+// Queue an asynchronous write of some data at a specified position within
+// the data block.
+
+bool DataBlock::QueueWriteData(AsyncIO    &aio,      // I/O engine to queue the write on
+                               u64         position, // Position within the block
+                               size_t      size,     // Size of the memory buffer
+                               const void *buffer,   // Pointer to memory buffer
+                               size_t     &wrote,    // Amount that will be written
+                               u32         tag)      // Tag for the completion
+{
+  assert(diskfile != 0);
+
+  wrote = 0;
+  if (length > position)
+  {
+    wrote = (size_t)min((u64)size, length - position);
+  }
+
+  return aio.QueueWrite(diskfile, offset + position, buffer, wrote, tag);
+}
@@ -21,6 +21,8 @@
 #define __DATABLOCK_H__
 
 class DiskFile;
+class AsyncIO;
+class BlockCache;
 
 // A Data Block is a block of data of a specific length at a specific
 // offset in a specific file.
@@ -66,6 +68,27 @@ public:
   // Write some of the data from memory to disk
   bool WriteData(u64 position, size_t size, const void *buffer, size_t &wrote);
 
+  // Copy the data of a source block into this block without reading it into memory.
+  // Both disk files must be open. Returns false if the OS cannot do that.
+  bool CopyDataFrom(const DataBlock &source);
+
+  // The same, but the transfer is queued on aio and completes asynchronously with
+  // the given tag. Any zero padding is done immediately.
+  bool QueueReadData(AsyncIO &aio, u64 position, size_t size, void *buffer, u32 tag);
+  bool QueueWriteData(AsyncIO &aio, u64 position, size_t size, const void *buffer, size_t &wrote, u32 tag);
+
+  // Read some of the data from the block cache instead of from disk, if it is there
+  bool ReadCachedData(BlockCache &cache, u64 position, size_t size, void *buffer);
+
+  // A pointer to some of the data in the memory mapped disk file, or 0 if the file is
+  // not mapped or the range extends beyond the end of the block (and needs zero padding).
+  const void *MappedData(u64 position, size_t size) const;
+  // Ask the OS to bring the mapped data into memory
+  void PrefetchData(u64 position, size_t size) const;
+
+  // Whether the data is in a hole of a sparse file, so that it is all zeroes
+  bool IsHole(u64 position, size_t size) const;
+
 protected:
   DiskFile *diskfile;  // Which disk file is the block associated with
   u64       offset;    // What is the file offset
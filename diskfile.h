@@ -38,6 +38,8 @@ public:
 
   // Write some data to the file
   bool Write(u64 offset, const void *buffer, size_t length);
+  // Write the buffers one after the other from offset on, in as few system calls as possible
+  bool WriteV(u64 offset, const struct iovec *buffers, u32 count);
 
   // Open the file. The tryToCacheData argument indicates wheteher the caller expects to
   // process all data in the file (as in a verify), and wants to cache it for possible
@@ -46,8 +48,38 @@ public:
   bool Open(string filename, bool tryToCacheData);
   bool Open(string filename, u64 filesize, bool tryToCacheData);
 
+  // Open the existing file for reading and writing, without changing its contents.
+  // Used to repair a file in place.
+  bool OpenForUpdate(void);
+  bool OpenForUpdate(string filename);
+
+  // Change the length of the file, which must be open for writing
+  bool SetLength(u64 aLength);
+
+  // Make sure that what has been written is on the disk, so that it survives a crash
+  bool Sync(void);
+
+  // Copy data from another open file without passing it through memory, by sharing the
+  // disk blocks (reflink) or by a copy in the kernel. Returns false if neither is
+  // possible; the caller then copies the data itself.
+  bool CopyRange(u64 aOffset, const DiskFile &aSource, u64 aSourceOffset, u64 aLength);
+
+  // Whether the file was last opened for writing (by Create or OpenForUpdate)
+  bool IsWritable(void) const {return mWritable;}
+
   // Check to see if the file is open
+#ifdef __APPLE__
   bool IsOpen(void) const {return mFile != 0;}
+#else
+  bool IsOpen(void) const {return mFile >= 0;}
+#endif
+  // The OS file descriptor while the file is open, -1 otherwise. Used for I/O that
+  // bypasses Read and Write, such as AsyncIO.
+  int FileDescriptor(void) const;
+  // Tells whether a transfer with these parameters may be done directly on the FileDescriptor.
+  // In direct I/O mode that requires alignment; Read and Write deal with unaligned transfers.
+  bool CanTransferDirectly(u64 aOffset, const void *aBuffer, size_t aLength) const;
+
   bool FileConsideredOK ();	// Tells whether the file can be considered OK without any verification
   static std::string Par2Representation (std::string aFilename);
   // FS2UTF8 makes a string with the UTF8 file representation of the file name in file system rep.
@@ -57,6 +89,26 @@ public:
 
   // Read data from the file
   bool Read(u64 offset, void *buffer, size_t length);
+
+  // Map the (open) file into memory, read only. The mapping is removed by Close.
+  // Returns false if the file cannot be mapped; Read still works in that case.
+  bool Map(void);
+  // A pointer to mapped file data, or 0 if the range is not mapped
+  const void *MappedData(u64 aOffset, size_t aLength) const;
+  // Tell the OS that a mapped range will be needed soon
+  void Prefetch(u64 aOffset, size_t aLength) const;
+  // How much of a range of the (open) file is in the file system cache. Only a guess;
+  // 0 if it cannot be determined.
+  u64 ResidentLength(u64 aOffset, u64 aLength) const;
+  // Whether a range of the (open) file is a hole in a sparse file, which reads as zeroes
+  // without any I/O. False if it cannot be determined.
+  bool IsHole(u64 aOffset, u64 aLength) const;
+  // The first hole that ends beyond aOffset, as [aStart, aEnd). False if there is none,
+  // or if it cannot be determined.
+  bool NextHole(u64 aOffset, u64 &aStart, u64 &aEnd) const;
+
+  // The device the file is on. Returns false if the file does not exist.
+  bool Device(u64 &aDevice) const;
   
   // Close the file
   void Close(void);
@@ -78,13 +130,26 @@ public:
   bool Delete(void);
 
 public:
+  // In direct I/O mode, input files are read without going through the file system cache.
+  static void SetDirectIO(bool aDirectIO);
+  static bool DirectIO(void);
+  // In direct write mode, large writes to output files do not stay in the file system cache.
+  static void SetDirectWrite(bool aDirectWrite);
+  static bool DirectWrite(void);
+
   static string GetCanonicalPathname(string filename);
 
   static void SplitFilename(string filename, string &path, string &name);
   static string TranslateFilename(string filename);
 
+  // These two are answered from the cache of the DiskFilePool
   static bool FileExists(string filename);
   static u64 GetFileSize(string filename);
+  // Ask the OS; false if the file does not exist (as a regular file)
+  static bool StatFile(string filename, u64 &filesize);
+  // The same, and also the modification and status change times (in nanoseconds) and
+  // the inode number of the file
+  static bool StatFile(string filename, u64 &filesize, u64 &mtime, u64 &ctime, u64 &inode);
 
   // Search the specified path for files which match the specified wildcard
   // and return their names in a list.
@@ -95,9 +160,31 @@ private:
   u64    filesize;
 
   // OS file handle
+#ifdef __APPLE__
   void  *mFile;			// Actually NSFileHandle; make sure C++ can compile
+#else
+  int    mFile;     // File descriptor (diskfile_posix.cpp); -1 if not open
+  bool   mDirect;   // mFile was opened with O_DIRECT
+
+  bool ReadBounced(u64 aOffset, void *aBuffer, size_t aLength);
+  void DropWritten(u64 aOffset, u64 aLength);
+#endif
+
+  // Opened by Create or OpenForUpdate
+  bool   mWritable;
+
+  // The file contents, if mapped with Map, and how much of it is mapped
+  void  *mMap;
+  u64    mMapLength;
+
+  // The start and end offsets of the holes in the file. Found by Open, with one pass of
+  // SEEK_HOLE and SEEK_DATA, so that IsHole needs no system call. Empty while the file
+  // is open for writing, as writes fill holes.
+  vector<u64> mHoles;
+  void FindHoles(int aFile);
 
-  // Current offset within the file
+  // Current offset within the file. Only the Xcode version seeks; the POSIX version uses
+  // positional I/O, which leaves it alone, so threads can share a DiskFile.
   u64    offset;
 
   // Does the file exist
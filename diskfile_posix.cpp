@@ -0,0 +1,1158 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+// A portable POSIX implementation of the DiskFile class, for systems without Cocoa.
+// It is the counterpart of Xcode/DiskFileX.mm and must not be linked together with it.
+// All I/O is positional (pread/pwrite), so there is no seek state to maintain and a
+// DiskFile can be read from several threads at once. Read and Write never allocate memory.
+
+#include "par2cmdline.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#define MaxOffset 0x7fffffffffffffffULL
+#define MaxLength 0xffffffffUL
+
+// Size of the aligned buffer used for unaligned reads in direct I/O mode
+#define BounceBufferSize (1024 * 1024)
+
+// In direct write mode, writes of at least this size are flushed and dropped from the cache
+#define DirectWriteMinimum (1024 * 1024)
+
+// copy_file_range appeared in glibc 2.27
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+static bool sDirectIO = false;
+static bool sDirectWrite = false;
+
+DiskFile::DiskFile(void)
+{
+  filesize = 0;
+  offset = 0;
+
+  mFile = -1;
+  mDirect = false;
+  mWritable = false;
+  mMap = 0;
+  mMapLength = 0;
+
+  exists = false;
+  mFullFileBuffer = 0;    // Not used by this implementation
+}
+
+DiskFile::~DiskFile(void)
+{
+  Close();
+}
+
+// Create a file and set its length; also opens the file.
+bool DiskFile::Create(string _filename, u64 _filesize)
+{
+  assert(mFile < 0);
+
+  filename = _filename;
+  filesize = _filesize;
+
+  if (_filesize > MaxOffset)
+  {
+    cerr << "Requested file size for " << _filename << " is too large." << endl;
+    return false;
+  }
+
+  // Create the file
+  mFile = ::open(_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  DiskFilePool::StatusChanged(_filename);
+  if (mFile < 0)
+  {
+    cerr << "Could not create: " << _filename << ": " << strerror(errno) << endl;
+    return false;
+  }
+
+  if (_filesize > 0)
+  {
+    // Reserve the space in one go. This gives the file system the opportunity to
+    // allocate contiguous extents instead of growing the file piece by piece.
+    int lResult = -1;
+#ifdef __linux__
+    lResult = fallocate(mFile, 0, 0, (off_t)_filesize);
+#else
+    // posix_fallocate returns the error instead of setting errno
+    lResult = posix_fallocate(mFile, 0, (off_t)_filesize);
+    if (lResult != 0)
+    {
+      errno = lResult;
+      lResult = -1;
+    }
+#endif
+    if (lResult != 0)
+    {
+      // No fallocate support (or not for this file system); just set the length.
+      lResult = ftruncate(mFile, (off_t)_filesize);
+    }
+
+    if (lResult != 0)
+    {
+      cerr << "Could not set end of file: " << _filename << ": " << strerror(errno) << endl;
+
+      ::close(mFile);
+      mFile = -1;
+      ::unlink(_filename.c_str());
+      DiskFilePool::StatusChanged(_filename);
+
+      return false;
+    }
+  }
+
+  offset = filesize;
+
+  exists = true;
+  mWritable = true;
+
+  return true;
+}
+
+// Write some data to the file
+bool DiskFile::Write(u64 _offset, const void *buffer, size_t length)
+{
+  assert(mFile >= 0);
+
+  if (_offset > MaxOffset || length > MaxLength)
+  {
+    cerr << "Could not write " << (u64)length << " bytes to " << filename << " at offset " << _offset << endl;
+    return false;
+  }
+
+  const u8 *lBuffer = (const u8 *)buffer;
+  size_t lRemaining = length;
+  u64 lOffset = _offset;
+
+  while (lRemaining > 0)
+  {
+    ssize_t lWritten = ::pwrite(mFile, lBuffer, lRemaining, (off_t)lOffset);
+    if (lWritten < 0 && errno == EINTR)
+      continue;
+    if (lWritten <= 0)
+    {
+      cerr << "Could not write " << (u64)length << " bytes to " << filename << " at offset " << _offset
+           << ": " << strerror(errno) << endl;
+      return false;
+    }
+
+    lBuffer += lWritten;
+    lRemaining -= lWritten;
+    lOffset += lWritten;
+  }
+
+  if (filesize < lOffset)
+  {
+    filesize = lOffset;
+  }
+
+  if (sDirectWrite && length >= DirectWriteMinimum)
+    DropWritten(_offset, length);
+
+  return true;
+}
+
+// Write several buffers to consecutive parts of the file
+bool DiskFile::WriteV(u64 _offset, const struct iovec *buffers, u32 count)
+{
+  assert(mFile >= 0);
+
+  u64 lLength = 0;
+  for (u32 i = 0; i < count; i++)
+    lLength += buffers[i].iov_len;
+
+  if (_offset > MaxOffset)
+  {
+    cerr << "Could not write " << lLength << " bytes to " << filename << " at offset " << _offset << endl;
+    return false;
+  }
+
+  // pwritev takes at most IOV_MAX entries, and may write less than asked. Each batch is
+  // copied to the stack, so that the entries that are done can be skipped.
+  struct iovec lBatch[IOV_MAX];
+  u32 lNext = 0;
+  u64 lOffset = _offset;
+  while (lNext < count)
+  {
+    int lCount = (int)min((u32)IOV_MAX, count - lNext);
+    memcpy(lBatch, &buffers[lNext], lCount * sizeof(struct iovec));
+    lNext += lCount;
+
+    int lFirst = 0;
+    while (lFirst < lCount)
+    {
+      if (lBatch[lFirst].iov_len == 0)
+      {
+        lFirst++;
+        continue;
+      }
+
+      ssize_t lWritten = ::pwritev(mFile, &lBatch[lFirst], lCount - lFirst, (off_t)lOffset);
+      if (lWritten < 0 && errno == EINTR)
+        continue;
+      if (lWritten <= 0)
+      {
+        cerr << "Could not write " << lLength << " bytes to " << filename << " at offset " << _offset
+             << ": " << strerror(errno) << endl;
+        return false;
+      }
+
+      lOffset += lWritten;
+      while (lWritten > 0)
+      {
+        size_t lUsed = min((size_t)lWritten, lBatch[lFirst].iov_len);
+        lBatch[lFirst].iov_base = (u8 *)lBatch[lFirst].iov_base + lUsed;
+        lBatch[lFirst].iov_len -= lUsed;
+        lWritten -= lUsed;
+        if (lBatch[lFirst].iov_len == 0)
+          lFirst++;
+      }
+    }
+  }
+
+  if (filesize < lOffset)
+  {
+    filesize = lOffset;
+  }
+
+  if (sDirectWrite && lLength >= DirectWriteMinimum)
+    DropWritten(_offset, lLength);
+
+  return true;
+}
+
+// Write the range to the disk and drop it from the file system cache. O_DIRECT cannot be
+// used for this, because the recovery data is not aligned in the recovery files.
+void DiskFile::DropWritten(u64 aOffset, u64 aLength)
+{
+#ifdef __linux__
+  sync_file_range(mFile, (off_t)aOffset, (off_t)aLength,
+                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+  fdatasync(mFile);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(mFile, (off_t)aOffset, (off_t)aLength, POSIX_FADV_DONTNEED);
+#endif
+}
+
+// Open the file
+bool DiskFile::Open(bool tryToCacheData)
+{
+  string _filename = filename;
+  return Open(_filename, tryToCacheData);
+}
+
+bool DiskFile::Open(string _filename, bool tryToCacheData)
+{
+  return Open(_filename, GetFileSize(_filename), tryToCacheData);
+}
+
+// The tryToCacheData argument is not used here either; see the comments in DiskFileX.mm.
+bool DiskFile::Open(string _filename, u64 _filesize, bool tryToCacheData)
+{
+  assert(mFile < 0);
+
+  filename = _filename;
+  filesize = _filesize;
+
+  if (_filesize > MaxOffset)
+  {
+    cerr << "File size for " << _filename << " is too large." << endl;
+    return false;
+  }
+
+  mFile = -1;
+  mDirect = false;
+#ifdef O_DIRECT
+  if (sDirectIO)
+  {
+    // Not all file systems support O_DIRECT (tmpfs, for one); they fail with EINVAL and
+    // are read in the usual way.
+    mFile = ::open(_filename.c_str(), O_RDONLY | O_DIRECT);
+    mDirect = mFile >= 0;
+  }
+#endif
+  if (mFile < 0)
+    mFile = ::open(_filename.c_str(), O_RDONLY);
+  if (mFile < 0)
+    return false;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  // Input files are mostly processed front to back; ask the kernel for aggressive
+  // read ahead. This replaces F_RDAHEAD of the OSX version.
+  posix_fadvise(mFile, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  offset = 0;
+  exists = true;
+  mWritable = false;
+
+  FindHoles(mFile);
+
+  return true;
+}
+
+// Open the file for reading and writing
+bool DiskFile::OpenForUpdate(void)
+{
+  assert(mFile < 0);
+
+  mFile = ::open(filename.c_str(), O_RDWR);
+  if (mFile < 0)
+  {
+    cerr << "Could not open " << filename << " for writing: " << strerror(errno) << endl;
+    return false;
+  }
+  mDirect = false;
+
+  struct stat st;
+  if (fstat(mFile, &st) == 0)
+  {
+    filesize = (u64)st.st_size;
+  }
+
+  offset = 0;
+  exists = true;
+  mWritable = true;
+  mHoles.clear();
+
+  return true;
+}
+
+bool DiskFile::OpenForUpdate(string _filename)
+{
+  filename = _filename;
+
+  return OpenForUpdate();
+}
+
+// Change the length of the file
+bool DiskFile::SetLength(u64 aLength)
+{
+  assert(mFile >= 0);
+
+  // The mapping covers the old length
+  if (mMap != 0)
+  {
+    munmap(mMap, (size_t)mMapLength);
+    mMap = 0;
+    mMapLength = 0;
+  }
+
+  if (aLength > MaxOffset || ftruncate(mFile, (off_t)aLength) != 0)
+  {
+    cerr << "Could not set end of file: " << filename << ": " << strerror(errno) << endl;
+    return false;
+  }
+
+  filesize = aLength;
+  DiskFilePool::StatusChanged(filename);
+
+  return true;
+}
+
+// Write everything to the disk
+bool DiskFile::Sync(void)
+{
+  assert(mFile >= 0);
+
+  if (fsync(mFile) != 0)
+  {
+    cerr << "Could not write " << filename << " to disk: " << strerror(errno) << endl;
+    return false;
+  }
+
+  return true;
+}
+
+// Copy data from another file inside the kernel
+bool DiskFile::CopyRange(u64 aOffset, const DiskFile &aSource, u64 aSourceOffset, u64 aLength)
+{
+  assert(mFile >= 0 && aSource.mFile >= 0);
+
+  if (aLength == 0)
+    return true;
+  if (aOffset > MaxOffset || aSourceOffset > MaxOffset || aLength > MaxOffset)
+    return false;
+
+#ifdef FICLONERANGE
+  // Share the disk blocks. This only works within one file system that supports it
+  // (btrfs, XFS), and only for ranges that are aligned to its block size.
+  struct file_clone_range lClone;
+  lClone.src_fd = aSource.mFile;
+  lClone.src_offset = aSourceOffset;
+  lClone.src_length = aLength;
+  lClone.dest_offset = aOffset;
+  if (ioctl(mFile, FICLONERANGE, &lClone) == 0)
+  {
+    if (filesize < aOffset + aLength)
+      filesize = aOffset + aLength;
+    return true;
+  }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  // Let the kernel copy the data; some file systems do it on the server or device
+  loff_t lSourceOffset = (loff_t)aSourceOffset;
+  loff_t lOffset = (loff_t)aOffset;
+  u64 lRemaining = aLength;
+  while (lRemaining > 0)
+  {
+    ssize_t lCopied = copy_file_range(aSource.mFile, &lSourceOffset, mFile, &lOffset,
+                                      (size_t)min(lRemaining, (u64)MaxLength), 0);
+    if (lCopied < 0 && errno == EINTR)
+      continue;
+    if (lCopied <= 0)
+      return false;   // Not supported here (EXDEV, EINVAL, ENOSYS ...), or end of file
+
+    lRemaining -= lCopied;
+  }
+
+  if (filesize < aOffset + aLength)
+    filesize = aOffset + aLength;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Read data from the file
+bool DiskFile::Read(u64 _offset, void *buffer, size_t length)
+{
+  assert(mFile >= 0);
+
+  if (_offset > MaxOffset || length > MaxLength)
+  {
+    cerr << "Could not read " << (u64)length << " bytes from " << filename << " at offset " << _offset << endl;
+    return false;
+  }
+
+  // A mapped file needs no system call at all
+  const void *lMapped = MappedData(_offset, length);
+  if (lMapped != 0)
+  {
+    memcpy(buffer, lMapped, length);
+    return true;
+  }
+
+  if (!CanTransferDirectly(_offset, buffer, length))
+    return ReadBounced(_offset, buffer, length);
+
+  u8 *lBuffer = (u8 *)buffer;
+  size_t lRemaining = length;
+  u64 lOffset = _offset;
+
+  // pread may return less than requested (signals, very large requests); keep reading.
+  while (lRemaining > 0)
+  {
+    ssize_t lRead = ::pread(mFile, lBuffer, lRemaining, (off_t)lOffset);
+    if (lRead < 0 && errno == EINTR)
+      continue;
+    if (lRead <= 0)
+    {
+      cerr << "Could not read " << (u64)length << " bytes from " << filename << " at offset " << _offset << endl;
+      return false;
+    }
+
+    lBuffer += lRead;
+    lRemaining -= lRead;
+    lOffset += lRead;
+  }
+
+  return true;
+}
+
+// Read through an aligned buffer. This is used in direct I/O mode when the offset, the
+// length or the memory buffer of a read is not aligned, which O_DIRECT does not allow.
+// The aligned range that is read may extend beyond the end of the file; the kernel then
+// returns less data, which is fine as long as the requested part is covered.
+bool DiskFile::ReadBounced(u64 _offset, void *buffer, size_t length)
+{
+  size_t lBounceSize = AlignedBufferPool::RoundUp(min(length + AlignedBufferPool::Alignment(),
+                                                      (size_t)BounceBufferSize));
+  u8 *lBounce = (u8 *)AlignedBufferPool::Get(lBounceSize);
+  if (lBounce == 0)
+  {
+    cerr << "Could not allocate buffer memory." << endl;
+    return false;
+  }
+
+  u8 *lBuffer = (u8 *)buffer;
+  size_t lRemaining = length;
+  u64 lOffset = _offset;
+
+  while (lRemaining > 0)
+  {
+    u64 lStart = AlignedBufferPool::RoundDown(lOffset);
+    size_t lSkip = (size_t)(lOffset - lStart);
+    size_t lWant = min(lBounceSize, AlignedBufferPool::RoundUp(lSkip + lRemaining));
+
+    ssize_t lRead;
+    do
+    {
+      lRead = ::pread(mFile, lBounce, lWant, (off_t)lStart);
+    } while (lRead < 0 && errno == EINTR);
+
+    if (lRead <= (ssize_t)lSkip)
+    {
+      cerr << "Could not read " << (u64)length << " bytes from " << filename << " at offset " << _offset << endl;
+      AlignedBufferPool::Release(lBounce);
+      return false;
+    }
+
+    size_t lUseful = min((size_t)lRead - lSkip, lRemaining);
+    memcpy(lBuffer, &lBounce[lSkip], lUseful);
+
+    lBuffer += lUseful;
+    lRemaining -= lUseful;
+    lOffset += lUseful;
+  }
+
+  AlignedBufferPool::Release(lBounce);
+
+  return true;
+}
+
+bool DiskFile::Map(void)
+{
+  assert(mFile >= 0);
+
+  if (mMap != 0)
+    return true;
+  if (filesize == 0 || filesize != (u64)(size_t)filesize)
+    return false;
+
+  void *lMap = mmap(0, (size_t)filesize, PROT_READ, MAP_SHARED, mFile, 0);
+  if (lMap == MAP_FAILED)
+    return false;
+
+  // The blocks of a file are processed front to back
+  madvise(lMap, (size_t)filesize, MADV_SEQUENTIAL);
+
+  mMap = lMap;
+  mMapLength = filesize;
+
+  return true;
+}
+
+const void *DiskFile::MappedData(u64 aOffset, size_t aLength) const
+{
+  if (mMap == 0 || aOffset + aLength > mMapLength)
+    return 0;
+
+  return &((const u8 *)mMap)[aOffset];
+}
+
+void DiskFile::Prefetch(u64 aOffset, size_t aLength) const
+{
+  if (mMap == 0 || aOffset >= mMapLength)
+    return;
+
+  // madvise wants a page aligned address
+  u64 lStart = AlignedBufferPool::RoundDown(aOffset);
+  u64 lEnd = min(aOffset + aLength, mMapLength);
+  madvise(&((u8 *)mMap)[lStart], (size_t)(lEnd - lStart), MADV_WILLNEED);
+}
+
+// Walk the holes of the file once. A file without holes takes a single lseek, which
+// ends up at the implicit hole at the end of the file. ENXIO from SEEK_DATA means that
+// there is no data after the hole; it runs to the end of the file.
+void DiskFile::FindHoles(int aFile)
+{
+  mHoles.clear();
+#ifdef SEEK_HOLE
+  u64 lOffset = 0;
+  while (lOffset < filesize)
+  {
+    off_t lHole = lseek(aFile, (off_t)lOffset, SEEK_HOLE);
+    if (lHole < 0 || (u64)lHole >= filesize)
+      break;
+
+    off_t lData = lseek(aFile, lHole, SEEK_DATA);
+    if (lData < 0 && errno != ENXIO)
+      break;
+    u64 lEnd = lData < 0 ? filesize : min((u64)lData, filesize);
+    if (lEnd <= (u64)lHole)
+      break;
+
+    mHoles.push_back((u64)lHole);
+    mHoles.push_back(lEnd);
+    lOffset = lEnd;
+  }
+#endif
+}
+
+bool DiskFile::NextHole(u64 aOffset, u64 &aStart, u64 &aEnd) const
+{
+  // Binary search for the first hole that ends beyond aOffset
+  size_t lLow = 0;
+  size_t lHigh = mHoles.size() / 2;
+  while (lLow < lHigh)
+  {
+    size_t lMiddle = (lLow + lHigh) / 2;
+    if (mHoles[2*lMiddle+1] <= aOffset)
+      lLow = lMiddle + 1;
+    else
+      lHigh = lMiddle;
+  }
+  if (lLow == mHoles.size() / 2)
+    return false;
+
+  aStart = mHoles[2*lLow];
+  aEnd = mHoles[2*lLow+1];
+
+  return true;
+}
+
+bool DiskFile::IsHole(u64 aOffset, u64 aLength) const
+{
+  if (aOffset >= filesize || aLength == 0)
+    return false;
+  aLength = min(aLength, filesize - aOffset);
+
+  u64 lStart, lEnd;
+  if (!NextHole(aOffset, lStart, lEnd))
+    return false;
+
+  return lStart <= aOffset && aOffset + aLength <= lEnd;
+}
+
+// Find out which pages of the range are in memory, by mapping them temporarily
+u64 DiskFile::ResidentLength(u64 aOffset, u64 aLength) const
+{
+  assert(mFile >= 0);
+
+  if (aOffset >= filesize || aLength == 0)
+    return 0;
+  aLength = min(aLength, filesize - aOffset);
+
+  u64 lStart = AlignedBufferPool::RoundDown(aOffset);
+  u64 lLength = aOffset + aLength - lStart;
+  if (lLength != (u64)(size_t)lLength)
+    return 0;
+
+  void *lMap = mmap(0, (size_t)lLength, PROT_READ, MAP_SHARED, mFile, (off_t)lStart);
+  if (lMap == MAP_FAILED)
+    return 0;
+
+  size_t lPageSize = AlignedBufferPool::Alignment();
+  vector<unsigned char> lResident(((size_t)lLength + lPageSize - 1) / lPageSize);
+  u64 rv = 0;
+  if (mincore(lMap, (size_t)lLength, &lResident[0]) == 0)
+  {
+    for (size_t i = 0; i < lResident.size(); i++)
+    {
+      if (lResident[i] & 1)
+        rv += lPageSize;
+    }
+  }
+
+  munmap(lMap, (size_t)lLength);
+
+  return min(rv, aLength);
+}
+
+bool DiskFile::Device(u64 &aDevice) const
+{
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0)
+    return false;
+
+  aDevice = (u64)st.st_dev;
+  return true;
+}
+
+int DiskFile::FileDescriptor(void) const
+{
+  return mFile;
+}
+
+bool DiskFile::CanTransferDirectly(u64 aOffset, const void *aBuffer, size_t aLength) const
+{
+  return !mDirect || AlignedBufferPool::IsAligned(aOffset, aBuffer, aLength);
+}
+
+void DiskFile::SetDirectIO(bool aDirectIO)
+{
+  sDirectIO = aDirectIO;
+}
+
+bool DiskFile::DirectIO(void)
+{
+  return sDirectIO;
+}
+
+void DiskFile::SetDirectWrite(bool aDirectWrite)
+{
+  sDirectWrite = aDirectWrite;
+}
+
+bool DiskFile::DirectWrite(void)
+{
+  return sDirectWrite;
+}
+
+// Close the file
+void DiskFile::Close(void)
+{
+  if (mMap != 0)
+  {
+    munmap(mMap, (size_t)mMapLength);
+    mMap = 0;
+    mMapLength = 0;
+  }
+
+  if (mFile >= 0)
+  {
+#ifdef POSIX_FADV_DONTNEED
+    // In direct I/O mode, input files should not stay in the file system cache. If the
+    // file system refused O_DIRECT, drop what was read now. Otherwise the cache is left
+    // alone: it may hold data that the user still needs, and recovery packets that are
+    // resident are the cheapest to read in a later pass.
+    if (sDirectIO && !mDirect && !mWritable)
+      posix_fadvise(mFile, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    ::close(mFile);
+    mFile = -1;
+    mDirect = false;
+    mHoles.clear();
+
+    DiskFilePool::Forget(this);
+  }
+}
+
+// Rename the file to a self-generated name by appending a number. Increase
+// the number until a non-existing file has been found.
+bool DiskFile::Rename(void)
+{
+  u32 lIndex = 0;
+  char lNumberAsString [20];    // Certainly long enough
+  struct stat st;
+  string newname;
+
+  do
+  {
+    sprintf (lNumberAsString, "%u", ++lIndex);
+    newname = filename + "." + lNumberAsString;
+  } while (stat(newname.c_str (), &st) == 0);
+
+  return Rename(newname);
+}
+
+bool DiskFile::Rename(string _filename)
+{
+  assert(mFile < 0);    // File must not be open
+
+  if (::rename(filename.c_str(), _filename.c_str()) == 0)
+  {
+    DiskFilePool::StatusChanged(filename);
+    DiskFilePool::StatusChanged(_filename);
+    filename = _filename;
+
+    return true;
+  }
+  else
+  {
+    cerr << filename << " cannot be renamed to " << _filename << endl;
+
+    return false;
+  }
+}
+
+// Delete the file
+bool DiskFile::Delete(void)
+{
+  assert(mFile < 0);
+
+  if (filename.size() > 0 && ::unlink(filename.c_str()) == 0)
+  {
+    DiskFilePool::StatusChanged(filename);
+    return true;
+  }
+  else
+  {
+    cerr << "Cannot delete " << filename << endl;
+
+    return false;
+  }
+}
+
+string DiskFile::GetCanonicalPathname(string filename)
+{
+  // Is the supplied path already an absolute one
+  if (filename.size() == 0 || filename[0] == '/')
+    return filename;
+
+  // Get the current directory
+  char curdir[1000];
+  if (0 == getcwd(curdir, sizeof(curdir)))
+  {
+    return filename;
+  }
+
+  // Allocate a work buffer and copy the resulting full path into it.
+  char *work = new char[strlen(curdir) + filename.size() + 2];
+  strcpy(work, curdir);
+  if (work[strlen(work)-1] != '/')
+    strcat(work, "/");
+  strcat(work, filename.c_str());
+
+  char *in = work;
+  char *out = work;
+
+  while (*in)
+  {
+    if (*in == '/')
+    {
+      if (in[1] == '.' && in[2] == '/')
+      {
+        // skip the input past /./
+        in += 2;
+      }
+      else if (in[1] == '.' && in[2] == '.' && in[3] == '/')
+      {
+        // backtrack the output if /../ was found on the input
+        in += 3;
+        if (out > work)
+        {
+          do
+          {
+            out--;
+          } while (out > work && *out != '/');
+        }
+      }
+      else
+      {
+        *out++ = *in++;
+      }
+    }
+    else
+    {
+      *out++ = *in++;
+    }
+  }
+  *out = 0;
+
+  string result = work;
+  delete [] work;
+
+  return result;
+}
+
+void DiskFile::SplitFilename(string filename, string &path, string &name)
+{
+  string::size_type where;
+
+  if (string::npos != (where = filename.find_last_of('/')))
+  {
+    path = filename.substr(0, where+1);
+    name = filename.substr(where+1);
+  }
+  else
+  {
+    path = "." PATHSEP;
+    name = filename;
+  }
+}
+
+// Without Cocoa there is no way to find out what the file system encoding is; assume
+// it is UTF8, which it is on every modern system.
+std::string DiskFile::FS2UTF8(const char *aFilename)
+{
+  return std::string(aFilename);
+}
+
+std::string DiskFile::FS2UTF8(const std::string &aFilename)
+{
+  return aFilename;
+}
+
+// Take a filename from a PAR2 file and replace any characters
+// which would be illegal for a file on disk.
+string DiskFile::TranslateFilename(string filename)
+{
+  string result;
+
+  string::iterator p = filename.begin();
+  while (p != filename.end())
+  {
+    unsigned char ch = *p;
+
+    bool ok = true;
+    if (ch < 32)      // Character must not be a control char
+    {
+      ok = false;
+    }
+    else
+    {
+      switch (ch)
+      {
+        case '/':
+          ok = false; // Slash is not allowed
+      }
+    }
+
+    if (ok)
+    {
+      result += ch;
+    }
+    else
+    {
+      // convert problem characters to hex
+      result += ((ch >> 4) < 10) ? (ch >> 4) + '0' : (ch >> 4) + 'A'-10;
+      result += ((ch & 0xf) < 10) ? (ch & 0xf) + '0' : (ch & 0xf) + 'A'-10;
+    }
+
+    ++p;
+  }
+
+  return result;
+}
+
+bool DiskFile::FileExists(string filename)
+{
+  u64 filesize;
+  return DiskFilePool::Status(filename, filesize);
+}
+
+u64 DiskFile::GetFileSize(string filename)
+{
+  u64 filesize;
+  return DiskFilePool::Status(filename, filesize) ? filesize : 0;
+}
+
+bool DiskFile::StatFile(string filename, u64 &filesize)
+{
+  // Symbolic links are not followed, just like in the OSX version.
+  struct stat st;
+  if ((0 == lstat(filename.c_str(), &st)) && S_ISREG(st.st_mode))
+  {
+    filesize = st.st_size;
+    return true;
+  }
+  else
+  {
+    filesize = 0;
+    return false;
+  }
+}
+
+bool DiskFile::StatFile(string filename, u64 &filesize, u64 &mtime, u64 &ctime, u64 &inode)
+{
+  struct stat st;
+  if ((0 == lstat(filename.c_str(), &st)) && S_ISREG(st.st_mode))
+  {
+    filesize = st.st_size;
+#ifdef __APPLE__
+    mtime = (u64)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+    ctime = (u64)st.st_ctimespec.tv_sec * 1000000000 + st.st_ctimespec.tv_nsec;
+#else
+    mtime = (u64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    ctime = (u64)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+#endif
+    inode = st.st_ino;
+    return true;
+  }
+  else
+  {
+    filesize = mtime = ctime = inode = 0;
+    return false;
+  }
+}
+
+// Search the specified path for files which match the specified wildcard
+// and return their names in a list.
+list<string>* DiskFile::FindFiles(string path, string wildcard)
+{
+  list<string> *matches = new list<string>;
+
+  string::size_type where;
+
+  if ((where = wildcard.find_first_of('*')) != string::npos ||
+      (where = wildcard.find_first_of('?')) != string::npos)
+  {
+    string front = wildcard.substr(0, where);
+    bool multiple = wildcard[where] == '*';
+    string back = wildcard.substr(where+1);
+
+    DIR *dirp = opendir(path.c_str());
+    if (dirp != 0)
+    {
+      struct dirent *d;
+      while ((d = readdir(dirp)) != 0)
+      {
+        string name = d->d_name;
+
+        if (name == "." || name == "..")
+          continue;
+
+        if (multiple)
+        {
+          if (name.size() >= wildcard.size() &&
+              name.substr(0, where) == front &&
+              name.substr(name.size()-back.size()) == back)
+          {
+            matches->push_back(path + name);
+          }
+        }
+        else
+        {
+          if (name.size() == wildcard.size())
+          {
+            string::const_iterator pw = wildcard.begin();
+            string::const_iterator pn = name.begin();
+            while (pw != wildcard.end())
+            {
+              if (*pw != '?' && *pw != *pn)
+                break;
+              ++pw;
+              ++pn;
+            }
+
+            if (pw == wildcard.end())
+            {
+              matches->push_back(path + name);
+            }
+          }
+        }
+
+      }
+      closedir(dirp);
+    }
+  }
+  else
+  {
+    struct stat st;
+    string fn = path + wildcard;
+    if (stat(fn.c_str(), &st) == 0)
+    {
+      matches->push_back(path + wildcard);
+    }
+  }
+
+  return matches;
+}
+
+bool DiskFile::FileConsideredOK ()
+{
+  // Same as the OSX version: the file is OK when its name (without path) occurs in
+  // the environment variable PAR2_FILES_CONSIDERED_OK, a list of tab separated names.
+  // Because the file system representation is assumed to be UTF8, no conversion is needed.
+  bool rv = false;
+  const char *lOKFilesEnv = getenv ("PAR2_FILES_CONSIDERED_OK");
+  if (!lOKFilesEnv || !*lOKFilesEnv)
+    return false; // Data is absent or empty
+  if (this->filename.empty())
+    return false;
+
+  std::string lPath;
+  std::string lName;
+  DiskFile::SplitFilename(this->filename, lPath, lName);
+  if (lName.empty())
+    return false;
+
+  const char *lCurrent = lOKFilesEnv;
+  while (lCurrent)
+  {
+    const char *lTab = strchr(lCurrent, '\t');
+    size_t lLength = lTab ? (size_t)(lTab - lCurrent) : strlen(lCurrent);
+    if (lLength > 0 && lLength == lName.size() && strncmp(lCurrent, lName.c_str(), lLength) == 0)
+    {
+      rv = true;
+      break;
+    }
+    lCurrent = lTab ? lTab + 1 : 0;
+  }
+
+  return rv;
+}
+
+std::string DiskFile::Par2Representation (std::string aFilename)
+{
+  // File names are stored as they are in the file system (UTF8).
+  return aFilename;
+}
+
+// DiskFileMap uses an STL map. Unlike the original implementation in diskfile.cpp the
+// map is protected by a semaphore, because source files are verified concurrently.
+typedef map<string, DiskFile*> FilenameDiskFileMap;
+static dispatch_semaphore_t sDiskFileMapSema = dispatch_semaphore_create(1);
+
+DiskFileMap::DiskFileMap(void)
+{
+  mDiskfilemap = new FilenameDiskFileMap;
+}
+
+DiskFileMap::~DiskFileMap(void)
+{
+  FilenameDiskFileMap *lMap = (FilenameDiskFileMap *)mDiskfilemap;
+  for (FilenameDiskFileMap::iterator i = lMap->begin(); i != lMap->end(); ++i)
+  {
+    delete (*i).second;
+  }
+  delete lMap;
+}
+
+bool DiskFileMap::Insert(DiskFile *diskfile)
+{
+  string filename = diskfile->FileName();
+  assert(filename.length() != 0);
+
+  dispatch_semaphore_wait(sDiskFileMapSema, DISPATCH_TIME_FOREVER);
+  pair<FilenameDiskFileMap::const_iterator,bool> location =
+    ((FilenameDiskFileMap *)mDiskfilemap)->insert(pair<string,DiskFile*>(filename, diskfile));
+  dispatch_semaphore_signal(sDiskFileMapSema);
+
+  return location.second;
+}
+
+void DiskFileMap::Remove(DiskFile *diskfile)
+{
+  string filename = diskfile->FileName();
+  assert(filename.length() != 0);
+
+  dispatch_semaphore_wait(sDiskFileMapSema, DISPATCH_TIME_FOREVER);
+  ((FilenameDiskFileMap *)mDiskfilemap)->erase(filename);
+  dispatch_semaphore_signal(sDiskFileMapSema);
+}
+
+DiskFile* DiskFileMap::Find(string filename) const
+{
+  assert(filename.length() != 0);
+
+  DiskFile *rv = 0;
+
+  dispatch_semaphore_wait(sDiskFileMapSema, DISPATCH_TIME_FOREVER);
+  FilenameDiskFileMap::const_iterator f = ((FilenameDiskFileMap *)mDiskfilemap)->find(filename);
+  if (f != ((FilenameDiskFileMap *)mDiskfilemap)->end())
+    rv = (*f).second;
+  dispatch_semaphore_signal(sDiskFileMapSema);
+
+  return rv;
+}
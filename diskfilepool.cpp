@@ -0,0 +1,305 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#include "par2cmdline.h"
+#include <sys/resource.h>
+
+// How many file descriptors are left for everything that is not in the pool: the
+// files that are scanned during verification, recovery files, journals, and so on.
+#define ReservedDescriptors 64
+// The most files the pool keeps open by default, even with a very high limit
+#define MaxDefaultLimit 4096
+
+struct PoolEntry
+{
+  DiskFile         *diskfile;
+  u32               users;      // Acquire calls without a Release
+  bool              closable;   // Opened by the pool, or adopted
+  dispatch_group_t  busy;       // While the pool opens or closes the file, outside the lock
+};
+typedef list<PoolEntry>::iterator PoolIterator;
+
+static dispatch_semaphore_t sPoolSema = dispatch_semaphore_create(1);
+static u32 sLimit = 0;
+static u32 sClosable = 0;                       // Entries that may be closed
+static list<PoolEntry> sEntries;                // Most recently used first
+static map<DiskFile*, PoolIterator> sIndex;
+
+static dispatch_semaphore_t sStatusSema = dispatch_semaphore_create(1);
+static map<string, pair<bool, u64> > sStatus;   // File name -> exists, size
+
+void DiskFilePool::SetLimit(u32 aLimit)
+{
+  dispatch_semaphore_wait(sPoolSema, DISPATCH_TIME_FOREVER);
+  sLimit = aLimit;
+  dispatch_semaphore_signal(sPoolSema);
+}
+
+u32 DiskFilePool::Limit(void)
+{
+  if (sLimit == 0)
+  {
+    struct rlimit rlp;
+    u64 lDescriptors = MaxDefaultLimit + ReservedDescriptors;
+    if (getrlimit(RLIMIT_NOFILE, &rlp) == 0 && rlp.rlim_cur != RLIM_INFINITY)
+      lDescriptors = (u64)rlp.rlim_cur;
+
+    // Keep at least a few, however low the limit
+    sLimit = (u32)max((u64)8, min((u64)MaxDefaultLimit, lDescriptors - min(lDescriptors, (u64)ReservedDescriptors)));
+  }
+
+  return sLimit;
+}
+
+// Mark an entry busy; whoever waits for it can retry after LeaveBusy
+static dispatch_group_t EnterBusy(PoolEntry &aEntry)
+{
+  aEntry.busy = dispatch_group_create();
+  dispatch_group_enter(aEntry.busy);
+  return aEntry.busy;
+}
+
+static void LeaveBusy(dispatch_group_t aBusy)
+{
+  dispatch_group_leave(aBusy);
+  dispatch_release(aBusy);
+}
+
+// Make room for one more open file, if the pool is full. Caller holds sPoolSema.
+// The victims stay in the index, busy, until they are closed, so that an Acquire
+// of one of them in the meantime waits instead of taking the file that is about
+// to be closed for one that is open.
+static void SelectVictims(u32 aLimit, vector<PoolEntry> &aVictims)
+{
+  PoolIterator lEntry = sEntries.end();
+  while (sClosable >= aLimit && lEntry != sEntries.begin())
+  {
+    --lEntry;
+    if (lEntry->closable && lEntry->users == 0 && lEntry->busy == 0)
+    {
+      EnterBusy(*lEntry);
+      lEntry->closable = false;
+      sClosable--;
+      aVictims.push_back(*lEntry);
+    }
+  }
+}
+
+// Close the files outside the lock; Close calls Forget
+static void CloseVictims(const vector<PoolEntry> &aVictims)
+{
+  for (size_t i = 0; i < aVictims.size(); i++)
+  {
+    aVictims[i].diskfile->Close();
+
+    // In case the file was closed already, and Forget was not called
+    dispatch_semaphore_wait(sPoolSema, DISPATCH_TIME_FOREVER);
+    map<DiskFile*, PoolIterator>::iterator lFound = sIndex.find(aVictims[i].diskfile);
+    if (lFound != sIndex.end() && lFound->second->busy == aVictims[i].busy)
+    {
+      sEntries.erase(lFound->second);
+      sIndex.erase(lFound);
+    }
+    dispatch_semaphore_signal(sPoolSema);
+
+    LeaveBusy(aVictims[i].busy);
+  }
+}
+
+bool DiskFilePool::Acquire(DiskFile *aFile)
+{
+  u32 lLimit = Limit();
+
+  for (;;)
+  {
+    vector<PoolEntry> lVictims;
+
+    dispatch_semaphore_wait(sPoolSema, DISPATCH_TIME_FOREVER);
+
+    map<DiskFile*, PoolIterator>::iterator lFound = sIndex.find(aFile);
+    if (lFound != sIndex.end() && lFound->second->busy != 0)
+    {
+      // Another thread is opening or closing it; see how that ends
+      dispatch_group_t lBusy = lFound->second->busy;
+      dispatch_retain(lBusy);
+      dispatch_semaphore_signal(sPoolSema);
+
+      dispatch_group_wait(lBusy, DISPATCH_TIME_FOREVER);
+      dispatch_release(lBusy);
+      continue;
+    }
+
+    if (lFound != sIndex.end())
+    {
+      lFound->second->users++;
+      sEntries.splice(sEntries.begin(), sEntries, lFound->second);
+      dispatch_semaphore_signal(sPoolSema);
+      return true;
+    }
+
+    // Someone else opened the file; it stays theirs
+    bool lOpen = aFile->IsOpen();
+    if (!lOpen)
+      SelectVictims(lLimit, lVictims);
+
+    PoolEntry lEntry;
+    lEntry.diskfile = aFile;
+    lEntry.users = 1;
+    lEntry.closable = !lOpen;
+    lEntry.busy = 0;
+    sEntries.push_front(lEntry);
+    sIndex[aFile] = sEntries.begin();
+    dispatch_group_t lBusy = 0;
+    if (lEntry.closable)
+    {
+      sClosable++;
+      // Until it is open, no one else may use it
+      lBusy = EnterBusy(sEntries.front());
+    }
+
+    dispatch_semaphore_signal(sPoolSema);
+
+    CloseVictims(lVictims);
+
+    if (lOpen)
+      return true;
+
+    // Open it the way it was open before
+    bool lOpened = aFile->IsWritable() ? aFile->OpenForUpdate() : aFile->Open(false);  // false: don't expect to read all data of the file
+
+    dispatch_semaphore_wait(sPoolSema, DISPATCH_TIME_FOREVER);
+    lFound = sIndex.find(aFile);
+    if (lFound != sIndex.end() && lFound->second->busy == lBusy)
+    {
+      lFound->second->busy = 0;
+      if (!lOpened)
+      {
+        if (lFound->second->closable)
+          sClosable--;
+        sEntries.erase(lFound->second);
+        sIndex.erase(lFound);
+      }
+    }
+    dispatch_semaphore_signal(sPoolSema);
+
+    LeaveBusy(lBusy);
+
+    return lOpened;
+  }
+}
+
+void DiskFilePool::Release(DiskFile *aFile)
+{
+  dispatch_semaphore_wait(sPoolSema, DISPATCH_TIME_FOREVER);
+
+  map<DiskFile*, PoolIterator>::iterator lFound = sIndex.find(aFile);
+  if (lFound != sIndex.end())
+  {
+    PoolIterator lEntry = lFound->second;
+    assert(lEntry->users > 0);
+
+    // Files that are not ours are not kept track of when they are not in use
+    if (--lEntry->users == 0 && !lEntry->closable)
+    {
+      sIndex.erase(lFound);
+      sEntries.erase(lEntry);
+    }
+  }
+
+  dispatch_semaphore_signal(sPoolSema);
+}
+
+void DiskFilePool::Adopt(DiskFile *aFile)
+{
+  u32 lLimit = Limit();
+  vector<PoolEntry> lVictims;
+
+  dispatch_semaphore_wait(sPoolSema, DISPATCH_TIME_FOREVER);
+
+  map<DiskFile*, PoolIterator>::iterator lFound = sIndex.find(aFile);
+  if (lFound == sIndex.end())
+  {
+    PoolEntry lEntry;
+    lEntry.diskfile = aFile;
+    lEntry.users = 0;
+    lEntry.closable = false;
+    lEntry.busy = 0;
+    sEntries.push_front(lEntry);
+    lFound = sIndex.insert(pair<DiskFile*, PoolIterator>(aFile, sEntries.begin())).first;
+  }
+
+  // A file that the pool is closing cannot be adopted
+  if (!lFound->second->closable && lFound->second->busy == 0)
+  {
+    lFound->second->closable = true;
+    sClosable++;
+  }
+
+  // The adopted file itself may be closed again right away if it is not in use
+  if (sClosable > lLimit)
+    SelectVictims(lLimit + 1, lVictims);
+
+  dispatch_semaphore_signal(sPoolSema);
+
+  CloseVictims(lVictims);
+}
+
+void DiskFilePool::Forget(DiskFile *aFile)
+{
+  dispatch_semaphore_wait(sPoolSema, DISPATCH_TIME_FOREVER);
+
+  map<DiskFile*, PoolIterator>::iterator lFound = sIndex.find(aFile);
+  if (lFound != sIndex.end())
+  {
+    if (lFound->second->closable)
+      sClosable--;
+    sEntries.erase(lFound->second);
+    sIndex.erase(lFound);
+  }
+
+  dispatch_semaphore_signal(sPoolSema);
+}
+
+bool DiskFilePool::Status(string aFileName, u64 &aFileSize)
+{
+  dispatch_semaphore_wait(sStatusSema, DISPATCH_TIME_FOREVER);
+  map<string, pair<bool, u64> >::const_iterator lFound = sStatus.find(aFileName);
+  bool lCached = lFound != sStatus.end();
+  bool lExists = lCached && lFound->second.first;
+  aFileSize = lCached ? lFound->second.second : 0;
+  dispatch_semaphore_signal(sStatusSema);
+
+  if (!lCached)
+  {
+    // Ask the OS without holding the lock; another thread may do the same
+    lExists = DiskFile::StatFile(aFileName, aFileSize);
+
+    dispatch_semaphore_wait(sStatusSema, DISPATCH_TIME_FOREVER);
+    sStatus[aFileName] = pair<bool, u64>(lExists, aFileSize);
+    dispatch_semaphore_signal(sStatusSema);
+  }
+
+  return lExists;
+}
+
+void DiskFilePool::StatusChanged(string aFileName)
+{
+  dispatch_semaphore_wait(sStatusSema, DISPATCH_TIME_FOREVER);
+  sStatus.erase(aFileName);
+  dispatch_semaphore_signal(sStatusSema);
+}
@@ -0,0 +1,57 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#ifndef __DISKFILEPOOL_H__
+#define __DISKFILEPOOL_H__
+
+// The DiskFilePool limits how many files are open at the same time, so that sets with
+// many thousands of files work within the limit on file descriptors. Files are opened
+// when they are needed (Acquire) and stay open after Release, so that the next pass over
+// the blocks does not have to open them again. When the limit is reached, the file that
+// has not been used for the longest time is closed. A file that was opened for writing
+// is reopened for writing.
+// The pool only closes files that it opened itself, or that were handed to it with Adopt.
+// It also caches the status (existence and size) of files by name, because the same files
+// are looked up many times. DiskFile keeps the cache up to date for the changes it makes.
+// All functions are thread safe.
+
+class DiskFilePool
+{
+public:
+  // Set the number of files the pool may keep open. 0 means: derived from the limit
+  // on file descriptors of the process.
+  static void SetLimit(u32 aLimit);
+  static u32 Limit(void);
+
+  // Make sure the file is open, and keep it open until the matching Release.
+  static bool Acquire(DiskFile *aFile);
+  static void Release(DiskFile *aFile);
+
+  // Let the pool close a file that is open already, when it is not in use
+  static void Adopt(DiskFile *aFile);
+
+  // The file has been closed (called by DiskFile::Close)
+  static void Forget(DiskFile *aFile);
+
+  // Whether a file exists (as a regular file), and its size
+  static bool Status(string aFileName, u64 &aFileSize);
+  // The file has been created, deleted, renamed or changed in size
+  static void StatusChanged(string aFileName);
+};
+
+#endif // __DISKFILEPOOL_H__
@@ -30,7 +30,8 @@ FileCheckSummer::FileCheckSummer(DiskFile   *_diskfile,
 , windowtable(_windowtable)
 , windowmask(_windowmask)
 {
-  buffer = new char[(size_t)blocksize*2];
+  // Page aligned, and reused for the next file that is scanned
+  buffer = (char*)AlignedBufferPool::Get((size_t)blocksize*2);
 
   filesize = diskfile->FileSize();
 
@@ -39,12 +40,18 @@ FileCheckSummer::FileCheckSummer(DiskFile   *_diskfile,
 
 FileCheckSummer::~FileCheckSummer(void)
 {
-  delete [] buffer;
+  AlignedBufferPool::Release(buffer);
 }
 
 // Start reading the file at the beginning
 bool FileCheckSummer::Start(void)
 {
+  if (buffer == 0)
+  {
+    cerr << "Could not allocate buffer memory." << endl;
+    return false;
+  }
+
   currentoffset = readoffset = 0;
 
   tailpointer = outpointer = buffer;
@@ -130,15 +137,40 @@ bool FileCheckSummer::Fill(void)
   // How much data can we read into the buffer
   size_t want = (size_t)min(filesize-readoffset, (u64)(&buffer[2*blocksize]-tailpointer));
 
-  if (want > 0)
+  while (want > 0)
   {
-    // Read data
-    if (!diskfile->Read(readoffset, tailpointer, want))
-      return false;
+    // The holes of a sparse file read as zeroes; only read the data around them
+    size_t length = want;
+    bool hole = false;
+    u64 holestart, holeend;
+    if (diskfile->NextHole(readoffset, holestart, holeend))
+    {
+      if (holestart <= readoffset)
+      {
+        hole = true;
+        length = (size_t)min((u64)want, holeend-readoffset);
+      }
+      else
+      {
+        length = (size_t)min((u64)want, holestart-readoffset);
+      }
+    }
 
-    UpdateHashes(readoffset, tailpointer, want);
-    readoffset += want;
-    tailpointer += want;
+    if (hole)
+    {
+      memset(tailpointer, 0, length);
+    }
+    else
+    {
+      // Read data
+      if (!diskfile->Read(readoffset, tailpointer, length))
+        return false;
+    }
+
+    UpdateHashes(readoffset, tailpointer, length);
+    readoffset += length;
+    tailpointer += length;
+    want -= length;
   }
 
   // Did we fill the buffer
@@ -206,10 +238,18 @@ void FileCheckSummer::GetFileHashes(MD5Hash &hashfull, MD5Hash &hash16k) const
 // Compute and return the current hash
 MD5Hash FileCheckSummer::Hash(void)
 {
+  MD5Hash hash;
+
+  // The hash of a block of zeroes is known
+  if (ZeroBlock::IsZero(outpointer, (size_t)blocksize))
+  {
+    u32 crc;
+    ZeroBlock::Digest(blocksize, hash, crc);
+    return hash;
+  }
+
   MD5Context context;
   context.Update(outpointer, (size_t)blocksize);
-
-  MD5Hash hash;
   context.Final(hash);
 
   return hash;
@@ -68,6 +68,9 @@ public:
   // Return the current file offset
   u64 Offset(void) const;
 
+  // The data in the current window (BlockLength() bytes, followed by zeroes up to blocksize)
+  const void *WindowData(void) const {return outpointer;}
+
   // Return the full file hash and the 16k file hash
   void GetFileHashes(MD5Hash &hashfull, MD5Hash &hash16k) const;
 
@@ -120,3 +120,29 @@ bool MainPacket::Load(DiskFile *diskfile, u64 offset, PACKET_HEADER &header)
 
   return true;
 }
+
+// Replace the fileid of one file
+
+void MainPacket::FileId(u32 filenumber, const MD5Hash &fileid)
+{
+  assert(packetdata != 0);
+  assert(filenumber<totalfilecount);
+
+  ((MAINPACKET*)packetdata)->fileid[filenumber] = fileid;
+}
+
+// Compute the set_id_hash in the same way as Create does, and the packet_hash with it
+
+void MainPacket::ComputeSetId(void)
+{
+  assert(packetdata != 0);
+
+  MAINPACKET *packet = (MAINPACKET *)packetdata;
+
+  MD5Hash setid;
+  MD5Context setidcontext;
+  setidcontext.Update(&packet->blocksize, packetlength - offsetof(MAINPACKET, blocksize));
+  setidcontext.Final(setid);
+
+  FinishPacket(setid);
+}
@@ -56,6 +56,13 @@ public:
   // Get the fileid of one file
   const MD5Hash& FileId(u32 filenumber) const;
 
+  // Replace the fileid of a file that has changed. Afterwards, the set id
+  // must be computed again.
+  void FileId(u32 filenumber, const MD5Hash &fileid);
+
+  // Compute the set id from the contents of the packet and finish the packet with it
+  void ComputeSetId(void);
+
 protected:
   u64 blocksize;
   u32 totalfilecount;
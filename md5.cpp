@@ -315,6 +315,40 @@ MD5Hash MD5Context::Hash(void) const
   return output;
 }
 
+void MD5Context::Save(u8 *saved) const
+{
+  leu32 words[4];
+  for (unsigned int i = 0; i < 4; i++)
+    words[i] = state[i];
+  leu64 counts[2];
+  counts[0] = (u64)used;
+  counts[1] = bytes;
+
+  memcpy(&saved[0], words, sizeof(words));
+  memcpy(&saved[sizeof(words)], block, buffersize);
+  memcpy(&saved[sizeof(words) + buffersize], counts, sizeof(counts));
+}
+
+// Returns false if the saved state is not a possible one
+bool MD5Context::Load(const u8 *saved)
+{
+  leu32 words[4];
+  leu64 counts[2];
+  memcpy(words, &saved[0], sizeof(words));
+  memcpy(counts, &saved[sizeof(words) + buffersize], sizeof(counts));
+
+  if (counts[0] >= (u64)buffersize || counts[0] != counts[1] % buffersize)
+    return false;
+
+  for (unsigned int i = 0; i < 4; i++)
+    state[i] = words[i];
+  memcpy(block, &saved[sizeof(words)], buffersize);
+  used = (size_t)counts[0];
+  bytes = counts[1];
+
+  return true;
+}
+
 ostream& operator<<(ostream &result, const MD5Context &c)
 {
   char buffer[50];
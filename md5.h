@@ -102,6 +102,12 @@ public:
   friend ostream& operator<<(ostream &s, const MD5Context &context);
   string print(void) const;
 
+  // The state of an unfinished computation as bytes in a fixed (little endian) layout,
+  // so that another run can continue it. Both take savedsize bytes.
+  enum {savedsize = 4 * sizeof(u32) + 64 + 2 * sizeof(u64)};
+  void Save(u8 *saved) const;
+  bool Load(const u8 *saved);
+
 protected:
   enum {buffersize = 64};
   unsigned char block[buffersize];
@@ -0,0 +1,48 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+// A portable implementation of the OSXStuff functions, for systems without Cocoa. It is
+// the counterpart of Xcode/OSXStuff.mm and must not be linked together with it. Without
+// Cocoa there are no autorelease pools, so those functions do nothing.
+
+#include "par2cmdline.h"
+#include "OSXStuff.h"
+
+void *OSXStuff::SetupAutoreleasePool()
+{
+  return 0;
+}
+
+void OSXStuff::ReleaseAutoreleasePool(void *aPool)
+{
+}
+
+void OSXStuff::analyzeMemory(MemoryStats &aMemStats)
+{
+  memset(&aMemStats, 0, sizeof aMemStats);
+
+  // Only the free memory is known in a portable way
+#ifdef _SC_AVPHYS_PAGES
+  long lPages = sysconf(_SC_AVPHYS_PAGES);
+  long lPageSize = sysconf(_SC_PAGESIZE);
+  if (lPages > 0 && lPageSize > 0)
+  {
+    aMemStats.memFree = (uint64_t)lPages * (uint64_t)lPageSize;
+  }
+#endif
+}
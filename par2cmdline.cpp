@@ -68,6 +68,10 @@ int main(int argc, char *argv[])
     if (commandline->GetNoiseLevel() > CommandLine::nlSilent)
       banner();
 
+    DiskFile::SetDirectIO(commandline->GetDirectIO());
+    DiskFile::SetDirectWrite(commandline->GetDirectWrite());
+    DiskFilePool::SetLimit(commandline->GetOpenFileLimit());
+
     // Which operation was selected
     switch (commandline->GetOperation())
     {
@@ -128,6 +132,22 @@ int main(int argc, char *argv[])
         }
       }
       break;
+    case CommandLine::opMerge:
+      {
+        // Assemble the recovery files from the shards of a create
+        Par2Merger *merger = new Par2Merger;
+        result = merger->Process(*commandline);
+        delete merger;
+      }
+      break;
+    case CommandLine::opUpdate:
+      {
+        // Update the recovery files for changed data files
+        Par2Updater *updater = new Par2Updater;
+        result = updater->Process(*commandline);
+        delete updater;
+      }
+      break;
     case CommandLine::opNone:
       break;
     }
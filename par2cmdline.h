@@ -42,6 +42,7 @@ typedef uint64_t           u64;
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define PATHSEP "/"
@@ -83,6 +84,7 @@ typedef enum Result
 #include <list>
 #include <vector>
 #include <map>
+#include <set>
 #include <algorithm>
 
 #include <ctype.h>
@@ -114,8 +116,17 @@ extern dispatch_semaphore_t coutSema;
 #include "commandline.h"
 #include "reedsolomon.h"
 
+#include "alignedbufferpool.h"
+#include "zeroblock.h"
 #include "diskfile.h"
+#include "diskfilepool.h"
 #include "datablock.h"
+#include "asyncio.h"
+#include "blockcache.h"
+#include "syndromeaccumulator.h"
+#include "repairjournal.h"
+#include "checkpoint.h"
+#include "session.h"
 
 #include "criticalpacket.h"
 #include "par2creatorsourcefile.h"
@@ -131,8 +142,11 @@ extern dispatch_semaphore_t coutSema;
 #include "filechecksummer.h"
 #include "verificationhashtable.h"
 
+#include "par2creatorplanner.h"
 #include "par2creator.h"
+#include "par2merger.h"
 #include "par2repairer.h"
+#include "par2updater.h"
 
 #include "par1fileformat.h"
 #include "par1repairersourcefile.h"
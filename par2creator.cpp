@@ -20,14 +20,18 @@
 #include "par2cmdline.h"
 #include "TimeReporter.h"
 #include <sys/types.h>
-#include <sys/sysctl.h>
 
 Par2Creator::Par2Creator(void)
 : noiselevel(CommandLine::nlUnknown)
 , blocksize(0)
 , chunksize(0)
+, outputsperpass(0)
+, passfirstoutput(0)
+, passoutputcount(0)
 , inputbuffer(0)
 , outputbuffer(0)
+, readslotcount(0)
+, mappedinput(false)
 
 , sourcefilecount(0)
 , sourceblockcount(0)
@@ -37,12 +41,17 @@ Par2Creator::Par2Creator(void)
 , recoveryfilecount(0)
 , recoveryblockcount(0)
 , firstrecoveryblock(0)
+, shardnumber(0)
+, shardcount(0)
+, shardfirstblock(0)
+, shardblockcount(0)
 
 , mainpacket(0)
 , creatorpacket(0)
 
 , previouslyReportedFraction (0)
 , deferhashcomputation(false)
+, resumeoffset(0)
 {
   genericSema = dispatch_semaphore_create(1);   // Like a mutex
 }
@@ -52,8 +61,8 @@ Par2Creator::~Par2Creator(void)
   delete mainpacket;
   delete creatorpacket;
 
-  delete [] (u8*)inputbuffer;
-  delete [] (u8*)outputbuffer;
+  AlignedBufferPool::Release(inputbuffer);
+  AlignedBufferPool::Release(outputbuffer);
 
   vector<Par2CreatorSourceFile*>::iterator sourcefile = sourcefiles.begin();
   while (sourcefile != sourcefiles.end())
@@ -62,12 +71,16 @@ Par2Creator::~Par2Creator(void)
     ++sourcefile;
   }
   dispatch_release(genericSema);
+
+  // The buffers were sized for this set; don't keep them around for the next one
+  AlignedBufferPool::Purge();
 }
 
 Result Par2Creator::Process(const CommandLine &commandline)
 {
   // Get information from commandline
   noiselevel = commandline.GetNoiseLevel();
+  mappedinput = commandline.GetMappedInput();
   blocksize = commandline.GetBlockSize();
   sourceblockcount = commandline.GetBlockCount();
   const list<CommandLine::ExtraFile> extrafiles = commandline.GetExtraFiles();
@@ -80,6 +93,15 @@ Result Par2Creator::Process(const CommandLine &commandline)
   string par2filename = commandline.GetParFilename();
   size_t memorylimit = commandline.GetMemoryLimit();
   largestfilesize = commandline.GetLargestSourceSize();
+  shardnumber = commandline.GetShardNumber();
+  shardcount = commandline.GetShardCount();
+
+  if (!commandline.GetStreamFile().empty())
+    return ProcessStream(commandline);
+
+  // Let the planner choose the block size
+  if (commandline.GetAutoTune() && !AutoTuneBlockSize(extrafiles, redundancy, memorylimit))
+    return eInvalidCommandLineArguments;
 
   // Compute block size from block count or vice versa depending on which was
   // specified on the command line
@@ -91,8 +113,19 @@ Result Par2Creator::Process(const CommandLine &commandline)
   if (redundancy > 0 && !ComputeRecoveryBlockCount(redundancy))
     return eInvalidCommandLineArguments;
 
+  // A shard computes only its part of the recovery blocks, into a file of its own
+  if (shardcount > 0)
+  {
+    if (!SelectShard())
+      return eInvalidCommandLineArguments;
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".shard%uof%u", shardnumber, shardcount);
+    par2filename += suffix;
+  }
+
   // Determine how much recovery data can be computed on one pass
-  if (!CalculateProcessBlockSize(memorylimit))
+  if (!CalculateProcessBlockSize(memorylimit, commandline.GetResume()))
     return eLogicError;
 
   // Determine how many recovery files to create.
@@ -127,6 +160,10 @@ Result Par2Creator::Process(const CommandLine &commandline)
   if (!CreateMainPacket())
     return eLogicError;
 
+  // Find out whether an earlier run of the same command got part of the way
+  if (commandline.GetResume())
+    LoadCheckpoint(par2filename);
+
   // Create the creator packet.
   if (!CreateCreatorPacket())
     return eLogicError;
@@ -142,7 +179,7 @@ Result Par2Creator::Process(const CommandLine &commandline)
   if (recoveryblockcount > 0)
   {
     // Allocate memory buffers for reading and writing data to disk.
-    if (!AllocateBuffers())
+    if (!AllocateBuffers(memorylimit))
       return eMemoryError;
 
     // Compute the Reed Solomon matrix
@@ -150,22 +187,43 @@ Result Par2Creator::Process(const CommandLine &commandline)
       return eLogicError;
 
     // Set the total amount of data to be processed.
-    progress = 0;
+    progress = resumeoffset * sourceblockcount * recoveryblockcount;
     totaldata = blocksize * sourceblockcount * recoveryblockcount;
 	previouslyReportedFraction = -10000000;	// Big negative
 
-    // Start at an offset of 0 within a block.
-    u64 blockoffset = 0;
-    while (blockoffset < blocksize) // Continue until the end of the block.
+    if (outputsperpass < recoveryblockcount)
     {
-      // Work out how much data to process this time.
-      size_t blocklength = (size_t)min((u64)chunksize, blocksize-blockoffset);
+      // Each pass computes some of the recovery blocks over their full length. The first
+      // pass also computes the hashes of the source files. There is no checkpoint; it
+      // would have to include the state of those hashes, so --resume does not pick this.
+      for (u32 firstoutput = 0; firstoutput < recoveryblockcount; firstoutput += outputsperpass)
+      {
+        if (!ProcessData(0, (size_t)blocksize, firstoutput, min(outputsperpass, recoveryblockcount - firstoutput)))
+          return eFileIOError;
+      }
+    }
+    else
+    {
+      // Start at an offset of 0 within a block, unless the earlier passes have been
+      // done by an interrupted run.
+      u64 blockoffset = resumeoffset;
+      if (resumeoffset > 0)
+        RestoreCheckpointState();
+      while (blockoffset < blocksize) // Continue until the end of the block.
+      {
+        // Work out how much data to process this time.
+        size_t blocklength = (size_t)min((u64)chunksize, blocksize-blockoffset);
 
-      // Read source data, process it through the RS matrix and write it to disk.
-      if (!ProcessData(blockoffset, blocklength))
-        return eFileIOError;
+        // Read source data, process it through the RS matrix and write it to disk.
+        if (!ProcessData(blockoffset, blocklength, 0, recoveryblockcount))
+          return eFileIOError;
 
-      blockoffset += blocklength;
+        blockoffset += blocklength;
+
+        // A failed checkpoint only means that an interruption costs more
+        if (checkpoint.IsSet() && blockoffset < blocksize)
+          SaveCheckpoint(blockoffset);
+      }
     }
 
     if (noiselevel > CommandLine::nlQuiet)
@@ -203,6 +261,8 @@ Result Par2Creator::Process(const CommandLine &commandline)
   if (!CloseFiles())
     return eFileIOError;
 
+  checkpoint.Remove();
+
   if (noiselevel > CommandLine::nlSilent)
   {
     dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
@@ -217,6 +277,347 @@ Result Par2Creator::Process(const CommandLine &commandline)
   return eSuccess;
 }
 
+// The stream is read once. While the next block is read, the previous one is written
+// to the stream file, hashed, and added to all of the recovery blocks; those are
+// accumulated in memory, in the same way as the syndromes of a repair. The size and
+// the hashes of the file, and so the set id, are known only at the end of the stream;
+// only then are the recovery files written.
+Result Par2Creator::ProcessStream(const CommandLine &commandline)
+{
+  string par2filename = commandline.GetParFilename();
+  string streamfile = commandline.GetStreamFile();
+
+  if ((u64)firstrecoveryblock + recoveryblockcount > 65535)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "Too many recovery blocks requested." << endl;
+    dispatch_semaphore_signal(coutSema);
+    return eInvalidCommandLineArguments;
+  }
+
+  if ((u64)recoveryblockcount * blocksize > commandline.GetMemoryLimit())
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "The recovery blocks do not fit in the memory limit (-m) for a stream." << endl;
+    dispatch_semaphore_signal(coutSema);
+    return eInvalidCommandLineArguments;
+  }
+
+  // The number of source blocks is not known in advance; allow for the largest one
+  vector<u16> exponents;
+  for (u32 exponent = firstrecoveryblock; exponent < firstrecoveryblock + recoveryblockcount; exponent++)
+  {
+    exponents.push_back((u16)exponent);
+  }
+
+  SyndromeAccumulator recovery;
+  if (recoveryblockcount > 0 && !recovery.Start(32768, (size_t)blocksize, exponents))
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "Could not allocate buffer memory." << endl;
+    dispatch_semaphore_signal(coutSema);
+    return eMemoryError;
+  }
+
+  DiskFile output;
+  if (!output.Create(streamfile, 0))
+    return eFileIOError;
+
+  if (noiselevel > CommandLine::nlSilent)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Reading the standard input into: " << DiskFile::FS2UTF8(streamfile) << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  // One buffer is filled while the other is processed. The blocks in the GCD code
+  // blocks below must not copy the C++ objects.
+  u8 *buffers[2];
+  buffers[0] = new u8[(size_t)blocksize];
+  buffers[1] = new u8[(size_t)blocksize];
+
+  vector<MD5Hash> blockhashes;
+  vector<u32> blockcrcs;
+  MD5Context filecontext;
+  MD5Context *lFileContext = &filecontext;
+  MD5Hash hash16k;
+  MD5Hash *lHash16k = &hash16k;
+  SyndromeAccumulator *lRecovery = &recovery;
+  DiskFile *lOutput = &output;
+  size_t lBlockSize = (size_t)blocksize;
+
+  __block bool lWriteOK = true;
+  dispatch_group_t lGroup = dispatch_group_create();
+  dispatch_queue_t lQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+
+  u64 filesize = 0;
+  u32 blocknumber = 0;
+  int current = 0;
+  bool rv = true;
+  bool eof = false;
+
+  while (rv && !eof)
+  {
+    // Fill a block from the standard input
+    size_t length = 0;
+    while (length < lBlockSize)
+    {
+      ssize_t got = read(STDIN_FILENO, &buffers[current][length], lBlockSize - length);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got < 0)
+      {
+        dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+        cerr << "Could not read the standard input: " << strerror(errno) << endl;
+        dispatch_semaphore_signal(coutSema);
+        rv = false;
+        break;
+      }
+      if (got == 0)
+      {
+        eof = true;
+        break;
+      }
+      length += got;
+    }
+
+    // The other buffer is free once the previous block is done
+    dispatch_group_wait(lGroup, DISPATCH_TIME_FOREVER);
+    if (!rv || length == 0)
+      break;
+
+    if (blocknumber == 32768)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cerr << "The stream needs more than 32768 blocks; use a larger block size (-s)." << endl;
+      dispatch_semaphore_signal(coutSema);
+      rv = false;
+      break;
+    }
+
+    // The last block is padded with zeroes
+    u8 *lBuffer = buffers[current];
+    memset(&lBuffer[length], 0, lBlockSize - length);
+
+    u64 lOffset = filesize;
+    u32 lBlockNumber = blocknumber;
+    blockhashes.push_back(MD5Hash());
+    blockcrcs.push_back(0);
+    MD5Hash *lBlockHash = &blockhashes[blocknumber];
+    u32 *lBlockCRC = &blockcrcs[blocknumber];
+
+    // Tee the data to the stream file
+    dispatch_group_async(lGroup, lQueue, ^{
+      if (!lOutput->Write(lOffset, lBuffer, length))
+      {
+        dispatch_semaphore_wait(this->genericSema, DISPATCH_TIME_FOREVER);
+        lWriteOK = false;
+        dispatch_semaphore_signal(this->genericSema);
+      }
+    });
+
+    // The hash of the whole file, and of its first 16k
+    dispatch_group_async(lGroup, lQueue, ^{
+      if (lOffset < 16384 && lOffset + length >= 16384)
+      {
+        lFileContext->Update(lBuffer, (size_t)(16384-lOffset));
+
+        MD5Context temp = *lFileContext;
+        temp.Final(*lHash16k);
+
+        lFileContext->Update(&lBuffer[16384-lOffset], (size_t)(lOffset+length)-16384);
+      }
+      else
+      {
+        lFileContext->Update(lBuffer, length);
+      }
+    });
+
+    // The hash and CRC of the block, including the padding
+    dispatch_group_async(lGroup, lQueue, ^{
+      MD5Context lBlockContext;
+      lBlockContext.Update(lBuffer, lBlockSize);
+      lBlockContext.Final(*lBlockHash);
+      *lBlockCRC = ~0 ^ CRCUpdateBlock(~0, lBlockSize, lBuffer);
+    });
+
+    // The contribution of the block to each recovery block
+    dispatch_group_async(lGroup, lQueue, ^{
+      lRecovery->Add(this->rs, lBlockNumber, lBuffer, lBlockSize);
+    });
+
+    filesize += length;
+    blocknumber++;
+    current ^= 1;
+
+#ifndef MPDL
+    if (noiselevel > CommandLine::nlQuiet && (filesize - length) / 16777216 != filesize / 16777216)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cout << "Read " << filesize / 1048576 << " MB\r" << flush;
+      dispatch_semaphore_signal(coutSema);
+    }
+#endif
+  }
+
+  dispatch_group_wait(lGroup, DISPATCH_TIME_FOREVER);
+  dispatch_release(lGroup);
+  delete [] buffers[0];
+  delete [] buffers[1];
+  output.Close();
+
+  if (!rv || !lWriteOK)
+    return eFileIOError;
+
+  if (filesize == 0)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "The standard input is empty." << endl;
+    dispatch_semaphore_signal(coutSema);
+    return eFileIOError;
+  }
+
+  // Now the stream is one source file like any other
+  MD5Hash hashfull;
+  filecontext.Final(hashfull);
+  if (filesize < 16384)
+    hash16k = hashfull;
+
+  Par2CreatorSourceFile *sourcefile = new Par2CreatorSourceFile;
+  sourcefile->CreateFromStream(streamfile, filesize, hash16k, hashfull, blockhashes, blockcrcs);
+  sourcefile->RecordCriticalPackets(criticalpackets);
+  sourcefiles.push_back(sourcefile);
+
+  sourcefilecount = 1;
+  sourceblockcount = blocknumber;
+  largestfilesize = filesize;
+
+  // Determine how many recovery files to create.
+  if (!ComputeRecoveryFileCount())
+    return eInvalidCommandLineArguments;
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Stream size: " << filesize << endl;
+    cout << "Block size: " << blocksize << endl;
+    cout << "Source block count: " << sourceblockcount << endl;
+    cout << "Recovery block count: " << recoveryblockcount << endl;
+    cout << "Recovery file count: " << recoveryfilecount << endl;
+    cout << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  // Create the main packet and determine the setid to use with all packets
+  if (!CreateMainPacket())
+    return eLogicError;
+
+  // Create the creator packet.
+  if (!CreateCreatorPacket())
+    return eLogicError;
+
+  // Create all of the output files and allocate all packets to appropriate file offets.
+  if (!InitialiseOutputFiles(par2filename))
+    return eFileIOError;
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Writing recovery packets" << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  // The recovery data is complete in memory. The files are written in parallel, the
+  // packets in one file by one thread.
+  __block bool lOK = true;
+  dispatch_apply(recoveryfiles.size(), lQueue, ^(size_t aFile){
+    for (vector<RecoveryPacket>::iterator lPacket = this->recoverypackets.begin();
+         lPacket != this->recoverypackets.end();
+         ++lPacket)
+    {
+      if (lPacket->GetDiskFile() != &this->recoveryfiles[aFile])
+        continue;
+
+      const u8 *lData = lRecovery->Syndrome((u16)lPacket->Exponent());
+      if (!lPacket->WriteData(0, lBlockSize, lData) || !lPacket->WriteHeader())
+      {
+        dispatch_semaphore_wait(this->genericSema, DISPATCH_TIME_FOREVER);
+        lOK = false;
+        dispatch_semaphore_signal(this->genericSema);
+        break;
+      }
+    }
+  });
+
+  if (!lOK)
+    return eFileIOError;
+
+  // Fill in all remaining details in the critical packets.
+  if (!FinishCriticalPackets())
+    return eLogicError;
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Writing verification packets" << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  // Write all other critical packets to disk.
+  if (!WriteCriticalPackets())
+    return eFileIOError;
+
+  // Close all files.
+  if (!CloseFiles())
+    return eFileIOError;
+
+  if (noiselevel > CommandLine::nlSilent)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Done" << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return eSuccess;
+}
+
+// The planner only sets the block size; the block count and the passes are then worked
+// out as if the block size had been given with -s.
+bool Par2Creator::AutoTuneBlockSize(const list<CommandLine::ExtraFile> &extrafiles, u32 redundancy, size_t memorylimit)
+{
+  Par2CreatorPlanner planner;
+  planner.Calibrate(extrafiles);
+
+  Par2CreatorPlanner::Plan plan;
+  if (!planner.Choose(extrafiles, redundancy, recoveryblockcount, memorylimit, plan))
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "Could not find a block size that fits in the memory limit (-m)." << endl;
+    dispatch_semaphore_signal(coutSema);
+    return false;
+  }
+
+  blocksize = plan.blocksize;
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    if (noiselevel >= CommandLine::nlDebug)
+    {
+      cout << "Measured MB/s: Galois field " << (u64)(planner.KernelRate() / 1048576)
+           << ", hashing " << (u64)(planner.HashRate() / 1048576)
+           << ", disk " << (u64)(planner.DiskRate() / 1048576) << endl;
+    }
+    cout << "Auto-tune: block size " << plan.blocksize << ", " << plan.sourceblockcount << " source blocks, "
+         << plan.recoveryblockcount << " recovery blocks, chunk size " << plan.chunksize << ", "
+         << plan.passes << (plan.passes == 1 ? " pass" : " passes") << endl;
+    cout << "Estimated time " << (u64)(plan.seconds + 0.5) << " s, memory " << plan.memory / 1048576 << " MB" << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return true;
+}
+
 // Compute block size from block count or vice versa depending on which was
 // specified on the command line
 bool Par2Creator::ComputeBlockSizeAndBlockCount(const list<CommandLine::ExtraFile> &extrafiles)
@@ -415,8 +816,9 @@ bool Par2Creator::ComputeRecoveryBlockCount(u32 redundancy)
   return true;
 }
 
-// Determine how much recovery data can be computed on one pass
-bool Par2Creator::CalculateProcessBlockSize(size_t memorylimit)
+// Determine how much recovery data can be computed on one pass. Only the passes
+// over a part of every block can be resumed.
+bool Par2Creator::CalculateProcessBlockSize(size_t memorylimit, bool resumable)
 {
   // Are we computing any recovery blocks
   if (recoveryblockcount == 0)
@@ -425,17 +827,61 @@ bool Par2Creator::CalculateProcessBlockSize(size_t memorylimit)
   }
   else
   {
+    // The input buffer for whole blocks comes out of the same budget. It needs at least
+    // two slots; it gets more if there is memory left (see AllocateBuffers).
+    size_t inputbuffersize = AsyncBlockReader::MinimumBufferSize((size_t)blocksize);
+
     // Would single pass processing use too much memory
-    if (blocksize * recoveryblockcount > memorylimit)
+    if (blocksize * recoveryblockcount + inputbuffersize > memorylimit)
     {
-      // Pick a size that is small enough
-      chunksize = ~3 & (memorylimit / recoveryblockcount);
+      // Either compute a part of every recovery block in each pass, which reads a part of
+      // every source block per pass and all of the source data once more for the hashes,
+      // or compute some of the recovery blocks over their full length in each pass. The
+      // latter reads whole blocks, and computes the hashes in the first pass. Use it unless
+      // it takes more passes.
+      size_t partialchunksize = AsyncBlockReader::LargestChunkSize(memorylimit, recoveryblockcount);
+      u64 partialpasses = partialchunksize > 0 ? (blocksize + partialchunksize - 1) / partialchunksize + 1 : ~(u64)0;
+      u32 fullblocksperpass = memorylimit > inputbuffersize
+                            ? (u32)min((u64)recoveryblockcount, (memorylimit - inputbuffersize) / blocksize)
+                            : 0;
+      u64 fullpasses = fullblocksperpass > 0 ? (recoveryblockcount + fullblocksperpass - 1) / fullblocksperpass : ~(u64)0;
+
+      if (fullblocksperpass == 0 && partialchunksize == 0)
+      {
+        dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+        cerr << "The memory limit is too small for the recovery data." << endl;
+        dispatch_semaphore_signal(coutSema);
+        return false;
+      }
 
-      deferhashcomputation = false;
+      if (resumable && partialchunksize == 0)
+      {
+        dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+        cerr << "The memory limit is too small to resume: that needs a part of every recovery block in memory." << endl;
+        dispatch_semaphore_signal(coutSema);
+        return false;
+      }
+
+      if (fullblocksperpass > 0 && fullpasses <= partialpasses && !resumable)
+      {
+        chunksize = (size_t)blocksize;
+        outputsperpass = fullblocksperpass;
+
+        deferhashcomputation = true;
+      }
+      else
+      {
+        // Pick a size that is small enough
+        chunksize = partialchunksize;
+        outputsperpass = recoveryblockcount;
+
+        deferhashcomputation = false;
+      }
     }
     else
     {
       chunksize = (size_t)blocksize;
+      outputsperpass = recoveryblockcount;
 
       deferhashcomputation = true;
     }
@@ -444,6 +890,35 @@ bool Par2Creator::CalculateProcessBlockSize(size_t memorylimit)
   return true;
 }
 
+// Keep the part of the recovery blocks that belongs to the shard. The split only
+// depends on the recovery block count, so every shard of a set computes the same one.
+bool Par2Creator::SelectShard(void)
+{
+  if (recoveryblockcount < shardcount)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "There are fewer recovery blocks than shards." << endl;
+    dispatch_semaphore_signal(coutSema);
+    return false;
+  }
+
+  u32 first = (u32)((u64)recoveryblockcount * (shardnumber-1) / shardcount);
+  u32 limit = (u32)((u64)recoveryblockcount * shardnumber / shardcount);
+
+  // The creator packet records them, so that the merge can check that no shard is missing
+  shardfirstblock = firstrecoveryblock;
+  shardblockcount = recoveryblockcount;
+
+  firstrecoveryblock += first;
+  recoveryblockcount = limit - first;
+
+  // All of them go into one file
+  recoveryfilescheme = CommandLine::scUniform;
+  recoveryfilecount = 1;
+
+  return true;
+}
+
 // Determine how many recovery files to create.
 bool Par2Creator::ComputeRecoveryFileCount(void)
 {
@@ -610,7 +1085,10 @@ bool Par2Creator::CreateCreatorPacket(void)
   // Construct the creator packet
   creatorpacket = new CreatorPacket;
 
-  // Create the packet
+  // Create the packet; a shard also says which one it is
+  if (shardcount > 0)
+    return creatorpacket->Create(mainpacket->SetId(), shardnumber, shardcount, shardfirstblock, shardblockcount);
+
   return creatorpacket->Create(mainpacket->SetId());
 }
 
@@ -802,11 +1280,18 @@ bool Par2Creator::InitialiseOutputFiles(string par2filename)
       fileallocations[filenumber].filename = filename;
     }
     fileallocations[recoveryfilecount].filename = par2filename + ".par2";
+
+    // A shard is a single file with all of its recovery blocks, for the merge
+    if (shardcount > 0)
+    {
+      fileallocations[0].filename = par2filename + ".par2";
+      fileallocations.pop_back();
+    }
   }
 
   // Allocate the recovery files
   {
-    recoveryfiles.resize(recoveryfilecount+1);
+    recoveryfiles.resize(fileallocations.size());
 
     // Allocate packets to the output files
     {
@@ -889,8 +1374,32 @@ bool Par2Creator::InitialiseOutputFiles(string par2filename)
                                                             creatorpacket));
         offset += creatorpacket->PacketLength();
 
+        // When continuing an interrupted run, the file is already there; it has the
+        // right size if it was created for the same recovery set.
+        bool opened = false;
+        if (resumeoffset > 0 && DiskFile::FileExists(fileallocation->filename))
+        {
+          opened = recoveryfile->OpenForUpdate(fileallocation->filename);
+          if (opened && recoveryfile->FileSize() != offset)
+          {
+            recoveryfile->Close();
+            opened = false;
+          }
+        }
+        if (!opened && resumeoffset > 0)
+        {
+          // All recovery data has to be computed after all
+          resumeoffset = 0;
+          if (noiselevel > CommandLine::nlQuiet)
+          {
+            dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+            cout << "Cannot resume: " << fileallocation->filename << " is missing or has changed" << endl;
+            dispatch_semaphore_signal(coutSema);
+          }
+        }
+
         // Create the file on disk and make it the required size
-        if (!recoveryfile->Create(fileallocation->filename, offset))
+        if (!opened && !recoveryfile->Create(fileallocation->filename, offset))
           return false;
 
         ++recoveryfile;
@@ -903,10 +1412,15 @@ bool Par2Creator::InitialiseOutputFiles(string par2filename)
 }
 
 // Allocate memory buffers for reading and writing data to disk.
-bool Par2Creator::AllocateBuffers(void)
+bool Par2Creator::AllocateBuffers(size_t memorylimit)
 {
-  inputbuffer = new u8[chunksize];
-  outputbuffer = new u8[chunksize * recoveryblockcount];
+  // The input buffer has room for several chunks, so that the reads of the next
+  // source blocks can be in flight while one is processed. It gets what the output
+  // buffer leaves of the memory limit.
+  size_t outputbuffersize = chunksize * outputsperpass;
+  readslotcount = AsyncBlockReader::SlotCount(chunksize, memorylimit > outputbuffersize ? memorylimit - outputbuffersize : 0);
+  inputbuffer = AlignedBufferPool::Get(AlignedBufferPool::RoundUp(chunksize) * readslotcount);
+  outputbuffer = AlignedBufferPool::Get(outputbuffersize);
 
   if (inputbuffer == NULL || outputbuffer == NULL)
   {
@@ -940,58 +1454,59 @@ bool Par2Creator::ComputeRSMatrix(void)
 }
 
 // Read source data, process it through the RS matrix and write it to disk.
-bool Par2Creator::ProcessData(u64 blockoffset, size_t blocklength)
+bool Par2Creator::ProcessData(u64 blockoffset, size_t blocklength, u32 firstoutput, u32 outputcount)
 {
+  passfirstoutput = firstoutput;
+  passoutputcount = outputcount;
+
   // Clear the output buffer
-  memset(outputbuffer, 0, chunksize * recoveryblockcount);
+  memset(outputbuffer, 0, chunksize * outputcount);
 
   // If we have defered computation of the file hash and block crc and hashes
   // sourcefile and sourceindex will be used to update them during
-  // the main recovery block computation
+  // the main recovery block computation (the first pass, if there are several)
   vector<Par2CreatorSourceFile*>::iterator sourcefile = sourcefiles.begin();
   u32 sourceindex = 0;
 
-  vector<DataBlock>::iterator sourceblock;
-  u32 inputblock;
+  // The reader keeps the reads for the next source blocks in flight, and takes
+  // the files from the pool as needed.
+  vector<DataBlock*> inputblocks;
+  for (vector<DataBlock>::iterator sourceblock = sourceblocks.begin(); sourceblock != sourceblocks.end(); ++sourceblock)
+    inputblocks.push_back(&*sourceblock);
 
-  DiskFile *lastopenfile = NULL;
+  AsyncBlockReader reader;
+  if (!reader.Start(inputblocks, blockoffset, blocklength, inputbuffer, AlignedBufferPool::RoundUp(chunksize), readslotcount,
+                    0, mappedinput))
+    return false;
 
   // For each input block
-  for ((sourceblock=sourceblocks.begin()),(inputblock=0);
-       sourceblock != sourceblocks.end();
-       ++sourceblock, ++inputblock)
+  for (u32 inputblock=0; inputblock<sourceblockcount; inputblock++)
   {
-    // Are we reading from a new file?
-    if (lastopenfile != (*sourceblock).GetDiskFile())
-    {
-      // Close the last file
-      if (lastopenfile != NULL)
-      {
-        lastopenfile->Close();
-      }
-
-      // Open the new file
-      lastopenfile = (*sourceblock).GetDiskFile();
-      if (!lastopenfile->Open(true))
-      {
-        return false;
-      }
-    }
-
-    // Read data from the current input block
-    if (!sourceblock->ReadData(blockoffset, blocklength, inputbuffer))
+    // Wait for the data of the current input block
+    const void *lInput = reader.Next();
+    if (lInput == NULL)
       return false;
 
-    if (deferhashcomputation)
+    if (deferhashcomputation && firstoutput == 0)
     {
       assert(blockoffset == 0 && blocklength == blocksize);
       assert(sourcefile != sourcefiles.end());
 
-      (*sourcefile)->UpdateHashes(sourceindex, inputbuffer, blocklength);
+      (*sourcefile)->UpdateHashes(sourceindex, lInput, blocklength);
     }
 
-	  // Function that does the subtask in multiple threads if appropriate.
-    this->CreateParityBlocks (blocklength, inputblock);
+    // A block of zeroes adds nothing to the recovery blocks
+    if (!ZeroBlock::IsZero(lInput, blocklength))
+    {
+      // Function that does the subtask in multiple threads if appropriate.
+      this->CreateParityBlocks (blocklength, inputblock, lInput);
+    }
+    else if (noiselevel > CommandLine::nlQuiet)
+    {
+      dispatch_semaphore_wait(genericSema, DISPATCH_TIME_FOREVER);
+      progress += (u64)blocklength * passoutputcount;
+      dispatch_semaphore_signal(genericSema);
+    }
 	
     // Work out which source file the next block belongs to
     if (++sourceindex >= (*sourcefile)->BlockCount())
@@ -1001,11 +1516,9 @@ bool Par2Creator::ProcessData(u64 blockoffset, size_t blocklength)
     }
   }
 
-  // Close the last file
-  if (lastopenfile != NULL)
-  {
-    lastopenfile->Close();
-  }
+  // Give the files back to the pool
+  if (!reader.Finish())
+    return false;
 
   if (noiselevel > CommandLine::nlQuiet)
   {
@@ -1014,28 +1527,21 @@ bool Par2Creator::ProcessData(u64 blockoffset, size_t blocklength)
     dispatch_semaphore_signal(coutSema);
   }
 
-  // For each output block
-  for (u32 outputblock=0; outputblock<recoveryblockcount;outputblock++)
-  {
-    // Select the appropriate part of the output buffer
-    char *outbuf = &((char*)outputbuffer)[chunksize * outputblock];
-
-    // Write the data to the recovery packet
-    if (!recoverypackets[outputblock].WriteData(blockoffset, blocklength, outbuf))
-      return false;
-  }
+  // Write the data to the recovery packets
+  if (!WriteRecoveryData(blockoffset, blocklength, firstoutput, outputcount))
+    return false;
 
   if (noiselevel > CommandLine::nlQuiet)
   {
     dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
-    cout << "Wrote " << recoveryblockcount * blocklength << " bytes to disk" << endl;
+    cout << "Wrote " << (u64)outputcount * blocklength << " bytes to disk" << endl;
     dispatch_semaphore_signal(coutSema);
   }
 
   return true;
 }
 
-void Par2Creator::CreateParityBlocks (size_t blocklength, u32 inputindex)
+void Par2Creator::CreateParityBlocks (size_t blocklength, u32 inputindex, const void *inputdata)
 {
 	// Used from within ProcessData.
 	/*
@@ -1052,23 +1558,24 @@ void Par2Creator::CreateParityBlocks (size_t blocklength, u32 inputindex)
 	 * protected using a simple semaphore.
 	 * This function (RepairMissingBlocks) exits when all dispatched GCD blocks have finished.
    */
-	if (this->recoveryblockcount == 0)
+	if (this->passoutputcount == 0)
 		return;		// Nothing to do, actually
 	
   const int cNumBlocksPerThread = 1;   // Seems to give best results
-  int lNumGCDDispatches = ((this->recoveryblockcount - 1) / cNumBlocksPerThread) + 1;
+  int lNumGCDDispatches = ((this->passoutputcount - 1) / cNumBlocksPerThread) + 1;
 	
   // dispatch_apply sees to it that the blocks are posted simultaneously, and the global queue
   // executes them simultaneously if possible. dispatch_apply exists after all block have been executed.
   dispatch_apply(lNumGCDDispatches, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
                  ^(size_t lCurrent){
-                   this->CreateParityBlockRange (blocklength, inputindex, lCurrent * cNumBlocksPerThread,
+                   this->CreateParityBlockRange (blocklength, inputindex, inputdata, lCurrent * cNumBlocksPerThread,
                                                  (lCurrent + 1) * cNumBlocksPerThread);
                  });
 }
 
 //-----------------------------------------------------------------------------
-void Par2Creator::CreateParityBlockRange (size_t blocklength, u32 inputindex, u32 aStartBlockNo, u32 aEndBlockNo)
+void Par2Creator::CreateParityBlockRange (size_t blocklength, u32 inputindex, const void *inputdata,
+                                          u32 aStartBlockNo, u32 aEndBlockNo)
 {
 	// This function runs in multiple threads.
 	// For each output block
@@ -1078,7 +1585,7 @@ void Par2Creator::CreateParityBlockRange (size_t blocklength, u32 inputindex, u3
 		void *outbuf = &((u8*)outputbuffer)[chunksize * outputindex];
 		
 		// Process the data
-		rs.Process(blocklength, inputindex, inputbuffer, outputindex, outbuf);
+		rs.Process(blocklength, inputindex, inputdata, passfirstoutput + outputindex, outbuf);
 		
 		if (noiselevel > CommandLine::nlQuiet)
 		{
@@ -1101,20 +1608,111 @@ void Par2Creator::CreateParityBlockRange (size_t blocklength, u32 inputindex, u3
 	}
 }
 
-// Finish computation of the recovery packets and write the headers to disk.
-bool Par2Creator::WriteRecoveryPacketHeaders(void)
+// A write of recovery data: where it goes, and what
+typedef pair<u64, struct iovec> RecoveryWrite;
+
+static bool CompareRecoveryWrites(const RecoveryWrite &left, const RecoveryWrite &right)
 {
-  // For each recovery packet
-  for (vector<RecoveryPacket>::iterator recoverypacket = recoverypackets.begin();
-       recoverypacket != recoverypackets.end();
-       ++recoverypacket)
+  return left.first < right.first;
+}
+
+// Hash and write the recovery data of a pass. The hash of each packet is independent of
+// the others, so the packets are hashed in parallel. The data for one recovery file is
+// written by one thread, with a gathered write for each consecutive range, and the files
+// are written in parallel.
+// In the pass that starts at the beginning of the blocks, the headers are written along
+// with the data, so that with whole blocks a recovery file is one consecutive range. The
+// headers are written again once their hash is known.
+bool Par2Creator::WriteRecoveryData(u64 blockoffset, size_t blocklength, u32 firstoutput, u32 outputcount)
+{
+  dispatch_queue_t lQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+
+  dispatch_apply(outputcount, lQueue, ^(size_t aIndex){
+    this->recoverypackets[firstoutput + aIndex].HashData(&((u8*)this->outputbuffer)[this->chunksize * aIndex],
+                                                         blocklength);
+  });
+
+  // Sort out what goes to which file
+  vector<vector<RecoveryWrite> > lWrites(recoveryfiles.size());
+  for (u32 outputblock = 0; outputblock < outputcount; outputblock++)
   {
-    // Finish the packet header and write it to disk
-    if (!recoverypacket->WriteHeader())
-      return false;
+    const RecoveryPacket &packet = recoverypackets[firstoutput + outputblock];
+    vector<RecoveryWrite> &lFileWrites = lWrites[packet.GetDiskFile() - &recoveryfiles[0]];
+
+    struct iovec lBuffer;
+    if (blockoffset == 0)
+    {
+      lBuffer.iov_base = const_cast<RECOVERYBLOCKPACKET*>(&packet.Header());
+      lBuffer.iov_len = sizeof(RECOVERYBLOCKPACKET);
+      lFileWrites.push_back(RecoveryWrite(packet.Offset(), lBuffer));
+    }
+    lBuffer.iov_base = &((u8*)outputbuffer)[chunksize * outputblock];
+    lBuffer.iov_len = blocklength;
+    lFileWrites.push_back(RecoveryWrite(packet.Offset() + sizeof(RECOVERYBLOCKPACKET) + blockoffset, lBuffer));
   }
 
-  return true;
+  // The stack-based vector cannot be used in the block as such
+  vector<vector<RecoveryWrite> > *lAllWrites = &lWrites;
+
+  __block bool lSucceeded = true;
+  dispatch_apply(recoveryfiles.size(), lQueue, ^(size_t aFile){
+    vector<RecoveryWrite> &lFileWrites = (*lAllWrites)[aFile];
+    sort(lFileWrites.begin(), lFileWrites.end(), CompareRecoveryWrites);
+
+    size_t lFirst = 0;
+    while (lFirst < lFileWrites.size())
+    {
+      // Find the writes that follow on each other
+      vector<struct iovec> lRun(1, lFileWrites[lFirst].second);
+      u64 lNext = lFileWrites[lFirst].first + lFileWrites[lFirst].second.iov_len;
+      size_t lEnd = lFirst + 1;
+      while (lEnd < lFileWrites.size() && lFileWrites[lEnd].first == lNext)
+      {
+        lRun.push_back(lFileWrites[lEnd].second);
+        lNext += lFileWrites[lEnd].second.iov_len;
+        lEnd++;
+      }
+
+      if (!this->recoveryfiles[aFile].WriteV(lFileWrites[lFirst].first, &lRun[0], (u32)lRun.size()))
+      {
+        dispatch_semaphore_wait(this->genericSema, DISPATCH_TIME_FOREVER);
+        lSucceeded = false;
+        dispatch_semaphore_signal(this->genericSema);
+        break;
+      }
+
+      lFirst = lEnd;
+    }
+  });
+
+  return lSucceeded;
+}
+
+// Finish computation of the recovery packets and write the headers to disk.
+bool Par2Creator::WriteRecoveryPacketHeaders(void)
+{
+  // The files are written in parallel, the headers in one file by one thread
+  __block bool lSucceeded = true;
+  dispatch_apply(recoveryfiles.size(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                 ^(size_t aFile){
+                   // For each recovery packet in the file
+                   for (vector<RecoveryPacket>::iterator recoverypacket = this->recoverypackets.begin();
+                        recoverypacket != this->recoverypackets.end();
+                        ++recoverypacket)
+                   {
+                     // Finish the packet header and write it to disk
+                     if (recoverypacket->GetDiskFile() == &this->recoveryfiles[aFile] &&
+                         !recoverypacket->WriteHeader())
+                     {
+                       dispatch_semaphore_wait(this->genericSema, DISPATCH_TIME_FOREVER);
+                       lSucceeded = false;
+                       dispatch_semaphore_signal(this->genericSema);
+                       break;
+                     }
+                   }
+                 });
+
+  return lSucceeded;
 }
 
 bool Par2Creator::FinishFileHashComputation(void)
@@ -1156,21 +1754,82 @@ bool Par2Creator::FinishCriticalPackets(void)
 }
 
 // Write all other critical packets to disk.
-bool Par2Creator::WriteCriticalPackets(void)
+static bool CompareCriticalPacketEntries(const CriticalPacketEntry *left, const CriticalPacketEntry *right)
 {
-  list<CriticalPacketEntry>::const_iterator packetentry = criticalpacketentries.begin();
+  return left->Offset() < right->Offset();
+}
 
-  // For each critical packet
-  while (packetentry != criticalpacketentries.end())
+// Every recovery file has copies of all critical packets, so with many source files there
+// are very many small packets. The packets in one recovery file are written by one thread:
+// the packets of each consecutive range are copied into one buffer, which is written with
+// one call. The files are written in parallel.
+bool Par2Creator::WriteCriticalPackets(void)
+{
+  // Sort out what goes to which file
+  vector<vector<const CriticalPacketEntry*> > lEntries(recoveryfiles.size());
+  for (list<CriticalPacketEntry>::const_iterator packetentry = criticalpacketentries.begin();
+       packetentry != criticalpacketentries.end();
+       ++packetentry)
   {
-    // Write it to disk
-    if (!packetentry->WritePacket())
-      return false;
-
-    ++packetentry;
+    lEntries[packetentry->GetDiskFile() - &recoveryfiles[0]].push_back(&*packetentry);
   }
 
-  return true;
+  // The stack-based vector cannot be used in the block as such
+  vector<vector<const CriticalPacketEntry*> > *lAllEntries = &lEntries;
+
+  __block bool lSucceeded = true;
+  dispatch_apply(recoveryfiles.size(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                 ^(size_t aFile){
+    vector<const CriticalPacketEntry*> &lFileEntries = (*lAllEntries)[aFile];
+    sort(lFileEntries.begin(), lFileEntries.end(), CompareCriticalPacketEntries);
+
+    size_t lFirst = 0;
+    while (lFirst < lFileEntries.size())
+    {
+      // Find the packets that follow on each other
+      u64 lNext = lFileEntries[lFirst]->Offset() + lFileEntries[lFirst]->PacketLength();
+      size_t lEnd = lFirst + 1;
+      while (lEnd < lFileEntries.size() && lFileEntries[lEnd]->Offset() == lNext)
+      {
+        lNext += lFileEntries[lEnd]->PacketLength();
+        lEnd++;
+      }
+
+      bool lOK = true;
+      u64 lLength = lNext - lFileEntries[lFirst]->Offset();
+      u8 *lBuffer = (u8 *)malloc((size_t)lLength);
+      if (lBuffer != 0)
+      {
+        u8 *lTo = lBuffer;
+        for (size_t i = lFirst; i < lEnd; i++)
+        {
+          lTo += lFileEntries[i]->CopyPacket(lTo);
+        }
+        lOK = this->recoveryfiles[aFile].Write(lFileEntries[lFirst]->Offset(), lBuffer, (size_t)lLength);
+        free(lBuffer);
+      }
+      else
+      {
+        // No memory for the whole range; write the packets one by one
+        for (size_t i = lFirst; lOK && i < lEnd; i++)
+        {
+          lOK = lFileEntries[i]->WritePacket();
+        }
+      }
+
+      if (!lOK)
+      {
+        dispatch_semaphore_wait(this->genericSema, DISPATCH_TIME_FOREVER);
+        lSucceeded = false;
+        dispatch_semaphore_signal(this->genericSema);
+        break;
+      }
+
+      lFirst = lEnd;
+    }
+  });
+
+  return lSucceeded;
 }
 
 // Close all files.
@@ -1194,3 +1853,93 @@ bool Par2Creator::CloseFiles(void)
 
   return true;
 }
+
+// The checkpoint is only valid for the same recovery set, computed from the same
+// source data into the same recovery files.
+void Par2Creator::LoadCheckpoint(string par2filename)
+{
+  MD5Context context;
+  context.Update(&mainpacket->SetId(), sizeof(MD5Hash));
+  leu64 values[7];
+  values[0] = blocksize;
+  values[1] = sourceblockcount;
+  values[2] = recoveryblockcount;
+  values[3] = firstrecoveryblock;
+  values[4] = recoveryfilecount;
+  values[5] = (u64)recoveryfilescheme;
+  values[6] = MD5Context::savedsize;
+  context.Update(values, sizeof(values));
+  context.Update(par2filename.c_str(), par2filename.size());
+
+  // The set id covers the names and sizes of the source files, but not all of
+  // their contents. The full hashes do, but they are known only if their
+  // computation was not deferred; in that case all data is processed in one
+  // pass, and there is nothing to resume.
+  for (vector<Par2CreatorSourceFile*>::const_iterator sourcefile = sourcefiles.begin();
+       sourcefile != sourcefiles.end();
+       ++sourcefile)
+  {
+    context.Update(&(*sourcefile)->HashFull(), sizeof(MD5Hash));
+  }
+
+  MD5Hash identity;
+  context.Final(identity);
+  checkpoint.SetFile(par2filename + ".resume", identity);
+
+  u64 offset;
+  if (!deferhashcomputation &&
+      recoveryblockcount > 0 &&
+      checkpoint.Load(offset, resumestate) &&
+      offset < blocksize &&
+      resumestate.size() == recoveryblockcount * MD5Context::savedsize)
+  {
+    // Only take it if every saved context is a possible one
+    MD5Context context;
+    u32 outputblock = 0;
+    while (outputblock < recoveryblockcount && context.Load(&resumestate[outputblock * MD5Context::savedsize]))
+      outputblock++;
+
+    if (outputblock == recoveryblockcount)
+      resumeoffset = offset;
+  }
+}
+
+// Continue the hashes of the recovery packets where the checkpoint left them
+void Par2Creator::RestoreCheckpointState(void)
+{
+  for (u32 outputblock=0; outputblock<recoveryblockcount; outputblock++)
+  {
+    MD5Context context;
+    context.Load(&resumestate[outputblock * MD5Context::savedsize]);
+    recoverypackets[outputblock].SetHashContext(context);
+  }
+  resumestate.clear();
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Resuming at offset " << resumeoffset << " of " << blocksize << " in each block" << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+}
+
+// Record that the recovery data up to blockoffset is on disk
+bool Par2Creator::SaveCheckpoint(u64 blockoffset)
+{
+  // The checkpoint must not get ahead of the data
+  for (vector<DiskFile>::iterator recoveryfile = recoveryfiles.begin();
+       recoveryfile != recoveryfiles.end();
+       ++recoveryfile)
+  {
+    if (!recoveryfile->Sync())
+      return false;
+  }
+
+  vector<u8> state(recoveryblockcount * MD5Context::savedsize);
+  for (u32 outputblock=0; outputblock<recoveryblockcount; outputblock++)
+  {
+    recoverypackets[outputblock].HashContext().Save(&state[outputblock * MD5Context::savedsize]);
+  }
+
+  return checkpoint.Save(blockoffset, state);
+}
@@ -36,18 +36,29 @@ public:
   Result Process(const CommandLine &commandline);
 
 protected:
+  // Create from the standard input instead of from files (--stream). The data is
+  // read only once, so all of the recovery blocks are computed in memory.
+  Result ProcessStream(const CommandLine &commandline);
+
   // Steps in the creation process:
 
   // Compute block size from block count or vice versa depending on which was
   // specified on the command line
   bool ComputeBlockSizeAndBlockCount(const list<CommandLine::ExtraFile> &extrafiles);
 
+  // With --auto-tune, choose the block size with the Par2CreatorPlanner
+  bool AutoTuneBlockSize(const list<CommandLine::ExtraFile> &extrafiles, u32 redundancy, size_t memorylimit);
+
   // Determine how many recovery blocks to create based on the source block
   // count and the requested level of redundancy.
   bool ComputeRecoveryBlockCount(u32 redundancy);
 
-  // Determine how much recovery data can be computed on one pass
-  bool CalculateProcessBlockSize(size_t memorylimit);
+  // Determine how much recovery data can be computed on one pass. With resumable,
+  // in passes that a checkpoint can be saved after.
+  bool CalculateProcessBlockSize(size_t memorylimit, bool resumable);
+
+  // With --shard: keep only the recovery blocks of this shard
+  bool SelectShard(void);
 
   // Determine how many recovery files to create.
   bool ComputeRecoveryFileCount(void);
@@ -70,13 +81,17 @@ protected:
   bool InitialiseOutputFiles(string par2filename);
 
   // Allocate memory buffers for reading and writing data to disk.
-  bool AllocateBuffers(void);
+  bool AllocateBuffers(size_t memorylimit);
 
   // Compute the Reed Solomon matrix
   bool ComputeRSMatrix(void);
 
   // Read source data, process it through the RS matrix and write it to disk.
-  bool ProcessData(u64 blockoffset, size_t blocklength);
+  // Only the outputcount recovery blocks from firstoutput on are computed.
+  bool ProcessData(u64 blockoffset, size_t blocklength, u32 firstoutput, u32 outputcount);
+
+  // Hash the recovery data computed by ProcessData, and write it to disk.
+  bool WriteRecoveryData(u64 blockoffset, size_t blocklength, u32 firstoutput, u32 outputcount);
 
   // Finish computation of the recovery packets and write the headers to disk.
   bool WriteRecoveryPacketHeaders(void);
@@ -93,19 +108,34 @@ protected:
   // Close all files.
   bool CloseFiles(void);
 
+  // With --resume: pick up the checkpoint of an interrupted run of the same command,
+  // and record one after each pass.
+  void LoadCheckpoint(string par2filename);
+  void RestoreCheckpointState(void);
+  bool SaveCheckpoint(u64 blockoffset);
+
   // Submethods of ProcessData
-  void CreateParityBlocks (size_t blocklength, u32 inputindex);
+  void CreateParityBlocks (size_t blocklength, u32 inputindex, const void *inputdata);
   // In the next function, aEndBlockNo is the last block number + 1.
-  void CreateParityBlockRange (size_t blocklength, u32 inputindex, u32 aStartBlockNo, u32 aEndBlockNo);
+  void CreateParityBlockRange (size_t blocklength, u32 inputindex, const void *inputdata,
+                               u32 aStartBlockNo, u32 aEndBlockNo);
 protected:
   CommandLine::NoiseLevel noiselevel; // How noisy we should be
 
   u64 blocksize;      // The size of each block.
   size_t chunksize;   // How much of each block will be processed at a 
                       // time (due to memory constraints).
-
-  void *inputbuffer;  // chunksize
+  u32 outputsperpass; // How many recovery blocks are computed at a time. When
+                      // this is less than recoveryblockcount, the chunks are
+                      // whole blocks, and each pass computes some of the
+                      // recovery blocks.
+  u32 passfirstoutput; // The recovery blocks of the current pass
+  u32 passoutputcount;
+
+  void *inputbuffer;  // readslotcount page aligned chunks
   void *outputbuffer; // chunksize * recoveryblockcount
+  u32 readslotcount;  // How many source blocks can be read ahead
+  bool mappedinput;   // Process source data in place in mapped files
   
   u32 sourcefilecount;   // Number of source files for which recovery data will be computed.
   u32 sourceblockcount;  // Total number of data blocks that the source files will be
@@ -122,6 +152,11 @@ protected:
 
   u32 firstrecoveryblock; // The lowest exponent value to use for the recovery blocks.
 
+  u32 shardnumber;        // With --shard, which part of the recovery blocks is computed
+  u32 shardcount;         // here (1 .. shardcount); otherwise shardcount is 0.
+  u32 shardfirstblock;    // With --shard, the recovery blocks of all shards together
+  u32 shardblockcount;
+
   MainPacket    *mainpacket;    // The main packet
   CreatorPacket *creatorpacket; // The creator packet
 
@@ -149,6 +184,11 @@ protected:
                              // in one pass, then we can defer the computation of
                              // the full file hash and block crc and hashes until
                              // the recovery data is computed.
+
+  Checkpoint checkpoint;     // Only set with --resume
+  u64 resumeoffset;          // Where the first pass starts; not 0 when continuing from
+                             // a checkpoint.
+  vector<u8> resumestate;    // The hash contexts of the recovery packets at resumeoffset
 };
 
 #endif // __PAR2CREATOR_H__
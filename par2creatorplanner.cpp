@@ -0,0 +1,262 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#include "par2cmdline.h"
+
+#include <sys/time.h>
+
+// The size of the buffers for the measurements, and how long each one takes at least
+#define CalibrationSize (1024 * 1024)
+#define CalibrationTime 0.05
+// How much of a source file is read to measure the disk. If less than 1 MB can be read,
+// the default rate is used.
+#define CalibrationReadSize (16 * 1024 * 1024)
+#define DefaultDiskRate (100.0 * 1048576)
+// The fewest source blocks a plan may have, if the files allow it; the default of -b
+#define MinimumSourceBlockCount 2000
+
+// The packets for a source file, apart from its name and its verification entries
+#define FileOverhead (sizeof(FILEDESCRIPTIONPACKET) + sizeof(FILEVERIFICATIONPACKET) + sizeof(MD5Hash) + 64)
+
+static double Now(void)
+{
+  struct timeval lNow;
+  gettimeofday(&lNow, NULL);
+  return (double)lNow.tv_sec + (double)lNow.tv_usec / 1000000.0;
+}
+
+Par2CreatorPlanner::Par2CreatorPlanner(void)
+: mKernelRate(0)
+, mHashRate(0)
+, mDiskRate(DefaultDiskRate)
+{
+}
+
+void Par2CreatorPlanner::Calibrate(const list<CommandLine::ExtraFile> &extrafiles)
+{
+  // Data that is not all zeroes, which would be skipped
+  u8 *lInput = new u8[CalibrationSize];
+  for (size_t i = 0; i < CalibrationSize; i++)
+  {
+    lInput[i] = (u8)(i * 131 + 7);
+  }
+
+  // The multiplications run on all processors at once, as in Par2Creator::CreateParityBlocks
+  long lProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t lThreads = lProcessors > 0 ? (size_t)lProcessors : 1;
+  u8 *lOutput = new u8[CalibrationSize * lThreads];
+  memset(lOutput, 0, CalibrationSize * lThreads);
+
+  ReedSolomon<Galois16> rs;
+  ReedSolomon<Galois16> *lRS = &rs;
+  u64 lDone = 0;
+  double lStart = Now();
+  double lElapsed;
+  do
+  {
+    dispatch_apply(lThreads, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t aIndex){
+      lRS->MultiplyAdd(Galois16((Galois16::ValueType)(aIndex + 2)), CalibrationSize, lInput,
+                       &lOutput[aIndex * CalibrationSize]);
+    });
+    lDone += CalibrationSize * lThreads;
+    lElapsed = Now() - lStart;
+  } while (lElapsed < CalibrationTime);
+  mKernelRate = lDone / lElapsed;
+
+  // The block hashes need an MD5 and a CRC of the data
+  lDone = 0;
+  lStart = Now();
+  do
+  {
+    MD5Context lContext;
+    lContext.Update(lInput, CalibrationSize);
+    MD5Hash lHash;
+    lContext.Final(lHash);
+    CRCUpdateBlock(~0, CalibrationSize, lInput);
+    lDone += CalibrationSize;
+    lElapsed = Now() - lStart;
+  } while (lElapsed < CalibrationTime);
+  mHashRate = lDone / lElapsed;
+
+  delete [] lOutput;
+
+  // Read the start of the largest source file
+  const CommandLine::ExtraFile *lLargest = 0;
+  for (list<CommandLine::ExtraFile>::const_iterator i = extrafiles.begin(); i != extrafiles.end(); ++i)
+  {
+    if (lLargest == 0 || lLargest->FileSize() < i->FileSize())
+      lLargest = &*i;
+  }
+
+  if (lLargest != 0 && lLargest->FileSize() >= CalibrationSize)
+  {
+    DiskFile lFile;
+    if (lFile.Open(lLargest->FileName(), lLargest->FileSize(), false))
+    {
+      u64 lLength = min(lLargest->FileSize(), (u64)CalibrationReadSize);
+      lDone = 0;
+      lStart = Now();
+      while (lDone + CalibrationSize <= lLength && lFile.Read(lDone, lInput, CalibrationSize))
+      {
+        lDone += CalibrationSize;
+      }
+      lElapsed = Now() - lStart;
+      lFile.Close();
+
+      if (lDone > 0 && lElapsed > 0)
+        mDiskRate = lDone / lElapsed;
+    }
+  }
+
+  delete [] lInput;
+}
+
+bool Par2CreatorPlanner::Estimate(const list<CommandLine::ExtraFile> &extrafiles, u64 blocksize, u32 redundancy,
+                                  u32 recoveryblockcount, size_t memorylimit, Plan &plan) const
+{
+  u64 totalsize = 0;
+  u64 count = 0;
+  for (list<CommandLine::ExtraFile>::const_iterator i = extrafiles.begin(); i != extrafiles.end(); ++i)
+  {
+    totalsize += i->FileSize();
+    count += (i->FileSize() + blocksize-1) / blocksize;
+  }
+
+  if (count == 0 || count > 32768)
+    return false;
+
+  // The recovery block count as Par2Creator::ComputeRecoveryBlockCount works it out. The
+  // rounding must not take it below the requested redundancy.
+  u64 recovery = recoveryblockcount;
+  if (recovery == 0 && redundancy > 0)
+  {
+    recovery = max((count * redundancy + 50) / 100, (u64)1);
+    if (recovery * blocksize * 100 < (u64)redundancy * totalsize)
+      return false;
+  }
+  if (recovery > 32768)
+    return false;
+
+  // Scanning a file for its blocks needs two blocks of memory
+  if (2 * blocksize > memorylimit)
+    return false;
+
+  // The passes as Par2Creator::CalculateProcessBlockSize works them out
+  size_t chunksize = (size_t)blocksize;
+  u64 outputs = recovery * blocksize;
+  u64 passes = 1;
+  size_t inputbuffersize = AsyncBlockReader::MinimumBufferSize(chunksize);
+  if (recovery > 0 && outputs + inputbuffersize > memorylimit)
+  {
+    size_t partialchunksize = AsyncBlockReader::LargestChunkSize(memorylimit, (u32)recovery);
+    u64 partialpasses = partialchunksize > 0 ? (blocksize + partialchunksize - 1) / partialchunksize + 1 : ~(u64)0;
+    u64 fullblocksperpass = memorylimit > inputbuffersize ? min(recovery, (memorylimit - inputbuffersize) / blocksize) : 0;
+    u64 fullpasses = fullblocksperpass > 0 ? (recovery + fullblocksperpass - 1) / fullblocksperpass : ~(u64)0;
+
+    if (fullblocksperpass > 0 && fullpasses <= partialpasses)
+    {
+      outputs = fullblocksperpass * blocksize;
+      passes = fullpasses;
+    }
+    else if (partialchunksize > 0)
+    {
+      chunksize = partialchunksize;
+      outputs = recovery * chunksize;
+      passes = partialpasses;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  // Reading overlaps with the computation; the recovery data and the critical packets
+  // (a copy in every recovery file) are written at the end.
+  u32 recoveryfiles = 1;
+  for (u64 blocks = recovery; blocks > 1; blocks >>= 1)
+  {
+    recoveryfiles++;
+  }
+  double critical = (double)extrafiles.size() * FileOverhead + (double)count * sizeof(FILEVERIFICATIONENTRY);
+
+  double reading = (double)passes * totalsize / mDiskRate;
+  double hashing = 2.0 * totalsize / mHashRate;      // The block hashes and the file hash
+  double kernel = (double)count * blocksize * recovery / mKernelRate;
+  double writing = ((double)recovery * (blocksize + sizeof(RECOVERYBLOCKPACKET)) + critical * recoveryfiles) / mDiskRate;
+
+  plan.blocksize = blocksize;
+  plan.sourceblockcount = (u32)count;
+  plan.recoveryblockcount = (u32)recovery;
+  plan.chunksize = chunksize;
+  plan.passes = (u32)passes;
+  plan.memory = outputs + (u64)AlignedBufferPool::RoundUp(chunksize) *
+                AsyncBlockReader::SlotCount(chunksize, memorylimit > outputs ? (size_t)(memorylimit - outputs) : 0);
+  plan.seconds = max(reading, hashing + kernel) + writing;
+
+  return true;
+}
+
+bool Par2CreatorPlanner::Choose(const list<CommandLine::ExtraFile> &extrafiles, u32 redundancy, u32 recoveryblockcount,
+                                size_t memorylimit, Plan &plan) const
+{
+  u64 largestsize = 0;
+  for (list<CommandLine::ExtraFile>::const_iterator i = extrafiles.begin(); i != extrafiles.end(); ++i)
+  {
+    largestsize = max(largestsize, i->FileSize());
+  }
+
+  // Powers of two and the sizes halfway between them, and the size of the largest
+  // file, which gives one block per file
+  vector<u64> candidates;
+  for (u64 blocksize = 4; blocksize < largestsize; blocksize *= 2)
+  {
+    candidates.push_back(blocksize);
+    if (blocksize >= 8)
+      candidates.push_back(blocksize + blocksize / 2);
+  }
+  candidates.push_back((largestsize + 3) & ~(u64)3);
+
+  vector<Plan> plans;
+  u32 mostblocks = 0;
+  for (vector<u64>::const_iterator blocksize = candidates.begin(); blocksize != candidates.end(); ++blocksize)
+  {
+    Plan candidate;
+    if (Estimate(extrafiles, *blocksize, redundancy, recoveryblockcount, memorylimit, candidate))
+    {
+      plans.push_back(candidate);
+      mostblocks = max(mostblocks, candidate.sourceblockcount);
+    }
+  }
+
+  // Fewer, larger blocks are always faster, but each damaged spot then costs a larger
+  // block, so the set survives less damage. Keep at least the default number of source
+  // blocks, or as many as the files and the memory limit allow.
+  u32 fewestblocks = min(mostblocks, (u32)MinimumSourceBlockCount);
+
+  bool found = false;
+  for (vector<Plan>::const_iterator candidate = plans.begin(); candidate != plans.end(); ++candidate)
+  {
+    if (candidate->sourceblockcount >= fewestblocks && (!found || candidate->seconds < plan.seconds))
+    {
+      plan = *candidate;
+      found = true;
+    }
+  }
+
+  return found;
+}
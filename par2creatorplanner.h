@@ -0,0 +1,76 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#ifndef __PAR2CREATORPLANNER_H__
+#define __PAR2CREATORPLANNER_H__
+
+// The Par2CreatorPlanner chooses the block size for --auto-tune. The time to create depends
+// heavily on it: the Galois field work grows with the number of source blocks times the
+// number of recovery blocks, while the padding of the last block of each file, and the
+// memory for scanning, grow with the block size. The planner measures how fast this machine
+// multiplies in the Galois field, hashes, and reads the source files. With those rates it
+// estimates the time and the peak memory of a number of candidate block sizes, with the
+// chunk size and the number of passes that Par2Creator would use for each. The fastest plan
+// that gives the requested redundancy and fits in the memory limit is chosen, among those
+// with at least as many source blocks as the default of -b (2000), if the files allow that.
+// Without that floor the fastest plan would always have the fewest blocks, and a few
+// scattered bad bytes would be enough to make the set unrepairable.
+
+class Par2CreatorPlanner
+{
+public:
+  struct Plan
+  {
+    u64    blocksize;
+    u32    sourceblockcount;
+    u32    recoveryblockcount;
+    size_t chunksize;           // How much of each block is processed per pass
+    u32    passes;              // How often the source data is read
+    u64    memory;              // Estimated peak memory for the buffers
+    double seconds;             // Estimated time
+  };
+
+  Par2CreatorPlanner(void);
+
+  // Measure the throughput of this machine. The largest source file is read to measure
+  // the disk; if it is too small for that, a default rate is assumed.
+  void Calibrate(const list<CommandLine::ExtraFile> &extrafiles);
+
+  // Find the fastest plan with enough source blocks. If recoveryblockcount is not 0 it is
+  // fixed, otherwise it follows from the redundancy (in percent). Returns false if no plan
+  // fits.
+  bool Choose(const list<CommandLine::ExtraFile> &extrafiles, u32 redundancy, u32 recoveryblockcount,
+              size_t memorylimit, Plan &plan) const;
+
+  // The measured rates, in bytes per second
+  double KernelRate(void) const {return mKernelRate;}
+  double HashRate(void) const   {return mHashRate;}
+  double DiskRate(void) const   {return mDiskRate;}
+
+protected:
+  // Work out the plan for one block size; false if it is not possible
+  bool Estimate(const list<CommandLine::ExtraFile> &extrafiles, u64 blocksize, u32 redundancy,
+                u32 recoveryblockcount, size_t memorylimit, Plan &plan) const;
+
+protected:
+  double mKernelRate;   // Source bytes times recovery blocks, all threads together
+  double mHashRate;     // MD5 and CRC of the same data, one thread
+  double mDiskRate;     // Reading the source files; also used for writing
+};
+
+#endif // __PAR2CREATORPLANNER_H__
@@ -19,6 +19,10 @@
 
 #include "par2cmdline.h"
 
+// How much of a large file is read and hashed at a time. Files larger than this, with
+// blocks of at most half this size, are hashed by several threads.
+#define HashBatchSize (16*1024*1024)
+
 Par2CreatorSourceFile::Par2CreatorSourceFile(void)
 {
   descriptionpacket = 0;
@@ -53,21 +57,7 @@ bool Par2CreatorSourceFile::Open(CommandLine::NoiseLevel noiselevel, const Comma
   blockcount = (u32)((filesize + blocksize-1) / blocksize);
   
   // Determine what filename to record in the PAR2 files
-  string::size_type where;
-  if (string::npos != (where = diskfilename.find_last_of('\\')) ||
-      string::npos != (where = diskfilename.find_last_of('/')))
-  {
-    parfilename = diskfilename.substr(where+1);
-  }
-  else
-  {
-    parfilename = diskfilename;
-  }
-
-  // On the Mac parfilename is encoded with UTF-8. However, it seems that
-  // Windows' Quickpar can only deal with ISO Latin 1. So be kind to them, 
-  // and store the parfilename in that encoding.
-  parfilename = DiskFile::Par2Representation (parfilename);
+  ComputeParFileName();
 
   // Create the Description and Verification packets
   descriptionpacket = new DescriptionPacket;
@@ -121,6 +111,14 @@ bool Par2CreatorSourceFile::Open(CommandLine::NoiseLevel noiselevel, const Comma
     // during the recovery data generation phase
     contextfull = new MD5Context;
   }
+  else if (filesize > HashBatchSize && blocksize <= HashBatchSize / 2)
+  {
+    if (!ComputeHashesInParallel(noiselevel, blocksize))
+    {
+      diskfile->Close();
+      return false;
+    }
+  }
   else
   {
     // Initialise a buffer to read the source file
@@ -272,6 +270,163 @@ bool Par2CreatorSourceFile::Open(CommandLine::NoiseLevel noiselevel, const Comma
   return true;
 }
 
+bool Par2CreatorSourceFile::ComputeHashesInParallel(CommandLine::NoiseLevel noiselevel, u64 blocksize)
+{
+  // Read whole blocks, as many as fit in a batch
+  u32 batchblocks = (u32)(HashBatchSize / blocksize);
+  size_t buffersize = (size_t)(batchblocks * blocksize);
+  u8 *buffer = new u8[buffersize];
+
+  // The blocks in the GCD code blocks below must not copy the context
+  MD5Context filecontext;
+  MD5Context *lFileContext = &filecontext;
+
+  dispatch_queue_t lQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+
+  for (u32 firstblock = 0; firstblock < blockcount; firstblock += batchblocks)
+  {
+    u64 offset = (u64)firstblock * blocksize;
+    size_t want = (size_t)min(filesize-offset, (u64)buffersize);
+
+    if (!diskfile->Read(offset, buffer, want))
+    {
+      delete [] buffer;
+      return false;
+    }
+
+    // The hash of the whole file is one stream; it is computed while the blocks are hashed
+    dispatch_group_t lGroup = dispatch_group_create();
+    dispatch_group_async(lGroup, lQueue, ^{
+      // If the new data passes the 16k boundary, compute the 16k hash for the file
+      if (offset < 16384 && offset + want >= 16384)
+      {
+        lFileContext->Update(buffer, (size_t)(16384-offset));
+
+        MD5Context temp = *lFileContext;
+        MD5Hash hash;
+        temp.Final(hash);
+        this->descriptionpacket->Hash16k(hash);
+
+        lFileContext->Update(&buffer[16384-offset], (size_t)(offset+want)-16384);
+      }
+      else
+      {
+        lFileContext->Update(buffer, want);
+      }
+    });
+
+    // Each block is independent of the others. The last block of the file is padded with zeroes.
+    u32 lBlockCount = (u32)((want + blocksize - 1) / blocksize);
+    dispatch_apply(lBlockCount, lQueue, ^(size_t aIndex){
+      u64 lStart = (u64)aIndex * blocksize;
+      size_t lLength = (size_t)min((u64)want - lStart, blocksize);
+
+      // With the padding, a short block of zeroes is a full one
+      u32 lCRC;
+      MD5Hash lBlockHash;
+      if (ZeroBlock::IsZero(&buffer[lStart], lLength))
+      {
+        ZeroBlock::Digest(blocksize, lBlockHash, lCRC);
+      }
+      else
+      {
+        lCRC = ~0 ^ CRCUpdateBlock(~0, lLength, &buffer[lStart]);
+        MD5Context lBlockContext;
+        lBlockContext.Update(&buffer[lStart], lLength);
+        if (lLength < blocksize)
+        {
+          lCRC = ~0 ^ CRCUpdateBlock(~0 ^ lCRC, (size_t)(blocksize - lLength));
+          lBlockContext.Update((size_t)(blocksize - lLength));
+        }
+        lBlockContext.Final(lBlockHash);
+      }
+
+      this->verificationpacket->SetBlockHashAndCRC(firstblock + (u32)aIndex, lBlockHash, lCRC);
+    });
+
+    dispatch_group_wait(lGroup, DISPATCH_TIME_FOREVER);
+    dispatch_release(lGroup);
+
+#ifndef MPDL
+    if (noiselevel > CommandLine::nlQuiet)
+    {
+      // Display progress
+      u32 oldfraction = (u32)(1000 * offset / filesize);
+      u32 newfraction = (u32)(1000 * (offset + want) / filesize);
+      if (oldfraction != newfraction)
+      {
+        dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+        cout << newfraction/10 << '.' << newfraction%10 << "%\r" << flush;
+        dispatch_semaphore_signal(coutSema);
+      }
+    }
+#endif
+  }
+
+  delete [] buffer;
+
+  // Finish computing the file hash, and store it in the file description packet.
+  MD5Hash filehash;
+  filecontext.Final(filehash);
+  descriptionpacket->HashFull(filehash);
+
+  // Compute the fileid and store it in the verification packet.
+  descriptionpacket->ComputeFileId();
+  verificationpacket->FileId(descriptionpacket->FileId());
+
+  return true;
+}
+
+// Create the packets for data that was read from a stream, from the hashes and
+// CRCs that were computed while it was read. There is no file to read afterwards.
+
+void Par2CreatorSourceFile::CreateFromStream(string filename, u64 _filesize,
+                                             const MD5Hash &hash16k, const MD5Hash &hashfull,
+                                             const vector<MD5Hash> &blockhashes, const vector<u32> &blockcrcs)
+{
+  diskfilename = filename;
+  filesize = _filesize;
+  blockcount = (u32)blockhashes.size();
+
+  ComputeParFileName();
+
+  descriptionpacket = new DescriptionPacket;
+  descriptionpacket->Create(parfilename, filesize);
+  descriptionpacket->Hash16k(hash16k);
+  descriptionpacket->HashFull(hashfull);
+
+  verificationpacket = new VerificationPacket;
+  verificationpacket->Create(blockcount);
+  for (u32 blocknumber=0; blocknumber<blockcount; blocknumber++)
+  {
+    verificationpacket->SetBlockHashAndCRC(blocknumber, blockhashes[blocknumber], blockcrcs[blocknumber]);
+  }
+
+  // Compute the fileid and store it in the verification packet.
+  descriptionpacket->ComputeFileId();
+  verificationpacket->FileId(descriptionpacket->FileId());
+}
+
+// Determine what filename to record in the PAR2 files
+void Par2CreatorSourceFile::ComputeParFileName(void)
+{
+  string::size_type where;
+  if (string::npos != (where = diskfilename.find_last_of('\\')) ||
+      string::npos != (where = diskfilename.find_last_of('/')))
+  {
+    parfilename = diskfilename.substr(where+1);
+  }
+  else
+  {
+    parfilename = diskfilename;
+  }
+
+  // On the Mac parfilename is encoded with UTF-8. However, it seems that
+  // Windows' Quickpar can only deal with ISO Latin 1. So be kind to them, 
+  // and store the parfilename in that encoding.
+  parfilename = DiskFile::Par2Representation (parfilename);
+}
+
 void Par2CreatorSourceFile::Close(void)
 {
   diskfile->Close();
@@ -298,6 +453,11 @@ const MD5Hash& Par2CreatorSourceFile::FileId(void) const
   return descriptionpacket->FileId();
 }
 
+const MD5Hash& Par2CreatorSourceFile::HashFull(void) const
+{
+  return descriptionpacket->HashFull();
+}
+
 void Par2CreatorSourceFile::InitialiseSourceBlocks(vector<DataBlock>::iterator &sourceblock, u64 blocksize)
 {
   for (u32 blocknum=0; blocknum<blockcount; blocknum++)
@@ -312,12 +472,20 @@ void Par2CreatorSourceFile::InitialiseSourceBlocks(vector<DataBlock>::iterator &
 
 void Par2CreatorSourceFile::UpdateHashes(u32 blocknumber, const void *buffer, size_t length)
 {
-  // Compute the crc and hash of the data
-  u32 blockcrc = ~0 ^ CRCUpdateBlock(~0, length, buffer);
-  MD5Context blockcontext;
-  blockcontext.Update(buffer, length);
+  // Compute the crc and hash of the data; those of a block of zeroes are known
+  u32 blockcrc;
   MD5Hash blockhash;
-  blockcontext.Final(blockhash);
+  if (ZeroBlock::IsZero(buffer, length))
+  {
+    ZeroBlock::Digest(length, blockhash, blockcrc);
+  }
+  else
+  {
+    blockcrc = ~0 ^ CRCUpdateBlock(~0, length, buffer);
+    MD5Context blockcontext;
+    blockcontext.Update(buffer, length);
+    blockcontext.Final(blockhash);
+  }
 
   // Store the results in the verification packet
   verificationpacket->SetBlockHashAndCRC(blocknumber, blockhash, blockcrc);
@@ -43,6 +43,12 @@ public:
 			u64 blocksize, bool deferhashcomputation, bool tryToCache);
   void Close(void);
 
+  // Set up the packets for data that was read from a stream instead of a file,
+  // from the hashes and CRCs computed while it was read.
+  void CreateFromStream(string filename, u64 filesize,
+                        const MD5Hash &hash16k, const MD5Hash &hashfull,
+                        const vector<MD5Hash> &blockhashes, const vector<u32> &blockcrcs);
+
   // Recover the file description and file verification packets
   // in the critical packet list.
   void RecordCriticalPackets(list<CriticalPacket*> &criticalpackets);
@@ -50,6 +56,10 @@ public:
   // Get the file id
   const MD5Hash& FileId(void) const;
 
+  // Get the hash of the whole file; not known until FinishHashes if the
+  // computation was deferred
+  const MD5Hash& HashFull(void) const;
+
   // Sort source files based on the file id hash
   static bool CompareLess(const Par2CreatorSourceFile* const &left, const Par2CreatorSourceFile* const &right);
 
@@ -65,6 +75,14 @@ public:
   // How many blocks does this source file use
   u32 BlockCount(void) const {return blockcount;}
 
+protected:
+  // Work out the filename to record in the description packet from diskfilename
+  void ComputeParFileName(void);
+
+  // Compute the hashes and CRCs of a large file: the blocks are hashed by several
+  // threads at once, the hash of the whole file by one more.
+  bool ComputeHashesInParallel(CommandLine::NoiseLevel noiselevel, u64 blocksize);
+
 protected:
   DescriptionPacket  *descriptionpacket;  // The file description packet.
   VerificationPacket *verificationpacket; // The file verification packet.
@@ -0,0 +1,488 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#include "par2cmdline.h"
+
+// How much of a packet is read at a time, to check its hash or to copy it
+#define MergeBufferSize (1024*1024)
+
+Par2Merger::Par2Merger(void)
+: Par2Creator()
+, havesetid(false)
+, setshardcount(0)
+, setfirstblock(0)
+, setblockcount(0)
+{
+}
+
+Par2Merger::~Par2Merger(void)
+{
+  map<MD5Hash, DescriptionPacket*>::iterator dp;
+  for (dp = descriptionpackets.begin(); dp != descriptionpackets.end(); ++dp)
+  {
+    delete dp->second;
+  }
+
+  map<MD5Hash, VerificationPacket*>::iterator vp;
+  for (vp = verificationpackets.begin(); vp != verificationpackets.end(); ++vp)
+  {
+    delete vp->second;
+  }
+
+  for (size_t i = 0; i < shardfiles.size(); i++)
+  {
+    delete shardfiles[i];
+  }
+}
+
+Result Par2Merger::Process(const CommandLine &commandline)
+{
+  noiselevel = commandline.GetNoiseLevel();
+  recoveryfilecount = commandline.GetRecoveryFileCount();
+  recoveryfilescheme = commandline.GetRecoveryFileScheme();
+  string par2filename = commandline.GetParFilename();
+  const list<CommandLine::ExtraFile> &extrafiles = commandline.GetExtraFiles();
+
+  // Load the packets of all shards
+  for (ExtraFileIterator i = extrafiles.begin(); i != extrafiles.end(); ++i)
+  {
+    if (!LoadShard(i->FileName()))
+      return eInsufficientCriticalData;
+  }
+
+  if (!CheckShards())
+    return eInsufficientCriticalData;
+
+  // Determine how many recovery files to create.
+  if (!ComputeRecoveryFileCount())
+    return eInvalidCommandLineArguments;
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << endl;
+    cout << "Block size: " << blocksize << endl;
+    cout << "Recovery block count: " << recoveryblockcount << endl;
+    cout << "First recovery block: " << firstrecoveryblock << endl;
+    cout << "Recovery file count: " << recoveryfilecount << endl;
+    cout << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  // Create all of the output files and allocate all packets to appropriate file offets.
+  if (!InitialiseOutputFiles(par2filename))
+    return eFileIOError;
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Writing recovery packets" << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  if (!CopyRecoveryPackets())
+    return eFileIOError;
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Writing verification packets" << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  // The critical packets are complete; they were loaded with their set id and hash
+  if (!WriteCriticalPackets())
+    return eFileIOError;
+
+  if (!CloseFiles())
+    return eFileIOError;
+
+  if (noiselevel > CommandLine::nlSilent)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Done" << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return eSuccess;
+}
+
+// A shard file is written by a create, so there is nothing between its packets.
+// Unlike a verification, the loading does not search for packets: a shard file
+// that is damaged cannot be used.
+
+bool Par2Merger::LoadShard(const string &filename)
+{
+  string path;
+  string name;
+  DiskFile::SplitFilename(filename, path, name);
+
+  DiskFile *diskfile = new DiskFile;
+  if (!diskfile->Open(filename, true))
+  {
+    delete diskfile;
+    return false;
+  }
+  shardfiles.push_back(diskfile);
+
+  u64 filesize = diskfile->FileSize();
+  u64 offset = 0;
+  u32 recoverycount = 0;
+  bool identified = false;
+  u8 *buffer = new u8[MergeBufferSize];
+  bool rv = true;
+
+  while (rv && offset < filesize)
+  {
+    PACKET_HEADER header;
+    if (offset + sizeof(header) > filesize ||
+        !diskfile->Read(offset, &header, sizeof(header)) ||
+        packet_magic != header.magic ||
+        header.length < sizeof(header) ||
+        (header.length & 3) != 0 ||
+        header.length > filesize - offset)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cerr << "\"" << DiskFile::FS2UTF8(name) << "\" is not a complete shard file." << endl;
+      dispatch_semaphore_signal(coutSema);
+      rv = false;
+      break;
+    }
+
+    // Check the packet hash
+    MD5Context context;
+    context.Update(&header.setid, sizeof(header) - offsetof(PACKET_HEADER, setid));
+    for (u64 current = offset + sizeof(header); rv && current < offset + header.length; )
+    {
+      size_t want = (size_t)min((u64)MergeBufferSize, offset + header.length - current);
+      rv = diskfile->Read(current, buffer, want);
+      context.Update(buffer, want);
+      current += want;
+    }
+    MD5Hash hash;
+    context.Final(hash);
+    if (!rv || hash != header.hash)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cerr << "\"" << DiskFile::FS2UTF8(name) << "\" is damaged at offset " << offset << "." << endl;
+      dispatch_semaphore_signal(coutSema);
+      rv = false;
+      break;
+    }
+
+    // All shards must have been made from the same source files with the same block size
+    if (!havesetid)
+    {
+      setid = header.setid;
+      havesetid = true;
+    }
+    else if (setid != header.setid)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cerr << "\"" << DiskFile::FS2UTF8(name) << "\" is a shard of a different recovery set." << endl;
+      dispatch_semaphore_signal(coutSema);
+      rv = false;
+      break;
+    }
+
+    if (recoveryblockpacket_type == header.type)
+    {
+      leu32 exponent;
+      rv = header.length > sizeof(RECOVERYBLOCKPACKET) &&
+           diskfile->Read(offset + sizeof(PACKET_HEADER), &exponent, sizeof(exponent));
+
+      if (rv && shardpackets.find(exponent) != shardpackets.end())
+      {
+        dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+        cerr << "Recovery block " << exponent << " is in more than one shard." << endl;
+        dispatch_semaphore_signal(coutSema);
+        rv = false;
+      }
+
+      if (rv)
+      {
+        ShardPacket packet;
+        packet.diskfile = diskfile;
+        packet.offset = offset;
+        packet.length = header.length;
+        shardpackets[exponent] = packet;
+        recoverycount++;
+      }
+    }
+    else if (mainpacket_type == header.type)
+    {
+      if (mainpacket == 0)
+      {
+        mainpacket = new MainPacket;
+        rv = mainpacket->Load(diskfile, offset, header);
+      }
+    }
+    else if (creatorpacket_type == header.type && !identified)
+    {
+      // The creator packet says which shard this is. The merged files get a creator
+      // packet of their own.
+      CreatorPacket packet;
+      u32 number, count, first, blocks;
+      rv = packet.Load(diskfile, offset, header);
+      if (rv && packet.GetShard(number, count, first, blocks))
+      {
+        identified = true;
+
+        if (shardnumbers.empty())
+        {
+          setshardcount = count;
+          setfirstblock = first;
+          setblockcount = blocks;
+        }
+        else if (count != setshardcount || first != setfirstblock || blocks != setblockcount)
+        {
+          dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+          cerr << "\"" << DiskFile::FS2UTF8(name) << "\" is a shard of a different sharded create." << endl;
+          dispatch_semaphore_signal(coutSema);
+          rv = false;
+        }
+        else if (shardnumbers.find(number) != shardnumbers.end())
+        {
+          dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+          cerr << "Shard " << number << " of " << count << " is given more than once." << endl;
+          dispatch_semaphore_signal(coutSema);
+          rv = false;
+        }
+
+        shardnumbers.insert(number);
+      }
+    }
+    else if (filedescriptionpacket_type == header.type)
+    {
+      DescriptionPacket *packet = new DescriptionPacket;
+      rv = packet->Load(diskfile, offset, header);
+      if (rv && descriptionpackets.find(packet->FileId()) == descriptionpackets.end())
+        descriptionpackets[packet->FileId()] = packet;
+      else
+        delete packet;
+    }
+    else if (fileverificationpacket_type == header.type)
+    {
+      VerificationPacket *packet = new VerificationPacket;
+      rv = packet->Load(diskfile, offset, header);
+      if (rv && verificationpackets.find(packet->FileId()) == verificationpackets.end())
+        verificationpackets[packet->FileId()] = packet;
+      else
+        delete packet;
+    }
+
+    offset += header.length;
+  }
+
+  delete [] buffer;
+
+  // The packets are copied from the file later on
+  diskfile->Close();
+
+  if (rv && !identified)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "\"" << DiskFile::FS2UTF8(name) << "\" does not say which shard it is; was it made with --shard?" << endl;
+    dispatch_semaphore_signal(coutSema);
+    rv = false;
+  }
+
+  if (rv && noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Loaded " << recoverycount << " recovery blocks from \"" << DiskFile::FS2UTF8(name) << "\"" << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return rv;
+}
+
+bool Par2Merger::CheckShards(void)
+{
+  if (mainpacket == 0)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "The shard files do not contain the main packet." << endl;
+    dispatch_semaphore_signal(coutSema);
+    return false;
+  }
+
+  // A forgotten shard would silently lower the redundancy of the set
+  if (shardnumbers.size() != setshardcount)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "Only " << shardnumbers.size() << " of the " << setshardcount << " shards are given; missing:";
+    for (u32 number = 1; number <= setshardcount; number++)
+    {
+      if (shardnumbers.find(number) == shardnumbers.end())
+        cerr << " " << number;
+    }
+    cerr << endl;
+    dispatch_semaphore_signal(coutSema);
+    return false;
+  }
+
+  blocksize = mainpacket->BlockSize();
+
+  // Write the critical packets in the same order as a create does
+  criticalpackets.push_back(mainpacket);
+
+  for (u32 filenumber=0; filenumber<mainpacket->TotalFileCount(); filenumber++)
+  {
+    const MD5Hash &fileid = mainpacket->FileId(filenumber);
+
+    map<MD5Hash, DescriptionPacket*>::iterator dp = descriptionpackets.find(fileid);
+    map<MD5Hash, VerificationPacket*>::iterator vp = verificationpackets.find(fileid);
+    bool recoverable = filenumber < mainpacket->RecoverableFileCount();
+
+    if (dp == descriptionpackets.end() || (recoverable && vp == verificationpackets.end()))
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cerr << "The shard files do not describe all of the source files." << endl;
+      dispatch_semaphore_signal(coutSema);
+      return false;
+    }
+
+    criticalpackets.push_back(dp->second);
+    if (vp != verificationpackets.end())
+      criticalpackets.push_back(vp->second);
+
+    if (recoverable && largestfilesize < dp->second->FileSize())
+      largestfilesize = dp->second->FileSize();
+  }
+
+  if (shardpackets.empty())
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "The shard files do not contain any recovery blocks." << endl;
+    dispatch_semaphore_signal(coutSema);
+    return false;
+  }
+
+  // The recovery files are named after a range of exponents, so there must not be gaps
+  firstrecoveryblock = shardpackets.begin()->first;
+  recoveryblockcount = (u32)shardpackets.size();
+
+  u32 exponent = firstrecoveryblock;
+  for (map<u32, ShardPacket>::const_iterator sp = shardpackets.begin(); sp != shardpackets.end(); ++sp, ++exponent)
+  {
+    if (sp->first != exponent)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cerr << "Recovery block " << exponent << " is missing; is one of the shards missing?" << endl;
+      dispatch_semaphore_signal(coutSema);
+      return false;
+    }
+
+    if (sp->second.length != sizeof(RECOVERYBLOCKPACKET) + blocksize)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cerr << "Recovery block " << exponent << " has the wrong size." << endl;
+      dispatch_semaphore_signal(coutSema);
+      return false;
+    }
+  }
+
+  // Together the shards must have the recovery blocks they were computed from
+  if (firstrecoveryblock != setfirstblock || recoveryblockcount != setblockcount)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "The shards have recovery blocks " << firstrecoveryblock << " to " << firstrecoveryblock + recoveryblockcount - 1
+         << " instead of " << setfirstblock << " to " << setfirstblock + setblockcount - 1 << "." << endl;
+    dispatch_semaphore_signal(coutSema);
+    return false;
+  }
+
+  // The merged files are not a shard
+  return CreateCreatorPacket();
+}
+
+bool Par2Merger::CopyRecoveryPackets(void)
+{
+  // Sort out what goes to which file. Each recovery file is written by one thread,
+  // and each thread reads the shard files through DiskFiles of its own, so that no
+  // DiskFile is used by two threads at once.
+  vector<vector<u32> > lPackets(recoveryfiles.size());
+  for (u32 i = 0; i < recoverypackets.size(); i++)
+  {
+    lPackets[recoverypackets[i].GetDiskFile() - &recoveryfiles[0]].push_back(i);
+  }
+
+  // The stack-based vector cannot be used in the block as such
+  vector<vector<u32> > *lAllPackets = &lPackets;
+
+  // The recovery packets already have their headers; each is copied as a whole.
+  // Let the OS do that where it can, or else copy it through memory.
+  __block bool lOK = true;
+  dispatch_apply(recoveryfiles.size(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                 ^(size_t aFile){
+                   const vector<u32> &lFilePackets = (*lAllPackets)[aFile];
+                   map<DiskFile*, DiskFile*> lSources;
+                   u8 *lBuffer = 0;
+
+                   for (size_t i = 0; lOK && i < lFilePackets.size(); i++)
+                   {
+                     RecoveryPacket &lPacket = this->recoverypackets[lFilePackets[i]];
+                     const ShardPacket &lSource = this->shardpackets.find(lPacket.Exponent())->second;
+
+                     DiskFile *&lShard = lSources[lSource.diskfile];
+                     if (lShard == 0)
+                     {
+                       lShard = new DiskFile;
+                       if (!lShard->Open(lSource.diskfile->FileName(), false))
+                       {
+                         dispatch_semaphore_wait(this->genericSema, DISPATCH_TIME_FOREVER);
+                         lOK = false;
+                         dispatch_semaphore_signal(this->genericSema);
+                         break;
+                       }
+                     }
+
+                     bool lCopied = lPacket.GetDiskFile()->CopyRange(lPacket.Offset(), *lShard,
+                                                                     lSource.offset, lSource.length);
+                     if (!lCopied)
+                     {
+                       if (lBuffer == 0)
+                         lBuffer = new u8[MergeBufferSize];
+                       lCopied = true;
+                       for (u64 lDone = 0; lCopied && lDone < lSource.length; )
+                       {
+                         size_t lWant = (size_t)min((u64)MergeBufferSize, lSource.length - lDone);
+                         lCopied = lShard->Read(lSource.offset + lDone, lBuffer, lWant) &&
+                                   lPacket.GetDiskFile()->Write(lPacket.Offset() + lDone, lBuffer, lWant);
+                         lDone += lWant;
+                       }
+                     }
+
+                     if (!lCopied)
+                     {
+                       dispatch_semaphore_wait(this->genericSema, DISPATCH_TIME_FOREVER);
+                       lOK = false;
+                       dispatch_semaphore_signal(this->genericSema);
+                     }
+                   }
+
+                   delete [] lBuffer;
+                   for (map<DiskFile*, DiskFile*>::iterator s = lSources.begin(); s != lSources.end(); ++s)
+                   {
+                     delete s->second;
+                   }
+                 });
+
+  return lOK;
+}
@@ -0,0 +1,73 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#ifndef __PAR2MERGER_H__
+#define __PAR2MERGER_H__
+
+// The Par2Merger assembles the recovery files of a set from the files that the
+// shards of a sharded create (--shard) wrote. Each shard file holds the critical
+// packets of the set and the recovery packets of a range of exponents. Its creator
+// packet says which of the n shards it is, and which recovery blocks all n compute
+// together. The shards must all be of the same set, all n must be given, and together
+// they must have exactly those recovery blocks, so that a forgotten shard does not
+// silently lower the redundancy. The recovery files are laid out as a create would,
+// and the recovery packets are copied into them unchanged.
+
+class Par2Merger : public Par2Creator
+{
+public:
+  Par2Merger(void);
+  ~Par2Merger(void);
+
+  // Make the recovery files from the shard files specified on the command line
+  Result Process(const CommandLine &commandline);
+
+protected:
+  // Load the packets of a shard file, and check that it is of the same set
+  // as the other shard files.
+  bool LoadShard(const string &filename);
+
+  // Check that the packets of the shards describe the whole set, and take the
+  // block size and the recovery blocks from them.
+  bool CheckShards(void);
+
+  // Copy each recovery packet from its shard file into its recovery file
+  bool CopyRecoveryPackets(void);
+
+protected:
+  // Where a recovery packet is in a shard file
+  struct ShardPacket
+  {
+    DiskFile *diskfile;
+    u64       offset;
+    u64       length;
+  };
+
+  vector<DiskFile*>                 shardfiles;          // The shard files
+  bool                              havesetid;           // Whether a packet has been loaded
+  MD5Hash                           setid;               // The set id of all the shards
+  map<MD5Hash, DescriptionPacket*>  descriptionpackets;  // By file id
+  map<MD5Hash, VerificationPacket*> verificationpackets; // By file id
+  map<u32, ShardPacket>             shardpackets;        // The recovery packets, by exponent
+  set<u32>                          shardnumbers;        // Which shards have been loaded
+  u32                               setshardcount;       // What the shards say about the
+  u32                               setfirstblock;       // sharded create: the number of
+  u32                               setblockcount;       // shards, and their recovery blocks
+};
+
+#endif // __PAR2MERGER_H__
@@ -21,7 +21,6 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
-#include <sys/sysctl.h>
 #ifdef PROFILE
 #include <TimeReporter.h>
 #endif
@@ -49,18 +48,34 @@ Par2Repairer::Par2Repairer(void)
 
   inputbuffer = 0;
   outputbuffer = 0;
+  readslotcount = 0;
+  mappedinput = false;
+  rsinputcount = 0;
+  syndromebuffer = 0;
+  paranoid = false;
+  resume = false;
+  singlepass = false;
 
   noiselevel = CommandLine::nlNormal;
 	
 	// Some stuff for the multi-thread operation
   previouslyReportedProgress = 0;
   genericSema = dispatch_semaphore_create(1);
+  blocksneeded = 0;
+  countblocksneeded = false;
+  foundSema = dispatch_semaphore_create(1);
+  boundfoundblocks = false;
+  unscannedblocks = 0;
+  shortblockcount = 0;
+  repairimpossible = false;
+  shortfall = 0;
 }
 
 Par2Repairer::~Par2Repairer(void)
 {
-  delete [] (u8*)inputbuffer;
-  delete [] (u8*)outputbuffer;
+  AlignedBufferPool::Release(inputbuffer);
+  AlignedBufferPool::Release(outputbuffer);
+  AlignedBufferPool::Release(syndromebuffer);
 
   map<u32,RecoveryPacket*>::iterator rp = recoverypacketmap.begin();
   while (rp != recoverypacketmap.end())
@@ -79,10 +94,22 @@ Par2Repairer::~Par2Repairer(void)
     ++sf;
   }
 
+  map<DiskFile*, RepairJournal*>::iterator j = journals.begin();
+  while (j != journals.end())
+  {
+    delete (*j).second;
+
+    ++j;
+  }
+
   delete mainpacket;
   delete creatorpacket;
 	
   dispatch_release(genericSema);
+  dispatch_release(foundSema);
+
+  // The buffers were sized for this set; don't keep them around for the next one
+  AlignedBufferPool::Purge();
 }
 
 Result Par2Repairer::Process(const CommandLine &commandline, bool dorepair)
@@ -93,9 +120,9 @@ Result Par2Repairer::Process(const CommandLine &commandline, bool dorepair)
 
   // What noiselevel are we using
   noiselevel = commandline.GetNoiseLevel();
-
-  struct rlimit rlp;		// Need this to allow for enough file handles
-  int 	lFileHandlesNeeded;
+  mappedinput = commandline.GetMappedInput();
+  paranoid = commandline.GetParanoid();
+  resume = commandline.GetResume();
 
   // Get filesnames from the command line
   string par2filename = commandline.GetParFilename();
@@ -105,6 +132,15 @@ Result Par2Repairer::Process(const CommandLine &commandline, bool dorepair)
   string name;
   DiskFile::SplitFilename(par2filename, searchpath, name);
 
+  // Find out what an earlier verification of the set found, if it was kept
+  string sessiondir = commandline.GetSessionDir();
+  if (!sessiondir.empty())
+  {
+    if (sessiondir[sessiondir.size()-1] != '/')
+      sessiondir += '/';
+    session.Open(sessiondir + name + ".session");
+  }
+
   // Load packets from the main PAR2 file
   if (!LoadPacketsFromFile(searchpath + name))
     return eLogicError;
@@ -128,23 +164,19 @@ Result Par2Repairer::Process(const CommandLine &commandline, bool dorepair)
   if (!CheckPacketConsistency())
     return eInsufficientCriticalData;
 
-  // It appears that during repair the program opens all files simultaneously.
-  // Suppose the maximum number of file handles is 256, this would mean you can have
-  // about 250 files in a par set. This can be too small, so adjust if necessary. */
-  if (getrlimit (RLIMIT_NOFILE, &rlp) != 0)
-    return eLogicError;
+  // The blocks in the session are of no use for another set
+  if (session.IsOpen())
+    session.SetSetId(setid);
 
-  lFileHandlesNeeded = mainpacket->TotalFileCount() + 16;		// A few extra
-  if (rlp.rlim_cur < (unsigned int) lFileHandlesNeeded)
+  // There is no need for a file descriptor per file in the set: the target files and the
+  // files that are read during repair are kept open by the DiskFilePool, within its limit.
+  if (noiselevel > CommandLine::nlNormal)
   {
-    rlp.rlim_cur = lFileHandlesNeeded;
-    if (setrlimit (RLIMIT_NOFILE, &rlp) != 0)
-      return eLogicError;
     dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
-    cout << "Increased file limit to " << lFileHandlesNeeded << endl;
+    cout << "Keeping at most " << DiskFilePool::Limit() << " files open" << endl;
     dispatch_semaphore_signal(coutSema);
   }
-  
+
   // Use the information in the main packet to get the source files
   // into the correct order and determine their filenames
   if (!CreateSourceFileList())
@@ -165,6 +197,16 @@ Result Par2Repairer::Process(const CommandLine &commandline, bool dorepair)
   if (!ComputeWindowTable())
     return eLogicError;
 
+  // Data blocks that are found during verification are kept for the repair, if there
+  // is going to be one.
+  if (dorepair)
+    blockcache.SetBudget(commandline.GetCacheLimit());
+
+  // Optionally compute the syndromes of the recovery blocks while verifying, so that
+  // the repair does not need the data that is found again.
+  if (dorepair && commandline.GetSyndromes())
+    PrepareSyndromes(commandline.GetMemoryLimit());
+
   if (noiselevel > CommandLine::nlQuiet)
   {
     dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
@@ -172,6 +214,11 @@ Result Par2Repairer::Process(const CommandLine &commandline, bool dorepair)
     dispatch_semaphore_signal(coutSema);
   }
 
+  // When repairing, give up as soon as it is clear that too much data is missing. A
+  // verification alone reports everything that is there.
+  if (dorepair)
+    PrepareFoundBlocksBound(extrafiles);
+
   // Attempt to verify all of the source files
   if (!VerifySourceFiles())
     return eFileIOError;
@@ -189,12 +236,29 @@ Result Par2Repairer::Process(const CommandLine &commandline, bool dorepair)
     }
 
     // Scan any extra files specified on the command line
-    if (!VerifyExtraFiles(extrafiles))
+    if (!repairimpossible && !VerifyExtraFiles(extrafiles))
       return eLogicError;
 
     UpdateVerificationResults();
   }
 
+  // Keep what was found, so that a next run (with more recovery volumes, perhaps)
+  // only has to look at the files that are new or have changed.
+  if (session.IsOpen())
+    session.Save();
+
+  if (repairimpossible)
+  {
+    if (noiselevel > CommandLine::nlSilent)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cout << endl << "Repair is not possible; verification was stopped early." << endl;
+      cout << "You need at least " << shortfall << " more recovery blocks to be able to repair." << endl;
+      dispatch_semaphore_signal(coutSema);
+    }
+    return eRepairNotPossible;
+  }
+
   if (noiselevel > CommandLine::nlSilent)
   {
     dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
@@ -248,6 +312,10 @@ Result Par2Repairer::Process(const CommandLine &commandline, bool dorepair)
           return eFileIOError;
         }
 
+        // Unless they will be read back, check the reconstructed blocks as they are written
+        if (!paranoid)
+          PrepareWriteVerification();
+
         if (noiselevel > CommandLine::nlSilent)
         {
           dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
@@ -263,13 +331,23 @@ Result Par2Repairer::Process(const CommandLine &commandline, bool dorepair)
           return eMemoryError;
         }
 
+        // Find out whether an interrupted run already did part of this repair
+        u64 resumeoffset = 0;
+        if (resume)
+          resumeoffset = LoadCheckpoint(commandline.GetParFilename());
+
+        // Copy what the OS can copy by itself
+        CopyIntactBlocks();
+
         // Set the total amount of data to be processed.
-        progress = 0;
+        progress = resumeoffset * rsinputcount * (missingblockcount > 0 ? missingblockcount : 1);
         this->previouslyReportedProgress = -10000000;	// Big negative
-        totaldata = blocksize * sourceblockcount * (missingblockcount > 0 ? missingblockcount : 1);
+        totaldata = blocksize * rsinputcount * (missingblockcount > 0 ? missingblockcount : 1);
 
-        // Start at an offset of 0 within a block.
-        u64 blockoffset = 0;
+        // Start at an offset of 0 within a block, unless the earlier passes have been
+        // done by an interrupted run.
+        u64 blockoffset = resumeoffset;
+        singlepass = resumeoffset == 0 && chunksize == blocksize;
         while (blockoffset < blocksize) // Continue until the end of the block.
         {
           // Work out how much data to process this time.
@@ -285,6 +363,29 @@ Result Par2Repairer::Process(const CommandLine &commandline, bool dorepair)
 
           // Advance to the need offset within each block
           blockoffset += blocklength;
+
+          // A failed checkpoint only means that an interruption costs more
+          if (checkpoint.IsSet() && blockoffset < blocksize)
+            SaveCheckpoint(blockoffset);
+        }
+
+        if (noiselevel > CommandLine::nlNormal && blockcache.Budget() > 0)
+        {
+          dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+          cout << "Block cache: " << blockcache.Hits() << " reads from memory, "
+               << blockcache.Misses() << " from disk" << endl;
+          dispatch_semaphore_signal(coutSema);
+        }
+
+        // The cached data and the syndromes are of no use for verifying the repaired files
+        blockcache.SetBudget(0);
+        syndromes.Release();
+
+        if (!RenamePartFiles())
+        {
+          // Delete all of the partly reconstructed files
+          DeleteIncompleteTargetFiles();
+          return eFileIOError;
         }
 
 #ifdef PROFILE
@@ -305,6 +406,12 @@ Result Par2Repairer::Process(const CommandLine &commandline, bool dorepair)
           DeleteIncompleteTargetFiles();
           return eFileIOError;
         }
+
+        // Keep the files that were repaired in place, and restore the others
+        if (!FinishInPlaceRepairs())
+          return eFileIOError;
+
+        checkpoint.Remove();
       }
 
       // Are all of the target files now complete?
@@ -372,7 +479,26 @@ bool Par2Repairer::LoadPacketsFromFile(string filename)
 
   // How big is the file
   u64 filesize = diskfile->FileSize();
-  if (filesize > 0)
+
+  // If the file has not changed since the session found its packets, only those are read
+  Session::FileIdentity identity;
+  bool haveidentity = session.IsOpen() && Session::GetIdentity(filename, identity) && identity.size == filesize;
+  vector<u64> validoffsets;
+  if (haveidentity && session.FindPackets(filename, identity, validoffsets))
+  {
+    for (vector<u64>::const_iterator o = validoffsets.begin(); o != validoffsets.end(); ++o)
+    {
+      PACKET_HEADER header;
+      if (*o + sizeof(PACKET_HEADER) <= filesize &&
+          diskfile->Read(*o, &header, sizeof(header)) &&
+          packet_magic == header.magic &&
+          *o + header.length <= filesize)
+      {
+        LoadPacket(diskfile, *o, header, packets, recoverypackets);
+      }
+    }
+  }
+  else if (filesize > 0)
   {
     // Allocate a buffer to read data into
     // The buffer should be large enough to hold a whole 
@@ -457,60 +583,20 @@ bool Par2Repairer::LoadPacketsFromFile(string filename)
         continue;
       }
 
-      // If this is the first packet that we have found then record the setid
-      if (firstpacket)
-      {
-        setid = header.setid;
-        firstpacket = false;
-      }
+      // Remember where the valid packets are, for the session
+      validoffsets.push_back(offset);
 
-      // Is the packet from the correct set
-      if (setid == header.setid)
-      {
-        // Is it a packet type that we are interested in
-        if (recoveryblockpacket_type == header.type)
-        {
-          if (LoadRecoveryPacket(diskfile, offset, header))
-          {
-            recoverypackets++;
-            packets++;
-          }
-        }
-        else if (fileverificationpacket_type == header.type)
-        {
-          if (LoadVerificationPacket(diskfile, offset, header))
-          {
-            packets++;
-          }
-        }
-        else if (filedescriptionpacket_type == header.type)
-        {
-          if (LoadDescriptionPacket(diskfile, offset, header))
-          {
-            packets++;
-          }
-        }
-        else if (mainpacket_type == header.type)
-        {
-          if (LoadMainPacket(diskfile, offset, header))
-          {
-            packets++;
-          }
-        }
-        else if (creatorpacket_type == header.type)
-        {
-          if (LoadCreatorPacket(diskfile, offset, header))
-          {
-            packets++;
-          }
-        }
-      }
+      LoadPacket(diskfile, offset, header, packets, recoverypackets);
 
       // Advance to the next packet
       offset += header.length;
     }
 
     delete [] buffer;
+
+    // The whole file has been searched; the next run can skip that
+    if (haveidentity)
+      session.SetPackets(filename, identity, validoffsets);
   }
 
   // We have finished with the file for now
@@ -549,6 +635,59 @@ bool Par2Repairer::LoadPacketsFromFile(string filename)
   return true;
 }
 
+// Load a packet whose hash has been checked, if it belongs to the set
+void Par2Repairer::LoadPacket(DiskFile *diskfile, u64 offset, PACKET_HEADER &header, u32 &packets, u32 &recoverypackets)
+{
+  // If this is the first packet that we have found then record the setid
+  if (firstpacket)
+  {
+    setid = header.setid;
+    firstpacket = false;
+  }
+
+  // Is the packet from the correct set
+  if (setid == header.setid)
+  {
+    // Is it a packet type that we are interested in
+    if (recoveryblockpacket_type == header.type)
+    {
+      if (LoadRecoveryPacket(diskfile, offset, header))
+      {
+        recoverypackets++;
+        packets++;
+      }
+    }
+    else if (fileverificationpacket_type == header.type)
+    {
+      if (LoadVerificationPacket(diskfile, offset, header))
+      {
+        packets++;
+      }
+    }
+    else if (filedescriptionpacket_type == header.type)
+    {
+      if (LoadDescriptionPacket(diskfile, offset, header))
+      {
+        packets++;
+      }
+    }
+    else if (mainpacket_type == header.type)
+    {
+      if (LoadMainPacket(diskfile, offset, header))
+      {
+        packets++;
+      }
+    }
+    else if (creatorpacket_type == header.type)
+    {
+      if (LoadCreatorPacket(diskfile, offset, header))
+      {
+        packets++;
+      }
+    }
+  }
+}
+
 bool Par2Repairer::ReadPacketHeader(DiskFile *diskfile, u64 &offset, u8 *buffer, size_t buffersize,
                                     PACKET_HEADER &header)
 {
@@ -1175,6 +1314,38 @@ bool Par2Repairer::PrepareVerificationHashTable(void)
   return true;
 }
 
+// Start computing syndromes during verification, for the recovery blocks with the
+// lowest exponents (those are the ones ComputeRSmatrix uses). Their number is limited by
+// the memory limit and by the number of recovery blocks that have been loaded. The
+// syndromes that the repair uses share the memory limit with its buffers, so they may
+// take at most half of it.
+bool Par2Repairer::PrepareSyndromes(size_t memorylimit)
+{
+  size_t count = min((size_t)recoverypacketmap.size(), (size_t)(memorylimit / 2 / blocksize));
+  if (count == 0)
+    return false;
+
+  vector<u16> exponents;
+  map<u32,RecoveryPacket*>::iterator rp = recoverypacketmap.begin();
+  while (exponents.size() < count)
+  {
+    exponents.push_back((u16)rp->first);
+    ++rp;
+  }
+
+  if (!syndromes.Start(sourceblockcount, (size_t)blocksize, exponents))
+    return false;
+
+  if (noiselevel > CommandLine::nlNormal)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Computing syndromes for " << count << " recovery blocks during verification." << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return true;
+}
+
 // Compute the table for the sliding CRC computation
 bool Par2Repairer::ComputeWindowTable(void)
 {
@@ -1193,6 +1364,67 @@ static bool SortSourceFilesByFileName(Par2RepairerSourceFile *low,
   return low->TargetFileName() < high->TargetFileName();
 }
 
+void Par2Repairer::PrepareFoundBlocksBound(const list<CommandLine::ExtraFile> &extrafiles)
+{
+  // Files that can only be matched as a whole do not fit in the bound
+  boundfoundblocks = blockverifiable && unverifiablesourcefiles.empty();
+  if (!boundfoundblocks)
+    return;
+
+  shortblockcount = 0;
+  for (vector<DataBlock>::const_iterator sb = sourceblocks.begin(); sb != sourceblocks.end(); ++sb)
+  {
+    if (sb->GetLength() < blocksize)
+      shortblockcount++;
+  }
+
+  // A file that is both a source file and an extra file is counted twice. That
+  // only makes the bound less tight.
+  unscannedblocks = 0;
+  for (vector<Par2RepairerSourceFile*>::const_iterator sf = sourcefiles.begin(); sf != sourcefiles.end(); ++sf)
+  {
+    if (*sf != 0)
+      unscannedblocks += BlocksInFile(DiskFile::GetFileSize((*sf)->TargetFileName()));
+  }
+  for (ExtraFileIterator ef = extrafiles.begin(); ef != extrafiles.end(); ++ef)
+  {
+    // Recovery files are not scanned for data blocks (see Verify1ExtraFile)
+    string filename = ef->FileName();
+    if (string::npos == filename.find(".par2") &&
+        string::npos == filename.find(".PAR2"))
+    {
+      unscannedblocks += BlocksInFile(DiskFile::GetFileSize(DiskFile::GetCanonicalPathname(filename)));
+    }
+  }
+}
+
+void Par2Repairer::FileScanned(u64 filesize)
+{
+  if (!boundfoundblocks)
+    return;
+
+  dispatch_semaphore_wait(genericSema, DISPATCH_TIME_FOREVER);
+
+  unscannedblocks -= min(unscannedblocks, BlocksInFile(filesize));
+
+  u64 foundblocks = 0;
+  for (vector<DataBlock>::const_iterator sb = sourceblocks.begin(); sb != sourceblocks.end(); ++sb)
+  {
+    if (sb->IsSet())
+      foundblocks++;
+  }
+
+  u64 findable = min((u64)sourceblockcount, foundblocks + unscannedblocks + shortblockcount);
+  u64 recoverable = findable + recoverypacketmap.size();
+  if (recoverable < sourceblockcount && !repairimpossible)
+  {
+    shortfall = (u32)(sourceblockcount - recoverable);
+    repairimpossible = true;
+  }
+
+  dispatch_semaphore_signal(genericSema);
+}
+
 // Attempt to verify all of the source files
 bool Par2Repairer::VerifySourceFiles(void)
 {
@@ -1262,6 +1494,8 @@ bool Par2Repairer::VerifySourceFiles(void)
   __block bool lAllFilesResult = true;    // Optimistic default
   dispatch_apply(sortedfiles.size(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
                  ^(size_t aIndex){
+                   if (this->repairimpossible)
+                     return;
                    if (!this->Verify1SourceFile(lSourceFileArray[aIndex]))
                    {
                      dispatch_semaphore_wait(genericSema, DISPATCH_TIME_FOREVER);
@@ -1316,8 +1550,8 @@ bool Par2Repairer::Verify1SourceFile (Par2RepairerSourceFile* aSourcefile)
     diskFileMap.Insert(diskfile);
     assert(success);
     
-    // Do the actual verification
-    if (!VerifyDataFile(diskfile, aSourcefile))
+    // Do the actual verification, unless the session knows the file already
+    if (!ReplayDataFile(diskfile, aSourcefile) && !VerifyDataFile(diskfile, aSourcefile))
       rv = false;
     
     // We have finished with the file for now
@@ -1340,6 +1574,9 @@ bool Par2Repairer::Verify1SourceFile (Par2RepairerSourceFile* aSourcefile)
       dispatch_semaphore_signal(coutSema);
     }
   } // End file does not exist
+
+  FileScanned(DiskFile::GetFileSize(filename));
+
   OSXStuff::ReleaseAutoreleasePool(lPool);
   return rv;
 }
@@ -1363,11 +1600,26 @@ bool Par2Repairer::VerifyExtraFiles(const list<CommandLine::ExtraFile> &extrafil
     lExtraFileArray[i++] = &(*lIter);
   }
   
+  // Stop as soon as there are enough data blocks and recovery blocks for the repair. Each
+  // data block that is found for the first time brings that moment one block closer.
+  // But a file that is missing may be among the extra files under another name, and
+  // renaming it is much quicker than repairing it. So if any file is missing, all extra
+  // files are scanned.
+  bool lookforrenamed = false;
+  for (vector<Par2RepairerSourceFile*>::const_iterator sf = sourcefiles.begin(); sf != sourcefiles.end(); ++sf)
+  {
+    if (*sf != 0 && !(*sf)->GetTargetExists())
+      lookforrenamed = true;
+  }
+  blocksneeded = (long)missingblockcount - (long)recoverypacketmap.size();
+  countblocksneeded = !lookforrenamed;
+
   __block bool lMustContinue = true;  // Shared by all dispatched blocks
+  __block size_t lSkipped = 0;        // Extra files that were not scanned
   dispatch_apply(extrafiles.size(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
                  ^(size_t aIndex){
                    dispatch_semaphore_wait(genericSema, DISPATCH_TIME_FOREVER); // Protect lMustContinue
-                   if (lMustContinue)
+                   if (lMustContinue && !this->EnoughBlocksFound() && !this->repairimpossible)
                    {
                      dispatch_semaphore_signal(genericSema);
                      if (this->Verify1ExtraFile(lExtraFileArray[aIndex]) == 1)
@@ -1381,11 +1633,20 @@ bool Par2Repairer::VerifyExtraFiles(const list<CommandLine::ExtraFile> &extrafil
                    }
                    else
                    {
+                     lSkipped++;
                      dispatch_semaphore_signal(genericSema);
                    }
                  });
   
   free (lExtraFileArray);
+
+  if (lSkipped > 0 && EnoughBlocksFound() && noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Enough data has been found for the repair; the remaining extra files were not scanned." << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+  countblocksneeded = false;
   
   return true;
 }
@@ -1426,12 +1687,15 @@ int Par2Repairer::Verify1ExtraFile(const CommandLine::ExtraFile *aExtraFile)
       diskFileMap.Insert(diskfile);
       assert(success);
       
-      // Do the actual verification
-      VerifyDataFile(diskfile, 0);
+      // Do the actual verification, unless the session knows the file already
+      if (!ReplayDataFile(diskfile, 0))
+        VerifyDataFile(diskfile, 0);
       // Ignore errors
       
       // We have finished with the file for now
       diskfile->Close();
+
+      FileScanned(diskfile->FileSize());
       
       dispatch_semaphore_wait(genericSema, DISPATCH_TIME_FOREVER);
       // Find out how much data we have found
@@ -1442,7 +1706,8 @@ int Par2Repairer::Verify1ExtraFile(const CommandLine::ExtraFile *aExtraFile)
        we are sure a real repair is necessary. The alternative, calling CheckVerificationResults,
        results in a start of the repair as soon as we have enough data, even if some more files
        might easily have been renamed. As scanning is MUCH quicker than repairing, use the
-       former approach. */
+       former approach. (VerifyExtraFiles does stop once there is enough data for the repair,
+       but only when no file is missing, so that there is nothing to be found renamed.) */
       //if (CheckVerificationResults (1)) // Silent verification (alternative)
       if (completefilecount + renamedfilecount >= mainpacket->RecoverableFileCount())
       {
@@ -1466,6 +1731,12 @@ bool Par2Repairer::VerifyDataFile(DiskFile *diskfile, Par2RepairerSourceFile *so
   if (blockverifiable)
   {
     u32 count;
+    vector<Session::FoundBlock> found;
+    bool scanned;
+
+    // The identity is taken before the scan, so that a change during the scan is noticed
+    Session::FileIdentity identity;
+    bool haveidentity = session.IsOpen() && Session::GetIdentity(diskfile->FileName(), identity);
 
     // Scan the file at the block level.
 
@@ -1474,7 +1745,9 @@ bool Par2Repairer::VerifyDataFile(DiskFile *diskfile, Par2RepairerSourceFile *so
                       matchtype,  // [out]
                       hashfull,   // [out]
                       hash16k,    // [out]
-                      count))     // [out]
+                      count,      // [out]
+                      found,      // [out]
+                      scanned))   // [out]
     {
 #ifdef DEBUG
       cerr << "trace: ScanDataFile returned false in Par2Repairer::VerifyDataFile" << endl;
@@ -1482,6 +1755,18 @@ bool Par2Repairer::VerifyDataFile(DiskFile *diskfile, Par2RepairerSourceFile *so
       return false;
     }
 
+    // Keep what was found for the next run, unless the scan was cut short or a file
+    // without verification packet might still match the whole file.
+    if (haveidentity && scanned && (matchtype != eNoMatch || unverifiablesourcefiles.empty()))
+    {
+      MD5Hash completefile;
+      memset(&completefile, 0, sizeof(completefile));
+      if (matchtype == eFullMatch)
+        completefile = sourcefile->GetDescriptionPacket()->FileId();
+
+      session.SetBlocks(diskfile->FileName(), identity, found, matchtype == eFullMatch, completefile);
+    }
+
     switch (matchtype)
     {
     case eNoMatch:
@@ -1636,6 +1921,69 @@ bool Par2Repairer::VerifyDataFile(DiskFile *diskfile, Par2RepairerSourceFile *so
   return true;
 }
 
+// Use the blocks that the session found in the DiskFile when it was scanned last time
+bool Par2Repairer::ReplayDataFile(DiskFile *diskfile, Par2RepairerSourceFile *sourcefile)
+{
+  if (!session.IsOpen() || !blocksallocated)
+    return false;
+
+  Session::FileIdentity identity;
+  vector<Session::FoundBlock> found;
+  bool complete;
+  MD5Hash completefile;
+  if (!Session::GetIdentity(diskfile->FileName(), identity) ||
+      identity.size != diskfile->FileSize() ||
+      !session.FindBlocks(diskfile->FileName(), identity, found, complete, completefile))
+    return false;
+
+  // Check all of it before using any of it
+  Par2RepairerSourceFile *completesourcefile = 0;
+  if (complete)
+  {
+    map<MD5Hash, Par2RepairerSourceFile*>::iterator sfmi = sourcefilemap.find(completefile);
+    if (sfmi == sourcefilemap.end() || sfmi->second->GetCompleteFile() != 0)
+      return false;
+    completesourcefile = sfmi->second;
+  }
+  for (vector<Session::FoundBlock>::const_iterator b = found.begin(); b != found.end(); ++b)
+  {
+    if (b->blocknumber >= sourceblockcount ||
+        b->offset + sourceblocks[b->blocknumber].GetLength() > diskfile->FileSize())
+      return false;
+  }
+
+  // Record the matches, just like ScanDataFile does
+  dispatch_semaphore_wait(foundSema, DISPATCH_TIME_FOREVER);
+  for (vector<Session::FoundBlock>::const_iterator b = found.begin(); b != found.end(); ++b)
+  {
+    DataBlock &datablock = sourceblocks[b->blocknumber];
+    if (!datablock.IsSet())
+      __sync_sub_and_fetch(&blocksneeded, 1);
+    datablock.SetLocation(diskfile, b->offset);
+  }
+  dispatch_semaphore_signal(foundSema);
+
+  if (completesourcefile != 0)
+    completesourcefile->SetCompleteFile(diskfile);
+
+  if (noiselevel > CommandLine::nlSilent)
+  {
+    string path;
+    string name;
+    DiskFile::SplitFilename(diskfile->FileName(), path, name);
+
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << (sourcefile != 0 ? "Target: \"" : "File: \"") << DiskFile::FS2UTF8(name) << "\" - unchanged, ";
+    if (complete)
+      cout << "found." << endl;
+    else
+      cout << found.size() << " data blocks known from the session." << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return true;
+}
+
 // Perform a sliding window scan of the DiskFile looking for blocks of data that 
 // might belong to any of the source files (for which a verification packet was
 // available). If a block of data might be from more than one source file, prefer
@@ -1646,12 +1994,16 @@ bool Par2Repairer::ScanDataFile(DiskFile                *diskfile,    // [in]
                                 MatchType               &matchtype,   // [out]
                                 MD5Hash                 &hashfull,    // [out]
                                 MD5Hash                 &hash16k,     // [out]
-                                u32                     &count)       // [out]
+                                u32                     &count,       // [out]
+                                vector<Session::FoundBlock> &found,   // [out]
+                                bool                    &scanned)     // [out]
 {
   // Remember which file we wanted to match
   Par2RepairerSourceFile *originalsourcefile = sourcefile;
 
   matchtype = eNoMatch;
+  found.clear();
+  scanned = true;
 
   string path;
   string name;
@@ -1705,6 +2057,11 @@ bool Par2Repairer::ScanDataFile(DiskFile                *diskfile,    // [in]
       
       datablock.SetLocation(diskfile, offset);
       datablock.SetLength(min(blocksize, filesize-offset));
+
+      Session::FoundBlock block;
+      block.blocknumber = (u32)(&datablock - &sourceblocks[0]);
+      block.offset = offset;
+      found.push_back(block);
       
       offset += blocksize;
       ++sb;
@@ -1749,6 +2106,22 @@ bool Par2Repairer::ScanDataFile(DiskFile                *diskfile,    // [in]
     // Whilst we have not reached the end of the file
     while (filechecksummer.Offset() < diskfile->FileSize())
     {
+      // The rest of an extra file is not needed once the repair is certain to succeed.
+      // The blocks found so far are kept.
+      if (originalsourcefile == 0 && EnoughBlocksFound())
+      {
+        matchtype = ePartialMatch;
+        scanned = false;
+        break;
+      }
+      // Nor is the rest of any file, once it is clear that the repair is impossible
+      if (repairimpossible)
+      {
+        matchtype = ePartialMatch;
+        scanned = false;
+        break;
+      }
+
       // Define MPDL to suppress all percentages. This speeds up things considerably.
 #ifndef MPDL
       if (noiselevel > CommandLine::nlQuiet)
@@ -1809,8 +2182,26 @@ bool Par2Repairer::ScanDataFile(DiskFile                *diskfile,    // [in]
 
         if (blocksallocated)
         {
-          // Record the match
+          // Record the match. If the block had not been found before, one block less
+          // is needed.
+          dispatch_semaphore_wait(foundSema, DISPATCH_TIME_FOREVER);
+          if (!currententry->IsSet())
+            __sync_sub_and_fetch(&blocksneeded, 1);
           currententry->SetBlock(diskfile, filechecksummer.Offset());
+          dispatch_semaphore_signal(foundSema);
+
+          // Keep the data, so that a repair does not have to read it again
+          blockcache.Insert(diskfile, filechecksummer.Offset(), filechecksummer.WindowData(),
+                            (size_t)currententry->GetDataBlock()->GetLength());
+
+          // Add the block to the syndromes (only the first time it is found)
+          syndromes.Add(rs, (u32)(currententry->GetDataBlock() - &sourceblocks[0]), filechecksummer.WindowData(),
+                        (size_t)currententry->GetDataBlock()->GetLength());
+
+          Session::FoundBlock block;
+          block.blocknumber = (u32)(currententry->GetDataBlock() - &sourceblocks[0]);
+          block.offset = filechecksummer.Offset();
+          found.push_back(block);
         }
 
         // Update the number of matches found
@@ -2217,9 +2608,36 @@ bool Par2Repairer::RenameTargetFiles(void)
   {
     Par2RepairerSourceFile *sourcefile = *sf;
 
-    // If the target file exists but is not a complete version of the file
+    // An interrupted repair in place may have left a journal behind. A file that is
+    // repaired in place again continues it (see CreateTargetFiles); otherwise it is
+    // no longer needed if the file is complete, or else it puts the file back as it
+    // was before it is renamed.
+    if (sourcefile->GetTargetExists() &&
+        (sourcefile->GetTargetFile() == sourcefile->GetCompleteFile() || !CanRepairInPlace(sourcefile)))
+    {
+      DiskFile *targetfile = sourcefile->GetTargetFile();
+      RepairJournal journal;
+      if (journal.Find(targetfile))
+      {
+        if (targetfile == sourcefile->GetCompleteFile())
+        {
+          journal.Finish();
+        }
+        else
+        {
+          if (targetfile->IsOpen())
+            targetfile->Close();
+          if (!journal.Rollback())
+            return false;
+        }
+      }
+    }
+
+    // If the target file exists but is not a complete version of the file,
+    // and it cannot be patched where it is
     if (sourcefile->GetTargetExists() && 
-        sourcefile->GetTargetFile() != sourcefile->GetCompleteFile())
+        sourcefile->GetTargetFile() != sourcefile->GetCompleteFile() &&
+        !CanRepairInPlace(sourcefile))
     {
       DiskFile *targetfile = sourcefile->GetTargetFile();
 
@@ -2285,6 +2703,45 @@ bool Par2Repairer::RenameTargetFiles(void)
   return true;
 }
 
+bool Par2Repairer::CanRepairInPlace(Par2RepairerSourceFile *sourcefile) const
+{
+  DiskFile *targetfile = sourcefile->GetTargetFile();
+
+  // A complete version elsewhere is simply renamed
+  if (targetfile == 0 || sourcefile->GetCompleteFile() != 0)
+    return false;
+
+  vector<DataBlock>::iterator first = sourcefile->SourceBlocks();
+  vector<DataBlock>::iterator last = first + sourcefile->BlockCount();
+  bool found = false;
+
+  // Iterate through all source blocks for all files
+  vector<DataBlock>::const_iterator sb = sourceblocks.begin();
+  while (sb != sourceblocks.end())
+  {
+    bool ownblock = sb >= first && sb < last;
+
+    if (ownblock && sb->IsSet())
+    {
+      // Blocks of the file that are elsewhere would have to be copied in
+      if (sb->GetDiskFile() != targetfile || sb->GetOffset() != (u64)(sb - first) * blocksize)
+        return false;
+
+      found = true;
+    }
+    else if (!ownblock && sb->GetDiskFile() == targetfile)
+    {
+      // The block might be overwritten before it is read
+      return false;
+    }
+
+    ++sb;
+  }
+
+  // If nothing of the file survived, patching is no better than creating it
+  return found;
+}
+
 // Work out which files are being repaired, create them, and allocate
 // target DataBlocks to them, and remember them for later verification.
 bool Par2Repairer::CreateTargetFiles(void)
@@ -2304,9 +2761,19 @@ bool Par2Repairer::CreateTargetFiles(void)
       string filename = sourcefile->TargetFileName();
       u64 filesize = sourcefile->GetDescriptionPacket()->FileSize();
 
-      // Create the target file
-      if (!targetfile->Create(filename, filesize))
+      // Create the target file, or with --resume, take up the one that an interrupted
+      // run was writing. The checkpoint decides whether its contents are of any use;
+      // if not, all of it is written again.
+      if (resume)
+        filename += ".par2part";
+      bool created = resume && DiskFile::FileExists(filename)
+                   ? targetfile->OpenForUpdate(filename) &&
+                     (targetfile->FileSize() == filesize || targetfile->SetLength(filesize))
+                   : targetfile->Create(filename, filesize);
+      if (!created)
       {
+        if (targetfile->IsOpen())
+          targetfile->Close();
         delete targetfile;
         return false;
       }
@@ -2340,18 +2807,217 @@ bool Par2Repairer::CreateTargetFiles(void)
       // Add the file to the list of those that will need to be verified
       // once the repair has completed.
       verifylist.push_back(sourcefile);
+
+      // The file is written to in every pass, but need not stay open in between
+      DiskFilePool::Adopt(targetfile);
     }
+    // If the damaged file was kept to be repaired in place
+    else if (sourcefile->GetTargetFile() != sourcefile->GetCompleteFile())
+    {
+      DiskFile *targetfile = sourcefile->GetTargetFile();
+      u64 filesize = sourcefile->GetDescriptionPacket()->FileSize();
 
-    ++sf;
-    ++filenumber;
-  }
+      if (targetfile->IsOpen())
+        targetfile->Close();
+      if (!targetfile->OpenForUpdate())
+        return false;
 
-  return true;
-}
+      RepairJournal *journal = new RepairJournal;
+      journals[targetfile] = journal;
+      if (!journal->Start(targetfile))
+        return false;
 
-// Work out which data blocks are available, which need to be copied
-// directly to the output, and which need to be recreated, and compute
-// the appropriate Reed Solomon matrix.
+      // Add the file to the list of those that will need to be verified
+      // once the repair has completed (and rolled back if that fails).
+      verifylist.push_back(sourcefile);
+
+      u64 offset = 0;
+      vector<DataBlock>::iterator sb = sourcefile->SourceBlocks();
+      vector<DataBlock>::iterator tb = sourcefile->TargetBlocks();
+
+      // Only the missing blocks are written. The blocks that were found are
+      // already in place, so their target DataBlocks stay unset and they are
+      // not copied.
+      while (offset < filesize)
+      {
+        if (!sb->IsSet())
+        {
+          DataBlock &datablock = *tb;
+
+          datablock.SetLocation(targetfile, offset);
+          datablock.SetLength(min(blocksize, filesize-offset));
+
+          if (!journal->Save(offset, datablock.GetLength()))
+          {
+            // Nothing has been overwritten yet, but an interrupted repair whose
+            // journal was continued may have
+            journal->Rollback();
+            return false;
+          }
+        }
+
+        offset += blocksize;
+        ++sb;
+        ++tb;
+      }
+
+      // Cut off or extend the file
+      if (!journal->SetLength(filesize))
+      {
+        journal->Rollback();
+        return false;
+      }
+
+      // The journal must be safe before anything is overwritten
+      if (!journal->Seal())
+      {
+        journal->Rollback();
+        return false;
+      }
+      DiskFilePool::Adopt(targetfile);
+
+      if (noiselevel > CommandLine::nlQuiet)
+      {
+        dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+        cout << "Repairing in place: " << DiskFile::FS2UTF8(sourcefile->TargetFileName()) << endl;
+        dispatch_semaphore_signal(coutSema);
+      }
+    }
+
+    ++sf;
+    ++filenumber;
+  }
+
+  return true;
+}
+
+// A recovery file and the recovery packets in it that may be used
+struct RecoveryVolume
+{
+  DiskFile         *diskfile;
+  bool              otherdevice;   // Not on the same device as any target file
+  vector<u32>       exponents;     // The candidate packets, in file order
+};
+
+static bool SortVolumesByPreference(const RecoveryVolume &low, const RecoveryVolume &high)
+{
+  if (low.otherdevice != high.otherdevice)
+    return low.otherdevice;
+  return low.exponents.size() > high.exponents.size();
+}
+
+void Par2Repairer::SelectRecoveryPackets(u32 count)
+{
+  recoveryexponents.clear();
+
+  // With syndromes, only the packets that have one save reading the data blocks
+  bool needsyndrome = false;
+  if (syndromes.IsActive())
+  {
+    u32 withsyndrome = 0;
+    for (map<u32,RecoveryPacket*>::iterator rp = recoverypacketmap.begin(); rp != recoverypacketmap.end(); ++rp)
+    {
+      if (syndromes.Syndrome((u16)rp->first) != 0)
+        withsyndrome++;
+    }
+    needsyndrome = withsyndrome >= count;
+  }
+
+  // The devices of the target files
+  set<u64> targetdevices;
+  for (vector<Par2RepairerSourceFile*>::iterator sf = verifylist.begin(); sf != verifylist.end(); ++sf)
+  {
+    u64 device;
+    if ((*sf)->GetTargetFile() != 0 && (*sf)->GetTargetFile()->Device(device))
+      targetdevices.insert(device);
+  }
+
+  // Group the candidate packets by recovery file. Packets whose data is in the file
+  // system cache cost nothing to read, so they are taken first.
+  map<DiskFile*, RecoveryVolume> volumemap;
+  for (map<u32,RecoveryPacket*>::iterator rp = recoverypacketmap.begin(); rp != recoverypacketmap.end(); ++rp)
+  {
+    if (needsyndrome && syndromes.Syndrome((u16)rp->first) == 0)
+      continue;
+
+    DataBlock *datablock = rp->second->GetDataBlock();
+    RecoveryVolume &volume = volumemap[datablock->GetDiskFile()];
+    if (volume.diskfile == 0)
+    {
+      u64 device;
+      volume.diskfile = datablock->GetDiskFile();
+      volume.otherdevice = !volume.diskfile->Device(device) || targetdevices.count(device) == 0;
+    }
+    volume.exponents.push_back(rp->first);
+  }
+
+  vector<RecoveryVolume> volumes;
+  set<u32> selected;
+  for (map<DiskFile*, RecoveryVolume>::iterator v = volumemap.begin(); v != volumemap.end(); ++v)
+  {
+    RecoveryVolume &volume = v->second;
+
+    // The pool keeps the file open for the repair passes
+    if (DiskFilePool::Acquire(volume.diskfile))
+    {
+      for (vector<u32>::iterator e = volume.exponents.begin(); e != volume.exponents.end() && selected.size() < count; ++e)
+      {
+        DataBlock *datablock = recoverypacketmap[*e]->GetDataBlock();
+        if (volume.diskfile->ResidentLength(datablock->GetOffset(), datablock->GetLength()) == datablock->GetLength())
+          selected.insert(*e);
+      }
+      DiskFilePool::Release(volume.diskfile);
+    }
+
+    // Packets in a file are read in the order of their offsets
+    vector<pair<u64, u32> > byoffset;
+    for (vector<u32>::iterator e = volume.exponents.begin(); e != volume.exponents.end(); ++e)
+    {
+      if (selected.count(*e) == 0)
+        byoffset.push_back(pair<u64, u32>(recoverypacketmap[*e]->GetDataBlock()->GetOffset(), *e));
+    }
+    sort(byoffset.begin(), byoffset.end());
+
+    volume.exponents.clear();
+    for (size_t i = 0; i < byoffset.size(); i++)
+      volume.exponents.push_back(byoffset[i].second);
+
+    volumes.push_back(volume);
+  }
+
+  // Then take contiguous runs of packets from as few files as possible, preferring
+  // files that are not on the same device as the files being written.
+  sort(volumes.begin(), volumes.end(), SortVolumesByPreference);
+  u32 volumecount = 0;
+  for (vector<RecoveryVolume>::iterator v = volumes.begin(); v != volumes.end() && selected.size() < count; ++v)
+  {
+    for (vector<u32>::iterator e = v->exponents.begin(); e != v->exponents.end() && selected.size() < count; ++e)
+      selected.insert(*e);
+    volumecount++;
+  }
+
+  recoveryexponents.assign(selected.begin(), selected.end());
+
+  // Should never happen, as there are enough recovery packets; fall back on
+  // exponent order.
+  for (map<u32,RecoveryPacket*>::iterator rp = recoverypacketmap.begin();
+       recoveryexponents.size() < count && rp != recoverypacketmap.end(); ++rp)
+  {
+    if (selected.count(rp->first) == 0)
+      recoveryexponents.push_back(rp->first);
+  }
+
+  if (noiselevel > CommandLine::nlNormal && count > 0)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Using " << count << " recovery blocks, read from " << volumecount << " recovery files." << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+}
+
+// Work out which data blocks are available, which need to be copied
+// directly to the output, and which need to be recreated, and compute
+// the appropriate Reed Solomon matrix.
 bool Par2Repairer::ComputeRSmatrix(void)
 {
   inputblocks.resize(sourceblockcount);   // The DataBlocks that will read from disk
@@ -2410,15 +3076,16 @@ bool Par2Repairer::ComputeRSmatrix(void)
   if (!rs.SetInput(present))
     return false;
 
-  // Start iterating through the available recovery packets
-  map<u32,RecoveryPacket*>::iterator rp = recoverypacketmap.begin();
+  // Pick the recovery packets that are cheapest to read
+  SelectRecoveryPackets((u32)(inputblocks.end() - inputblock));
+  vector<u32>::iterator re = recoveryexponents.begin();
 
   // Continue to fill the remaining list of data blocks to be read
   while (inputblock != inputblocks.end())
   {
-    // Get the next available recovery packet
-    u32 exponent = rp->first;
-    RecoveryPacket* recoverypacket = rp->second;
+    // Get the next selected recovery packet
+    u32 exponent = *re;
+    RecoveryPacket* recoverypacket = recoverypacketmap[exponent];
 
     // Get the DataBlock from the recovery packet
     DataBlock *recoveryblock = recoverypacket->GetDataBlock();
@@ -2436,7 +3103,49 @@ bool Par2Repairer::ComputeRSmatrix(void)
       return false;
 
     ++inputblock;
-    ++rp;
+    ++re;
+  }
+
+  // Decide which inputs go through the RS matrix. Present data blocks that have been
+  // added to the syndromes are accounted for by combining the recovery blocks with
+  // their syndromes. That only works if all recovery blocks that are used have one.
+  inputviasyndrome.assign(sourceblockcount, false);
+  inputsyndrome.assign(sourceblockcount, (const u8*)0);
+  rsinputcount = sourceblockcount;
+
+  bool usesyndromes = syndromes.IsActive() && missingblockcount > 0;
+  re = recoveryexponents.begin();
+  for (u32 i = availableblockcount; usesyndromes && i < sourceblockcount; i++, ++re)
+  {
+    inputsyndrome[i] = syndromes.Syndrome((u16)*re);
+    usesyndromes = inputsyndrome[i] != 0;
+  }
+
+  if (usesyndromes)
+  {
+    // Only the syndromes of the recovery blocks that are used are needed from now on
+    vector<u16> usedexponents(recoveryexponents.begin(), recoveryexponents.begin() + missingblockcount);
+    syndromes.Keep(usedexponents);
+
+    for (u32 i = 0; i < availableblockcount; i++)
+    {
+      inputviasyndrome[i] = syndromes.Contains((u32)(inputblocks[i] - &sourceblocks[0]));
+      if (inputviasyndrome[i])
+        rsinputcount--;
+    }
+
+    if (noiselevel > CommandLine::nlNormal)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cout << "Using syndromes: " << sourceblockcount - rsinputcount << " data blocks need not be processed again." << endl;
+      dispatch_semaphore_signal(coutSema);
+    }
+  }
+  else
+  {
+    // Not enough syndromes for the number of missing blocks
+    inputsyndrome.assign(sourceblockcount, (const u8*)0);
+    syndromes.Release();
   }
 
   // If we need to, compute and solve the RS matrix
@@ -2448,23 +3157,122 @@ bool Par2Repairer::ComputeRSmatrix(void)
   return success;  
 }
 
+// Write part of a block that is copied to its target file, which is taken from the pool
+bool Par2Repairer::WriteTargetData(DataBlock *targetblock, u64 blockoffset, size_t blocklength, const void *buffer, size_t &wrote)
+{
+  DiskFile *targetfile = targetblock->GetDiskFile();
+  if (!DiskFilePool::Acquire(targetfile))
+    return false;
+
+  bool success = targetblock->WriteData(blockoffset, blocklength, buffer, wrote);
+  DiskFilePool::Release(targetfile);
+
+  return success;
+}
+
+// Copy intact blocks by reflinking or with copy_file_range.
+void Par2Repairer::CopyIntactBlocks(void)
+{
+  u32 copied = 0;
+  u32 failed = 0;
+
+  for (u32 i = 0; i < copyblocks.size(); i++)
+  {
+    DataBlock *targetblock = copyblocks[i];
+    DataBlock *sourceblock = inputblocks[i];
+    if (!targetblock->IsSet())
+      continue;
+
+    // The pool keeps the files open; the blocks are mostly grouped by file
+    DiskFile *targetfile = targetblock->GetDiskFile();
+    DiskFile *sourcefile = sourceblock->GetDiskFile();
+    if (!DiskFilePool::Acquire(targetfile))
+      continue;
+    if (!DiskFilePool::Acquire(sourcefile))
+    {
+      DiskFilePool::Release(targetfile);
+      continue;
+    }
+
+    bool success = targetblock->CopyDataFrom(*sourceblock);
+    DiskFilePool::Release(sourcefile);
+    DiskFilePool::Release(targetfile);
+
+    if (success)
+    {
+      // ProcessData does not have to copy this block. It does not pass through memory to
+      // be checked, but it was checked where it was found.
+      targetblock->ClearLocation();
+      if (i < copyverified.size())
+        copyverified[i] = true;
+      copied++;
+    }
+    else if (copied == 0)
+    {
+      // Without any success so far, the OS or file system does not support it
+      failed++;
+      break;
+    }
+    else
+    {
+      failed++;
+    }
+  }
+
+  if (noiselevel > CommandLine::nlNormal && copied > 0)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Copied " << copied << " intact blocks without reading them";
+    if (failed > 0)
+      cout << "; " << failed << " have to be copied the usual way";
+    cout << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+}
+
 // Allocate memory buffers for reading and writing data to disk.
 bool Par2Repairer::AllocateBuffers(size_t memorylimit)
 {
+  // The output buffer, the input buffer and the buffer for combining a recovery block
+  // with its syndrome all come out of the budget, and so do the syndromes themselves
+  size_t syndromememory = syndromes.MemoryUsed();
+  memorylimit = memorylimit > syndromememory ? memorylimit - syndromememory : 0;
+  u32 chunkcount = missingblockcount + (syndromes.IsActive() ? 1 : 0);
+
   // Would single pass processing use too much memory
-  if (blocksize * missingblockcount > memorylimit)
+  if (blocksize * chunkcount + AsyncBlockReader::MinimumBufferSize((size_t)blocksize) > memorylimit)
   {
     // Pick a size that is small enough
-    chunksize = ~3 & (memorylimit / missingblockcount);
+    chunksize = AsyncBlockReader::LargestChunkSize(memorylimit, chunkcount);
   }
   else
   {
     chunksize = (size_t)blocksize;
   }
 
-  // Allocate the two buffers
-  inputbuffer = new u8[(size_t)chunksize];
-  outputbuffer = new u8[(size_t)chunksize * missingblockcount];
+  if (chunksize == 0)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "The memory limit is too small for the repair." << endl;
+    dispatch_semaphore_signal(coutSema);
+    return false;
+  }
+
+  // Allocate the two buffers. The input buffer has room for several chunks, so that
+  // the reads of the next input blocks can be in flight while one is processed. It gets
+  // what the other buffers leave of the memory limit.
+  size_t otherbuffersize = (size_t)chunksize * chunkcount;
+  readslotcount = AsyncBlockReader::SlotCount((size_t)chunksize, memorylimit > otherbuffersize ? memorylimit - otherbuffersize : 0);
+  inputbuffer = AlignedBufferPool::Get(AlignedBufferPool::RoundUp((size_t)chunksize) * readslotcount);
+  outputbuffer = AlignedBufferPool::Get((size_t)chunksize * missingblockcount);
+
+  // Room for a recovery block combined with its syndrome
+  if (syndromes.IsActive())
+  {
+    syndromebuffer = AlignedBufferPool::Get((size_t)chunksize);
+    if (syndromebuffer == NULL)
+      outputbuffer = NULL;
+  }
 
   if (inputbuffer == NULL || outputbuffer == NULL)
   {
@@ -2489,65 +3297,90 @@ bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength)
   vector<DataBlock*>::iterator copyblock  = copyblocks.begin();
   u32                          inputindex = 0;
 
-  DiskFile *lastopenfile = NULL;
+  // The reader keeps the reads for the next input blocks in flight, and takes
+  // the files from the pool as needed.
+  AsyncBlockReader reader;
 
   // Are there any blocks which need to be reconstructed
   if (missingblockcount > 0)
   {
-    // For each input block
-    while (inputblock != inputblocks.end())       
+    // Present data blocks that are accounted for by the syndromes only have to be
+    // read if they must be copied.
+    vector<DataBlock*> readblocks;
+    vector<u32>        readindices;
+    for (u32 i = 0; i < inputblocks.size(); i++)
+    {
+      if (!inputviasyndrome[i] || (i < copyblocks.size() && copyblocks[i]->IsSet()))
+      {
+        readblocks.push_back(inputblocks[i]);
+        readindices.push_back(i);
+      }
+    }
+
+    if (!reader.Start(readblocks, blockoffset, blocklength, inputbuffer, AlignedBufferPool::RoundUp((size_t)chunksize),
+                      readslotcount, &blockcache, mappedinput))
+      return false;
+
+    // For each input block that is read
+    for (size_t readindex = 0; readindex < readblocks.size(); readindex++)
     {
       void *lPool = OSXStuff::SetupAutoreleasePool();   // Because we use Cocoa along the way
-      // Are we reading from a new file?
-      if (lastopenfile != (*inputblock)->GetDiskFile())
+
+      // Wait for the data of the current input block
+      const void *lInput = reader.Next();
+      if (lInput == NULL)
       {
-        // Close the last file
-        if (lastopenfile != NULL)
-        {
-          lastopenfile->Close();
-        }
+        OSXStuff::ReleaseAutoreleasePool(lPool);
+        return false;
+      }
+      inputindex = readindices[readindex];
+
+      // Is this a source data block that needs to be copied to the target file
+      if (inputindex < copyblocks.size() && copyblocks[inputindex]->IsSet())
+      {
+        size_t wrote;
 
-        // Open the new file
-        lastopenfile = (*inputblock)->GetDiskFile();
-        if (!lastopenfile->Open(false))  // false: don't expect to read all data of the file
+        // Write the block back to disk in the new target file
+        if (!WriteTargetData(copyblocks[inputindex], blockoffset, blocklength, lInput, wrote))
         {
           OSXStuff::ReleaseAutoreleasePool(lPool);
           return false;
         }
-      }
+        CheckCopiedBlock(inputindex, blockoffset, blocklength, lInput);
 
-      // Read data from the current input block
-      if (!(*inputblock)->ReadData(blockoffset, blocklength, inputbuffer))
-      {
-        OSXStuff::ReleaseAutoreleasePool(lPool);
-        return false;
+        totalwritten += wrote;
       }
 
-      // Have we reached the last source data block
-      if (copyblock != copyblocks.end())
+      if (!inputviasyndrome[inputindex])
       {
-        // Does this block need to be copied to the target file
-        if ((*copyblock)->IsSet())
+        if (inputsyndrome[inputindex] != 0)
         {
-          size_t wrote;
-
-          // Write the block back to disk in the new target file
-          if (!(*copyblock)->WriteData(blockoffset, blocklength, inputbuffer, wrote))
+          // Combine the recovery block with its syndrome, which removes the contribution
+          // of the data blocks that were found during verification.
+          const u32 *lRecovery = (const u32 *)lInput;
+          const u32 *lSyndrome = (const u32 *)&inputsyndrome[inputindex][blockoffset];
+          u32 *lCombined = (u32 *)syndromebuffer;
+          for (size_t word = 0; word < blocklength / 4; word++)
           {
-            OSXStuff::ReleaseAutoreleasePool(lPool);
-            return false;
+            lCombined[word] = lRecovery[word] ^ lSyndrome[word];
           }
+          lInput = syndromebuffer;
+        }
 
-          totalwritten += wrote;
+        // A block of zeroes adds nothing to the missing blocks
+        if (!ZeroBlock::IsZero(lInput, blocklength))
+        {
+          // Function to process things in multiple threads if appropariate
+          this->RepairMissingBlocks (blocklength, inputindex, lInput);
+        }
+        else if (noiselevel > CommandLine::nlQuiet)
+        {
+          dispatch_semaphore_wait(genericSema, DISPATCH_TIME_FOREVER);
+          progress += (u64)blocklength * missingblockcount;
+          dispatch_semaphore_signal(genericSema);
         }
-        ++copyblock;
       }
 
-			// Function to process things in multiple threads if appropariate
-			this->RepairMissingBlocks (blocklength, inputindex);
-
-      ++inputblock;
-      ++inputindex;
       OSXStuff::ReleaseAutoreleasePool(lPool);
     }
   }
@@ -2555,6 +3388,17 @@ bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength)
   {
     // Reconstruction is not required, we are just copying blocks between files
 
+    // Only the blocks that need to be copied are read
+    vector<DataBlock*> copysources;
+    for (u32 i = 0; i < copyblocks.size(); i++)
+    {
+      if (copyblocks[i]->IsSet())
+        copysources.push_back(inputblocks[i]);
+    }
+    if (!reader.Start(copysources, blockoffset, blocklength, inputbuffer, AlignedBufferPool::RoundUp((size_t)chunksize),
+                      readslotcount, &blockcache, mappedinput))
+      return false;
+
     // For each block that might need to be copied
     while (copyblock != copyblocks.end())
     {
@@ -2562,37 +3406,21 @@ bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength)
       // Does this block need to be copied
       if ((*copyblock)->IsSet())
       {
-        // Are we reading from a new file?
-        if (lastopenfile != (*inputblock)->GetDiskFile())
-        {
-          // Close the last file
-          if (lastopenfile != NULL)
-          {
-            lastopenfile->Close();
-          }
-
-          // Open the new file
-          lastopenfile = (*inputblock)->GetDiskFile();
-          if (!lastopenfile->Open(false))  // false: don't expect to read all data of the file
-          {
-            OSXStuff::ReleaseAutoreleasePool(lPool);
-            return false;
-          }
-        }
-
-        // Read data from the current input block
-        if (!(*inputblock)->ReadData(blockoffset, blocklength, inputbuffer))
+        // Wait for the data of the current input block
+        const void *lInput = reader.Next();
+        if (lInput == NULL)
         {
           OSXStuff::ReleaseAutoreleasePool(lPool);
           return false;
         }
 
         size_t wrote;
-        if (!(*copyblock)->WriteData(blockoffset, blocklength, inputbuffer, wrote))
+        if (!WriteTargetData(*copyblock, blockoffset, blocklength, lInput, wrote))
         {
           OSXStuff::ReleaseAutoreleasePool(lPool);
           return false;
         }
+        CheckCopiedBlock((u32)(copyblock - copyblocks.begin()), blockoffset, blocklength, lInput);
         totalwritten += wrote;
       }
 
@@ -2631,11 +3459,9 @@ bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength)
     }
   }
 
-  // Close the last file
-  if (lastopenfile != NULL)
-  {
-    lastopenfile->Close();
-  }
+  // Give the files back to the pool
+  if (!reader.Finish())
+    return false;
 
   if (noiselevel > CommandLine::nlQuiet)
   {
@@ -2644,22 +3470,65 @@ bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength)
     dispatch_semaphore_signal(coutSema);
   }
 
-  // For each output block that has been recomputed
+  // For each output block that has been recomputed. The writes are queued, so
+  // that several of them are in flight at the same time. The target file of each
+  // write is taken from the pool until the write has completed.
+  AsyncIO writer(AsyncIOMaxQueueDepth);
+  AsyncIO::Completion completions[AsyncIOMaxQueueDepth];
+  bool writesucceeded = true;
+
   vector<DataBlock*>::iterator outputblock = outputblocks.begin();
   for (u32 outputindex=0; outputindex<missingblockcount;outputindex++)
   {
     // Select the appropriate part of the output buffer
     char *outbuf = &((char*)outputbuffer)[chunksize * outputindex];
 
+    // Make room in the queue if necessary
+    if (writer.Outstanding() == writer.QueueDepth())
+    {
+      u32 count = writer.Reap(1, completions, AsyncIOMaxQueueDepth);
+      for (u32 i = 0; i < count; i++)
+      {
+        writesucceeded = writesucceeded && completions[i].success;
+        DiskFilePool::Release(outputblocks[completions[i].tag]->GetDiskFile());
+      }
+    }
+
     // Write the data to the target file
     size_t wrote;
-    if (!(*outputblock)->WriteData(blockoffset, blocklength, outbuf, wrote))
-      return false;
+    if (!DiskFilePool::Acquire((*outputblock)->GetDiskFile()))
+    {
+      writesucceeded = false;
+      break;
+    }
+    if (!(*outputblock)->QueueWriteData(writer, blockoffset, blocklength, outbuf, wrote, outputindex))
+    {
+      DiskFilePool::Release((*outputblock)->GetDiskFile());
+      writesucceeded = false;
+      break;
+    }
     totalwritten += wrote;
 
     ++outputblock;
   }
 
+  // Compute the checksums while the last writes complete
+  if (writesucceeded)
+    CheckOutputBlocks(blockoffset, blocklength);
+
+  while (writer.Outstanding() > 0)
+  {
+    u32 count = writer.Reap(1, completions, AsyncIOMaxQueueDepth);
+    for (u32 i = 0; i < count; i++)
+    {
+      writesucceeded = writesucceeded && completions[i].success;
+      DiskFilePool::Release(outputblocks[completions[i].tag]->GetDiskFile());
+    }
+  }
+
+  if (!writesucceeded)
+    return false;
+
   if (noiselevel > CommandLine::nlQuiet)
   {
     dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
@@ -2671,7 +3540,7 @@ bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength)
 }
 
 //-----------------------------------------------------------------------------
-void Par2Repairer::RepairMissingBlocks (size_t blocklength, u32 inputindex)
+void Par2Repairer::RepairMissingBlocks (size_t blocklength, u32 inputindex, const void *inputdata)
 {
 	// Used from within ProcessData.
 	/*
@@ -2697,14 +3566,15 @@ void Par2Repairer::RepairMissingBlocks (size_t blocklength, u32 inputindex)
     // executes them simultaneously if possible. dispatch_apply exists after all block have been executed.
     dispatch_apply(lNumGCDDispatches, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
                    ^(size_t lCurrent){
-                     this->RepairMissingBlockRange (blocklength, inputindex, lCurrent * cNumBlocksPerThread, 
+                     this->RepairMissingBlockRange (blocklength, inputindex, inputdata, lCurrent * cNumBlocksPerThread,
                                                     (lCurrent + 1) * cNumBlocksPerThread);
     });
   }
 }
 
 //-----------------------------------------------------------------------------
-void Par2Repairer::RepairMissingBlockRange (size_t blocklength, u32 inputindex, u32 aStartBlockNo, u32 aEndBlockNo)
+void Par2Repairer::RepairMissingBlockRange (size_t blocklength, u32 inputindex, const void *inputdata,
+                                            u32 aStartBlockNo, u32 aEndBlockNo)
 {
 	// This function is called in multiple threads.
   // aEndBlock could be beyond the last element
@@ -2719,7 +3589,7 @@ void Par2Repairer::RepairMissingBlockRange (size_t blocklength, u32 inputindex,
 		void *outbuf = &((u8*)outputbuffer)[chunksize * outputindex];
 		
 		// Process the data
-		rs.Process(blocklength, inputindex, inputbuffer, outputindex, outbuf);
+		rs.Process(blocklength, inputindex, inputdata, outputindex, outbuf);
 		
 		if (noiselevel > CommandLine::nlQuiet)
 		{
@@ -2742,6 +3612,297 @@ void Par2Repairer::RepairMissingBlockRange (size_t blocklength, u32 inputindex,
 	}
 }
 
+void Par2Repairer::PrepareWriteVerification(void)
+{
+  outputentries.assign(missingblockcount, (const FILEVERIFICATIONENTRY*)0);
+  outputfiles.assign(missingblockcount, (Par2RepairerSourceFile*)0);
+  outputhashes.assign(missingblockcount, MD5Context());
+  outputcrcs.assign(missingblockcount, ~0);
+  outputverified.assign(missingblockcount, false);
+  copyentries.assign(copyblocks.size(), (const FILEVERIFICATIONENTRY*)0);
+  copyhashes.assign(copyblocks.size(), MD5Context());
+  copycrcs.assign(copyblocks.size(), ~0);
+  copyverified.assign(copyblocks.size(), false);
+  filestreams.clear();
+  copystreams.assign(copyblocks.size(), ~(u32)0);
+
+  // Which output block, if any, each target block is
+  vector<u32> outputindex(sourceblockcount, missingblockcount);
+  for (u32 i = 0; i < missingblockcount; i++)
+  {
+    outputindex[outputblocks[i] - &targetblocks[0]] = i;
+  }
+
+  // And which copied block
+  u32 nocopy = (u32)copyblocks.size();
+  vector<u32> copyindex(sourceblockcount, nocopy);
+  for (u32 i = 0; i < copyblocks.size(); i++)
+  {
+    if (copyblocks[i]->IsSet())
+      copyindex[copyblocks[i] - &targetblocks[0]] = i;
+  }
+
+  vector<Par2RepairerSourceFile*>::iterator sf = sourcefiles.begin();
+  while (sf != sourcefiles.end())
+  {
+    Par2RepairerSourceFile *sourcefile = *sf;
+    if (sourcefile != 0 && sourcefile->GetVerificationPacket() != 0)
+    {
+      FileStream stream;
+      stream.sourcefile = sourcefile;
+      stream.nextblock = 0;
+      stream.inorder = true;
+      stream.firstoutput = missingblockcount;
+      stream.outputlimit = 0;
+      bool written = false;
+
+      vector<DataBlock>::iterator tb = sourcefile->TargetBlocks();
+      for (u32 blocknumber = 0; blocknumber < sourcefile->BlockCount(); blocknumber++, ++tb)
+      {
+        u32 i = outputindex[&*tb - &targetblocks[0]];
+        if (i < missingblockcount)
+        {
+          outputentries[i] = sourcefile->GetVerificationPacket()->VerificationEntry(blocknumber);
+          outputfiles[i] = sourcefile;
+
+          // The output blocks of a file are next to each other
+          stream.firstoutput = min(stream.firstoutput, i);
+          stream.outputlimit = i + 1;
+          written = true;
+        }
+
+        u32 c = copyindex[&*tb - &targetblocks[0]];
+        if (c < nocopy)
+        {
+          copyentries[c] = sourcefile->GetVerificationPacket()->VerificationEntry(blocknumber);
+          copystreams[c] = (u32)filestreams.size();
+          written = true;
+        }
+      }
+
+      if (written)
+        filestreams.push_back(stream);
+    }
+
+    ++sf;
+  }
+}
+
+void Par2Repairer::CheckOutputBlocks(u64 blockoffset, size_t blocklength)
+{
+  if (outputentries.size() != missingblockcount)
+    return;
+
+  // The blocks are independent, so each can be done on its own thread
+  dispatch_apply(missingblockcount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                 ^(size_t aIndex){
+                   if (this->outputentries[aIndex] != 0)
+                   {
+                     const char *outbuf = &((const char*)this->outputbuffer)[this->chunksize * aIndex];
+                     this->outputhashes[aIndex].Update(outbuf, blocklength);
+                     this->outputcrcs[aIndex] = CRCUpdateBlock(this->outputcrcs[aIndex], blocklength, outbuf);
+                   }
+                 });
+
+  // After the last part of the blocks, compare the checksums. The output buffer holds
+  // whole blocks, so the last block of a file includes its zero padding, just like
+  // the checksums in the verification packet.
+  if (blockoffset + blocklength < blocksize)
+    return;
+
+  for (u32 i = 0; i < missingblockcount; i++)
+  {
+    if (outputentries[i] != 0)
+    {
+      MD5Hash hash;
+      outputhashes[i].Final(hash);
+      outputverified[i] = hash == outputentries[i]->hash && (~0 ^ outputcrcs[i]) == outputentries[i]->crc;
+    }
+  }
+
+  // In a single pass the whole blocks are in the output buffer
+  if (blockoffset == 0)
+    StreamOutputBlocks();
+}
+
+void Par2Repairer::CheckCopiedBlock(u32 copyindex, u64 blockoffset, size_t blocklength, const void *buffer)
+{
+  if (copyentries.size() != copyblocks.size() || copyentries[copyindex] == 0)
+    return;
+
+  // The input slot holds whole blocks, including the zero padding of the last block
+  // of a file, just like the output buffer.
+  copyhashes[copyindex].Update(buffer, blocklength);
+  copycrcs[copyindex] = CRCUpdateBlock(copycrcs[copyindex], blocklength, buffer);
+
+  if (blockoffset + blocklength < blocksize)
+    return;
+
+  // A whole block in a single pass
+  if (blockoffset == 0 && copystreams[copyindex] < filestreams.size())
+  {
+    FileStream &stream = filestreams[copystreams[copyindex]];
+    StreamBlock(copystreams[copyindex], (u32)(copyblocks[copyindex] - &*stream.sourcefile->TargetBlocks()), buffer);
+  }
+
+  MD5Hash hash;
+  copyhashes[copyindex].Final(hash);
+  copyverified[copyindex] = hash == copyentries[copyindex]->hash && (~0 ^ copycrcs[copyindex]) == copyentries[copyindex]->crc;
+}
+
+bool Par2Repairer::WrittenBlocksVerified(Par2RepairerSourceFile *sourcefile) const
+{
+  if (paranoid || outputentries.size() != missingblockcount || copyentries.size() != copyblocks.size() ||
+      sourcefile->GetVerificationPacket() == 0)
+    return false;
+
+  for (u32 i = 0; i < missingblockcount; i++)
+  {
+    if (outputfiles[i] == sourcefile && !outputverified[i])
+      return false;
+  }
+
+  // Only the blocks of this file have its verification entries
+  const FILEVERIFICATIONENTRY *first = sourcefile->GetVerificationPacket()->VerificationEntry(0);
+  const FILEVERIFICATIONENTRY *last = first + sourcefile->BlockCount();
+  for (u32 i = 0; i < copyblocks.size(); i++)
+  {
+    if (copyentries[i] >= first && copyentries[i] < last && !copyverified[i])
+      return false;
+  }
+
+  return true;
+}
+
+void Par2Repairer::StreamOutputBlocks(void)
+{
+  // Each file on its own thread
+  dispatch_apply(filestreams.size(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                 ^(size_t aIndex){
+                   FileStream &stream = this->filestreams[aIndex];
+                   for (u32 i = stream.firstoutput; i < stream.outputlimit; i++)
+                   {
+                     const char *outbuf = &((const char*)this->outputbuffer)[this->chunksize * i];
+                     this->StreamBlock((u32)aIndex, (u32)(this->outputblocks[i] - &*stream.sourcefile->TargetBlocks()), outbuf);
+                   }
+                 });
+}
+
+void Par2Repairer::StreamBlock(u32 streamindex, u32 blocknumber, const void *buffer)
+{
+  FileStream &stream = filestreams[streamindex];
+  if (!stream.inorder)
+    return;
+
+  // A block that comes too early has to be read back after all
+  if (blocknumber != stream.nextblock)
+  {
+    stream.inorder = false;
+    return;
+  }
+  stream.nextblock++;
+
+  // The zero padding of the last block is not part of the file
+  u64 offset = (u64)blocknumber * blocksize;
+  size_t length = (size_t)min(blocksize, stream.sourcefile->GetDescriptionPacket()->FileSize() - offset);
+
+  // The same hashes as FileCheckSummer computes
+  if (offset < 16384)
+    stream.context16k.Update(buffer, (size_t)min((u64)length, 16384 - offset));
+  stream.contextfull.Update(buffer, length);
+}
+
+bool Par2Repairer::ConfirmTargetFile(Par2RepairerSourceFile *sourcefile)
+{
+  DiskFile *targetfile = sourcefile->GetTargetFile();
+  const DescriptionPacket *description = sourcefile->GetDescriptionPacket();
+
+  if (targetfile->IsOpen())
+    targetfile->Close();
+
+  u64 filesize;
+  if (!DiskFile::StatFile(targetfile->FileName(), filesize) || filesize != description->FileSize())
+    return false;
+
+  const FileStream *stream = 0;
+  for (size_t i = 0; i < filestreams.size(); i++)
+  {
+    if (filestreams[i].sourcefile == sourcefile)
+      stream = &filestreams[i];
+  }
+
+  // Nothing was written through memory
+  if (stream == 0)
+    return true;
+
+  // All of the file passed through memory in order
+  if (singlepass && stream->inorder && stream->nextblock == sourcefile->BlockCount())
+  {
+    MD5Context context16k = stream->context16k;
+    MD5Context contextfull = stream->contextfull;
+    MD5Hash hash16k;
+    MD5Hash hashfull;
+    context16k.Final(hash16k);
+    contextfull.Final(hashfull);
+    return hash16k == description->Hash16k() && hashfull == description->HashFull();
+  }
+
+  // The checksums of blocks that were written in parts, over several chunk passes, are
+  // not trusted on their own
+  if (!singlepass)
+    return ReadTargetFileHashes(sourcefile);
+
+  return true;
+}
+
+bool Par2Repairer::ReadTargetFileHashes(Par2RepairerSourceFile *sourcefile)
+{
+  DiskFile *targetfile = sourcefile->GetTargetFile();
+  const DescriptionPacket *description = sourcefile->GetDescriptionPacket();
+
+  if (targetfile->IsOpen())
+    targetfile->Close();
+  if (!targetfile->Open(true))  // true: expect to read all data of the file
+    return false;
+
+  u64 filesize = targetfile->FileSize();
+  bool rv = filesize == description->FileSize();
+
+  const size_t buffersize = 1024 * 1024;
+  u8 *buffer = rv ? (u8 *)AlignedBufferPool::Get(buffersize) : 0;
+  rv = rv && buffer != 0;
+
+  // The same hashes as FileCheckSummer computes
+  MD5Context context16k;
+  MD5Context contextfull;
+  for (u64 offset = 0; rv && offset < filesize; )
+  {
+    size_t length = (size_t)min((u64)buffersize, filesize - offset);
+    rv = targetfile->Read(offset, buffer, length);
+    if (rv)
+    {
+      if (offset < 16384)
+        context16k.Update(buffer, (size_t)min((u64)length, 16384 - offset));
+      contextfull.Update(buffer, length);
+    }
+    offset += length;
+  }
+
+  AlignedBufferPool::Release(buffer);
+  targetfile->Close();
+
+  if (rv)
+  {
+    MD5Hash hash16k;
+    MD5Hash hashfull;
+    context16k.Final(hash16k);
+    contextfull.Final(hashfull);
+    rv = hash16k == description->Hash16k() && hashfull == description->HashFull();
+  }
+
+  return rv;
+}
+
 // Verify that all of the reconstructed target files are now correct.
 // Do this in multiple threads if appropriate (1 thread per processor).
 bool Par2Repairer::VerifyTargetFiles(void)
@@ -2751,25 +3912,34 @@ bool Par2Repairer::VerifyTargetFiles(void)
   // Verify the target files in alphabetical order
   sort(verifylist.begin(), verifylist.end(), SortSourceFilesByFileName);
 
-  // Make an array of simple object pointers, to be used inside the GCD block
+  // Make an array of simple object pointers, to be used inside the GCD block. Files
+  // of which every written block has been checked already need not be scanned again;
+  // ConfirmTargetFile decides what else is checked.
   Par2RepairerSourceFile **lSourceFileArray = (Par2RepairerSourceFile **)malloc(verifylist.size() * 
                                                                                 sizeof (Par2RepairerSourceFile *));
+  bool *lCheckedArray = (bool *)malloc(verifylist.size() * sizeof (bool));
   for (unsigned int i = 0; i < verifylist.size(); i++)
   {
     lSourceFileArray[i] = verifylist[i];
+    lCheckedArray[i] = WrittenBlocksVerified(verifylist[i]);
   }
   
   // Note: cannot use finalresult as __block; that messes up the returned  value from this function!
   __block bool lAllFilesResult = true;    // Optimistic default
   dispatch_apply(verifylist.size(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
                  ^(size_t aIndex){
-                   if (!this->Verify1TargetFile(verifylist[aIndex]))
+                   if (lCheckedArray[aIndex] && this->ConfirmTargetFile(lSourceFileArray[aIndex]))
+                   {
+                     this->AcceptTargetFile(lSourceFileArray[aIndex]);
+                   }
+                   else if (!this->Verify1TargetFile(lSourceFileArray[aIndex]))
                    {
                      dispatch_semaphore_wait(genericSema, DISPATCH_TIME_FOREVER);
                      lAllFilesResult = false;
                      dispatch_semaphore_signal(genericSema);
                    }
                  });
+  free(lCheckedArray);
   free(lSourceFileArray);
   finalresult = lAllFilesResult;  // As noted above, cannot return lAllFilesResult directly
   
@@ -2818,16 +3988,61 @@ bool Par2Repairer::Verify1TargetFile(Par2RepairerSourceFile *aSourceFile)
   return rv;
 }
 
+// Record a target file that has been checked as complete, as Verify1TargetFile would
+// have done after scanning it.
+void Par2Repairer::AcceptTargetFile(Par2RepairerSourceFile *aSourceFile)
+{
+  DiskFile *targetfile = aSourceFile->GetTargetFile();
+
+  if (targetfile->IsOpen())
+    targetfile->Close();
+
+  // All data blocks for the file are where they belong
+  vector<DataBlock>::iterator sb = aSourceFile->SourceBlocks();
+  for (u32 blocknumber=0; blocknumber<aSourceFile->BlockCount(); blocknumber++)
+  {
+    sb->SetLocation(targetfile, (u64)blocknumber * blocksize);
+    ++sb;
+  }
+
+  aSourceFile->SetCompleteFile(targetfile);
+
+  if (noiselevel > CommandLine::nlSilent)
+  {
+    string path;
+    string name;
+    DiskFile::SplitFilename(targetfile->FileName(), path, name);
+
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Target: \"" << DiskFile::FS2UTF8(name) << "\" - found (checked while writing)." << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+}
+
 // Delete all of the partly reconstructed files.
 bool Par2Repairer::DeleteIncompleteTargetFiles(void)
 {
+  // What the checkpoint says has been written is about to be undone
+  checkpoint.Remove();
+
   vector<Par2RepairerSourceFile*>::iterator sf = verifylist.begin();
 
   // Iterate through each file in the verification list
   while (sf != verifylist.end())
   {
     Par2RepairerSourceFile *sourcefile = *sf;
-    if (sourcefile->GetTargetExists())
+    map<DiskFile*, RepairJournal*>::iterator j = journals.find(sourcefile->GetTargetFile());
+    if (j != journals.end())
+    {
+      // Put the damaged file back the way it was
+      if (j->first->IsOpen())
+        j->first->Close();
+      j->second->Rollback();
+
+      delete j->second;
+      journals.erase(j);
+    }
+    else if (sourcefile->GetTargetExists())
     {
       DiskFile *targetfile = sourcefile->GetTargetFile();
 
@@ -2850,3 +4065,192 @@ bool Par2Repairer::DeleteIncompleteTargetFiles(void)
 
   return true;
 }
+
+bool Par2Repairer::FinishInPlaceRepairs(void)
+{
+  bool rv = true;
+
+  vector<Par2RepairerSourceFile*>::iterator sf = verifylist.begin();
+  while (sf != verifylist.end())
+  {
+    Par2RepairerSourceFile *sourcefile = *sf;
+    map<DiskFile*, RepairJournal*>::iterator j = journals.find(sourcefile->GetTargetFile());
+    if (j != journals.end())
+    {
+      if (sourcefile->GetCompleteFile() == j->first)
+      {
+        j->second->Finish();
+      }
+      else
+      {
+        // Still damaged. Rather the original damage than a mix.
+        if (j->first->IsOpen())
+          j->first->Close();
+        if (!j->second->Rollback())
+          rv = false;
+      }
+
+      delete j->second;
+      journals.erase(j);
+    }
+
+    ++sf;
+  }
+
+  return rv;
+}
+
+// A checkpoint only helps if the earlier passes wrote their data into files that
+// are still there: the files that are repaired in place, and the new files, which
+// keep their part name until all passes are done. In both cases, the blocks that
+// were only partly written are still missing, so the same blocks are repaired as
+// in the interrupted run.
+u64 Par2Repairer::LoadCheckpoint(string par2filename)
+{
+  MD5Context context;
+  context.Update(&setid, sizeof(setid));
+  leu64 values[4];
+  values[0] = blocksize;
+  values[1] = missingblockcount;
+  values[2] = (u64)copyblocks.size();
+  values[3] = MD5Context::savedsize;
+  context.Update(values, sizeof(values));
+
+  // Which blocks are written where
+  for (int pass = 0; pass < 2; pass++)
+  {
+    const vector<DataBlock*> &blocks = pass == 0 ? outputblocks : copyblocks;
+    for (vector<DataBlock*>::const_iterator block = blocks.begin(); block != blocks.end(); ++block)
+    {
+      DiskFile *targetfile = (*block)->GetDiskFile();
+      string filename = targetfile != 0 ? targetfile->FileName() : string();
+      context.Update(filename.c_str(), filename.size() + 1);
+      leu64 location[2];
+      location[0] = (*block)->GetOffset();
+      location[1] = (*block)->GetLength();
+      context.Update(location, sizeof(location));
+    }
+  }
+
+  MD5Hash identity;
+  context.Final(identity);
+  checkpoint.SetFile(par2filename + ".resume", identity);
+
+  u64 offset;
+  vector<u8> state;
+  if (!checkpoint.Load(offset, state) || offset >= blocksize || !LoadCheckState(state))
+    return 0;
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Resuming at offset " << offset << " of " << blocksize << " in each block" << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return offset;
+}
+
+// Record that the repaired data up to blockoffset is on disk
+bool Par2Repairer::SaveCheckpoint(u64 blockoffset)
+{
+  // The checkpoint must not get ahead of the data
+  for (vector<Par2RepairerSourceFile*>::iterator sf = verifylist.begin(); sf != verifylist.end(); ++sf)
+  {
+    DiskFile *targetfile = (*sf)->GetTargetFile();
+    if (!DiskFilePool::Acquire(targetfile))
+      return false;
+    bool synced = targetfile->Sync();
+    DiskFilePool::Release(targetfile);
+    if (!synced)
+      return false;
+  }
+
+  vector<u8> state;
+  SaveCheckState(state);
+
+  return checkpoint.Save(blockoffset, state);
+}
+
+// The checksums of the blocks that are checked as they are written, so far: for the
+// output blocks and then for the copied blocks, the MD5 state, the CRC and whether
+// the block was checked.
+void Par2Repairer::SaveCheckState(vector<u8> &state) const
+{
+  const size_t entrysize = MD5Context::savedsize + sizeof(leu32) + 1;
+  state.assign((outputhashes.size() + copyhashes.size()) * entrysize, 0);
+
+  u8 *entry = state.empty() ? 0 : &state[0];
+  for (int pass = 0; pass < 2; pass++)
+  {
+    const vector<MD5Context> &hashes = pass == 0 ? outputhashes : copyhashes;
+    const vector<u32> &crcs = pass == 0 ? outputcrcs : copycrcs;
+    const vector<bool> &verified = pass == 0 ? outputverified : copyverified;
+    for (size_t i = 0; i < hashes.size(); i++, entry += entrysize)
+    {
+      hashes[i].Save(entry);
+      leu32 crc = crcs[i];
+      memcpy(entry + MD5Context::savedsize, &crc, sizeof(crc));
+      entry[MD5Context::savedsize + sizeof(leu32)] = verified[i] ? 1 : 0;
+    }
+  }
+}
+
+bool Par2Repairer::LoadCheckState(const vector<u8> &state)
+{
+  const size_t entrysize = MD5Context::savedsize + sizeof(leu32) + 1;
+  if (state.size() != (outputhashes.size() + copyhashes.size()) * entrysize)
+    return false;
+
+  // Check all of it before anything is changed
+  const u8 *entry = state.empty() ? 0 : &state[0];
+  for (size_t i = 0; i < outputhashes.size() + copyhashes.size(); i++, entry += entrysize)
+  {
+    MD5Context context;
+    if (!context.Load(entry) || entry[MD5Context::savedsize + sizeof(leu32)] > 1)
+      return false;
+  }
+
+  entry = state.empty() ? 0 : &state[0];
+  for (int pass = 0; pass < 2; pass++)
+  {
+    vector<MD5Context> &hashes = pass == 0 ? outputhashes : copyhashes;
+    vector<u32> &crcs = pass == 0 ? outputcrcs : copycrcs;
+    vector<bool> &verified = pass == 0 ? outputverified : copyverified;
+    for (size_t i = 0; i < hashes.size(); i++, entry += entrysize)
+    {
+      hashes[i].Load(entry);
+      leu32 crc;
+      memcpy(&crc, entry + MD5Context::savedsize, sizeof(crc));
+      crcs[i] = crc;
+      verified[i] = entry[MD5Context::savedsize + sizeof(leu32)] != 0;
+    }
+  }
+
+  return true;
+}
+
+bool Par2Repairer::RenamePartFiles(void)
+{
+  for (vector<Par2RepairerSourceFile*>::iterator sf = verifylist.begin(); sf != verifylist.end(); ++sf)
+  {
+    Par2RepairerSourceFile *sourcefile = *sf;
+    DiskFile *targetfile = sourcefile->GetTargetFile();
+    if (journals.find(targetfile) != journals.end() || targetfile->FileName() == sourcefile->TargetFileName())
+      continue;
+
+    if (targetfile->IsOpen())
+      targetfile->Close();
+
+    diskFileMap.Remove(targetfile);
+    if (!targetfile->Rename(sourcefile->TargetFileName()))
+      return false;
+#ifdef DEBUG
+    bool success = 
+#endif
+    diskFileMap.Insert(targetfile);
+    assert(success);
+  }
+
+  return true;
+}
@@ -26,7 +26,7 @@ class Par2Repairer
 {
 public:
   Par2Repairer(void);
-  ~Par2Repairer(void);
+  virtual ~Par2Repairer(void);
 
   Result Process(const CommandLine &commandline, bool dorepair);
 
@@ -48,6 +48,8 @@ protected:
   bool LoadMainPacket(DiskFile *diskfile, u64 offset, PACKET_HEADER &header);
   // Finish loading the creator packet
   bool LoadCreatorPacket(DiskFile *diskfile, u64 offset, PACKET_HEADER &header);
+  // Pass a valid packet to one of the above, if it is of the set and of interest
+  virtual void LoadPacket(DiskFile *diskfile, u64 offset, PACKET_HEADER &header, u32 &packets, u32 &recoverypackets);
 
   // Load packets from other PAR2 files with names based on the original PAR2 file
   bool LoadPacketsFromOtherFiles(string filename);
@@ -74,6 +76,9 @@ protected:
   // Compute the table for the sliding CRC computation
   bool ComputeWindowTable(void);
 
+  // Start the syndromes for as many recovery blocks as the memory limit allows
+  bool PrepareSyndromes(size_t memorylimit);
+
   // Attempt to verify all of the source files
   bool VerifySourceFiles(void);
   bool Verify1SourceFile (Par2RepairerSourceFile* aSourcefile); // The same, for one source file
@@ -85,6 +90,10 @@ protected:
   // Attempt to match the data in the DiskFile with the source file
   bool VerifyDataFile(DiskFile *diskfile, Par2RepairerSourceFile *sourcefile);
 
+  // Instead of scanning the DiskFile, use what the session found in it last time.
+  // Returns false if the session does not know the file, or the file has changed.
+  bool ReplayDataFile(DiskFile *diskfile, Par2RepairerSourceFile *sourcefile);
+
   // Perform a sliding window scan of the DiskFile looking for blocks of data that 
   // might belong to any of the source files (for which a verification packet was
   // available). If a block of data might be from more than one source file, prefer
@@ -95,7 +104,9 @@ protected:
                     MatchType               &matchtype,  // [out]    The type of match
                     MD5Hash                 &hashfull,   // [out]    The full hash of the file
                     MD5Hash                 &hash16k,    // [out]    The hash of the first 16k
-                    u32                     &count);     // [out]    The number of blocks found
+                    u32                     &count,      // [out]    The number of blocks found
+                    vector<Session::FoundBlock> &found,  // [out]    Where they were found
+                    bool                    &scanned);   // [out]    Whether the whole file was scanned
 
   // Find out how much data we have found
   void UpdateVerificationResults(void);
@@ -106,6 +117,11 @@ protected:
   // Rename any damaged or missnamed target files.
   bool RenameTargetFiles(void);
 
+  // Whether a damaged target file can be repaired in place: every block of the file that
+  // was found, was found in the target file at its own offset, and the target file holds
+  // no data that is needed for other files.
+  bool CanRepairInPlace(Par2RepairerSourceFile *sourcefile) const;
+
   // Work out which files are being repaired, create them, and allocate
   // target DataBlocks to them, and remember them for later verification.
   bool CreateTargetFiles(void);
@@ -115,23 +131,94 @@ protected:
   // the appropriate Reed Solomon matrix.
   bool ComputeRSmatrix(void);
 
+  // Choose the recovery packets to use for the repair, so that reading them costs as
+  // little as possible. Any set of the right size will do for the computation.
+  void SelectRecoveryPackets(u32 count);
+
   // Allocate memory buffers for reading and writing data to disk.
   bool AllocateBuffers(size_t memorylimit);
 
+  // Let the OS copy the intact blocks into the target files, where it can do so
+  // without the data passing through memory. Those blocks are not copied by ProcessData.
+  void CopyIntactBlocks(void);
+
+  // Look up the expected checksums of the blocks that will be reconstructed, so that
+  // they can be checked as they are written.
+  void PrepareWriteVerification(void);
+
   // Read source data, process it through the RS matrix and write it to disk.
   bool ProcessData(u64 blockoffset, size_t blocklength);
 
+  // Add part of the reconstructed blocks in the output buffer to their checksums,
+  // and check the checksums after the last part.
+  void CheckOutputBlocks(u64 blockoffset, size_t blocklength);
+
+  // The same for part of a block that is copied to its target file
+  void CheckCopiedBlock(u32 copyindex, u64 blockoffset, size_t blocklength, const void *buffer);
+
+  // Whether all blocks that were written to a file, reconstructed or copied, were checked
+  // when they were written. The blocks that were already in place were checked when
+  // they were found.
+  bool WrittenBlocksVerified(Par2RepairerSourceFile *sourcefile) const;
+
+  // Add the reconstructed blocks of each file to its file hashes, after the blocks that
+  // were copied to it, if they all came in offset order.
+  void StreamOutputBlocks(void);
+  // Add the next block of a file to its file hashes
+  void StreamBlock(u32 streamindex, u32 blocknumber, const void *buffer);
+
+  // Check a file of which all written blocks were checked. Its length must be right.
+  // If all of its data passed through memory in offset order, in a single chunk pass,
+  // its hashes were computed on the way and must be right too. Blocks that were
+  // written over several chunk passes are read back to compute the hashes. Otherwise
+  // the checks of the blocks are enough.
+  bool ConfirmTargetFile(Par2RepairerSourceFile *sourcefile);
+  bool ReadTargetFileHashes(Par2RepairerSourceFile *sourcefile);
+
+  // Start the upper bound on the number of data blocks that can still be found, from
+  // the sizes of the source files and the extra files that are going to be scanned.
+  void PrepareFoundBlocksBound(const list<CommandLine::ExtraFile> &extrafiles);
+
+  // Account for a file of the given size that has been scanned (or was not there), and
+  // find out whether the repair has become impossible.
+  void FileScanned(u64 filesize);
+
+  // The upper bound on the number of data blocks in a file of a certain size
+  u64 BlocksInFile(u64 filesize) const {return filesize / blocksize;}
+
+  // Whether enough data blocks have been found to stop scanning extra files
+  bool EnoughBlocksFound(void) const {return countblocksneeded && blocksneeded <= 0;}
+
   // Verify that all of the reconstructed target files are now correct
   bool VerifyTargetFiles(void);
   bool Verify1TargetFile(Par2RepairerSourceFile *aSourceFile);
+  void AcceptTargetFile(Par2RepairerSourceFile *aSourceFile);
 
   // Delete all of the partly reconstructed files
   bool DeleteIncompleteTargetFiles(void);
 
+  // Drop the journals of the files that were repaired in place, and roll back
+  // those that are still damaged.
+  bool FinishInPlaceRepairs(void);
+
+  // With --resume: pick up the checkpoint of an interrupted repair, and record one
+  // after each pass. Returns the offset within the blocks at which to start.
+  u64 LoadCheckpoint(string par2filename);
+  bool SaveCheckpoint(u64 blockoffset);
+  void SaveCheckState(vector<u8> &state) const;
+  bool LoadCheckState(const vector<u8> &state);
+
+  // With --resume, new target files are written under a name of their own until all
+  // passes are done, so that an interrupted repair leaves no target file behind that
+  // would change what the next run finds. Give them their real names.
+  bool RenamePartFiles(void);
+
   // Submethods of ProcessData
-  void RepairMissingBlocks (size_t blocklength, u32 inputindex);
+  bool WriteTargetData(DataBlock *targetblock, u64 blockoffset, size_t blocklength, const void *buffer, size_t &wrote);
+  void RepairMissingBlocks (size_t blocklength, u32 inputindex, const void *inputdata);
   // In the next function, aEndBlockNo is the last block number + 1.
-  void RepairMissingBlockRange (size_t blocklength, u32 inputindex, u32 aStartBlockNo, u32 aEndBlockNo);
+  void RepairMissingBlockRange (size_t blocklength, u32 inputindex, const void *inputdata,
+                                u32 aStartBlockNo, u32 aEndBlockNo);
 protected:
   CommandLine::NoiseLevel   noiselevel;              // OnScreen display
 
@@ -145,10 +232,12 @@ protected:
   CreatorPacket            *creatorpacket;           // One copy of the creator packet.
 
   DiskFileMap               diskFileMap;
+  BlockCache                blockcache;              // Data blocks found during verification
 
   map<MD5Hash,Par2RepairerSourceFile*> sourcefilemap;// Map from FileId to SourceFile
   vector<Par2RepairerSourceFile*>      sourcefiles;  // The source files
   vector<Par2RepairerSourceFile*>      verifylist;   // Those source files that are being repaired
+  map<DiskFile*, RepairJournal*>       journals;     // Files repaired in place, by target file
 
   u64                       blocksize;               // The block size.
   u64                       chunksize;               // How much of a block can be processed.
@@ -175,16 +264,70 @@ protected:
   vector<DataBlock*>        inputblocks;             // Which DataBlocks will be read from disk
   vector<DataBlock*>        copyblocks;              // Which DataBlocks will copied back to disk
   vector<DataBlock*>        outputblocks;            // Which DataBlocks have to calculated using RS
+  vector<u32>               recoveryexponents;       // The recovery packets used, in the order of inputblocks
 
   ReedSolomon<Galois16>     rs;                      // The Reed Solomon matrix.
-
-  void                     *inputbuffer;             // Buffer for reading DataBlocks (chunksize)
+  SyndromeAccumulator       syndromes;               // Recovery syndromes computed during verification
+  vector<bool>              inputviasyndrome;        // Input blocks accounted for by the syndromes
+  vector<const u8*>         inputsyndrome;           // The syndrome for each recovery input block, or 0
+  u32                       rsinputcount;            // How many input blocks go through the RS matrix
+  void                     *syndromebuffer;          // Recovery block combined with its syndrome (chunksize)
+
+  void                     *inputbuffer;             // Buffer for reading DataBlocks (readslotcount page aligned chunks)
+  u32                       readslotcount;           // How many input blocks can be read ahead
+  bool                      mappedinput;             // Process input data in place in mapped files
   void                     *outputbuffer;            // Buffer for writing DataBlocks (chunksize * missingblockcount)
 
+  bool                      paranoid;                // Read the repaired files back to verify them
+  bool                      resume;                  // Continue an interrupted repair
+  vector<const FILEVERIFICATIONENTRY*> outputentries;// The expected checksums of each output block, or 0
+  vector<Par2RepairerSourceFile*>      outputfiles;  // The file of each output block
+  vector<MD5Context>        outputhashes;            // The MD5 of each output block, so far
+  vector<u32>               outputcrcs;              // The CRC of each output block, so far
+  vector<bool>              outputverified;          // Whether each output block was written correctly
+  vector<const FILEVERIFICATIONENTRY*> copyentries;  // The expected checksums of each copied block, or 0
+  vector<MD5Context>        copyhashes;              // The MD5 of each copied block, so far
+  vector<u32>               copycrcs;                // The CRC of each copied block, so far
+  vector<bool>              copyverified;            // Whether each copied block was written correctly
+
+  // The file hashes of a file that is written, as its blocks pass through memory
+  struct FileStream
+  {
+    Par2RepairerSourceFile *sourcefile;
+    u32                     nextblock;               // The block of the file that must come next
+    bool                    inorder;                 // Whether the blocks so far came in that order
+    u32                     firstoutput;             // The output blocks of the file are
+    u32                     outputlimit;             // [firstoutput, outputlimit)
+    MD5Context              context16k;
+    MD5Context              contextfull;
+  };
+  vector<FileStream>        filestreams;             // For the files that blocks are written to
+  vector<u32>               copystreams;             // The stream of each copied block
+  bool                      singlepass;              // Whether the blocks were processed in one pass
+
   u64                       progress;                // How much data has been processed.
   u64                       totaldata;               // Total amount of data to be processed.
   int						previouslyReportedProgress;
   dispatch_semaphore_t      genericSema;             // For any synchronization between threads while processing
+
+  // While the extra files are scanned, the number of data blocks that must still be found
+  // before a repair is certain to be possible. Once it reaches 0, scanning stops.
+  volatile long             blocksneeded;
+  bool                      countblocksneeded;       // Whether blocksneeded is in use
+  dispatch_semaphore_t      foundSema;               // Protects finding a data block for the first time
+
+  // The number of data blocks that can still be found is at most the number found so
+  // far, plus the whole blocks that fit in the files that have not been scanned, plus
+  // the blocks that are shorter than the block size (which might be anywhere). If that
+  // is less than the data blocks that cannot be recovered, verification stops.
+  bool                      boundfoundblocks;        // Whether the bound is used
+  u64                       unscannedblocks;         // Whole blocks in the files not scanned yet
+  u32                       shortblockcount;         // Data blocks shorter than the block size
+  volatile bool             repairimpossible;        // The bound shows the repair is not possible
+  u32                       shortfall;               // How many more recovery blocks are needed, at least
+
+  Checkpoint                checkpoint;              // Only set with --resume
+  Session                   session;                 // Only open with --session
 };
 
 #endif // __PAR2REPAIRER_H__
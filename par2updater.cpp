@@ -0,0 +1,804 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#include "par2cmdline.h"
+
+// How much of a source file is read and hashed at a time
+#define UpdateBatchSize (16*1024*1024)
+
+Par2Updater::Par2Updater(void)
+: Par2Repairer()
+, previousdir()
+{
+}
+
+Par2Updater::~Par2Updater(void)
+{
+  map<Par2RepairerSourceFile*, DiskFile*>::iterator f;
+  for (f = currentfiles.begin(); f != currentfiles.end(); ++f)
+  {
+    delete f->second;
+  }
+  for (f = oldfiles.begin(); f != oldfiles.end(); ++f)
+  {
+    delete f->second;
+  }
+
+  map<string, DiskFile*>::iterator u;
+  for (u = updatefiles.begin(); u != updatefiles.end(); ++u)
+  {
+    delete u->second;
+  }
+}
+
+Result Par2Updater::Process(const CommandLine &commandline)
+{
+  // What noiselevel are we using
+  noiselevel = commandline.GetNoiseLevel();
+
+  // Where the versions of the files are that the recovery files were made from
+  previousdir = commandline.GetPreviousDir();
+  if (previousdir[previousdir.size()-1] != '/')
+    previousdir += '/';
+
+  // Get filesnames from the command line
+  string par2filename = commandline.GetParFilename();
+  const list<CommandLine::ExtraFile> &extrafiles = commandline.GetExtraFiles();
+
+  // Determine the searchpath from the location of the main PAR2 file
+  string name;
+  DiskFile::SplitFilename(par2filename, searchpath, name);
+
+  // Load the packets, as for a verification. LoadPacket remembers where each copy is.
+  if (!LoadPacketsFromFile(searchpath + name))
+    return eLogicError;
+
+  if (!LoadPacketsFromOtherFiles(par2filename))
+    return eLogicError;
+
+  if (!LoadPacketsFromExtraFiles(extrafiles))
+    return eLogicError;
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  // Check that the packets are consistent and discard any that are not
+  if (!CheckPacketConsistency())
+    return eInsufficientCriticalData;
+
+  // Get the source files in the order of the main packet, which is the order of
+  // the blocks in the recovery data
+  if (!CreateSourceFileList())
+    return eLogicError;
+
+  if (!AllocateSourceBlocks())
+    return eLogicError;
+
+  // The recovery data covers all of the recoverable files; each of them must be known
+  for (u32 filenumber=0; filenumber<mainpacket->RecoverableFileCount(); filenumber++)
+  {
+    Par2RepairerSourceFile *sourcefile = sourcefiles[filenumber];
+    if (sourcefile == 0 || sourcefile->GetVerificationPacket() == 0)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cerr << "The recovery files do not describe all of the source files, so they cannot be updated." << endl;
+      dispatch_semaphore_signal(coutSema);
+      return eInsufficientCriticalData;
+    }
+  }
+
+  // Find out which blocks have changed
+  if (!FindChangedBlocks())
+    return eFileIOError;
+
+  if (changedblocks.empty())
+  {
+    if (noiselevel > CommandLine::nlSilent)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cout << "None of the files have changed; there is nothing to update." << endl;
+      dispatch_semaphore_signal(coutSema);
+    }
+    return eSuccess;
+  }
+
+  // Compute the new set id
+  if (!UpdateMainPacket())
+    return eInsufficientCriticalData;
+
+  // Update the recovery data, and then the packets that describe it
+  if (!UpdateRecoveryPackets(commandline.GetMemoryLimit()) ||
+      !WriteCriticalPackets())
+  {
+    DiscardUpdatedFiles();
+    return eFileIOError;
+  }
+
+  if (!ReplaceUpdatedFiles())
+  {
+    DiscardUpdatedFiles();
+    return eFileIOError;
+  }
+
+  if (noiselevel > CommandLine::nlSilent)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Update complete." << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return eSuccess;
+}
+
+void Par2Updater::LoadPacket(DiskFile *diskfile, u64 offset, PACKET_HEADER &header, u32 &packets, u32 &recoverypackets)
+{
+  Par2Repairer::LoadPacket(diskfile, offset, header, packets, recoverypackets);
+
+  // Only one copy of each packet is loaded, but every copy has to be updated
+  if (setid != header.setid)
+    return;
+
+  PacketCopy copy;
+  copy.filename = diskfile->FileName();
+  copy.offset = offset;
+  copy.length = header.length;
+  copy.type = header.type;
+
+  if (recoveryblockpacket_type == header.type)
+  {
+    leu32 exponent;
+    if (diskfile->Read(offset + sizeof(PACKET_HEADER), &exponent, sizeof(exponent)))
+    {
+      recoverycopies[exponent].push_back(copy);
+    }
+  }
+  else if (fileverificationpacket_type == header.type || filedescriptionpacket_type == header.type)
+  {
+    // Both packets start with the file id; that tells which file the copy belongs to
+    if (diskfile->Read(offset + sizeof(PACKET_HEADER), &copy.fileid, sizeof(copy.fileid)))
+    {
+      criticalcopies.push_back(copy);
+    }
+  }
+  else if (mainpacket_type == header.type || creatorpacket_type == header.type)
+  {
+    criticalcopies.push_back(copy);
+  }
+}
+
+bool Par2Updater::FindChangedBlocks(void)
+{
+  for (u32 filenumber=0; filenumber<mainpacket->RecoverableFileCount(); filenumber++)
+  {
+    if (!Hash1SourceFile(sourcefiles[filenumber]))
+      return false;
+  }
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << changedblocks.size() << " of the " << sourceblockcount << " data blocks have changed." << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return true;
+}
+
+// Compute the hashes of the current version of the file in the same way as when
+// creating, and compare the block hashes with those in the verification packet.
+// The old version of every block that changed is checked against the verification
+// packet, because the recovery data can only be updated with the right old data.
+
+bool Par2Updater::Hash1SourceFile(Par2RepairerSourceFile *sourcefile)
+{
+  DescriptionPacket *descriptionpacket = sourcefile->GetDescriptionPacket();
+  VerificationPacket *verificationpacket = sourcefile->GetVerificationPacket();
+  u64 filesize = descriptionpacket->FileSize();
+  u32 blockcount = sourcefile->BlockCount();
+
+  string filename = sourcefile->TargetFileName();
+  string shortname = descriptionpacket->FileName();
+
+  DiskFile *diskfile = new DiskFile;
+  if (!diskfile->Open(filename, true))
+  {
+    delete diskfile;
+    return false;
+  }
+
+  // The blocks of the recovery data would move if the size changed
+  if (diskfile->FileSize() != filesize)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "The size of \"" << DiskFile::FS2UTF8(shortname)
+         << "\" has changed; the recovery files have to be created anew." << endl;
+    dispatch_semaphore_signal(coutSema);
+    delete diskfile;
+    return false;
+  }
+
+  // Read whole blocks, as many as fit in a batch
+  u32 batchblocks = (u32)max((u64)1, (u64)UpdateBatchSize / blocksize);
+  size_t buffersize = (size_t)(batchblocks * blocksize);
+  u8 *buffer = new u8[buffersize];
+  MD5Hash *blockhashes = new MD5Hash[batchblocks];
+  u32 *blockcrcs = new u32[batchblocks];
+  u8 *oldbuffer = 0;
+  DiskFile *oldfile = 0;
+
+  // The blocks in the GCD code blocks below must not copy the contexts
+  MD5Context filecontext;
+  MD5Context *lFileContext = &filecontext;
+  MD5Hash hash16k;
+  MD5Hash *lHash16k = &hash16k;
+
+  dispatch_queue_t lQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+  size_t firstchanged = changedblocks.size();
+  bool rv = true;
+
+  for (u32 firstblock = 0; rv && firstblock < blockcount; firstblock += batchblocks)
+  {
+    u64 offset = (u64)firstblock * blocksize;
+    size_t want = (size_t)min(filesize-offset, (u64)buffersize);
+
+    if (!diskfile->Read(offset, buffer, want))
+    {
+      rv = false;
+      break;
+    }
+
+    // The hash of the whole file is one stream; it is computed while the blocks are hashed
+    dispatch_group_t lGroup = dispatch_group_create();
+    dispatch_group_async(lGroup, lQueue, ^{
+      if (offset < 16384 && offset + want >= 16384)
+      {
+        lFileContext->Update(buffer, (size_t)(16384-offset));
+
+        MD5Context temp = *lFileContext;
+        temp.Final(*lHash16k);
+
+        lFileContext->Update(&buffer[16384-offset], (size_t)(offset+want)-16384);
+      }
+      else
+      {
+        lFileContext->Update(buffer, want);
+      }
+    });
+
+    // The last block of the file is padded with zeroes
+    u32 lBlockCount = (u32)((want + blocksize - 1) / blocksize);
+    u64 lBlockSize = blocksize;
+    dispatch_apply(lBlockCount, lQueue, ^(size_t aIndex){
+      u64 lStart = (u64)aIndex * lBlockSize;
+      size_t lLength = (size_t)min((u64)want - lStart, lBlockSize);
+
+      u32 lCRC = ~0 ^ CRCUpdateBlock(~0, lLength, &buffer[lStart]);
+      MD5Context lBlockContext;
+      lBlockContext.Update(&buffer[lStart], lLength);
+      if (lLength < lBlockSize)
+      {
+        lCRC = ~0 ^ CRCUpdateBlock(~0 ^ lCRC, (size_t)(lBlockSize - lLength));
+        lBlockContext.Update((size_t)(lBlockSize - lLength));
+      }
+
+      lBlockContext.Final(blockhashes[aIndex]);
+      blockcrcs[aIndex] = lCRC;
+    });
+
+    dispatch_group_wait(lGroup, DISPATCH_TIME_FOREVER);
+    dispatch_release(lGroup);
+
+    for (u32 index = 0; rv && index < lBlockCount; index++)
+    {
+      u32 blocknumber = firstblock + index;
+      const FILEVERIFICATIONENTRY *entry = verificationpacket->VerificationEntry(blocknumber);
+      if (entry->hash == blockhashes[index] && entry->crc == blockcrcs[index])
+        continue;
+
+      // Get the old version of the file, the first time a block has changed
+      if (oldfile == 0)
+      {
+        oldfile = new DiskFile;
+        if (!oldfile->Open(previousdir + shortname, true))
+        {
+          rv = false;
+          break;
+        }
+        if (oldfile->FileSize() != filesize)
+        {
+          dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+          cerr << "The previous version of \"" << DiskFile::FS2UTF8(shortname)
+               << "\" is not the one the recovery files were made from." << endl;
+          dispatch_semaphore_signal(coutSema);
+          rv = false;
+          break;
+        }
+        oldbuffer = new u8[(size_t)blocksize];
+      }
+
+      // Check the old version of the block
+      u64 blockoffset = (u64)blocknumber * blocksize;
+      size_t length = (size_t)min(blocksize, filesize - blockoffset);
+      if (!oldfile->Read(blockoffset, oldbuffer, length))
+      {
+        rv = false;
+        break;
+      }
+      memset(&oldbuffer[length], 0, (size_t)blocksize - length);
+
+      MD5Context oldcontext;
+      oldcontext.Update(oldbuffer, (size_t)blocksize);
+      MD5Hash oldhash;
+      oldcontext.Final(oldhash);
+      u32 oldcrc = ~0 ^ CRCUpdateBlock(~0, (size_t)blocksize, oldbuffer);
+
+      if (entry->hash != oldhash || entry->crc != oldcrc)
+      {
+        dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+        cerr << "Block " << blocknumber << " of the previous version of \"" << DiskFile::FS2UTF8(shortname)
+             << "\" is not the one the recovery files were made from." << endl;
+        dispatch_semaphore_signal(coutSema);
+        rv = false;
+        break;
+      }
+
+      ChangedBlock changed;
+      changed.sourcefile = sourcefile;
+      changed.blocknumber = blocknumber;
+      changed.index = (u32)(sourcefile->SourceBlocks() - sourceblocks.begin()) + blocknumber;
+      changedblocks.push_back(changed);
+
+      verificationpacket->SetBlockHashAndCRC(blocknumber, blockhashes[index], blockcrcs[index]);
+    }
+
+#ifndef MPDL
+    if (noiselevel > CommandLine::nlQuiet)
+    {
+      // Display progress
+      u32 oldfraction = (u32)(1000 * offset / filesize);
+      u32 newfraction = (u32)(1000 * (offset + want) / filesize);
+      if (oldfraction != newfraction)
+      {
+        dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+        cout << "Scanning: \"" << DiskFile::FS2UTF8(shortname) << "\": " << newfraction/10 << '.' << newfraction%10 << "%\r" << flush;
+        dispatch_semaphore_signal(coutSema);
+      }
+    }
+#endif
+  }
+
+  delete [] buffer;
+  delete [] blockhashes;
+  delete [] blockcrcs;
+  delete [] oldbuffer;
+
+  if (!rv)
+  {
+    delete diskfile;
+    delete oldfile;
+    return false;
+  }
+
+  size_t changedcount = changedblocks.size() - firstchanged;
+  if (changedcount == 0)
+  {
+    // Nothing to do for this file
+    delete diskfile;
+    delete oldfile;
+  }
+  else
+  {
+    // Store the new hashes in the description packet; the file id may change
+    MD5Hash hashfull;
+    filecontext.Final(hashfull);
+    descriptionpacket->HashFull(hashfull);
+    descriptionpacket->Hash16k(filesize < 16384 ? hashfull : hash16k);
+
+    descriptionpacket->ComputeFileId();
+    verificationpacket->FileId(descriptionpacket->FileId());
+
+    // Keep both versions of the file for updating the recovery data
+    currentfiles[sourcefile] = diskfile;
+    oldfiles[sourcefile] = oldfile;
+  }
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "Target: \"" << DiskFile::FS2UTF8(shortname) << "\" - ";
+    if (changedcount == 0)
+      cout << "unchanged." << endl;
+    else
+      cout << changedcount << " changed block" << (changedcount == 1 ? "." : "s.") << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return true;
+}
+
+bool Par2Updater::UpdateMainPacket(void)
+{
+  // The files are in the order of their file ids. The recovery data uses the same
+  // order, so it can only be updated if the new file ids keep it.
+  for (u32 filenumber=0; filenumber<mainpacket->RecoverableFileCount(); filenumber++)
+  {
+    const MD5Hash &fileid = sourcefiles[filenumber]->GetDescriptionPacket()->FileId();
+
+    if (filenumber > 0 && !(mainpacket->FileId(filenumber-1) < fileid))
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cerr << "The changes alter the order of the files in the recovery set; the recovery files have to be created anew." << endl;
+      dispatch_semaphore_signal(coutSema);
+      return false;
+    }
+
+    mainpacket->FileId(filenumber, fileid);
+  }
+
+  mainpacket->ComputeSetId();
+  newsetid = mainpacket->SetId();
+
+  if (noiselevel > CommandLine::nlNormal && newsetid != setid)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << "The set id changes to " << newsetid << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return true;
+}
+
+bool Par2Updater::ReadBlocks(const ChangedBlock &changed, u8 *current, u8 *old)
+{
+  u64 filesize = changed.sourcefile->GetDescriptionPacket()->FileSize();
+  u64 offset = (u64)changed.blocknumber * blocksize;
+  size_t length = (size_t)min(blocksize, filesize - offset);
+
+  if (!currentfiles.find(changed.sourcefile)->second->Read(offset, current, length) ||
+      !oldfiles.find(changed.sourcefile)->second->Read(offset, old, length))
+    return false;
+
+  memset(&current[length], 0, (size_t)blocksize - length);
+  memset(&old[length], 0, (size_t)blocksize - length);
+
+  return true;
+}
+
+void Par2Updater::GroupByFile(vector<UpdateTask> &tasks, vector<size_t> &starts)
+{
+  sort(tasks.begin(), tasks.end());
+
+  starts.clear();
+  for (size_t i = 0; i < tasks.size(); i++)
+  {
+    if (i == 0 || tasks[i].diskfile != tasks[i-1].diskfile)
+      starts.push_back(i);
+  }
+  starts.push_back(tasks.size());
+}
+
+bool Par2Updater::UpdateRecoveryPackets(size_t memorylimit)
+{
+  // Open all of the recovery files before the threads use them
+  map<u32, vector<PacketCopy> >::iterator rc;
+  for (rc = recoverycopies.begin(); rc != recoverycopies.end(); ++rc)
+  {
+    for (size_t i = 0; i < rc->second.size(); i++)
+    {
+      if (UpdateFile(rc->second[i].filename) == 0)
+        return false;
+    }
+  }
+
+  vector<u16> exponents;
+  map<u32, RecoveryPacket*>::iterator rp;
+  for (rp = recoverypacketmap.begin(); rp != recoverypacketmap.end(); ++rp)
+  {
+    exponents.push_back((u16)rp->first);
+  }
+
+  // A DiskFile must not be used by more than one thread at a time, so the changed
+  // blocks are read by one thread per changed file. They are grouped by file already.
+  vector<size_t> filestarts;
+  for (size_t i = 0; i < changedblocks.size(); i++)
+  {
+    if (i == 0 || changedblocks[i].sourcefile != changedblocks[i-1].sourcefile)
+      filestarts.push_back(i);
+  }
+  filestarts.push_back(changedblocks.size());
+  const size_t *lFileStarts = &filestarts[0];
+
+  // Each recovery block that is updated in a pass needs two blocks of memory: for the
+  // change, and for the new data
+  size_t groupsize = (size_t)max((u64)1, (u64)memorylimit / (2 * blocksize));
+  u64 lBlockSize = blocksize;
+  dispatch_queue_t lQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+
+  for (size_t first = 0; first < exponents.size(); first += groupsize)
+  {
+    vector<u16> group(exponents.begin() + first, exponents.begin() + min(first + groupsize, exponents.size()));
+
+    // The change of each recovery block is the syndrome of the changes of the data blocks
+    SyndromeAccumulator delta;
+    SyndromeAccumulator *lDelta = &delta;
+    u8 *lNewData = delta.Start(sourceblockcount, (size_t)blocksize, group)
+                 ? (u8 *)AlignedBufferPool::Get(group.size() * (size_t)blocksize)
+                 : 0;
+    if (lNewData == 0)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cerr << "Could not allocate buffer memory." << endl;
+      dispatch_semaphore_signal(coutSema);
+      return false;
+    }
+
+    __block bool lOK = true;
+    dispatch_apply(filestarts.size() - 1, lQueue, ^(size_t aFile){
+      u8 *lCurrent = new u8[(size_t)lBlockSize];
+      u8 *lOld = new u8[(size_t)lBlockSize];
+
+      for (size_t c = lFileStarts[aFile]; c < lFileStarts[aFile + 1]; c++)
+      {
+        const ChangedBlock &lChanged = this->changedblocks[c];
+        if (!this->ReadBlocks(lChanged, lCurrent, lOld))
+        {
+          dispatch_semaphore_wait(this->genericSema, DISPATCH_TIME_FOREVER);
+          lOK = false;
+          dispatch_semaphore_signal(this->genericSema);
+          break;
+        }
+
+        u32 *lWords = (u32 *)lCurrent;
+        const u32 *lOldWords = (const u32 *)lOld;
+        for (size_t w = 0; w < lBlockSize / 4; w++)
+        {
+          lWords[w] ^= lOldWords[w];
+        }
+        lDelta->Add(this->rs, lChanged.index, lCurrent, (size_t)lBlockSize);
+      }
+
+      delete [] lCurrent;
+      delete [] lOld;
+    });
+
+    // Read the recovery data of the group, and add the change to it. Then write every
+    // copy of each packet with the new data, set id and hash. Both are done by one
+    // thread per recovery file.
+    vector<UpdateTask> reads;
+    vector<UpdateTask> writes;
+    for (size_t slot = 0; lOK && slot < group.size(); slot++)
+    {
+      RecoveryPacket *packet = recoverypacketmap.find(group[slot])->second;
+      UpdateTask read;
+      read.diskfile = updatefiles.find(packet->GetDiskFile()->FileName())->second;
+      read.offset = packet->Offset() + sizeof(RECOVERYBLOCKPACKET);
+      read.slot = slot;
+      reads.push_back(read);
+
+      const vector<PacketCopy> &copies = recoverycopies.find(group[slot])->second;
+      for (size_t i = 0; i < copies.size(); i++)
+      {
+        UpdateTask write;
+        write.diskfile = updatefiles.find(copies[i].filename)->second;
+        write.offset = copies[i].offset;
+        write.slot = slot;
+        writes.push_back(write);
+      }
+    }
+
+    if (lOK)
+    {
+      vector<size_t> readstarts;
+      GroupByFile(reads, readstarts);
+      const UpdateTask *lReads = &reads[0];
+      const size_t *lReadStarts = &readstarts[0];
+      const u16 *lGroup = &group[0];
+
+      dispatch_apply(readstarts.size() - 1, lQueue, ^(size_t aFile){
+        for (size_t r = lReadStarts[aFile]; lOK && r < lReadStarts[aFile + 1]; r++)
+        {
+          u8 *lData = &lNewData[lReads[r].slot * (size_t)lBlockSize];
+          if (!lReads[r].diskfile->Read(lReads[r].offset, lData, (size_t)lBlockSize))
+          {
+            dispatch_semaphore_wait(this->genericSema, DISPATCH_TIME_FOREVER);
+            lOK = false;
+            dispatch_semaphore_signal(this->genericSema);
+            break;
+          }
+
+          u32 *lWords = (u32 *)lData;
+          const u32 *lSyndrome = (const u32 *)lDelta->Syndrome(lGroup[lReads[r].slot]);
+          for (size_t w = 0; w < lBlockSize / 4; w++)
+          {
+            lWords[w] ^= lSyndrome[w];
+          }
+        }
+      });
+    }
+
+    if (lOK)
+    {
+      vector<size_t> writestarts;
+      GroupByFile(writes, writestarts);
+      const UpdateTask *lWrites = &writes[0];
+      const size_t *lWriteStarts = &writestarts[0];
+      const u16 *lGroup = &group[0];
+
+      dispatch_apply(writestarts.size() - 1, lQueue, ^(size_t aFile){
+        for (size_t w = lWriteStarts[aFile]; lOK && w < lWriteStarts[aFile + 1]; w++)
+        {
+          RecoveryPacket lCopy;
+          lCopy.Create(lWrites[w].diskfile, lWrites[w].offset, lBlockSize, lGroup[lWrites[w].slot], this->newsetid);
+          if (!lCopy.WriteData(0, (size_t)lBlockSize, &lNewData[lWrites[w].slot * (size_t)lBlockSize]) ||
+              !lCopy.WriteHeader())
+          {
+            dispatch_semaphore_wait(this->genericSema, DISPATCH_TIME_FOREVER);
+            lOK = false;
+            dispatch_semaphore_signal(this->genericSema);
+            break;
+          }
+        }
+      });
+    }
+
+    AlignedBufferPool::Release(lNewData);
+
+    if (!lOK)
+      return false;
+
+    if (noiselevel > CommandLine::nlQuiet)
+    {
+      dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+      cout << "Updated " << first + group.size() << " of " << exponents.size() << " recovery blocks.\r" << flush;
+      dispatch_semaphore_signal(coutSema);
+    }
+  }
+
+  if (noiselevel > CommandLine::nlQuiet)
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cout << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+
+  return true;
+}
+
+bool Par2Updater::WriteCriticalPackets(void)
+{
+  // Store the new set id in all of the critical packets. The main packet already has it.
+  if (creatorpacket)
+    creatorpacket->FinishPacket(newsetid);
+
+  map<MD5Hash, Par2RepairerSourceFile*>::iterator sf;
+  for (sf = sourcefilemap.begin(); sf != sourcefilemap.end(); ++sf)
+  {
+    sf->second->GetDescriptionPacket()->FinishPacket(newsetid);
+    if (sf->second->GetVerificationPacket())
+      sf->second->GetVerificationPacket()->FinishPacket(newsetid);
+  }
+
+  for (size_t i = 0; i < criticalcopies.size(); i++)
+  {
+    const PacketCopy &copy = criticalcopies[i];
+    const CriticalPacket *packet = 0;
+
+    if (mainpacket_type == copy.type)
+    {
+      packet = mainpacket;
+    }
+    else if (creatorpacket_type == copy.type)
+    {
+      packet = creatorpacket;
+    }
+    else
+    {
+      sf = sourcefilemap.find(copy.fileid);
+      if (sf != sourcefilemap.end())
+      {
+        if (filedescriptionpacket_type == copy.type)
+          packet = sf->second->GetDescriptionPacket();
+        else
+          packet = sf->second->GetVerificationPacket();
+      }
+    }
+
+    // A copy that differs from the packet that was loaded (such as one that was
+    // discarded as inconsistent) is left alone; it is overwritten only in place.
+    if (packet == 0 || packet->PacketLength() != copy.length)
+      continue;
+
+    DiskFile *diskfile = UpdateFile(copy.filename);
+    if (diskfile == 0 || !packet->WritePacket(*diskfile, copy.offset))
+      return false;
+  }
+
+  return true;
+}
+
+DiskFile* Par2Updater::UpdateFile(const string &filename)
+{
+  map<string, DiskFile*>::iterator f = updatefiles.find(filename);
+  if (f != updatefiles.end())
+    return f->second;
+
+  // The changes go into a copy, which takes the place of the file when all of them
+  // have been made. An interruption leaves the old file as it was.
+  DiskFile original;
+  if (!original.Open(filename, false))
+    return 0;
+
+  DiskFile *diskfile = new DiskFile;
+  updatefiles[filename] = diskfile;
+  if (!diskfile->Create(filename + ".par2new", original.FileSize()))
+    return 0;
+
+  // Share the disk blocks or let the kernel copy, where possible
+  bool copied = diskfile->CopyRange(0, original, 0, original.FileSize());
+  if (!copied)
+  {
+    const size_t chunk = 1024 * 1024;
+    u8 *buffer = new u8[chunk];
+    copied = true;
+    for (u64 offset = 0; copied && offset < original.FileSize(); offset += chunk)
+    {
+      size_t length = (size_t)min((u64)chunk, original.FileSize() - offset);
+      copied = original.Read(offset, buffer, length) && diskfile->Write(offset, buffer, length);
+    }
+    delete [] buffer;
+  }
+  original.Close();
+
+  return copied ? diskfile : 0;
+}
+
+bool Par2Updater::ReplaceUpdatedFiles(void)
+{
+  // All copies must be on the disk before any of them takes the place of a file
+  map<string, DiskFile*>::iterator u;
+  for (u = updatefiles.begin(); u != updatefiles.end(); ++u)
+  {
+    if (!u->second->Sync())
+      return false;
+    u->second->Close();
+  }
+
+  for (u = updatefiles.begin(); u != updatefiles.end(); ++u)
+  {
+    if (!u->second->Rename(u->first))
+      return false;
+  }
+
+  return true;
+}
+
+void Par2Updater::DiscardUpdatedFiles(void)
+{
+  map<string, DiskFile*>::iterator u;
+  for (u = updatefiles.begin(); u != updatefiles.end(); ++u)
+  {
+    if (u->second->IsOpen())
+      u->second->Close();
+    if (u->second->FileName() != u->first && DiskFile::FileExists(u->second->FileName()))
+      u->second->Delete();
+  }
+}
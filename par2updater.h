@@ -0,0 +1,124 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#ifndef __PAR2UPDATER_H__
+#define __PAR2UPDATER_H__
+
+// The Par2Updater brings existing recovery volumes up to date after some of the
+// source files have changed, without computing the recovery data from scratch.
+// A recovery block with exponent e is the sum of base(i)^e * D(i) over all source
+// blocks D(i), so when some blocks change, the recovery block changes by the same
+// sum over just the differences (old XOR new) of the changed blocks. That is what
+// a SyndromeAccumulator computes; only the changed blocks need to be read.
+// The old versions of the changed files must still be available to compute the
+// differences. The files must keep their sizes, and their new file ids must keep
+// the order of the files in the main packet; otherwise the set has to be created anew.
+// The changes are made in copies of the recovery files, which replace them when all
+// of them are done, so an update that is interrupted leaves the recovery files as
+// they were.
+
+class Par2Updater : public Par2Repairer
+{
+public:
+  Par2Updater(void);
+  ~Par2Updater(void);
+
+  Result Process(const CommandLine &commandline);
+
+protected:
+  // Where a copy of a packet of the set is stored
+  struct PacketCopy
+  {
+    string     filename;
+    u64        offset;
+    u64        length;
+    PACKETTYPE type;
+    MD5Hash    fileid;     // Of the description and verification packets
+  };
+
+  // A transfer of the recovery data of one packet of a group being updated. The
+  // transfers are grouped by file, so that only one thread uses each file.
+  struct UpdateTask
+  {
+    DiskFile  *diskfile;
+    u64        offset;
+    size_t     slot;       // Within the group
+
+    bool operator<(const UpdateTask &aOther) const
+    {
+      return diskfile != aOther.diskfile ? diskfile < aOther.diskfile : offset < aOther.offset;
+    }
+  };
+
+  // A data block that is different from the block the recovery data was made from
+  struct ChangedBlock
+  {
+    Par2RepairerSourceFile *sourcefile;
+    u32                     blocknumber; // Within the file
+    u32                     index;       // Within all source blocks
+  };
+
+protected:
+  // Remember where every copy of every packet of the set is, and then load it as usual
+  virtual void LoadPacket(DiskFile *diskfile, u64 offset, PACKET_HEADER &header, u32 &packets, u32 &recoverypackets);
+
+  // Hash the current version of each source file, update the description and
+  // verification packets, and find the blocks that changed
+  bool FindChangedBlocks(void);
+  bool Hash1SourceFile(Par2RepairerSourceFile *sourcefile);
+
+  // Store the new file ids in the main packet, and compute the new set id
+  bool UpdateMainPacket(void);
+
+  // Read a block of the current and of the old version of a file, padded with
+  // zeroes to the block size
+  bool ReadBlocks(const ChangedBlock &changed, u8 *current, u8 *old);
+
+  // Add the differences of the changed blocks to the recovery blocks, for as many
+  // recovery blocks at a time as the memory limit allows, and rewrite all copies
+  bool UpdateRecoveryPackets(size_t memorylimit);
+
+  // Sort the tasks by file (and offset), and find where each file starts. The last
+  // start is the end of the tasks.
+  static void GroupByFile(vector<UpdateTask> &tasks, vector<size_t> &starts);
+
+  // Rewrite all copies of the critical packets
+  bool WriteCriticalPackets(void);
+
+  // A copy of a recovery file, opened for writing
+  DiskFile* UpdateFile(const string &filename);
+
+  // Put the updated copies in place of the recovery files, or delete them
+  bool ReplaceUpdatedFiles(void);
+  void DiscardUpdatedFiles(void);
+
+protected:
+  string                       previousdir;     // Where the old versions of the files are
+
+  vector<PacketCopy>           criticalcopies;  // Every copy of every critical packet
+  map<u32, vector<PacketCopy> > recoverycopies; // Every copy of each recovery packet, by exponent
+
+  vector<ChangedBlock>         changedblocks;   // The blocks that have to be added to the recovery data
+  map<Par2RepairerSourceFile*, DiskFile*> currentfiles; // The current version of each changed file
+  map<Par2RepairerSourceFile*, DiskFile*> oldfiles;     // The old version of each changed file
+
+  map<string, DiskFile*>       updatefiles;     // The copies of the recovery files, by the name of the file
+  MD5Hash                      newsetid;        // The set id after the update
+};
+
+#endif // __PAR2UPDATER_H__
@@ -77,6 +77,11 @@ bool RecoveryPacket::WriteData(u64 position,
   return datablock.WriteData(position, size, buffer, wrote);
 }
 
+void RecoveryPacket::HashData(const void *buffer, size_t size)
+{
+  packetcontext->Update(buffer, size);
+}
+
 // Write the header of the packet to disk
 bool RecoveryPacket::WriteHeader(void)
 {
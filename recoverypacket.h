@@ -46,9 +46,22 @@ public:
   bool WriteData(u64         position,  // Relative position within the data block
                  size_t      size,      // Size of data to write to block
                  const void *buffer);   // Buffer containing the data to write
+  // Update the hash of the packet with data that the caller writes to the data block
+  // itself (for instance, together with other packets in one gathered write).
+  void HashData(const void *buffer, size_t size);
   // Finish computing the hash of the recovery packet and write the header to disk.
   bool WriteHeader(void);
 
+  // Where the packet is, and the header (with exponent) as it is so far
+  DiskFile* GetDiskFile(void) const {return diskfile;}
+  u64 Offset(void) const {return offset;}
+  const RECOVERYBLOCKPACKET& Header(void) const {return packet;}
+
+  // The hash of the packet as far as it has been written; used to continue
+  // an interrupted create.
+  const MD5Context& HashContext(void) const {return *packetcontext;}
+  void SetHashContext(const MD5Context &context) {*packetcontext = context;}
+
 public:
   // Load a recovery packet from a specified file
   bool Load(DiskFile *diskfile, u64 offset, PACKET_HEADER &header);
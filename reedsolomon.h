@@ -64,6 +64,10 @@ public:
                const void *inputbuffer, // Buffer containing input data
                u32 outputindex,         // The row in the RS matrix
                void *outputbuffer);     // Buffer containing output data
+
+  // Multiply a block of data by a factor and add it to the output, without using
+  // the RS matrix. Used to compute syndromes (see SyndromeAccumulator).
+  bool MultiplyAdd(const g &factor, size_t size, const void *inputbuffer, void *outputbuffer);
 private:
 		bool InternalProcess(const g &factor, size_t size, const void *inputbuffer, void *outputbuffer);	// Optimization
 protected:
@@ -161,6 +165,14 @@ inline bool ReedSolomon<g>::Process(size_t size, u32 inputindex, const void *inp
 	return this->InternalProcess (factor, size, inputbuffer, outputbuffer);
 }
 
+template<class g>
+inline bool ReedSolomon<g>::MultiplyAdd(const g &factor, size_t size, const void *inputbuffer, void *outputbuffer)
+{
+	if (factor == 0)
+		return true;
+	return this->InternalProcess (factor, size, inputbuffer, outputbuffer);
+}
+
 u32 gcd(u32 a, u32 b);
 
 // Record whether the recovery block with the specified
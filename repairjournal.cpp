@@ -0,0 +1,326 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "par2cmdline.h"
+
+// The size of the pieces in which data is copied between the files
+#define JournalCopySize (1024 * 1024)
+
+// The layout of a journal file:
+//   magic, original length, name length, name of the target file (without the path)
+// followed by records of:
+//   offset, length, the saved data, CRC of all three
+static const u8 sJournalMagic[8] = {'P', 'A', 'R', '2', 'J', 'R', 'N', '\0'};
+
+RepairJournal::RepairJournal(void)
+: mTarget(0)
+, mOriginalLength(0)
+, mNewLength(0)
+, mJournalLength(0)
+{
+}
+
+RepairJournal::~RepairJournal(void)
+{
+  if (mJournal.IsOpen())
+    mJournal.Close();
+}
+
+bool RepairJournal::Start(DiskFile *aTarget)
+{
+  assert(aTarget->IsOpen());
+
+  // Continue the journal of an interrupted repair
+  if (Find(aTarget))
+    return true;
+
+  // Or start a new one, under a name that is not in use
+  mTarget = aTarget;
+  string lName = aTarget->FileName() + ".par2journal";
+  for (u32 lIndex = 1; DiskFile::FileExists(lName); lIndex++)
+  {
+    char lNumberAsString[20];
+    sprintf(lNumberAsString, "%u", lIndex);
+    lName = aTarget->FileName() + "." + lNumberAsString + ".par2journal";
+  }
+
+  if (!mJournal.Create(lName, 0))
+    return false;
+
+  leu64 lOriginalLength = mOriginalLength;
+  leu64 lNameLength = (u64)mTargetName.size();
+  vector<u8> lHeader;
+  lHeader.insert(lHeader.end(), sJournalMagic, sJournalMagic + sizeof(sJournalMagic));
+  lHeader.insert(lHeader.end(), (const u8*)&lOriginalLength, (const u8*)&lOriginalLength + sizeof(leu64));
+  lHeader.insert(lHeader.end(), (const u8*)&lNameLength, (const u8*)&lNameLength + sizeof(leu64));
+  lHeader.insert(lHeader.end(), mTargetName.begin(), mTargetName.end());
+
+  mJournalLength = lHeader.size();
+
+  return mJournal.Write(0, &lHeader[0], lHeader.size());
+}
+
+bool RepairJournal::Find(DiskFile *aTarget)
+{
+  string lPath;
+  mTarget = aTarget;
+  DiskFile::SplitFilename(aTarget->FileName(), lPath, mTargetName);
+  mOriginalLength = aTarget->FileSize();
+  mNewLength = mOriginalLength;
+  mJournalLength = 0;
+  mRecords.clear();
+
+  string lName = aTarget->FileName() + ".par2journal";
+  for (u32 lIndex = 1; DiskFile::FileExists(lName); lIndex++)
+  {
+    if (Load(lName))
+    {
+      // Drop whatever follows the last complete record
+      if (mJournal.OpenForUpdate(lName) &&
+          (mJournal.FileSize() == mJournalLength || mJournal.SetLength(mJournalLength)))
+        return true;
+
+      if (mJournal.IsOpen())
+        mJournal.Close();
+      break;
+    }
+
+    char lNumberAsString[20];
+    sprintf(lNumberAsString, "%u", lIndex);
+    lName = aTarget->FileName() + "." + lNumberAsString + ".par2journal";
+  }
+
+  mTarget = 0;
+  mRecords.clear();
+  return false;
+}
+
+bool RepairJournal::Load(string aFileName)
+{
+  DiskFile lFile;
+  if (!lFile.Open(aFileName, false))
+    return false;
+
+  u64 lFileSize = lFile.FileSize();
+  u64 lPosition = sizeof(sJournalMagic) + 2 * sizeof(leu64);
+  if (lFileSize < lPosition)
+    return false;
+
+  u8 lMagic[sizeof(sJournalMagic)];
+  leu64 lLengths[2];
+  if (!lFile.Read(0, lMagic, sizeof(lMagic)) ||
+      memcmp(lMagic, sJournalMagic, sizeof(sJournalMagic)) != 0 ||
+      !lFile.Read(sizeof(lMagic), lLengths, sizeof(lLengths)) ||
+      lLengths[1] != (u64)mTargetName.size() ||
+      lFileSize - lPosition < lLengths[1])
+    return false;
+
+  // It must be the journal of this file
+  string lName((size_t)lLengths[1], '\0');
+  if (!lName.empty() && !lFile.Read(lPosition, &lName[0], lName.size()))
+    return false;
+  if (lName != mTargetName)
+    return false;
+  lPosition += lName.size();
+
+  u8 *lBuffer = (u8 *)AlignedBufferPool::Get(JournalCopySize);
+  if (lBuffer == 0)
+    return false;
+
+  // Take the records up to the first one that is incomplete or damaged
+  vector<Record> lRecords;
+  while (lFileSize - lPosition >= 2 * sizeof(leu64) + sizeof(leu32))
+  {
+    leu64 lRange[2];
+    if (!lFile.Read(lPosition, lRange, sizeof(lRange)))
+      break;
+
+    Record lRecord;
+    lRecord.offset = lRange[0];
+    lRecord.length = lRange[1];
+    lRecord.position = lPosition + sizeof(lRange);
+    if (lFileSize - lRecord.position < sizeof(leu32) || lRecord.length > lFileSize - lRecord.position - sizeof(leu32))
+      break;
+
+    u32 lCRC = CRCUpdateBlock(~0, sizeof(lRange), lRange);
+    bool lReadable = true;
+    for (u64 lDone = 0; lReadable && lDone < lRecord.length; )
+    {
+      size_t lLength = (size_t)min((u64)JournalCopySize, lRecord.length - lDone);
+      lReadable = lFile.Read(lRecord.position + lDone, lBuffer, lLength);
+      lCRC = CRCUpdateBlock(lCRC, lLength, lBuffer);
+      lDone += lLength;
+    }
+
+    leu32 lStoredCRC;
+    if (!lReadable ||
+        !lFile.Read(lRecord.position + lRecord.length, &lStoredCRC, sizeof(lStoredCRC)) ||
+        lStoredCRC != (~0 ^ lCRC))
+      break;
+
+    lRecords.push_back(lRecord);
+    lPosition = lRecord.position + lRecord.length + sizeof(leu32);
+  }
+
+  AlignedBufferPool::Release(lBuffer);
+  lFile.Close();
+
+  mOriginalLength = lLengths[0];
+  mRecords = lRecords;
+  mJournalLength = lPosition;
+
+  return true;
+}
+
+bool RepairJournal::Save(u64 aOffset, u64 aLength)
+{
+  assert(mJournal.IsOpen());
+
+  if (aOffset >= mOriginalLength)
+    return true;
+  aLength = min(aLength, mOriginalLength - aOffset);
+
+  u8 *lBuffer = (u8 *)AlignedBufferPool::Get(JournalCopySize);
+  if (lBuffer == 0)
+    return false;
+
+  leu64 lRange[2];
+  lRange[0] = aOffset;
+  lRange[1] = aLength;
+
+  Record lRecord;
+  lRecord.offset = aOffset;
+  lRecord.length = aLength;
+  lRecord.position = mJournalLength + sizeof(lRange);
+
+  bool rv = mJournal.Write(mJournalLength, lRange, sizeof(lRange));
+  u32 lCRC = CRCUpdateBlock(~0, sizeof(lRange), lRange);
+  u64 lPosition = lRecord.position;
+
+  for (u64 lDone = 0; rv && lDone < aLength; )
+  {
+    size_t lLength = (size_t)min((u64)JournalCopySize, aLength - lDone);
+    rv = mTarget->Read(aOffset + lDone, lBuffer, lLength) &&
+         mJournal.Write(lPosition, lBuffer, lLength);
+    lCRC = CRCUpdateBlock(lCRC, lLength, lBuffer);
+    lDone += lLength;
+    lPosition += lLength;
+  }
+
+  AlignedBufferPool::Release(lBuffer);
+
+  leu32 lStoredCRC = ~0 ^ lCRC;
+  rv = rv && mJournal.Write(lPosition, &lStoredCRC, sizeof(lStoredCRC));
+  if (rv)
+  {
+    mRecords.push_back(lRecord);
+    mJournalLength = lPosition + sizeof(lStoredCRC);
+  }
+
+  return rv;
+}
+
+bool RepairJournal::SetLength(u64 aLength)
+{
+  u64 lLength = mTarget->FileSize();
+
+  // Save the part that is cut off
+  if (aLength < lLength && !Save(aLength, lLength - aLength))
+    return false;
+
+  mNewLength = aLength;
+
+  return true;
+}
+
+bool RepairJournal::Seal(void)
+{
+  bool rv = mJournal.Sync();
+  mJournal.Close();
+
+  // Only now that the journal is on the disk may the file change
+  if (rv && mNewLength != mTarget->FileSize())
+    rv = mTarget->SetLength(mNewLength);
+
+  return rv;
+}
+
+bool RepairJournal::Rollback(void)
+{
+  if (mTarget == 0)
+    return true;
+
+  // The journal file was created for writing only
+  mJournal.Close();
+  if (!mJournal.Open(false))
+    return false;
+
+  if (mTarget->IsOpen())
+    mTarget->Close();
+  if (!mTarget->OpenForUpdate())
+    return false;
+
+  u8 *lBuffer = (u8 *)AlignedBufferPool::Get(JournalCopySize);
+  bool rv = lBuffer != 0 &&
+            (mTarget->FileSize() == mOriginalLength || mTarget->SetLength(mOriginalLength));
+
+  // Newest first, in case a range was saved twice: the oldest data is the original
+  for (vector<Record>::reverse_iterator r = mRecords.rbegin(); rv && r != mRecords.rend(); ++r)
+  {
+    for (u64 lDone = 0; rv && lDone < r->length; )
+    {
+      size_t lLength = (size_t)min((u64)JournalCopySize, r->length - lDone);
+      rv = mJournal.Read(r->position + lDone, lBuffer, lLength) &&
+           mTarget->Write(r->offset + lDone, lBuffer, lLength);
+      lDone += lLength;
+    }
+  }
+
+  AlignedBufferPool::Release(lBuffer);
+  mTarget->Close();
+
+  // Keep the journal if the file could not be restored; it is all that is left of the
+  // original contents.
+  if (rv)
+  {
+    Finish();
+  }
+  else
+  {
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "Could not restore " << mTarget->FileName() << "; its original contents are in "
+         << mJournal.FileName() << endl;
+    dispatch_semaphore_signal(coutSema);
+    mJournal.Close();
+    mTarget = 0;
+  }
+
+  return rv;
+}
+
+void RepairJournal::Finish(void)
+{
+  if (mTarget == 0)
+    return;
+
+  if (mJournal.IsOpen())
+    mJournal.Close();
+  mJournal.Delete();
+
+  mTarget = 0;
+  mRecords.clear();
+}
@@ -0,0 +1,89 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#ifndef __REPAIRJOURNAL_H__
+#define __REPAIRJOURNAL_H__
+
+// When a damaged file is repaired in place, the reconstructed blocks overwrite the
+// damaged data in the file itself. Before anything is overwritten, the RepairJournal
+// saves the old contents in a journal file next to it, together with the original
+// length of the file, so that the file can be put back as it was if the repair fails.
+// The journal file is deleted by Finish and by Rollback.
+// The journal file describes itself: a header with the name and the original length of
+// the file, followed by records of an offset, a length, the saved data and a CRC. So
+// when a repair is interrupted, the next repair of the file picks up the journal that
+// was left behind, and its Rollback still restores the contents from before the first
+// repair. A record that was not completely written is ignored, along with anything
+// after it.
+
+class RepairJournal
+{
+public:
+  RepairJournal(void);
+  ~RepairJournal(void);
+
+  // Create the journal file for aTarget, which must be open for update, or continue the
+  // one that an interrupted repair left behind.
+  bool Start(DiskFile *aTarget);
+
+  // Take up the journal that an interrupted repair of aTarget left behind, if there is
+  // one. A repair that does not continue should Rollback or Finish it.
+  bool Find(DiskFile *aTarget);
+
+  // Save the contents of a range of the target file before it is overwritten. The part
+  // beyond the original end of the file is not saved; Rollback just cuts it off.
+  bool Save(u64 aOffset, u64 aLength);
+
+  // Change the length of the target file. The part that is cut off is saved, and the
+  // length is changed by Seal.
+  bool SetLength(u64 aLength);
+
+  // Everything has been saved: make sure the journal is on disk before the target
+  // file is changed, and close it until Rollback needs it.
+  bool Seal(void);
+
+  // Put the saved contents and the original length back
+  bool Rollback(void);
+
+  // The repair succeeded; delete the journal file
+  void Finish(void);
+
+  DiskFile *TargetFile(void) const {return mTarget;}
+
+protected:
+  // Read an existing journal file of the target; false if it is not one
+  bool Load(string aFileName);
+
+protected:
+  struct Record
+  {
+    u64 offset;         // In the target file
+    u64 length;
+    u64 position;       // Of the data in the journal file
+  };
+
+  DiskFile         *mTarget;
+  string            mTargetName;        // Without the path, as in the header
+  u64               mOriginalLength;
+  u64               mNewLength;         // For Seal
+  DiskFile          mJournal;
+  u64               mJournalLength;
+  vector<Record>    mRecords;
+};
+
+#endif // __REPAIRJOURNAL_H__
@@ -0,0 +1,346 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "par2cmdline.h"
+
+// The layout of a session file:
+//   magic, set id, record count, records, MD5 of all that precedes
+// and of each record:
+//   name length, name, size, mtime, ctime, inode, flags, file id of the complete file,
+//   packet count, packet offsets, block count, (block number, offset) per block
+// The times are in nanoseconds; the first layout had mtime in seconds, and no ctime.
+static const u8 sSessionMagic[8] = {'P', 'A', 'R', '2', 'S', 'E', 'S', '2'};
+
+enum
+{
+  eHasPackets = 1,
+  eHasBlocks  = 2,
+  eComplete   = 4
+};
+
+static void Append(vector<u8> &aData, const void *aValue, size_t aLength)
+{
+  aData.insert(aData.end(), (const u8*)aValue, (const u8*)aValue + aLength);
+}
+
+// Take aLength bytes from the data, if there are that many left
+static bool Take(const vector<u8> &aData, size_t aEnd, size_t &aPosition, void *aValue, size_t aLength)
+{
+  if (aLength > aEnd - aPosition)
+    return false;
+  memcpy(aValue, &aData[aPosition], aLength);
+  aPosition += aLength;
+  return true;
+}
+
+Session::Record::Record(void)
+: haspackets(false)
+, hasblocks(false)
+, complete(false)
+{
+  memset(&identity, 0, sizeof(identity));
+  memset(&completefile, 0, sizeof(completefile));
+}
+
+Session::Session(void)
+{
+  memset(&mSetId, 0, sizeof(mSetId));
+  mSema = dispatch_semaphore_create(1);
+}
+
+Session::~Session(void)
+{
+  dispatch_release(mSema);
+}
+
+void Session::Open(string aFileName)
+{
+  mFileName = aFileName;
+  mRecords.clear();
+
+  // A session that cannot be read is the same as a new one
+  if (!Load())
+    mRecords.clear();
+}
+
+void Session::SetSetId(const MD5Hash &aSetId)
+{
+  dispatch_semaphore_wait(mSema, DISPATCH_TIME_FOREVER);
+
+  if (aSetId != mSetId)
+  {
+    for (map<string, Record>::iterator r = mRecords.begin(); r != mRecords.end(); ++r)
+    {
+      r->second.hasblocks = false;
+      r->second.blocks.clear();
+      r->second.complete = false;
+    }
+    mSetId = aSetId;
+  }
+
+  dispatch_semaphore_signal(mSema);
+}
+
+bool Session::GetIdentity(string aFileName, FileIdentity &aIdentity)
+{
+  return DiskFile::StatFile(aFileName, aIdentity.size, aIdentity.mtime, aIdentity.ctime, aIdentity.inode);
+}
+
+bool Session::FindPackets(string aFileName, const FileIdentity &aIdentity, vector<u64> &aOffsets)
+{
+  dispatch_semaphore_wait(mSema, DISPATCH_TIME_FOREVER);
+
+  map<string, Record>::const_iterator r = mRecords.find(aFileName);
+  bool rv = r != mRecords.end() && r->second.haspackets && r->second.identity == aIdentity;
+  if (rv)
+    aOffsets = r->second.packets;
+
+  dispatch_semaphore_signal(mSema);
+
+  return rv;
+}
+
+void Session::SetPackets(string aFileName, const FileIdentity &aIdentity, const vector<u64> &aOffsets)
+{
+  dispatch_semaphore_wait(mSema, DISPATCH_TIME_FOREVER);
+
+  Record &lRecord = mRecords[aFileName];
+  if (!(lRecord.identity == aIdentity))
+  {
+    lRecord.hasblocks = false;
+    lRecord.blocks.clear();
+    lRecord.complete = false;
+  }
+  lRecord.identity = aIdentity;
+  lRecord.haspackets = true;
+  lRecord.packets = aOffsets;
+
+  dispatch_semaphore_signal(mSema);
+}
+
+bool Session::FindBlocks(string aFileName, const FileIdentity &aIdentity, vector<FoundBlock> &aBlocks,
+                         bool &aComplete, MD5Hash &aCompleteFile)
+{
+  dispatch_semaphore_wait(mSema, DISPATCH_TIME_FOREVER);
+
+  map<string, Record>::const_iterator r = mRecords.find(aFileName);
+  bool rv = r != mRecords.end() && r->second.hasblocks && r->second.identity == aIdentity;
+  if (rv)
+  {
+    aBlocks = r->second.blocks;
+    aComplete = r->second.complete;
+    aCompleteFile = r->second.completefile;
+  }
+
+  dispatch_semaphore_signal(mSema);
+
+  return rv;
+}
+
+void Session::SetBlocks(string aFileName, const FileIdentity &aIdentity, const vector<FoundBlock> &aBlocks,
+                        bool aComplete, const MD5Hash &aCompleteFile)
+{
+  dispatch_semaphore_wait(mSema, DISPATCH_TIME_FOREVER);
+
+  Record &lRecord = mRecords[aFileName];
+  if (!(lRecord.identity == aIdentity))
+  {
+    lRecord.haspackets = false;
+    lRecord.packets.clear();
+  }
+  lRecord.identity = aIdentity;
+  lRecord.hasblocks = true;
+  lRecord.blocks = aBlocks;
+  lRecord.complete = aComplete;
+  lRecord.completefile = aCompleteFile;
+
+  dispatch_semaphore_signal(mSema);
+}
+
+bool Session::Load(void)
+{
+  if (!DiskFile::FileExists(mFileName))
+    return false;
+
+  DiskFile lFile;
+  if (!lFile.Open(mFileName, false))
+    return false;
+
+  u64 lFileSize = lFile.FileSize();
+  if (lFileSize < sizeof(sSessionMagic) + 2 * sizeof(MD5Hash) + sizeof(leu32) || lFileSize > 0x7fffffff)
+    return false;
+
+  vector<u8> lData((size_t)lFileSize);
+  if (!lFile.Read(0, &lData[0], lData.size()))
+    return false;
+  lFile.Close();
+
+  // Check the whole file before believing any of it
+  size_t lDataSize = lData.size() - sizeof(MD5Hash);
+  MD5Context lContext;
+  lContext.Update(&lData[0], lDataSize);
+  MD5Hash lHash;
+  lContext.Final(lHash);
+  if (memcmp(&lHash, &lData[lDataSize], sizeof(MD5Hash)) != 0)
+    return false;
+
+  size_t lPosition = 0;
+  u8 lMagic[sizeof(sSessionMagic)];
+  leu32 lRecordCount;
+  if (!Take(lData, lDataSize, lPosition, lMagic, sizeof(lMagic)) ||
+      memcmp(lMagic, sSessionMagic, sizeof(sSessionMagic)) != 0 ||
+      !Take(lData, lDataSize, lPosition, &mSetId, sizeof(mSetId)) ||
+      !Take(lData, lDataSize, lPosition, &lRecordCount, sizeof(lRecordCount)))
+    return false;
+
+  for (u32 i = 0; i < lRecordCount; i++)
+  {
+    leu32 lNameLength;
+    if (!Take(lData, lDataSize, lPosition, &lNameLength, sizeof(lNameLength)) ||
+        lNameLength > lDataSize - lPosition)
+      return false;
+    string lName((const char*)&lData[lPosition], lNameLength);
+    lPosition += lNameLength;
+
+    Record lRecord;
+    leu64 lValues[4];
+    u8 lFlags;
+    leu32 lCount;
+    if (!Take(lData, lDataSize, lPosition, lValues, sizeof(lValues)) ||
+        !Take(lData, lDataSize, lPosition, &lFlags, sizeof(lFlags)) ||
+        !Take(lData, lDataSize, lPosition, &lRecord.completefile, sizeof(MD5Hash)) ||
+        !Take(lData, lDataSize, lPosition, &lCount, sizeof(lCount)))
+      return false;
+    lRecord.identity.size = lValues[0];
+    lRecord.identity.mtime = lValues[1];
+    lRecord.identity.ctime = lValues[2];
+    lRecord.identity.inode = lValues[3];
+    lRecord.haspackets = (lFlags & eHasPackets) != 0;
+    lRecord.hasblocks = (lFlags & eHasBlocks) != 0;
+    lRecord.complete = (lFlags & eComplete) != 0;
+
+    for (u32 j = 0; j < lCount; j++)
+    {
+      leu64 lOffset;
+      if (!Take(lData, lDataSize, lPosition, &lOffset, sizeof(lOffset)))
+        return false;
+      lRecord.packets.push_back(lOffset);
+    }
+
+    if (!Take(lData, lDataSize, lPosition, &lCount, sizeof(lCount)))
+      return false;
+    for (u32 j = 0; j < lCount; j++)
+    {
+      leu32 lBlockNumber;
+      leu64 lOffset;
+      if (!Take(lData, lDataSize, lPosition, &lBlockNumber, sizeof(lBlockNumber)) ||
+          !Take(lData, lDataSize, lPosition, &lOffset, sizeof(lOffset)))
+        return false;
+      FoundBlock lBlock;
+      lBlock.blocknumber = lBlockNumber;
+      lBlock.offset = lOffset;
+      lRecord.blocks.push_back(lBlock);
+    }
+
+    mRecords[lName] = lRecord;
+  }
+
+  return lPosition == lDataSize;
+}
+
+bool Session::Save(void)
+{
+  if (!IsOpen())
+    return false;
+
+  dispatch_semaphore_wait(mSema, DISPATCH_TIME_FOREVER);
+
+  vector<u8> lData;
+  leu32 lRecordCount = (u32)mRecords.size();
+  Append(lData, sSessionMagic, sizeof(sSessionMagic));
+  Append(lData, &mSetId, sizeof(mSetId));
+  Append(lData, &lRecordCount, sizeof(lRecordCount));
+
+  for (map<string, Record>::const_iterator r = mRecords.begin(); r != mRecords.end(); ++r)
+  {
+    const Record &lRecord = r->second;
+
+    leu32 lNameLength = (u32)r->first.size();
+    Append(lData, &lNameLength, sizeof(lNameLength));
+    Append(lData, r->first.c_str(), r->first.size());
+
+    leu64 lValues[4];
+    lValues[0] = lRecord.identity.size;
+    lValues[1] = lRecord.identity.mtime;
+    lValues[2] = lRecord.identity.ctime;
+    lValues[3] = lRecord.identity.inode;
+    u8 lFlags = (lRecord.haspackets ? eHasPackets : 0) |
+                (lRecord.hasblocks ? eHasBlocks : 0) |
+                (lRecord.complete ? eComplete : 0);
+    Append(lData, lValues, sizeof(lValues));
+    Append(lData, &lFlags, sizeof(lFlags));
+    Append(lData, &lRecord.completefile, sizeof(MD5Hash));
+
+    leu32 lCount = (u32)lRecord.packets.size();
+    Append(lData, &lCount, sizeof(lCount));
+    for (size_t j = 0; j < lRecord.packets.size(); j++)
+    {
+      leu64 lOffset = lRecord.packets[j];
+      Append(lData, &lOffset, sizeof(lOffset));
+    }
+
+    lCount = (u32)lRecord.blocks.size();
+    Append(lData, &lCount, sizeof(lCount));
+    for (size_t j = 0; j < lRecord.blocks.size(); j++)
+    {
+      leu32 lBlockNumber = lRecord.blocks[j].blocknumber;
+      leu64 lOffset = lRecord.blocks[j].offset;
+      Append(lData, &lBlockNumber, sizeof(lBlockNumber));
+      Append(lData, &lOffset, sizeof(lOffset));
+    }
+  }
+
+  dispatch_semaphore_signal(mSema);
+
+  MD5Context lContext;
+  lContext.Update(&lData[0], lData.size());
+  MD5Hash lHash;
+  lContext.Final(lHash);
+  Append(lData, &lHash, sizeof(lHash));
+
+  // Write a new file and put it in place of the old one
+  string lNewName = mFileName + ".new";
+  DiskFile lFile;
+  if (!lFile.Create(lNewName, 0))
+    return false;
+  bool rv = lFile.Write(0, &lData[0], lData.size()) && lFile.Sync();
+  lFile.Close();
+
+  if (rv && ::rename(lNewName.c_str(), mFileName.c_str()) != 0)
+    rv = false;
+  if (!rv)
+  {
+    ::unlink(lNewName.c_str());
+    dispatch_semaphore_wait(coutSema, DISPATCH_TIME_FOREVER);
+    cerr << "Could not write session " << mFileName << endl;
+    dispatch_semaphore_signal(coutSema);
+  }
+  DiskFilePool::StatusChanged(lNewName);
+  DiskFilePool::StatusChanged(mFileName);
+
+  return rv;
+}
@@ -0,0 +1,110 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+// A Session keeps what a verification found out about each file: the offsets of the
+// packets in the PAR2 files, and the data blocks in the data files. When the files are
+// verified again (typically after more recovery volumes have been obtained), a file
+// whose size, modification and status change times (to the nanosecond, as far as the
+// file system keeps them) and inode are unchanged does not have to be read again; what
+// was found in it last time is used instead. The status change time cannot be set
+// back, as the modification time can.
+// The blocks are only used for the same recovery set; the packet offsets do not depend
+// on it. The session file is replaced in one rename when it is saved.
+// All functions are thread safe.
+
+class Session
+{
+public:
+  // Identifies the contents of a file without reading it
+  struct FileIdentity
+  {
+    u64 size;
+    u64 mtime;          // In nanoseconds
+    u64 ctime;
+    u64 inode;
+
+    bool operator==(const FileIdentity &aOther) const
+    {
+      return size == aOther.size && mtime == aOther.mtime && ctime == aOther.ctime && inode == aOther.inode;
+    }
+  };
+
+  // A data block that was found: its number among all source blocks, and where it is
+  struct FoundBlock
+  {
+    u32 blocknumber;
+    u64 offset;
+  };
+
+public:
+  Session(void);
+  ~Session(void);
+
+  // Read the session file, if there is one
+  void Open(string aFileName);
+
+  // Which recovery set is being verified. The blocks are dropped if they are for another set.
+  void SetSetId(const MD5Hash &aSetId);
+
+  // Write the session file
+  bool Save(void);
+
+  bool IsOpen(void) const {return !mFileName.empty();}
+
+  // Get the identity of a file from the OS
+  static bool GetIdentity(string aFileName, FileIdentity &aIdentity);
+
+  // The offsets of the valid packets in a PAR2 file. Find returns false if the file is not
+  // known or has changed since.
+  bool FindPackets(string aFileName, const FileIdentity &aIdentity, vector<u64> &aOffsets);
+  void SetPackets(string aFileName, const FileIdentity &aIdentity, const vector<u64> &aOffsets);
+
+  // The data blocks that were found in a data file, and whether the whole file is a perfect
+  // copy of a source file (then aCompleteFile is its file id).
+  bool FindBlocks(string aFileName, const FileIdentity &aIdentity, vector<FoundBlock> &aBlocks,
+                  bool &aComplete, MD5Hash &aCompleteFile);
+  void SetBlocks(string aFileName, const FileIdentity &aIdentity, const vector<FoundBlock> &aBlocks,
+                 bool aComplete, const MD5Hash &aCompleteFile);
+
+protected:
+  struct Record
+  {
+    Record(void);
+
+    FileIdentity        identity;
+    bool                haspackets;
+    vector<u64>         packets;
+    bool                hasblocks;
+    vector<FoundBlock>  blocks;
+    bool                complete;
+    MD5Hash             completefile;
+  };
+
+  bool Load(void);
+
+protected:
+  string                mFileName;
+  MD5Hash               mSetId;
+  map<string, Record>   mRecords;
+  dispatch_semaphore_t  mSema;        // Protects mRecords
+};
+
+#endif // __SESSION_H__
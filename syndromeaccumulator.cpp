@@ -0,0 +1,172 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "par2cmdline.h"
+
+SyndromeAccumulator::SyndromeAccumulator(void)
+: mBlockSize(0)
+{
+  mAddedSema = dispatch_semaphore_create(1);
+}
+
+SyndromeAccumulator::~SyndromeAccumulator(void)
+{
+  Release();
+  dispatch_release(mAddedSema);
+}
+
+bool SyndromeAccumulator::Start(u32 aSourceBlockCount, size_t aBlockSize, const vector<u16> &aExponents)
+{
+  Release();
+
+  // Compute the base values for all source blocks, in the same way as
+  // ReedSolomon<Galois16>::SetInput does.
+  mBases.resize(aSourceBlockCount);
+  unsigned int logbase = 0;
+  for (u32 index = 0; index < aSourceBlockCount; index++)
+  {
+    while (gcd(Galois16::Limit, logbase) != 1)
+    {
+      logbase++;
+    }
+    if (logbase >= Galois16::Limit)
+    {
+      mBases.clear();
+      return false;
+    }
+    mBases[index] = Galois16(logbase++).ALog();
+  }
+
+  mBlockSize = aBlockSize;
+  mExponents = aExponents;
+  mAdded.assign(aSourceBlockCount, false);
+
+  for (size_t i = 0; i < mExponents.size(); i++)
+  {
+    u8 *lSyndrome = (u8 *)calloc(1, mBlockSize);
+    if (lSyndrome == 0)
+    {
+      Release();
+      return false;
+    }
+    mSyndromes.push_back(lSyndrome);
+    mSyndromeSemas.push_back(dispatch_semaphore_create(1));
+  }
+
+  return true;
+}
+
+void SyndromeAccumulator::Release(void)
+{
+  for (size_t i = 0; i < mSyndromes.size(); i++)
+  {
+    free(mSyndromes[i]);
+    dispatch_release(mSyndromeSemas[i]);
+  }
+  mSyndromes.clear();
+  mSyndromeSemas.clear();
+  mExponents.clear();
+  mBases.clear();
+  mAdded.clear();
+}
+
+void SyndromeAccumulator::Keep(const vector<u16> &aExponents)
+{
+  size_t lKept = 0;
+  for (size_t i = 0; i < mSyndromes.size(); i++)
+  {
+    if (find(aExponents.begin(), aExponents.end(), mExponents[i]) == aExponents.end())
+    {
+      free(mSyndromes[i]);
+      dispatch_release(mSyndromeSemas[i]);
+      continue;
+    }
+
+    mExponents[lKept] = mExponents[i];
+    mSyndromes[lKept] = mSyndromes[i];
+    mSyndromeSemas[lKept] = mSyndromeSemas[i];
+    lKept++;
+  }
+  mExponents.resize(lKept);
+  mSyndromes.resize(lKept);
+  mSyndromeSemas.resize(lKept);
+
+  if (lKept == 0)
+    Release();
+}
+
+void SyndromeAccumulator::Add(ReedSolomon<Galois16> &aRS, u32 aIndex, const void *aData, size_t aLength)
+{
+  if (!IsActive())
+    return;
+
+  assert(aIndex < mAdded.size() && aLength <= mBlockSize);
+
+  // Each block counts only once, even if it is found in several files
+  dispatch_semaphore_wait(mAddedSema, DISPATCH_TIME_FOREVER);
+  bool lAlreadyAdded = mAdded[aIndex];
+  mAdded[aIndex] = true;
+  dispatch_semaphore_signal(mAddedSema);
+  if (lAlreadyAdded)
+    return;
+
+  // A block of zeroes adds nothing
+  if (ZeroBlock::IsZero(aData, aLength))
+    return;
+
+  // The multiplication works on 32 bit words. If the length is not a multiple of 4,
+  // pad the last word with zeroes.
+  size_t lLength = (aLength + 3) & ~(size_t)3;
+  const void *lData = aData;
+  u8 *lPadded = 0;
+  if (lLength != aLength)
+  {
+    lPadded = new u8[lLength];
+    memcpy(lPadded, aData, aLength);
+    memset(&lPadded[aLength], 0, lLength - aLength);
+    lData = lPadded;
+  }
+
+  // Each syndrome has its own lock, so that the threads scanning different files
+  // can work on different syndromes at the same time. The syndromes of one block
+  // are computed by several threads as well.
+  ReedSolomon<Galois16> *lRS = &aRS;
+  dispatch_apply(mSyndromes.size(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i){
+    Galois16 lFactor = Galois16(this->mBases[aIndex]).pow(this->mExponents[i]);
+
+    dispatch_semaphore_wait(this->mSyndromeSemas[i], DISPATCH_TIME_FOREVER);
+    lRS->MultiplyAdd(lFactor, lLength, lData, this->mSyndromes[i]);
+    dispatch_semaphore_signal(this->mSyndromeSemas[i]);
+  });
+
+  delete [] lPadded;
+}
+
+bool SyndromeAccumulator::Contains(u32 aIndex) const
+{
+  return IsActive() && aIndex < mAdded.size() && mAdded[aIndex];
+}
+
+const u8 *SyndromeAccumulator::Syndrome(u16 aExponent) const
+{
+  for (size_t i = 0; i < mExponents.size(); i++)
+  {
+    if (mExponents[i] == aExponent)
+      return mSyndromes[i];
+  }
+  return 0;
+}
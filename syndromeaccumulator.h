@@ -0,0 +1,69 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef __SYNDROMEACCUMULATOR_H__
+#define __SYNDROMEACCUMULATOR_H__
+
+// A recovery block with exponent e is the sum of base(i)^e * D(i) over all source blocks D(i).
+// The SyndromeAccumulator computes that sum over the source blocks that are found during
+// verification, for a number of recovery exponents, as the blocks are scanned. During repair,
+// the sum of a recovery block and its syndrome depends only on the missing data blocks, so the
+// data blocks that have been accumulated need not be read (or processed) again.
+// Each source block is accumulated only once. Add may be called from several threads at once.
+
+class SyndromeAccumulator
+{
+public:
+  SyndromeAccumulator(void);
+  ~SyndromeAccumulator(void);
+
+  // Allocate zeroed syndromes for the given recovery exponents. Returns false if
+  // there is not enough memory; the accumulator is not active then.
+  bool Start(u32 aSourceBlockCount, size_t aBlockSize, const vector<u16> &aExponents);
+
+  // Free the memory. Afterwards, Add does nothing.
+  void Release(void);
+
+  // Free the syndromes of all exponents except the given ones
+  void Keep(const vector<u16> &aExponents);
+
+  bool IsActive(void) const {return !mSyndromes.empty();}
+
+  // How much memory the syndromes take
+  size_t MemoryUsed(void) const {return mSyndromes.size() * mBlockSize;}
+
+  // Add a source block, given its index in the list of all source blocks. Data beyond
+  // aLength (up to the block size) counts as zero.
+  void Add(ReedSolomon<Galois16> &aRS, u32 aIndex, const void *aData, size_t aLength);
+
+  // Whether a source block has been added
+  bool Contains(u32 aIndex) const;
+
+  // The syndrome for a recovery exponent, or 0 if it has not been accumulated
+  const u8 *Syndrome(u16 aExponent) const;
+
+protected:
+  size_t                         mBlockSize;
+  vector<u16>                    mExponents;
+  vector<u8*>                    mSyndromes;     // One per exponent, mBlockSize bytes each
+  vector<dispatch_semaphore_t>   mSyndromeSemas; // Protect the syndromes, one each
+  vector<Galois16::ValueType>    mBases;         // Per source block, as in the RS matrix
+  vector<bool>                   mAdded;         // Per source block
+  dispatch_semaphore_t           mAddedSema;     // Protects mAdded
+};
+
+#endif // __SYNDROMEACCUMULATOR_H__
@@ -0,0 +1,80 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#include "par2cmdline.h"
+
+static dispatch_semaphore_t sDigestSema = dispatch_semaphore_create(1);
+static u64 sDigestBlockSize = 0;
+static MD5Hash sDigestHash;
+static u32 sDigestCRC = 0;
+
+bool ZeroBlock::IsZero(const void *aData, size_t aLength)
+{
+  const u8 *lBytes = (const u8 *)aData;
+
+  // Bytes up to a word boundary
+  while (aLength > 0 && ((uintptr_t)lBytes & 7) != 0)
+  {
+    if (*lBytes != 0)
+      return false;
+    lBytes++;
+    aLength--;
+  }
+
+  // 64 bytes at a time. The compiler turns the OR of the words into vector instructions;
+  // the test per 64 bytes makes data that is not zero fail fast.
+  const u64 *lWords = (const u64 *)lBytes;
+  while (aLength >= 64)
+  {
+    if ((lWords[0] | lWords[1] | lWords[2] | lWords[3] | lWords[4] | lWords[5] | lWords[6] | lWords[7]) != 0)
+      return false;
+    lWords += 8;
+    aLength -= 64;
+  }
+
+  // The rest
+  lBytes = (const u8 *)lWords;
+  while (aLength > 0)
+  {
+    if (*lBytes != 0)
+      return false;
+    lBytes++;
+    aLength--;
+  }
+
+  return true;
+}
+
+void ZeroBlock::Digest(u64 aBlockSize, MD5Hash &aHash, u32 &aCRC)
+{
+  dispatch_semaphore_wait(sDigestSema, DISPATCH_TIME_FOREVER);
+
+  if (sDigestBlockSize != aBlockSize)
+  {
+    MD5Context lContext;
+    lContext.Update((size_t)aBlockSize);
+    lContext.Final(sDigestHash);
+    sDigestCRC = ~0 ^ CRCUpdateBlock(~0, (size_t)aBlockSize);
+    sDigestBlockSize = aBlockSize;
+  }
+
+  aHash = sDigestHash;
+  aCRC = sDigestCRC;
+
+  dispatch_semaphore_signal(sDigestSema);
+}
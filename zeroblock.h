@@ -0,0 +1,38 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#ifndef __ZEROBLOCK_H__
+#define __ZEROBLOCK_H__
+
+// Sparse files, such as disk images and databases, often have long runs of zeroes. A block
+// of zeroes adds nothing to a recovery block, so it need not be multiplied, and its hash
+// and CRC depend only on the block size. ZeroBlock tells whether data is all zeroes, and
+// keeps the digest of a block of zeroes for the block size in use.
+
+class ZeroBlock
+{
+public:
+  // Whether aLength bytes from aData on are all zero. Stops at the first byte that is not.
+  static bool IsZero(const void *aData, size_t aLength);
+
+  // The MD5 hash and the CRC of aBlockSize zero bytes. They are computed only once
+  // for the same block size.
+  static void Digest(u64 aBlockSize, MD5Hash &aHash, u32 &aCRC);
+};
+
+#endif // __ZEROBLOCK_H__